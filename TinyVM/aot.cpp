@@ -0,0 +1,682 @@
+#include "aot.hpp"
+
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "vm.hpp"
+#include "platform.hpp"
+
+// Signature of a block function, see vm_aot_emit. A block runs until one of its exits
+// and leaves IP and IC exactly where the interpreter would have left them.
+typedef void (*aot_block)(vmword *registers, const vmword *memory);
+
+// Layout of the tvm_aot symbol of a library, declared again in the emitted source.
+// Bump VM_AOT_VERSION whenever it or the meaning of a field changes.
+struct AotBlock
+{
+    vmword address;
+    vmword instructions;
+    aot_block run;
+};
+
+struct AotModule
+{
+    uint32_t version;
+    // Memory operands read by the blocks are below this
+    vmword memory_words;
+    vmword block_count;
+    const AotBlock *blocks;
+    // The code each block was compiled from, 4 words per instruction in the order of blocks
+    const vmword *code;
+};
+
+struct AotState
+{
+    PlatLibrary *library;
+    const AotModule *module;
+
+    // Loaded block starting at each instruction slot, if any. Mapped lazily, so only
+    // the parts of memory that run code take up space.
+    aot_block *blocks;
+    size_t slots;
+    // Indices into module->blocks of the blocks in use
+    std::vector<size_t> installed;
+};
+
+namespace
+{
+    const uint32_t VM_AOT_VERSION = 1;
+    const char AOT_SYMBOL[] = "tvm_aot";
+    const size_t AOT_MAX_BLOCK_INSTRUCTIONS = 256;
+
+    static_assert(offsetof(VMContext, ic_limit) == offsetof(VMContext, registers) + sizeof(vmword) * VM_REGISTER_COUNT,
+        "Blocks expect ic_limit right after the registers.");
+
+    ////////
+    // Code discovery
+    ////////
+
+    // IP and IC are kept exact by the block exits, so instructions must not touch them directly
+    bool is_compilable_register(vmword reg)
+    {
+        return reg < VM_REGISTER_COUNT && reg != IP && reg != IC;
+    }
+
+    bool is_source_compilable(AddressingMode mode, vmword operand, size_t memory_size)
+    {
+        switch (mode)
+        {
+        case AM_LITERAL:
+            return true;
+        case AM_MEMORY:
+            return operand < memory_size;
+        case AM_REGISTER:
+            return is_compilable_register(operand);
+        default:
+            return false;
+        }
+    }
+
+    // Blocks never write guest memory, so they can't invalidate themselves
+    bool is_target_compilable(AddressingMode mode, vmword operand)
+    {
+        return mode == AM_REGISTER && is_compilable_register(operand);
+    }
+
+    // The instructions the JIT compiles, see jit.cpp
+    bool is_compilable(const Instruction &instr, size_t memory_size)
+    {
+        auto &am = instr.addressing;
+        auto &op = instr.operands;
+        switch (instr.opcode)
+        {
+        case OP_NOP:
+            return true;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_MOD:
+        case OP_CMP:
+            return is_target_compilable(am[0], op[0])
+                && is_source_compilable(am[1], op[1], memory_size)
+                && is_source_compilable(am[2], op[2], memory_size);
+        case OP_INC:
+        case OP_DEC:
+        case OP_NOT:
+            return is_target_compilable(am[0], op[0]);
+        case OP_MOV:
+            return is_target_compilable(am[0], op[0])
+                && is_source_compilable(am[1], op[1], memory_size);
+        case OP_JMP:
+            return is_source_compilable(am[0], op[0], memory_size);
+        case OP_JNZ:
+            return is_source_compilable(am[0], op[0], memory_size)
+                && is_source_compilable(am[1], op[1], memory_size);
+        case OP_JEQ:
+        case OP_JNE:
+            return is_source_compilable(am[0], op[0], memory_size)
+                && is_source_compilable(am[1], op[1], memory_size)
+                && is_source_compilable(am[2], op[2], memory_size);
+        default:
+            return false;
+        }
+    }
+
+    bool is_branch(Opcode opcode)
+    {
+        return opcode == OP_JMP || opcode == OP_JEQ || opcode == OP_JNE || opcode == OP_JNZ;
+    }
+
+    bool writes_target(Opcode opcode)
+    {
+        return !is_branch(opcode) && opcode != OP_NOP;
+    }
+
+    // Number of operands a compilable instruction reads or writes, the others may hold anything
+    size_t operand_count(Opcode opcode)
+    {
+        switch (opcode)
+        {
+        case OP_NOP:
+            return 0;
+        case OP_INC:
+        case OP_DEC:
+        case OP_NOT:
+        case OP_JMP:
+            return 1;
+        case OP_MOV:
+        case OP_JNZ:
+            return 2;
+        default:
+            return 3;
+        }
+    }
+
+    // Basic blocks of the code reachable from IP. Targets are only known for literal
+    // operands, code behind computed jumps is left to the interpreter.
+    class CodeMap
+    {
+    public:
+        explicit CodeMap(const VMContext *ctx)
+            : ctx(ctx), slots(ctx->memory_size / 4), reached(slots), leader(slots)
+        {
+            add_target(ctx->registers[IP]);
+            while (!pending.empty())
+            {
+                auto slot = pending.back();
+                pending.pop_back();
+                walk(slot);
+            }
+            split_long_blocks();
+        }
+
+        // Slots starting a block, in ascending order
+        std::vector<size_t> block_starts() const
+        {
+            std::vector<size_t> starts;
+            for (size_t slot = 0; slot < slots; slot++)
+            {
+                if (leader[slot] && reached[slot] && is_compilable(decode(slot), ctx->memory_size))
+                    starts.push_back(slot);
+            }
+            return starts;
+        }
+
+        // The instructions of the block starting at slot
+        std::vector<Instruction> block(size_t slot) const
+        {
+            std::vector<Instruction> instrs;
+            for (auto s = slot; s < slots; s++)
+            {
+                if (s != slot && leader[s])
+                    break;
+                auto instr = decode(s);
+                if (!is_compilable(instr, ctx->memory_size))
+                    break;
+                instrs.push_back(instr);
+                if (is_branch(instr.opcode))
+                    break;
+            }
+            return instrs;
+        }
+
+    private:
+        Instruction decode(size_t slot) const
+        {
+            return vmi_decode(reinterpret_cast<const InstructionData*>(ctx->memory + slot * 4));
+        }
+
+        void add_target(vmword address)
+        {
+            auto slot = address >> 2;
+            if ((address & 3) != 0 || slot >= slots)
+                return;
+            leader[slot] = true;
+            if (!reached[slot])
+                pending.push_back(slot);
+        }
+
+        // Follow the code from slot until it can't continue or runs into code seen before
+        void walk(size_t slot)
+        {
+            for (; slot < slots && !reached[slot]; slot++)
+            {
+                reached[slot] = true;
+                auto instr = decode(slot);
+                auto opcode = instr.opcode;
+                if ((is_branch(opcode) || opcode == OP_CALL) && instr.addressing[0] == AM_LITERAL)
+                    add_target(instr.operands[0]);
+                if (opcode == OP_JMP || opcode == OP_RET || opcode == OP_HALT)
+                    return;
+                // Returns from calls and everything the interpreter runs come back to the dispatcher
+                if ((is_branch(opcode) || !is_compilable(instr, ctx->memory_size)) && slot + 1 < slots)
+                    leader[slot + 1] = true;
+            }
+        }
+
+        // Start a new block after every AOT_MAX_BLOCK_INSTRUCTIONS instructions of straight-line code
+        void split_long_blocks()
+        {
+            size_t length = 0;
+            for (size_t slot = 0; slot < slots; slot++)
+            {
+                if (leader[slot] || !reached[slot])
+                    length = 0;
+                if (!reached[slot])
+                    continue;
+                auto instr = decode(slot);
+                if (!is_compilable(instr, ctx->memory_size) || is_branch(instr.opcode))
+                    length = 0;
+                else if (++length > AOT_MAX_BLOCK_INSTRUCTIONS)
+                {
+                    leader[slot] = true;
+                    length = 1;
+                }
+            }
+        }
+
+        const VMContext *ctx;
+        size_t slots;
+        std::vector<bool> reached;
+        std::vector<bool> leader;
+        std::vector<size_t> pending;
+    };
+
+    ////////
+    // Source emitter
+    ////////
+
+    const char* const REGISTER_NAMES[VM_REGISTER_COUNT] =
+    {
+        "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+        "ip", "ic", "sp", "sbp", "rmd",
+    };
+
+    std::string number(vmword value)
+    {
+        return "UINT64_C(" + std::to_string(value) + ")";
+    }
+
+    class BlockEmitter
+    {
+    public:
+        BlockEmitter(vmword start, const std::vector<Instruction> &instrs, std::ostream &out)
+            : start(start), instrs(instrs), out(out)
+        {
+            for (auto &flag : used)
+                flag = false;
+            for (auto &flag : written)
+                flag = false;
+            for (auto &instr : instrs)
+            {
+                for (size_t i = 0; i < operand_count(instr.opcode); i++)
+                {
+                    if (instr.addressing[i] != AM_REGISTER)
+                        continue;
+                    used[instr.operands[i]] = true;
+                    if (i == 0 && writes_target(instr.opcode))
+                        written[instr.operands[i]] = true;
+                }
+                if (instr.opcode == OP_DIV)
+                    used[RMD] = written[RMD] = true;
+            }
+            auto &last = instrs.back();
+            loops = is_branch(last.opcode) && last.addressing[0] == AM_LITERAL && last.operands[0] == start;
+        }
+
+        // Highest memory operand read by the block plus one, 0 if there is none
+        vmword memory_words() const
+        {
+            vmword words = 0;
+            for (auto &instr : instrs)
+            {
+                for (size_t i = 0; i < operand_count(instr.opcode); i++)
+                {
+                    if (instr.addressing[i] == AM_MEMORY && instr.operands[i] >= words)
+                        words = instr.operands[i] + 1;
+                }
+            }
+            return words;
+        }
+
+        void emit()
+        {
+            // m stays unnamed in blocks that don't read memory
+            out << "static void block_" << start << "(uint64_t *r, const uint64_t *" << (memory_words() > 0 ? "m" : "") << ")\n{\n";
+            for (size_t reg = 0; reg < VM_REGISTER_COUNT; reg++)
+            {
+                if (used[reg])
+                    out << "    uint64_t " << REGISTER_NAMES[reg] << " = r[" << reg << "];\n";
+            }
+            out << "    uint64_t ic = r[" << IC << "], ip;\n";
+
+            indent = loops ? "        " : "    ";
+            if (loops)
+                out << "    for (;;)\n    {\n";
+            for (size_t k = 0; k < instrs.size(); k++)
+                emit_instruction(k);
+            if (instrs.back().opcode != OP_JMP)
+                emit_exit(instrs.size(), number(start + 4 * instrs.size()));
+            if (loops)
+                out << "    }\n";
+
+            out << "leave:\n";
+            for (size_t reg = 0; reg < VM_REGISTER_COUNT; reg++)
+            {
+                if (written[reg])
+                    out << "    r[" << reg << "] = " << REGISTER_NAMES[reg] << ";\n";
+            }
+            out << "    r[" << IP << "] = ip;\n";
+            out << "    r[" << IC << "] = ic;\n";
+            out << "}\n\n";
+        }
+
+    private:
+        std::string source(size_t k, size_t i) const
+        {
+            auto mode = instrs[k].addressing[i];
+            auto operand = instrs[k].operands[i];
+            if (mode == AM_LITERAL)
+                return number(operand);
+            if (mode == AM_MEMORY)
+                return "m[" + std::to_string(operand) + "]";
+            return REGISTER_NAMES[operand];
+        }
+
+        void line(const std::string &text)
+        {
+            out << indent << text << "\n";
+        }
+
+        // Leave the block at ip, counting executed more instructions
+        void emit_exit(size_t executed, const std::string &ip)
+        {
+            line("ip = " + ip + ";");
+            if (executed > 0)
+                line("ic += " + std::to_string(executed) + ";");
+            line("goto leave;");
+        }
+
+        // Leave the block (or loop back to its start) with the target in operand a of instruction k
+        void jump(size_t k)
+        {
+            if (loops && k + 1 == instrs.size())
+            {
+                // Loop until the budget of vm_run is used up, then leave at the start of the block
+                line("ic += " + std::to_string(k + 1) + ";");
+                line("if (ic < r[" + std::to_string(VM_REGISTER_COUNT) + "])");
+                line("    continue;");
+                emit_exit(0, number(start));
+            }
+            else
+                emit_exit(k + 1, source(k, 0));
+        }
+
+        void emit_instruction(size_t k)
+        {
+            auto &instr = instrs[k];
+            auto a = std::string(writes_target(instr.opcode) ? REGISTER_NAMES[instr.operands[0]] : "");
+            out << indent << "// " << start + 4 * k << "\n";
+
+            switch (instr.opcode)
+            {
+            case OP_NOP:
+                break;
+            case OP_ADD:
+                line(a + " = " + source(k, 1) + " + " + source(k, 2) + ";");
+                break;
+            case OP_SUB:
+                line(a + " = " + source(k, 1) + " - " + source(k, 2) + ";");
+                break;
+            case OP_MUL:
+                line(a + " = " + source(k, 1) + " * " + source(k, 2) + ";");
+                break;
+            case OP_SHL:
+                line(a + " = " + source(k, 1) + " << (" + source(k, 2) + " & 63);");
+                break;
+            case OP_SHR:
+                line(a + " = " + source(k, 1) + " >> (" + source(k, 2) + " & 63);");
+                break;
+            case OP_DIV:
+            case OP_MOD:
+            {
+                line("{");
+                auto outer = indent;
+                indent += "    ";
+                line("uint64_t b = " + source(k, 1) + ", c = " + source(k, 2) + ";");
+                // Leave division by zero to the interpreter
+                line("if (c == 0)");
+                line("{");
+                indent += "    ";
+                emit_exit(k, number(start + 4 * k));
+                indent = outer + "    ";
+                line("}");
+                if (instr.opcode == OP_DIV)
+                {
+                    line(a + " = b / c;");
+                    line("rmd = b % c;");
+                }
+                else
+                    line(a + " = b % c;");
+                indent = outer;
+                line("}");
+                break;
+            }
+            case OP_INC:
+                line(a + "++;");
+                break;
+            case OP_DEC:
+                line(a + "--;");
+                break;
+            case OP_NOT:
+                line(a + " = ~" + a + ";");
+                break;
+            case OP_CMP:
+                line("{");
+                indent += "    ";
+                line("uint64_t b = " + source(k, 1) + ", c = " + source(k, 2) + ";");
+                line(a + " = c < b ? UINT64_MAX : uint64_t(c > b);");
+                indent.resize(indent.size() - 4);
+                line("}");
+                break;
+            case OP_MOV:
+                line(a + " = " + source(k, 1) + ";");
+                break;
+            case OP_JMP:
+                jump(k);
+                break;
+            case OP_JEQ:
+            case OP_JNE:
+            case OP_JNZ:
+            {
+                if (instr.opcode == OP_JNZ)
+                    line("if (" + source(k, 1) + " != 0)");
+                else
+                    line("if (" + source(k, 1) + (instr.opcode == OP_JEQ ? " == " : " != ") + source(k, 2) + ")");
+                line("{");
+                indent += "    ";
+                jump(k);
+                indent.resize(indent.size() - 4);
+                line("}");
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        vmword start;
+        const std::vector<Instruction> &instrs;
+        std::ostream &out;
+        std::string indent;
+        bool loops;
+
+        bool used[VM_REGISTER_COUNT];
+        bool written[VM_REGISTER_COUNT];
+    };
+
+    void aot_clear_covered(VMContext *ctx, const AotBlock &block)
+    {
+        auto first = block.address >> 2;
+        for (size_t slot = first; slot < first + block.instructions && slot < ctx->predecode_slots; slot++)
+            ctx->predecoded[slot].aot_covered = false;
+    }
+}
+
+VMAotResult vm_aot_emit(const VMContext *ctx, std::ostream &out)
+{
+    VMAotResult result = {};
+    CodeMap map(ctx);
+    auto starts = map.block_starts();
+
+    out << "// Compiled by tvm-aot, build as a shared library and load with TinyVM --aot\n"
+        << "#include <stdint.h>\n\n"
+        << "typedef void (*tvm_aot_func)(uint64_t *r, const uint64_t *m);\n"
+        << "struct tvm_aot_block { uint64_t address; uint64_t instructions; tvm_aot_func run; };\n"
+        << "struct tvm_aot_module { uint32_t version; uint64_t memory_words; uint64_t block_count;\n"
+        << "    const tvm_aot_block *blocks; const uint64_t *code; };\n\n";
+
+    vmword memory_words = 0;
+    std::vector<std::vector<Instruction>> blocks;
+    for (auto slot : starts)
+    {
+        blocks.push_back(map.block(slot));
+        BlockEmitter emitter(static_cast<vmword>(slot * 4), blocks.back(), out);
+        emitter.emit();
+        memory_words = std::max(memory_words, emitter.memory_words());
+        result.instructions += blocks.back().size();
+    }
+    result.blocks = blocks.size();
+
+    // Both tables end with an unused entry, so neither is empty
+    out << "static const tvm_aot_block blocks[] =\n{\n";
+    for (size_t i = 0; i < starts.size(); i++)
+        out << "    { " << starts[i] * 4 << ", " << blocks[i].size() << ", &block_" << starts[i] * 4 << " },\n";
+    out << "    { 0, 0, 0 },\n};\n\n";
+
+    out << "static const uint64_t code[] =\n{\n";
+    for (size_t i = 0; i < starts.size(); i++)
+    {
+        auto words = ctx->memory + starts[i] * 4;
+        for (size_t k = 0; k < blocks[i].size(); k++, words += 4)
+            out << "    " << number(words[0]) << ", " << number(words[1]) << ", " << number(words[2]) << ", " << number(words[3]) << ",\n";
+    }
+    out << "    0,\n};\n\n";
+
+    out << "extern \"C\" const tvm_aot_module " << AOT_SYMBOL << " =\n"
+        << "    { " << VM_AOT_VERSION << ", " << memory_words << ", " << result.blocks << ", blocks, code };\n";
+    return result;
+}
+
+bool vm_aot_load(VMContext *ctx, const char *filename)
+{
+    vm_aot_unload(ctx);
+    auto library = plat_load_library(filename);
+    if (library == nullptr)
+        return false;
+    auto module = static_cast<const AotModule*>(plat_library_symbol(library, AOT_SYMBOL));
+    if (module == nullptr || module->version != VM_AOT_VERSION || module->memory_words > ctx->memory_size)
+    {
+        plat_unload_library(library);
+        return false;
+    }
+
+    auto slots = ctx->predecode_slots;
+    auto blocks = static_cast<aot_block*>(plat_map_bytes(slots * sizeof(aot_block)));
+    if (blocks == nullptr)
+    {
+        plat_unload_library(library);
+        return false;
+    }
+
+    auto aot = new AotState;
+    aot->library = library;
+    aot->module = module;
+    aot->blocks = blocks;
+    aot->slots = slots;
+    ctx->aot = aot;
+
+    // Blocks of code that changed since the library was built are left out
+    auto code = module->code;
+    for (size_t i = 0; i < module->block_count; i++)
+    {
+        auto &block = module->blocks[i];
+        auto first = block.address >> 2;
+        auto words = block.instructions * 4;
+        if ((block.address & 3) == 0 && block.instructions <= slots && first <= slots - block.instructions
+            && memcmp(ctx->memory + block.address, code, words * sizeof(vmword)) == 0)
+        {
+            blocks[first] = block.run;
+            for (auto slot = first; slot < first + block.instructions; slot++)
+            {
+                ctx->predecoded[slot].aot_covered = true;
+                vm_mark_decoded(ctx, slot);
+            }
+            aot->installed.push_back(i);
+        }
+        code += words;
+    }
+    return true;
+}
+
+void vm_aot_unload(VMContext *ctx)
+{
+    auto aot = ctx->aot;
+    if (aot == nullptr)
+        return;
+    // The whole table may have been replaced in the meantime (vm_invalidate_all), but then
+    // clearing the flags again is harmless
+    for (auto i : aot->installed)
+        aot_clear_covered(ctx, aot->module->blocks[i]);
+    plat_unmap_bytes(aot->blocks, aot->slots * sizeof(aot_block));
+    plat_unload_library(aot->library);
+    delete aot;
+    ctx->aot = nullptr;
+}
+
+void vm_aot_invalidate(VMContext *ctx, size_t slot)
+{
+    ctx->predecoded[slot].aot_covered = false;
+    auto aot = ctx->aot;
+    if (aot == nullptr)
+        return;
+    auto &installed = aot->installed;
+    installed.erase(std::remove_if(installed.begin(), installed.end(), [ctx, aot, slot](size_t i)
+    {
+        auto &block = aot->module->blocks[i];
+        auto first = block.address >> 2;
+        if (slot < first || slot >= first + block.instructions)
+            return false;
+        aot->blocks[first] = nullptr;
+        aot_clear_covered(ctx, block);
+        return true;
+    }), installed.end());
+}
+
+namespace
+{
+    void run_aot(VMContext *ctx, void*)
+    {
+        auto aot = ctx->aot;
+        ctx->running = true;
+        while (ctx->running)
+        {
+            auto ip = ctx->registers[IP];
+            auto slot = ip >> 2;
+            if (aot != nullptr && (ip & 3) == 0 && slot < aot->slots)
+            {
+                auto block = aot->blocks[slot];
+                if (block != nullptr)
+                {
+                    auto ic = ctx->registers[IC];
+                    if (ctx->trace != nullptr)
+                        vm_trace_record_block(ctx, ip);
+                    block(ctx->registers, ctx->memory);
+                    // A block that bails out on its first instruction (division by zero)
+                    // made no progress, the interpreter has to handle that instruction
+                    if (ctx->registers[IC] != ic)
+                    {
+                        vm_check_budget(ctx);
+                        continue;
+                    }
+                }
+            }
+
+            auto instr = vm_fetch_decode(ctx);
+            vm_execute(ctx, instr);
+        }
+    }
+}
+
+VMTrap vm_run_aot(VMContext *ctx)
+{
+    return vm_run_guarded(ctx, &run_aot, nullptr);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <ostream>
+
+// Forward-declare VMContext
+struct VMContext;
+enum VMTrap : int;
+
+// Opaque per-context state of loaded ahead-of-time code
+struct AotState;
+
+// What vm_aot_emit wrote
+struct VMAotResult
+{
+    // Number of basic blocks compiled to functions
+    size_t blocks;
+    // Number of instructions in them
+    size_t instructions;
+};
+
+// Write C++ source for the code of ctx reachable from IP to out. Every basic block
+// the JIT could compile becomes one function keeping the guest registers in locals,
+// which leaves IP and IC exactly where the interpreter would have left them.
+// The source only needs <stdint.h>, built into a shared library it can be loaded
+// with vm_aot_load into any context holding the same code.
+VMAotResult vm_aot_emit(const VMContext *ctx, std::ostream &out);
+
+// Load a shared library built from the output of vm_aot_emit into ctx, replacing
+// the one loaded before. Only blocks whose code still matches the memory of ctx are
+// used, those that are written to later are dropped again.
+// Returns false if the library can't be loaded or was built for a different version
+bool vm_aot_load(VMContext *ctx, const char *filename);
+
+// Unload the library of ctx. Does nothing if none is loaded.
+void vm_aot_unload(VMContext *ctx);
+
+// Drop the loaded blocks covering slot, because the code there was written
+void vm_aot_invalidate(VMContext *ctx, size_t slot);
+
+// Run ctx until it stops. Loaded blocks run at every address they start at,
+// everything else is interpreted.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted.
+VMTrap vm_run_aot(VMContext *ctx);
@@ -0,0 +1,115 @@
+// tvm-aot: compile the code of an image ahead of time
+//
+// Writes C++ source with one function per basic block reachable from the entry point
+// (see vm_aot_emit) and builds it into a shared library with the host compiler.
+// TinyVM --aot loads the library next to the same image and runs the blocks natively,
+// everything they don't cover is interpreted.
+
+#include "vm.hpp"
+#include "aot.hpp"
+#include "assembler.hpp"
+#include "instruction_support.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+namespace
+{
+    bool ends_with(const std::string &text, const std::string &suffix)
+    {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), std::string::npos, suffix) == 0;
+    }
+
+    // Load image into ctx like TinyVM does, assembling it if it is tasm source
+    bool load_image(VMContext *ctx, const std::string &image)
+    {
+        if (!ends_with(image, ".tasm"))
+            return vmi_load_memory_image_file(image.c_str(), ctx);
+
+        std::ifstream file(image, std::ios::binary);
+        if (!file)
+            return false;
+        std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        auto result = vm_assemble(ctx, source.data(), source.size());
+        if (result.error == ASSEMBLE_OK)
+            return true;
+        std::cerr << image << ": " << vm_assemble_message(result.error) << " in line " << result.line << std::endl;
+        return false;
+    }
+
+    void print_usage(const char *program)
+    {
+        std::cout << "Usage: " << program << " [--memory words] [--cxx compiler] -o output.so|output.cpp [image | source.tasm]" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *image = nullptr;
+    const char *output = nullptr;
+    size_t memory_size = VM_MEMORY_SIZE;
+    std::string cxx = getenv("CXX") != nullptr ? getenv("CXX") : "c++";
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc)
+            memory_size = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--cxx") == 0 && i + 1 < argc)
+            cxx = argv[++i];
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+            output = argv[++i];
+        else if (argv[i][0] != '-' && image == nullptr)
+            image = argv[i];
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (image == nullptr || output == nullptr || memory_size == 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    auto ctx = vm_create(memory_size);
+    if (ctx == nullptr)
+    {
+        std::cerr << "Could not reserve " << memory_size << " words of memory" << std::endl;
+        return 1;
+    }
+    if (!load_image(ctx, image))
+    {
+        std::cerr << "Could not load image " << image << std::endl;
+        vm_destroy(ctx);
+        return 1;
+    }
+
+    // Anything but C++ source is built from the source written next to it
+    std::string library = output;
+    auto source = ends_with(library, ".cpp") ? library : library + ".cpp";
+    std::ofstream file(source);
+    auto result = vm_aot_emit(ctx, file);
+    file.close();
+    vm_destroy(ctx);
+    if (!file)
+    {
+        std::cerr << "Could not write " << source << std::endl;
+        return 1;
+    }
+    std::cout << "Compiled " << result.blocks << " blocks (" << result.instructions << " instructions) to " << source << std::endl;
+    if (source == library)
+        return 0;
+
+    auto command = cxx + " -std=c++11 -O2 -shared -fPIC -o \"" + library + "\" \"" + source + "\"";
+    if (std::system(command.c_str()) != 0)
+    {
+        std::cerr << "Could not build " << library << " with: " << command << std::endl;
+        return 1;
+    }
+    std::cout << "Built " << library << std::endl;
+    return 0;
+}
@@ -0,0 +1,512 @@
+#include "assembler.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.hpp"
+
+static_assert(INSTRUCTION_COUNT == 34, "Update MNEMONICS of the assembler.");
+
+namespace
+{
+    struct Mnemonic
+    {
+        const char *name;
+        size_t operands;
+    };
+
+    // Must be kept in the same order as the Opcode enum
+    const Mnemonic MNEMONICS[INSTRUCTION_COUNT] =
+    {
+        { "nop", 0 }, { "halt", 0 }, { "push", 1 }, { "pop", 1 },
+        { "add", 3 }, { "sub", 3 }, { "mul", 3 }, { "div", 3 },
+        { "shl", 3 }, { "shr", 3 }, { "mod", 3 }, { "inc", 1 },
+        { "dec", 1 }, { "not", 1 }, { "cmp", 3 }, { "mov", 2 },
+        { "call", 1 }, { "ret", 0 }, { "jmp", 1 }, { "jeq", 3 },
+        { "jne", 3 }, { "jnz", 2 }, { "rdrand", 3 }, { "syscall", 1 },
+        { "vadd", 3 }, { "vsub", 3 }, { "vmul", 3 }, { "vxor", 3 },
+        { "vfill", 3 }, { "vcopy", 3 }, { "vsum", 3 }, { "vmin", 3 },
+        { "vmax", 3 }, { "vcount", 3 },
+    };
+
+    // Must be kept in the same order as the register numbers
+    const char *const REGISTER_NAMES[VM_REGISTER_COUNT] =
+    {
+        "r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+        "rIP", "rIC", "rSP", "rSBP", "rRMD",
+    };
+
+    // A run of characters of the source
+    struct Token
+    {
+        const char *text;
+        size_t length;
+
+        // The characters packed into a number, so that looking up mnemonics and registers
+        // compares numbers. 0 for words that are too long to be either.
+        uint64_t key() const
+        {
+            if (length > sizeof(uint64_t))
+                return 0;
+            uint64_t key = 0;
+            for (size_t i = 0; i < length; i++)
+                key = key << 8 | static_cast<uint8_t>(text[i]);
+            return key;
+        }
+
+        std::string str() const
+        {
+            return std::string(text, length);
+        }
+    };
+
+    uint64_t name_key(const char *name)
+    {
+        return Token{ name, strlen(name) }.key();
+    }
+
+    // Keys of the mnemonics and register names, in the same order
+    struct NameKeys
+    {
+        uint64_t mnemonics[INSTRUCTION_COUNT];
+        uint64_t registers[VM_REGISTER_COUNT];
+
+        NameKeys()
+        {
+            for (size_t i = 0; i < INSTRUCTION_COUNT; i++)
+                mnemonics[i] = name_key(MNEMONICS[i].name);
+            for (size_t i = 0; i < VM_REGISTER_COUNT; i++)
+                registers[i] = name_key(REGISTER_NAMES[i]);
+        }
+    };
+
+    const NameKeys NAME_KEYS;
+
+    // Index of key in keys, count if it isn't there
+    size_t find_key(const uint64_t *keys, size_t count, uint64_t key)
+    {
+        size_t i = 0;
+        while (i < count && keys[i] != key)
+            i++;
+        return i;
+    }
+
+    bool is_word_char(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    int hex_digit(char c)
+    {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if (c >= 'a' && c <= 'f')
+            return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F')
+            return c - 'A' + 10;
+        return -1;
+    }
+
+    // Decimal, or hex with an h in front
+    VMAssembleError parse_number(Token token, vmword *value)
+    {
+        if (token.length == 0)
+            return ASSEMBLE_SYNTAX;
+        vmword result = 0;
+        if (token.text[0] == 'h')
+        {
+            if (token.length == 1)
+                return ASSEMBLE_SYNTAX;
+            for (size_t i = 1; i < token.length; i++)
+            {
+                auto digit = hex_digit(token.text[i]);
+                if (digit < 0)
+                    return ASSEMBLE_SYNTAX;
+                if (result >> 60 != 0)
+                    return ASSEMBLE_INVALID_NUMBER;
+                result = result << 4 | static_cast<vmword>(digit);
+            }
+        }
+        else
+        {
+            for (size_t i = 0; i < token.length; i++)
+            {
+                auto c = token.text[i];
+                if (c < '0' || c > '9')
+                    return ASSEMBLE_INVALID_NUMBER;
+                vmword digit = c - '0';
+                if (result > (~vmword(0) - digit) / 10)
+                    return ASSEMBLE_INVALID_NUMBER;
+                result = result * 10 + digit;
+            }
+        }
+        *value = result;
+        return ASSEMBLE_OK;
+    }
+
+    // An operand word to patch with the address of a label defined further down
+    struct Fixup
+    {
+        vmword address;
+        std::string label;
+        size_t line;
+    };
+
+    // Consecutive words written to memory, invalidated at the end
+    struct Run
+    {
+        vmword base;
+        size_t words;
+    };
+
+    class Assembler
+    {
+    public:
+        Assembler(VMContext *ctx, const char *source, size_t length)
+            : ctx(ctx), pos(source), end(source + length)
+        {
+        }
+
+        VMAssembleResult run()
+        {
+            VMAssembleResult result = {};
+            result.error = assemble_lines();
+            if (result.error == ASSEMBLE_OK)
+                result.error = resolve_fixups();
+            result.line = result.error != ASSEMBLE_OK ? line : 0;
+            result.instructions = instructions;
+
+            for (auto &run : runs)
+                vm_invalidate_range(ctx, run.base, run.words);
+            if (result.error != ASSEMBLE_OK)
+                return result;
+            if (has_entry || instructions > 0)
+                vm_init_programbase(ctx, has_entry ? entry : first_instruction);
+            if (has_stack)
+                vm_init_stack(ctx, stack);
+            return result;
+        }
+
+    private:
+        VMContext *ctx;
+        const char *pos;
+        const char *end;
+        size_t line = 1;
+        // Where the next instruction goes
+        vmword address = 0;
+        size_t instructions = 0;
+        vmword first_instruction = 0;
+        std::unordered_map<std::string, vmword> labels;
+        std::vector<Fixup> fixups;
+        std::vector<Run> runs;
+        bool has_entry = false;
+        vmword entry = 0;
+        // .entry naming a label defined further down
+        std::string entry_label;
+        size_t entry_line = 0;
+        bool has_stack = false;
+        vmword stack = 0;
+
+        ////////
+        // Scanning
+        ////////
+
+        // Skip blanks and comments up to the end of the line
+        void skip_blank()
+        {
+            while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\r'))
+                pos++;
+            if (pos < end && *pos == ';')
+            {
+                while (pos < end && *pos != '\n')
+                    pos++;
+            }
+        }
+
+        bool at_line_end()
+        {
+            skip_blank();
+            return pos == end || *pos == '\n';
+        }
+
+        bool accept(char c)
+        {
+            if (pos == end || *pos != c)
+                return false;
+            pos++;
+            return true;
+        }
+
+        // Read the word at pos, which is empty if there is none
+        Token read_word()
+        {
+            auto start = pos;
+            while (pos < end && is_word_char(*pos))
+                pos++;
+            return { start, static_cast<size_t>(pos - start) };
+        }
+
+        ////////
+        // Lines
+        ////////
+
+        VMAssembleError assemble_lines()
+        {
+            while (pos < end)
+            {
+                auto error = assemble_line();
+                if (error != ASSEMBLE_OK)
+                    return error;
+                if (!at_line_end())
+                    return ASSEMBLE_SYNTAX;
+                if (accept('\n'))
+                    line++;
+            }
+            return ASSEMBLE_OK;
+        }
+
+        // [label:] [instruction operands...] or .specifier operand
+        VMAssembleError assemble_line()
+        {
+            if (at_line_end())
+                return ASSEMBLE_OK;
+            auto word = read_word();
+            if (word.length > 0 && accept(':'))
+            {
+                if (!labels.emplace(word.str(), address).second)
+                    return ASSEMBLE_DUPLICATE_LABEL;
+                if (at_line_end())
+                    return ASSEMBLE_OK;
+                word = read_word();
+            }
+            if (word.length > 0)
+                return assemble_instruction(word);
+            if (accept('.'))
+                return assemble_specifier(read_word());
+            return ASSEMBLE_SYNTAX;
+        }
+
+        VMAssembleError assemble_instruction(Token name)
+        {
+            auto opcode = find_key(NAME_KEYS.mnemonics, INSTRUCTION_COUNT, name.key());
+            if (opcode == INSTRUCTION_COUNT)
+                return ASSEMBLE_UNKNOWN_INSTRUCTION;
+
+            Instruction instr{ static_cast<Opcode>(opcode), OF_NORMAL, {}, {} };
+            // Operands naming labels that aren't defined yet
+            Token pending[3] = {};
+            size_t count = 0;
+            while (!at_line_end())
+            {
+                if (count == 3)
+                    return ASSEMBLE_OPERAND_COUNT;
+                auto error = parse_operand(instr, count, &pending[count]);
+                if (error != ASSEMBLE_OK)
+                    return error;
+                count++;
+            }
+            if (count != MNEMONICS[opcode].operands)
+                return ASSEMBLE_OPERAND_COUNT;
+            if (address > ctx->memory_size || ctx->memory_size - address < 4)
+                return ASSEMBLE_OUT_OF_RANGE;
+
+            if (overwrites(address))
+                drop_fixups(address);
+            auto data = vmi_encode(&instr);
+            memcpy(ctx->memory + address, data.words, sizeof(data.words));
+            for (size_t i = 0; i < count; i++)
+            {
+                if (pending[i].length > 0)
+                    fixups.push_back({ address + 1 + i, pending[i].str(), line });
+            }
+            if (runs.empty() || runs.back().base + runs.back().words != address)
+                runs.push_back({ address, 0 });
+            runs.back().words += 4;
+            if (instructions++ == 0)
+                first_instruction = address;
+            address += 4;
+            return ASSEMBLE_OK;
+        }
+
+        // Whether an instruction at address overwrites one written before, after a .base
+        bool overwrites(vmword address) const
+        {
+            for (auto &run : runs)
+            {
+                if (address + 4 > run.base && address < run.base + run.words)
+                    return true;
+            }
+            return false;
+        }
+
+        // Forget the labels the instruction at address was waiting for, it is replaced
+        void drop_fixups(vmword address)
+        {
+            fixups.erase(std::remove_if(fixups.begin(), fixups.end(),
+                [address](const Fixup &fixup) { return fixup.address - address < 4; }), fixups.end());
+        }
+
+        // #literal, :label, register or memory address, each optionally in brackets
+        VMAssembleError parse_operand(Instruction &instr, size_t index, Token *label)
+        {
+            unsigned mode = 0;
+            bool indirect = accept('[');
+            if (indirect)
+            {
+                mode = AM_INDIRECT;
+                skip_blank();
+            }
+
+            vmword value = 0;
+            if (accept('#'))
+            {
+                mode |= AM_LITERAL;
+                auto error = parse_number(read_word(), &value);
+                if (error != ASSEMBLE_OK)
+                    return error;
+            }
+            else if (accept(':'))
+            {
+                mode |= AM_LITERAL;
+                auto name = read_word();
+                if (name.length == 0)
+                    return ASSEMBLE_SYNTAX;
+                auto found = labels.find(name.str());
+                if (found != labels.end())
+                    value = found->second;
+                else
+                    *label = name;
+            }
+            else
+            {
+                auto word = read_word();
+                if (word.length > 0 && word.text[0] == 'r')
+                {
+                    mode |= AM_REGISTER;
+                    value = find_key(NAME_KEYS.registers, VM_REGISTER_COUNT, word.key());
+                    if (value == VM_REGISTER_COUNT)
+                        return ASSEMBLE_INVALID_REGISTER;
+                }
+                else
+                {
+                    mode |= AM_MEMORY;
+                    auto error = parse_number(word, &value);
+                    if (error != ASSEMBLE_OK)
+                        return error;
+                }
+            }
+
+            if (indirect)
+            {
+                skip_blank();
+                if (!accept(']'))
+                    return ASSEMBLE_SYNTAX;
+            }
+            instr.addressing[index] = static_cast<AddressingMode>(mode);
+            instr.operands[index] = value;
+            return ASSEMBLE_OK;
+        }
+
+        VMAssembleError assemble_specifier(Token name)
+        {
+            if (at_line_end())
+                return name.length > 0 ? ASSEMBLE_OPERAND_COUNT : ASSEMBLE_SYNTAX;
+            auto key = name.key();
+            if (key == name_key("base"))
+            {
+                auto error = parse_number(read_word(), &address);
+                if (error != ASSEMBLE_OK)
+                    return error;
+                return address % 4 == 0 ? ASSEMBLE_OK : ASSEMBLE_MISALIGNED_BASE;
+            }
+            if (key == name_key("stack"))
+            {
+                has_stack = true;
+                return parse_number(read_word(), &stack);
+            }
+            if (key == name_key("entry"))
+            {
+                has_entry = true;
+                if (!accept(':'))
+                    return parse_number(read_word(), &entry);
+                auto label = read_word();
+                if (label.length == 0)
+                    return ASSEMBLE_SYNTAX;
+                auto found = labels.find(label.str());
+                if (found != labels.end())
+                    entry = found->second;
+                else
+                {
+                    entry_label = label.str();
+                    entry_line = line;
+                }
+                return ASSEMBLE_OK;
+            }
+            return ASSEMBLE_UNKNOWN_SPECIFIER;
+        }
+
+        VMAssembleError resolve_fixups()
+        {
+            for (auto &fixup : fixups)
+            {
+                auto found = labels.find(fixup.label);
+                if (found == labels.end())
+                {
+                    line = fixup.line;
+                    return ASSEMBLE_UNKNOWN_LABEL;
+                }
+                ctx->memory[fixup.address] = found->second;
+            }
+            if (!entry_label.empty())
+            {
+                auto found = labels.find(entry_label);
+                if (found == labels.end())
+                {
+                    line = entry_line;
+                    return ASSEMBLE_UNKNOWN_LABEL;
+                }
+                entry = found->second;
+            }
+            return ASSEMBLE_OK;
+        }
+    };
+}
+
+VMAssembleResult vm_assemble(VMContext *ctx, const char *source, size_t length)
+{
+    return Assembler(ctx, source, length).run();
+}
+
+const char* vm_assemble_message(VMAssembleError error)
+{
+    switch (error)
+    {
+    case ASSEMBLE_OK:
+        return "Assembled";
+    case ASSEMBLE_SYNTAX:
+        return "Syntax error";
+    case ASSEMBLE_UNKNOWN_INSTRUCTION:
+        return "Unknown instruction";
+    case ASSEMBLE_UNKNOWN_SPECIFIER:
+        return "Unknown specifier";
+    case ASSEMBLE_OPERAND_COUNT:
+        return "Wrong number of operands";
+    case ASSEMBLE_INVALID_NUMBER:
+        return "Invalid number";
+    case ASSEMBLE_INVALID_REGISTER:
+        return "Invalid register";
+    case ASSEMBLE_DUPLICATE_LABEL:
+        return "Duplicate label";
+    case ASSEMBLE_UNKNOWN_LABEL:
+        return "Unknown label";
+    case ASSEMBLE_MISALIGNED_BASE:
+        return "Base address not a multiple of 4";
+    case ASSEMBLE_OUT_OF_RANGE:
+        return "Instruction out of range";
+    }
+    return "Unknown error";
+}
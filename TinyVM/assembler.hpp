@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+#include "vmtypes.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+
+// Why vm_assemble rejected a program
+enum VMAssembleError
+{
+    ASSEMBLE_OK,
+    ASSEMBLE_SYNTAX,              // Something that is neither a label, specifier, instruction nor operand
+    ASSEMBLE_UNKNOWN_INSTRUCTION,
+    ASSEMBLE_UNKNOWN_SPECIFIER,
+    ASSEMBLE_OPERAND_COUNT,       // Wrong number of operands for the instruction or specifier
+    ASSEMBLE_INVALID_NUMBER,      // Number that doesn't fit into a word
+    ASSEMBLE_INVALID_REGISTER,
+    ASSEMBLE_DUPLICATE_LABEL,
+    ASSEMBLE_UNKNOWN_LABEL,
+    ASSEMBLE_MISALIGNED_BASE,     // .base that is not a multiple of 4
+    ASSEMBLE_OUT_OF_RANGE,        // Instruction outside of memory
+};
+
+struct VMAssembleResult
+{
+    VMAssembleError error;
+    // Source line of the error, counting from 1, 0 if there is no error
+    size_t line;
+    // Number of instructions written
+    size_t instructions;
+};
+
+// Assemble the length bytes of tasm source at source straight into the memory of ctx,
+// the way tasm.py assembles it into an image: labels, :label references, #literals,
+// [indirect] operands, decimal and h-prefixed hex numbers, .base, .entry and .stack.
+// Runs in a single pass, references to labels that aren't defined yet are patched at
+// the end. IP is set to the entry point, which defaults to the first instruction, and
+// the stack is initialized if the source has .stack. Memory the source doesn't cover
+// is left alone.
+// Returns the result. On error the registers are unchanged, but the instructions
+// assembled before the error was found may already be in memory.
+VMAssembleResult vm_assemble(VMContext *ctx, const char *source, size_t length);
+
+// Describe error, e.g. "Unknown label"
+const char* vm_assemble_message(VMAssembleError error);
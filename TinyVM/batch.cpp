@@ -0,0 +1,779 @@
+#include "batch.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "vm.hpp"
+#include "block.hpp"
+#include "platform.hpp"
+
+// The AVX2 kernels are built where the block instructions have them too
+#if TVM_BLOCK_AVX2
+#include <immintrin.h>
+#endif
+
+namespace
+{
+    // Register rows are padded to a multiple of this many lanes, so kernels have no tail
+    const size_t LANE_ALIGNMENT = 4;
+
+    const size_t NO_LANE = SIZE_MAX;
+
+    // A source operand of a lockstep instruction: a register row or a literal
+    struct BatchOperand
+    {
+        const vmword *row;
+        vmword value;
+
+        vmword at(size_t lane) const
+        {
+            return row != nullptr ? row[lane] : value;
+        }
+
+#if TVM_BLOCK_AVX2
+        TVM_AVX2 __m256i avx2_at(size_t lane) const
+        {
+            return row != nullptr ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + lane)) : _mm256_set1_epi64x(value);
+        }
+#endif
+    };
+
+    enum BatchAlu
+    {
+        ALU_ADD,
+        ALU_SUB,
+        ALU_MUL,
+        ALU_SHL,
+        ALU_SHR,
+        ALU_CMP,
+
+        ALU_COUNT,
+    };
+
+    // The lanes of a run as the kernels see them. Every row has count lanes, a multiple
+    // of LANE_ALIGNMENT, and the running row has all bits set for running lanes.
+    struct LaneRows
+    {
+        vmword *ip;
+        vmword *ic;
+        const vmword *running;
+        size_t count;
+    };
+
+    // Kernels run an instruction for the running lanes at pc, which move on to pc + 4 first,
+    // and count it in their IC. Sources are read after that and the destination is written
+    // before IC, so operands may name IP or IC just like in the interpreter. They return the
+    // lowest IP of the running lanes afterwards, which is where the next step goes, and add
+    // the number of lanes at pc to selected.
+    struct BatchKernels
+    {
+        // Lowest IP of the running lanes, all bits set if none is running
+        vmword (*lowest)(const LaneRows &lanes);
+        // Set all bits of the running lanes at pc in mask and clear them for the others.
+        // Returns the number of lanes set.
+        size_t (*select)(const LaneRows &lanes, vmword pc, vmword *mask);
+        // dst = b op c
+        vmword (*alu[ALU_COUNT])(const LaneRows &lanes, vmword pc, vmword *dst, BatchOperand b, BatchOperand c, size_t *selected);
+        // IP = target if (b == c) == equal
+        vmword (*branch)(const LaneRows &lanes, vmword pc, BatchOperand target, BatchOperand b, BatchOperand c,
+            bool equal, size_t *selected);
+    };
+
+    ////////
+    // Operations, one lane and one vector at a time
+    ////////
+
+#if TVM_BLOCK_AVX2
+    // Low 64 bits of the products of the 64-bit lanes, there is no instruction for it before AVX-512
+    TVM_AVX2 inline __m256i mul_lanes(__m256i a, __m256i b)
+    {
+        auto cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+        return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+    }
+
+    // CMP: -1 if c < b, 1 if c > b, 0 otherwise. Flipping the sign bits makes the signed compares unsigned.
+    TVM_AVX2 inline __m256i cmp_lanes(__m256i b, __m256i c)
+    {
+        auto bias = _mm256_set1_epi64x(INT64_MIN);
+        b = _mm256_xor_si256(b, bias);
+        c = _mm256_xor_si256(c, bias);
+        auto less = _mm256_cmpgt_epi64(b, c);
+        auto greater = _mm256_and_si256(_mm256_cmpgt_epi64(c, b), _mm256_set1_epi64x(1));
+        return _mm256_or_si256(less, greater);
+    }
+
+    // Shift counts wrap around at 64 like the x86 shift instructions the interpreter uses
+    TVM_AVX2 inline __m256i shift_count(__m256i c)
+    {
+        return _mm256_and_si256(c, _mm256_set1_epi64x(63));
+    }
+
+#define BATCH_OP(name, expr, avx2_expr) \
+    struct name \
+    { \
+        static vmword scalar(vmword b, vmword c) { return expr; } \
+        TVM_AVX2 static __m256i avx2(__m256i b, __m256i c) { return avx2_expr; } \
+    }
+#else
+#define BATCH_OP(name, expr, avx2_expr) \
+    struct name \
+    { \
+        static vmword scalar(vmword b, vmword c) { return expr; } \
+    }
+#endif
+
+    BATCH_OP(Add, b + c, _mm256_add_epi64(b, c));
+    BATCH_OP(Sub, b - c, _mm256_sub_epi64(b, c));
+    BATCH_OP(Mul, b * c, mul_lanes(b, c));
+    BATCH_OP(Shl, b << (c & 63), _mm256_sllv_epi64(b, shift_count(c)));
+    BATCH_OP(Shr, b >> (c & 63), _mm256_srlv_epi64(b, shift_count(c)));
+    BATCH_OP(Cmp, c < b ? ~vmword(0) : c > b ? 1 : 0, cmp_lanes(b, c));
+
+#undef BATCH_OP
+
+    ////////
+    // Generic kernels
+    ////////
+
+    // All bits set if lane is running and at pc
+    inline vmword lane_mask(const LaneRows &lanes, size_t lane, vmword pc)
+    {
+        return lanes.running[lane] & (0 - static_cast<vmword>(lanes.ip[lane] == pc));
+    }
+
+    // IP of lane for finding the lowest one, stopped lanes count as being at the highest address
+    inline vmword lane_key(const LaneRows &lanes, size_t lane)
+    {
+        return lanes.ip[lane] | ~lanes.running[lane];
+    }
+
+    vmword generic_lowest(const LaneRows &lanes)
+    {
+        vmword lowest = ~vmword(0);
+        for (size_t i = 0; i < lanes.count; i++)
+            lowest = std::min(lowest, lane_key(lanes, i));
+        return lowest;
+    }
+
+    size_t generic_select(const LaneRows &lanes, vmword pc, vmword *mask)
+    {
+        size_t selected = 0;
+        for (size_t i = 0; i < lanes.count; i++)
+        {
+            mask[i] = lane_mask(lanes, i, pc);
+            selected += mask[i] & 1;
+        }
+        return selected;
+    }
+
+    template<typename Op>
+    vmword generic_alu(const LaneRows &lanes, vmword pc, vmword *dst, BatchOperand b, BatchOperand c, size_t *selected)
+    {
+        vmword lowest = ~vmword(0);
+        for (size_t i = 0; i < lanes.count; i++)
+        {
+            auto mask = lane_mask(lanes, i, pc);
+            lanes.ip[i] = ((pc + 4) & mask) | (lanes.ip[i] & ~mask);
+            auto result = Op::scalar(b.at(i), c.at(i));
+            dst[i] = (result & mask) | (dst[i] & ~mask);
+            lanes.ic[i] -= mask;
+            lowest = std::min(lowest, lane_key(lanes, i));
+            *selected += mask & 1;
+        }
+        return lowest;
+    }
+
+    vmword generic_branch(const LaneRows &lanes, vmword pc, BatchOperand target, BatchOperand b, BatchOperand c,
+        bool equal, size_t *selected)
+    {
+        vmword lowest = ~vmword(0);
+        for (size_t i = 0; i < lanes.count; i++)
+        {
+            auto mask = lane_mask(lanes, i, pc);
+            lanes.ip[i] = ((pc + 4) & mask) | (lanes.ip[i] & ~mask);
+            auto taken = mask & (0 - static_cast<vmword>((b.at(i) == c.at(i)) == equal));
+            lanes.ip[i] = (target.at(i) & taken) | (lanes.ip[i] & ~taken);
+            lanes.ic[i] -= mask;
+            lowest = std::min(lowest, lane_key(lanes, i));
+            *selected += mask & 1;
+        }
+        return lowest;
+    }
+
+    const BatchKernels GENERIC_KERNELS =
+    {
+        &generic_lowest,
+        &generic_select,
+        {
+            &generic_alu<Add>, &generic_alu<Sub>, &generic_alu<Mul>,
+            &generic_alu<Shl>, &generic_alu<Shr>, &generic_alu<Cmp>,
+        },
+        &generic_branch,
+    };
+
+#if TVM_BLOCK_AVX2
+    ////////
+    // AVX2 kernels, 4 lanes per vector
+    ////////
+
+    TVM_AVX2 inline __m256i load4(const vmword *src)
+    {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    }
+
+    TVM_AVX2 inline void store4(vmword *dst, __m256i value)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), value);
+    }
+
+    // Running lanes at pc, see lane_mask
+    TVM_AVX2 inline __m256i mask4(const LaneRows &lanes, size_t lane, __m256i pc)
+    {
+        return _mm256_and_si256(_mm256_cmpeq_epi64(load4(lanes.ip + lane), pc), load4(lanes.running + lane));
+    }
+
+    // Track the unsigned minimum of lane_key in lowest, whose sign bits are flipped, see cmp_lanes
+    TVM_AVX2 inline void track_lowest(const LaneRows &lanes, size_t lane, __m256i &lowest)
+    {
+        auto stopped = _mm256_xor_si256(load4(lanes.running + lane), _mm256_set1_epi64x(-1));
+        auto key = _mm256_xor_si256(_mm256_or_si256(load4(lanes.ip + lane), stopped), _mm256_set1_epi64x(INT64_MIN));
+        lowest = _mm256_blendv_epi8(lowest, key, _mm256_cmpgt_epi64(lowest, key));
+    }
+
+    TVM_AVX2 inline vmword lowest_lane(__m256i lowest)
+    {
+        vmword keys[4];
+        store4(keys, _mm256_xor_si256(lowest, _mm256_set1_epi64x(INT64_MIN)));
+        return std::min(std::min(keys[0], keys[1]), std::min(keys[2], keys[3]));
+    }
+
+    TVM_AVX2 inline size_t count_lanes(__m256i mask)
+    {
+        return __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(mask)));
+    }
+
+    TVM_AVX2 vmword avx2_lowest(const LaneRows &lanes)
+    {
+        auto lowest = _mm256_set1_epi64x(INT64_MAX);
+        for (size_t i = 0; i < lanes.count; i += 4)
+            track_lowest(lanes, i, lowest);
+        return lowest_lane(lowest);
+    }
+
+    TVM_AVX2 size_t avx2_select(const LaneRows &lanes, vmword pc, vmword *mask)
+    {
+        auto here = _mm256_set1_epi64x(pc);
+        size_t selected = 0;
+        for (size_t i = 0; i < lanes.count; i += 4)
+        {
+            auto lanes_here = mask4(lanes, i, here);
+            store4(mask + i, lanes_here);
+            selected += count_lanes(lanes_here);
+        }
+        return selected;
+    }
+
+    template<typename Op>
+    TVM_AVX2 vmword avx2_alu(const LaneRows &lanes, vmword pc, vmword *dst, BatchOperand b, BatchOperand c, size_t *selected)
+    {
+        auto here = _mm256_set1_epi64x(pc);
+        auto next = _mm256_set1_epi64x(pc + 4);
+        auto lowest = _mm256_set1_epi64x(INT64_MAX);
+        size_t count = 0;
+        for (size_t i = 0; i < lanes.count; i += 4)
+        {
+            auto mask = mask4(lanes, i, here);
+            store4(lanes.ip + i, _mm256_blendv_epi8(load4(lanes.ip + i), next, mask));
+            auto result = Op::avx2(b.avx2_at(i), c.avx2_at(i));
+            store4(dst + i, _mm256_blendv_epi8(load4(dst + i), result, mask));
+            store4(lanes.ic + i, _mm256_sub_epi64(load4(lanes.ic + i), mask));
+            track_lowest(lanes, i, lowest);
+            count += count_lanes(mask);
+        }
+        *selected += count;
+        return lowest_lane(lowest);
+    }
+
+    TVM_AVX2 vmword avx2_branch(const LaneRows &lanes, vmword pc, BatchOperand target, BatchOperand b, BatchOperand c,
+        bool equal, size_t *selected)
+    {
+        auto here = _mm256_set1_epi64x(pc);
+        auto next = _mm256_set1_epi64x(pc + 4);
+        auto invert = equal ? _mm256_setzero_si256() : _mm256_set1_epi64x(-1);
+        auto lowest = _mm256_set1_epi64x(INT64_MAX);
+        size_t count = 0;
+        for (size_t i = 0; i < lanes.count; i += 4)
+        {
+            auto mask = mask4(lanes, i, here);
+            store4(lanes.ip + i, _mm256_blendv_epi8(load4(lanes.ip + i), next, mask));
+            auto condition = _mm256_xor_si256(_mm256_cmpeq_epi64(b.avx2_at(i), c.avx2_at(i)), invert);
+            auto taken = _mm256_and_si256(condition, mask);
+            store4(lanes.ip + i, _mm256_blendv_epi8(load4(lanes.ip + i), target.avx2_at(i), taken));
+            store4(lanes.ic + i, _mm256_sub_epi64(load4(lanes.ic + i), mask));
+            track_lowest(lanes, i, lowest);
+            count += count_lanes(mask);
+        }
+        *selected += count;
+        return lowest_lane(lowest);
+    }
+
+    const BatchKernels AVX2_KERNELS =
+    {
+        &avx2_lowest,
+        &avx2_select,
+        {
+            &avx2_alu<Add>, &avx2_alu<Sub>, &avx2_alu<Mul>,
+            &avx2_alu<Shl>, &avx2_alu<Shr>, &avx2_alu<Cmp>,
+        },
+        &avx2_branch,
+    };
+#endif
+
+    const BatchKernels* best_kernels()
+    {
+#if TVM_BLOCK_AVX2
+        if (vm_cpu_has_avx2())
+            return &AVX2_KERNELS;
+#endif
+        return &GENERIC_KERNELS;
+    }
+
+    const BatchKernels *const batch_kernels = best_kernels();
+
+    ////////
+    // Lockstep execution
+    ////////
+
+    enum SlotKind : uint8_t
+    {
+        SLOT_UNKNOWN, // Not looked at yet in this run
+        SLOT_SCALAR,  // Interpreted lane by lane
+        SLOT_VECTOR,  // Run for all lanes at once, and marked batched in every lane that shares it
+    };
+
+    struct BatchRun
+    {
+        // Fork of the snapshot that lockstep instructions are decoded from, never run
+        VMContext *code;
+        VMContext *const *lanes;
+        size_t count;
+        // Lanes per register row
+        size_t stride;
+        // Row r holds register r of every lane. Lanes that are interpreted have theirs in
+        // their context while they are, the rows are up to date everywhere else.
+        std::vector<vmword> registers;
+        std::vector<vmword> running;
+        std::vector<vmword> mask;
+        std::vector<SlotKind> kinds;
+        // Lanes whose code turned out to differ, to be interpreted until they stop
+        std::vector<size_t> pending;
+        // The lane being interpreted and its IC when it started, for faults
+        size_t current;
+        vmword current_ic;
+        VMBatchStats stats;
+
+        vmword* row(size_t reg)
+        {
+            return registers.data() + reg * stride;
+        }
+    };
+
+    // Only register and literal operands run in lockstep, the registers must exist
+    bool lockstep_source(const Instruction &instr, int index)
+    {
+        auto mode = instr.addressing[index];
+        return mode == AM_LITERAL || (mode == AM_REGISTER && instr.operands[index] < VM_REGISTER_COUNT);
+    }
+
+    bool lockstep_target(const Instruction &instr, int index)
+    {
+        return instr.addressing[index] == AM_REGISTER && instr.operands[index] < VM_REGISTER_COUNT;
+    }
+
+    bool runs_in_lockstep(const Instruction &instr)
+    {
+        switch (instr.opcode)
+        {
+        case OP_NOP:
+        case OP_HALT:
+            return true;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_MOD:
+        case OP_CMP:
+            return lockstep_target(instr, 0) && lockstep_source(instr, 1) && lockstep_source(instr, 2);
+        case OP_INC:
+        case OP_DEC:
+        case OP_NOT:
+            return lockstep_target(instr, 0);
+        case OP_MOV:
+            return lockstep_target(instr, 0) && lockstep_source(instr, 1);
+        case OP_JMP:
+            return lockstep_source(instr, 0);
+        case OP_JNZ:
+            return lockstep_source(instr, 0) && lockstep_source(instr, 1);
+        case OP_JEQ:
+        case OP_JNE:
+            return lockstep_source(instr, 0) && lockstep_source(instr, 1) && lockstep_source(instr, 2);
+        default:
+            return false;
+        }
+    }
+
+    void diverge(BatchRun &run, size_t lane)
+    {
+        run.lanes[lane]->batch_diverged = true;
+        run.pending.push_back(lane);
+    }
+
+    // Mark slot batched in every lane whose code there is the same as in the snapshot.
+    // From then on, a lane writing to it notices through vm_invalidate.
+    void share_slot(BatchRun &run, size_t slot)
+    {
+        auto code = run.code->memory + slot * 4;
+        for (size_t lane = 0; lane < run.count; lane++)
+        {
+            auto ctx = run.lanes[lane];
+            if (ctx->batch_diverged)
+                continue;
+            if (memcmp(ctx->memory + slot * 4, code, 4 * sizeof(vmword)) != 0)
+            {
+                diverge(run, lane);
+                continue;
+            }
+            ctx->predecoded[slot].batched = true;
+            vm_mark_decoded(ctx, slot);
+        }
+    }
+
+    SlotKind classify(BatchRun &run, vmword ip)
+    {
+        auto slot = ip >> 2;
+        if ((ip & 3) != 0 || slot >= run.kinds.size())
+            return SLOT_SCALAR;
+        auto &kind = run.kinds[slot];
+        if (kind == SLOT_UNKNOWN)
+        {
+            auto entry = run.code->predecoded + slot;
+            if (entry->impl == nullptr)
+                vm_predecode(run.code, entry, ip);
+            kind = runs_in_lockstep(entry->instr) ? SLOT_VECTOR : SLOT_SCALAR;
+            if (kind == SLOT_VECTOR)
+                share_slot(run, slot);
+        }
+        return kind;
+    }
+
+    void load_lane(BatchRun &run, size_t lane)
+    {
+        auto ctx = run.lanes[lane];
+        for (size_t reg = 0; reg < VM_REGISTER_COUNT; reg++)
+            ctx->registers[reg] = run.row(reg)[lane];
+        run.current = lane;
+        run.current_ic = ctx->registers[IC];
+    }
+
+    void store_lane(BatchRun &run, size_t lane)
+    {
+        auto ctx = run.lanes[lane];
+        for (size_t reg = 0; reg < VM_REGISTER_COUNT; reg++)
+            run.row(reg)[lane] = ctx->registers[reg];
+        run.running[lane] = ctx->running ? ~vmword(0) : 0;
+        run.stats.scalar_instructions += ctx->registers[IC] - run.current_ic;
+        run.current = NO_LANE;
+    }
+
+    // Interpret lane until it gets to an instruction that runs in lockstep, or until it
+    // stops if its code differs
+    void run_scalar(BatchRun &run, size_t lane)
+    {
+        auto ctx = run.lanes[lane];
+        load_lane(run, lane);
+        ctx->running = true;
+        do
+        {
+            vm_execute(ctx, vm_fetch_decode(ctx));
+        } while (ctx->running && (ctx->batch_diverged || classify(run, ctx->registers[IP]) != SLOT_VECTOR));
+        store_lane(run, lane);
+    }
+
+    BatchOperand operand(BatchRun &run, const Instruction &instr, int index)
+    {
+        if (instr.addressing[index] == AM_REGISTER)
+            return { run.row(instr.operands[index]), 0 };
+        return { nullptr, instr.operands[index] };
+    }
+
+    LaneRows lane_rows(BatchRun &run)
+    {
+        return { run.row(IP), run.row(IC), run.running.data(), run.stride };
+    }
+
+    // Select the lanes at pc in the mask row and move them on to pc + 4, for the
+    // instructions that have no kernel. Returns how many there are.
+    size_t begin_masked(BatchRun &run, vmword pc)
+    {
+        auto selected = batch_kernels->select(lane_rows(run), pc, run.mask.data());
+        auto mask = run.mask.data();
+        auto ip = run.row(IP);
+        for (size_t i = 0; i < run.stride; i++)
+            ip[i] = ((pc + 4) & mask[i]) | (ip[i] & ~mask[i]);
+        return selected;
+    }
+
+    // Count the instruction for the lanes in the mask row
+    void end_masked(BatchRun &run)
+    {
+        auto mask = run.mask.data();
+        auto ic = run.row(IC);
+        for (size_t i = 0; i < run.stride; i++)
+            ic[i] -= mask[i];
+    }
+
+    // DIV and MOD have no vector instructions, they are looped over the lanes in the
+    // mask row, after begin_masked. Returns false with their IP put back if one would trap.
+    bool divide(BatchRun &run, const Instruction &instr, vmword pc, bool quotient)
+    {
+        auto b = operand(run, instr, 1);
+        auto c = operand(run, instr, 2);
+        auto mask = run.mask.data();
+        // Division by zero traps, leave that to the interpreter
+        for (size_t i = 0; i < run.stride; i++)
+        {
+            if (mask[i] != 0 && c.at(i) == 0)
+            {
+                auto ip = run.row(IP);
+                for (size_t j = 0; j < run.stride; j++)
+                    ip[j] = (pc & mask[j]) | (ip[j] & ~mask[j]);
+                return false;
+            }
+        }
+
+        auto dst = run.row(instr.operands[0]);
+        auto rmd = run.row(RMD);
+        for (size_t i = 0; i < run.stride; i++)
+        {
+            if (mask[i] == 0)
+                continue;
+            auto dividend = b.at(i);
+            auto divisor = c.at(i);
+            if (quotient)
+            {
+                dst[i] = dividend / divisor;
+                rmd[i] = dividend % divisor;
+            }
+            else
+                dst[i] = dividend % divisor;
+        }
+        end_masked(run);
+        return true;
+    }
+
+    // Execute the instruction at pc for the running lanes there and set next to where the
+    // next step goes. Returns false if it has to be interpreted lane by lane after all.
+    bool run_vector(BatchRun &run, vmword pc, vmword *next)
+    {
+        auto &instr = run.code->predecoded[pc >> 2].instr;
+        auto kernels = batch_kernels;
+        auto lanes = lane_rows(run);
+        size_t selected = 0;
+        auto run_alu = [&](BatchAlu alu, BatchOperand b, BatchOperand c)
+        {
+            *next = kernels->alu[alu](lanes, pc, run.row(instr.operands[0]), b, c, &selected);
+        };
+        auto run_branch = [&](BatchOperand target, BatchOperand b, BatchOperand c, bool equal)
+        {
+            *next = kernels->branch(lanes, pc, target, b, c, equal, &selected);
+        };
+        BatchOperand zero = { nullptr, 0 };
+        BatchOperand one = { nullptr, 1 };
+
+        switch (instr.opcode)
+        {
+        case OP_HALT:
+            selected = begin_masked(run, pc);
+            for (size_t i = 0; i < run.stride; i++)
+                run.running[i] &= ~run.mask[i];
+            end_masked(run);
+            *next = kernels->lowest(lanes);
+            break;
+        case OP_NOP:
+            selected = begin_masked(run, pc);
+            end_masked(run);
+            *next = kernels->lowest(lanes);
+            break;
+        case OP_DIV:
+        case OP_MOD:
+            selected = begin_masked(run, pc);
+            if (!divide(run, instr, pc, instr.opcode == OP_DIV))
+                return false;
+            *next = kernels->lowest(lanes);
+            break;
+        case OP_ADD:
+            run_alu(ALU_ADD, operand(run, instr, 1), operand(run, instr, 2));
+            break;
+        case OP_SUB:
+            run_alu(ALU_SUB, operand(run, instr, 1), operand(run, instr, 2));
+            break;
+        case OP_MUL:
+            run_alu(ALU_MUL, operand(run, instr, 1), operand(run, instr, 2));
+            break;
+        case OP_SHL:
+            run_alu(ALU_SHL, operand(run, instr, 1), operand(run, instr, 2));
+            break;
+        case OP_SHR:
+            run_alu(ALU_SHR, operand(run, instr, 1), operand(run, instr, 2));
+            break;
+        case OP_CMP:
+            run_alu(ALU_CMP, operand(run, instr, 1), operand(run, instr, 2));
+            break;
+        case OP_INC:
+            run_alu(ALU_ADD, operand(run, instr, 0), one);
+            break;
+        case OP_DEC:
+            run_alu(ALU_SUB, operand(run, instr, 0), one);
+            break;
+        case OP_NOT:
+            // ~a == -1 - a
+            run_alu(ALU_SUB, { nullptr, ~vmword(0) }, operand(run, instr, 0));
+            break;
+        case OP_MOV:
+            run_alu(ALU_ADD, operand(run, instr, 1), zero);
+            break;
+        case OP_JMP:
+            run_branch(operand(run, instr, 0), zero, zero, true);
+            break;
+        case OP_JEQ:
+            run_branch(operand(run, instr, 0), operand(run, instr, 1), operand(run, instr, 2), true);
+            break;
+        case OP_JNE:
+            run_branch(operand(run, instr, 0), operand(run, instr, 1), operand(run, instr, 2), false);
+            break;
+        case OP_JNZ:
+            run_branch(operand(run, instr, 0), operand(run, instr, 1), zero, false);
+            break;
+        default:
+            return false;
+        }
+        run.stats.vector_steps++;
+        run.stats.vector_instructions += selected;
+        return true;
+    }
+
+    void run_lanes(void *arg)
+    {
+        auto &run = *static_cast<BatchRun*>(arg);
+        auto lanes = lane_rows(run);
+        vmword pc = 0;
+        // Whether pc is still the lowest IP, lanes interpreted on their own may have moved
+        bool known = false;
+        for (;;)
+        {
+            while (!run.pending.empty())
+            {
+                auto lane = run.pending.back();
+                run.pending.pop_back();
+                if (run.running[lane] != 0)
+                    run_scalar(run, lane);
+                known = false;
+            }
+
+            if (!known)
+                pc = batch_kernels->lowest(lanes);
+            // All bits set may also be the address of a lane
+            if (pc == ~vmword(0) && batch_kernels->select(lanes, pc, run.mask.data()) == 0)
+                return;
+            auto kind = classify(run, pc);
+            // Some of the lanes there may have to run on their own now
+            if (!run.pending.empty())
+                continue;
+            known = kind == SLOT_VECTOR && run_vector(run, pc, &pc);
+            if (known)
+                continue;
+            batch_kernels->select(lanes, pc, run.mask.data());
+            for (size_t lane = 0; lane < run.count; lane++)
+            {
+                if (run.mask[lane] != 0)
+                    run_scalar(run, lane);
+            }
+        }
+    }
+
+    // Stop the lane that was interrupted by fault, the way vm_run_guarded does
+    void stop_current(BatchRun &run, PlatFault fault)
+    {
+        auto ctx = run.lanes[run.current];
+        if (fault == PLAT_FAULT_OUT_OF_RANGE || fault == PLAT_FAULT_OUT_OF_MEMORY)
+        {
+            ctx->running = false;
+            ctx->trap = fault == PLAT_FAULT_OUT_OF_RANGE ? TRAP_OUT_OF_RANGE : TRAP_OUT_OF_MEMORY;
+            ctx->trap_address = ctx->registers[IP] - 4;
+        }
+        ctx->running = false;
+        if (ctx->trap != TRAP_NONE)
+            vm_trace_dump(ctx);
+        store_lane(run, run.current);
+    }
+}
+
+VMBatchStats vm_run_batch(const VMSnapshot *code, VMContext *const *lanes, size_t count)
+{
+    BatchRun run;
+    run.code = vm_fork(code);
+    run.stats = {};
+    if (run.code == nullptr)
+    {
+        for (size_t lane = 0; lane < count; lane++)
+        {
+            auto ic = lanes[lane]->registers[IC];
+            vm_run_table(lanes[lane]);
+            run.stats.scalar_instructions += lanes[lane]->registers[IC] - ic;
+        }
+        return run.stats;
+    }
+
+    run.lanes = lanes;
+    run.count = count;
+    run.stride = (count + LANE_ALIGNMENT - 1) / LANE_ALIGNMENT * LANE_ALIGNMENT;
+    run.registers.assign(VM_REGISTER_COUNT * run.stride, 0);
+    run.running.assign(run.stride, 0);
+    run.mask.assign(run.stride, 0);
+    run.kinds.assign(run.code->predecode_slots, SLOT_UNKNOWN);
+    run.current = NO_LANE;
+    for (size_t lane = 0; lane < count; lane++)
+    {
+        auto ctx = lanes[lane];
+        for (size_t reg = 0; reg < VM_REGISTER_COUNT; reg++)
+            run.row(reg)[lane] = ctx->registers[reg];
+        run.running[lane] = ~vmword(0);
+        ctx->trap = TRAP_NONE;
+        // Whether the code is shared is found out again slot by slot
+        ctx->batch_diverged = false;
+        if (ctx->memory_size != run.code->memory_size || ctx->trace != nullptr)
+            diverge(run, lane);
+    }
+
+    // Faults unwind out of the lane being interpreted, stop it and carry on with the others
+    for (;;)
+    {
+        auto fault = plat_run_guarded(&run_lanes, &run);
+        if (fault == PLAT_FAULT_NONE || run.current == NO_LANE)
+            break;
+        stop_current(run, fault);
+    }
+
+    for (size_t lane = 0; lane < count; lane++)
+    {
+        auto ctx = lanes[lane];
+        for (size_t reg = 0; reg < VM_REGISTER_COUNT; reg++)
+            ctx->registers[reg] = run.row(reg)[lane];
+        ctx->running = false;
+    }
+    vm_destroy(run.code);
+    return run.stats;
+}
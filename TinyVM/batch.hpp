@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+
+#include "vmtypes.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+struct VMSnapshot;
+
+// What vm_run_batch did
+struct VMBatchStats
+{
+    // Instructions executed for a group of lanes at once, and the lane instructions they covered
+    vmword vector_steps;
+    vmword vector_instructions;
+    // Lane instructions interpreted one lane at a time
+    vmword scalar_instructions;
+};
+
+// Run count contexts side by side until every one of them stops, like running each
+// with vm_run_table, but with the instructions they share executed for all of them at once.
+//
+// The registers of the lanes are kept in a structure-of-arrays register file. Each step
+// picks the lowest IP of the running lanes and executes its instruction for every lane
+// that is there, so lanes that took different branches wait for each other at the first
+// address they share again. Arithmetic, compares, moves and jumps on registers and
+// literals run as SIMD kernels under a lane mask, every other instruction is interpreted
+// for one lane at a time in its context.
+//
+// code is the snapshot the lanes were forked from. The lockstep code is decoded from it,
+// so a lane whose code differs from it, or that writes to code it shares, is interpreted
+// on its own until it stops. Lanes with a different memory size or tracing enabled are
+// interpreted on their own from the start. Traps stop the lane they occur in.
+// Returns what was run in lockstep and what was not.
+VMBatchStats vm_run_batch(const VMSnapshot *code, VMContext *const *lanes, size_t count);
@@ -0,0 +1,711 @@
+// TinyVM benchmark suite
+//
+// Microbenchmarks time every instruction implementation under every combination
+// of addressing modes, macrobenchmarks run the .tasm workloads in bench/workloads,
+// and the batch suite runs many copies of a workload one by one and as one batch.
+// Results can be printed as a table, CSV or JSON for tracking regressions.
+
+#include "vm.hpp"
+#include "vm_threaded.hpp"
+#include "jit.hpp"
+#include "instruction_support.hpp"
+#include "config.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TVM_BENCH_TSC 1
+#else
+#define TVM_BENCH_TSC 0
+#endif
+
+#ifndef TVM_BENCH_WORKLOAD_DIR
+#define TVM_BENCH_WORKLOAD_DIR "."
+#endif
+
+namespace
+{
+    ////////
+    // Measurement
+    ////////
+
+    uint64_t read_cycles()
+    {
+#if TVM_BENCH_TSC
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+    struct Result
+    {
+        std::string suite;
+        std::string engine;
+        std::string name;
+        vmword instructions;
+        double seconds;
+        uint64_t cycles;
+        vmword result;
+        // Size of the program in the form the engine runs it from, words or compact code
+        size_t code_bytes;
+    };
+
+    struct Engine
+    {
+        const char *name;
+        VMTrap (*run)(VMContext *ctx);
+        bool jit;
+        // Runs compact code, see vm_compact_load
+        bool compact;
+        // Runs the program verified, see vm_verify
+        bool verify;
+    };
+
+    const Engine ENGINES[] =
+    {
+        { "table", &vm_run_table, false, false, false },
+        { "threaded", &vm_run_threaded, false, false, false },
+        { "jit", &vm_run_jit, true, false, false },
+        { "compact", &vm_run_compact, false, true, false },
+        { "verified", &vm_run_table, false, false, true },
+    };
+
+    // Prepares a fresh context for one run and stores the size of the program in code_bytes.
+    // Returns false if it can't
+    typedef bool (*prepare_func)(VMContext *ctx, const void *arg, bool compact, size_t *code_bytes);
+
+    // Run a benchmark repeat times on fresh contexts and keep the fastest run
+    bool measure(const Engine &engine, prepare_func prepare, const void *arg, size_t repeat, Result *result)
+    {
+        bool have_result = false;
+        for (size_t i = 0; i < repeat; i++)
+        {
+            auto ctx = vm_create();
+            if (ctx == nullptr)
+                return false;
+            size_t code_bytes = 0;
+            if ((engine.jit && !vm_jit_enable(ctx)) || !prepare(ctx, arg, engine.compact, &code_bytes))
+            {
+                vm_destroy(ctx);
+                return false;
+            }
+            if (engine.verify && vm_verify(ctx).error != VERIFY_OK)
+            {
+                vm_destroy(ctx);
+                return false;
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            auto start_cycles = read_cycles();
+            auto trap = engine.run(ctx);
+            auto cycles = read_cycles() - start_cycles;
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (trap != TRAP_NONE)
+            {
+                vm_destroy(ctx);
+                return false;
+            }
+
+            if (!have_result || seconds < result->seconds)
+            {
+                result->engine = engine.name;
+                result->instructions = ctx->registers[IC];
+                result->seconds = seconds;
+                result->cycles = cycles;
+                result->result = ctx->registers[R0];
+                result->code_bytes = code_bytes;
+                have_result = true;
+            }
+            vm_destroy(ctx);
+        }
+        return have_result;
+    }
+
+    ////////
+    // Microbenchmarks
+    ////////
+
+    enum OperandRole
+    {
+        NONE,
+        TARGET,      // Written
+        MODIFIED,    // Read and written
+        SOURCE,      // Read
+        NEXT,        // Jump target, always the next instruction
+    };
+
+    struct OpcodeBench
+    {
+        const char *name;
+        Opcode opcode;
+        OperandRole roles[3];
+    };
+
+    // Every opcode except HALT. PUSH, POP and CALL are paired with an instruction
+    // that undoes their effect on the stack, both count as executed instructions.
+    const OpcodeBench OPCODE_BENCHES[] =
+    {
+        { "nop", OP_NOP, { NONE, NONE, NONE } },
+        { "push", OP_PUSH, { SOURCE, NONE, NONE } },
+        { "pop", OP_POP, { TARGET, NONE, NONE } },
+        { "add", OP_ADD, { TARGET, SOURCE, SOURCE } },
+        { "sub", OP_SUB, { TARGET, SOURCE, SOURCE } },
+        { "mul", OP_MUL, { TARGET, SOURCE, SOURCE } },
+        { "div", OP_DIV, { TARGET, SOURCE, SOURCE } },
+        { "shl", OP_SHL, { TARGET, SOURCE, SOURCE } },
+        { "shr", OP_SHR, { TARGET, SOURCE, SOURCE } },
+        { "mod", OP_MOD, { TARGET, SOURCE, SOURCE } },
+        { "inc", OP_INC, { MODIFIED, NONE, NONE } },
+        { "dec", OP_DEC, { MODIFIED, NONE, NONE } },
+        { "not", OP_NOT, { MODIFIED, NONE, NONE } },
+        { "cmp", OP_CMP, { TARGET, SOURCE, SOURCE } },
+        { "mov", OP_MOV, { TARGET, SOURCE, NONE } },
+        { "call", OP_CALL, { NEXT, NONE, NONE } },
+        { "ret", OP_RET, { NONE, NONE, NONE } },
+        { "jmp", OP_JMP, { NEXT, NONE, NONE } },
+        { "jeq", OP_JEQ, { NEXT, SOURCE, SOURCE } },
+        { "jne", OP_JNE, { NEXT, SOURCE, SOURCE } },
+        { "jnz", OP_JNZ, { NEXT, SOURCE, NONE } },
+        { "rdrand", OP_RDRAND, { TARGET, SOURCE, SOURCE } },
+        { "syscall", OP_SYSCALL, { SOURCE, NONE, NONE } },
+        { "vadd", OP_VADD, { SOURCE, SOURCE, SOURCE } },
+        { "vsub", OP_VSUB, { SOURCE, SOURCE, SOURCE } },
+        { "vmul", OP_VMUL, { SOURCE, SOURCE, SOURCE } },
+        { "vxor", OP_VXOR, { SOURCE, SOURCE, SOURCE } },
+        { "vfill", OP_VFILL, { SOURCE, SOURCE, SOURCE } },
+        { "vcopy", OP_VCOPY, { SOURCE, SOURCE, SOURCE } },
+        { "vsum", OP_VSUM, { TARGET, SOURCE, SOURCE } },
+        { "vmin", OP_VMIN, { TARGET, SOURCE, SOURCE } },
+        { "vmax", OP_VMAX, { TARGET, SOURCE, SOURCE } },
+        { "vcount", OP_VCOUNT, { MODIFIED, SOURCE, SOURCE } },
+    };
+
+    // Addressing modes a benchmark operand can take. Every source evaluates to
+    // SOURCE_VALUE, so divisors and shift counts are sane and block instructions
+    // work on the short block at address SOURCE_VALUE, deep in the unused end of the stack.
+    struct OperandMode
+    {
+        const char *name;
+        AddressingMode mode;
+        vmword target_operand;
+        vmword source_operand;
+    };
+
+    const vmword SOURCE_VALUE = 7;
+    const vmword PROGRAM_BASE = 1024;
+    const vmword DATA_BASE = 60000;
+    const size_t STACK_SIZE = 1024;
+    // Copies of the benchmarked instruction per loop iteration
+    const size_t UNROLL = 32;
+    // Loop counter, targets and pointers used by the generated programs
+    const vmword COUNTER = R15;
+    const vmword TARGET_REGISTER = R1;
+    const vmword TARGET_POINTER = R2;
+    const vmword SOURCE_REGISTER = R3;
+    const vmword SOURCE_POINTER = R4;
+    const vmword SCRATCH_REGISTER = R5;
+
+    const OperandMode OPERAND_MODES[] =
+    {
+        { "r", AM_REGISTER, TARGET_REGISTER, SOURCE_REGISTER },
+        { "m", AM_MEMORY, DATA_BASE, DATA_BASE + 1 },
+        { "[r]", static_cast<AddressingMode>(AM_REGISTER | AM_INDIRECT), TARGET_POINTER, SOURCE_POINTER },
+        { "l", AM_LITERAL, 0, SOURCE_VALUE },
+    };
+    const size_t TARGET_MODE_COUNT = 3;
+    const size_t SOURCE_MODE_COUNT = 4;
+
+    struct MicroBench
+    {
+        const OpcodeBench *op;
+        const OperandMode *modes[3];
+        size_t iterations;
+    };
+
+    std::string micro_name(const MicroBench &bench)
+    {
+        std::string name = bench.op->name;
+        const char *separator = " ";
+        for (size_t i = 0; i < 3; i++)
+        {
+            if (bench.modes[i] == nullptr)
+                continue;
+            name += separator;
+            name += bench.modes[i]->name;
+            separator = ",";
+        }
+        return name;
+    }
+
+    // Bound to SOURCE_VALUE, so SYSCALL measures the cost of calling into the host
+    VMTrap empty_syscall(VMContext*, void*)
+    {
+        return TRAP_NONE;
+    }
+
+    bool prepare_micro(VMContext *ctx, const void *arg, bool compact, size_t *code_bytes)
+    {
+        auto &bench = *static_cast<const MicroBench*>(arg);
+        std::vector<InstructionData> program;
+        auto address = [&program]() { return PROGRAM_BASE + program.size() * 4; };
+        auto call_target = PROGRAM_BASE + (UNROLL * 2 + 3) * 4;
+
+        auto loop = address();
+        for (size_t i = 0; i < UNROLL; i++)
+        {
+            Instruction instr = { bench.op->opcode, OF_NORMAL, {}, {} };
+            for (size_t o = 0; o < 3; o++)
+            {
+                auto mode = bench.modes[o];
+                switch (bench.op->roles[o])
+                {
+                case NONE:
+                    instr.addressing[o] = static_cast<AddressingMode>(0);
+                    break;
+                case TARGET:
+                case MODIFIED:
+                    instr.addressing[o] = mode->mode;
+                    instr.operands[o] = mode->target_operand;
+                    break;
+                case SOURCE:
+                    instr.addressing[o] = mode->mode;
+                    instr.operands[o] = mode->source_operand;
+                    break;
+                case NEXT:
+                    instr.addressing[o] = AM_LITERAL;
+                    instr.operands[o] = bench.op->opcode == OP_CALL ? call_target : address() + 4;
+                    break;
+                }
+            }
+
+            // Keep the stack balanced
+            if (bench.op->opcode == OP_POP || bench.op->opcode == OP_RET)
+                program.push_back(vmi_encode_instr_1(OP_PUSH, OF_NORMAL, AM_LITERAL, address() + 8));
+            program.push_back(vmi_encode(&instr));
+            if (bench.op->opcode == OP_PUSH)
+                program.push_back(vmi_encode_instr_1(OP_POP, OF_NORMAL, AM_REGISTER, SCRATCH_REGISTER));
+            else if (bench.op->opcode == OP_CALL)
+                program.push_back(vmi_encode_instr_0(OP_NOP));
+        }
+        program.push_back(vmi_encode_instr_1(OP_DEC, OF_NORMAL, AM_REGISTER, COUNTER));
+        program.push_back(vmi_encode_instr_2(OP_JNZ, OF_NORMAL, AM_LITERAL, loop, AM_REGISTER, COUNTER));
+        program.push_back(vmi_encode_instr_0(OP_HALT));
+        // CALL benchmarks return from here, the NOP after each call keeps slots aligned
+        while (address() < call_target)
+            program.push_back(vmi_encode_instr_0(OP_NOP));
+        program.push_back(vmi_encode_instr_0(OP_RET));
+
+        vm_init_stack(ctx, STACK_SIZE);
+        vm_init_programbase(ctx, PROGRAM_BASE);
+        if (compact)
+        {
+            std::vector<uint8_t> code;
+            for (auto &data : program)
+            {
+                auto instr = vmi_decode(&data);
+                uint8_t bytes[VMI_COMPACT_MAX_BYTES];
+                auto length = vmi_encode_compact(&instr, bytes);
+                code.insert(code.end(), bytes, bytes + length);
+            }
+            if (!vm_compact_load(ctx, PROGRAM_BASE, code.data(), code.size(), program.size()))
+                return false;
+            *code_bytes = code.size();
+        }
+        else
+        {
+            vm_load_program(ctx, program.data(), program.size());
+            *code_bytes = program.size() * sizeof(InstructionData);
+        }
+        ctx->registers[COUNTER] = bench.iterations;
+        ctx->registers[TARGET_REGISTER] = SOURCE_VALUE;
+        ctx->registers[TARGET_POINTER] = DATA_BASE + 2;
+        ctx->registers[SOURCE_REGISTER] = SOURCE_VALUE;
+        ctx->registers[SOURCE_POINTER] = DATA_BASE + 3;
+        for (vmword i = 0; i < 4; i++)
+            ctx->memory[DATA_BASE + i] = SOURCE_VALUE;
+        return vm_syscall_register(ctx, SOURCE_VALUE, &empty_syscall, nullptr);
+    }
+
+    // Enumerate all addressing mode combinations of op into benches
+    void add_micro_benches(const OpcodeBench &op, size_t iterations, std::vector<MicroBench> &benches)
+    {
+        size_t counts[3];
+        for (size_t o = 0; o < 3; o++)
+        {
+            auto role = op.roles[o];
+            counts[o] = role == TARGET || role == MODIFIED ? TARGET_MODE_COUNT : role == SOURCE ? SOURCE_MODE_COUNT : 1;
+        }
+        for (size_t a = 0; a < counts[0]; a++)
+        {
+            for (size_t b = 0; b < counts[1]; b++)
+            {
+                for (size_t c = 0; c < counts[2]; c++)
+                {
+                    size_t indices[3] = { a, b, c };
+                    MicroBench bench = { &op, {}, iterations };
+                    for (size_t o = 0; o < 3; o++)
+                    {
+                        auto role = op.roles[o];
+                        bench.modes[o] = role == NONE || role == NEXT ? nullptr : &OPERAND_MODES[indices[o]];
+                    }
+                    benches.push_back(bench);
+                }
+            }
+        }
+    }
+
+    ////////
+    // Macrobenchmarks
+    ////////
+
+    const char *WORKLOADS[] =
+    {
+        "loop",
+        "fib",
+        "indirect",
+        "sort",
+        "collatz",
+    };
+
+    struct MacroBench
+    {
+        std::string path;
+        // The same workload assembled with tasm.py --compact
+        std::string compact_path;
+        bool fuse;
+    };
+
+    bool prepare_macro(VMContext *ctx, const void *arg, bool compact, size_t *code_bytes)
+    {
+        auto &bench = *static_cast<const MacroBench*>(arg);
+        auto &path = compact ? bench.compact_path : bench.path;
+        vm_init_stack(ctx, 2048);
+        vm_init_programbase(ctx, 0);
+        if (!vmi_load_memory_image_file(path.c_str(), ctx))
+            return false;
+        auto fp = fopen(path.c_str(), "rb");
+        if (fp != nullptr)
+        {
+            fseek(fp, 0, SEEK_END);
+            *code_bytes = ftell(fp);
+            fclose(fp);
+        }
+        if (bench.fuse)
+            vm_fuse(ctx, 0, ctx->memory_size);
+        return true;
+    }
+
+    ////////
+    // Batches
+    ////////
+
+    const char *BATCH_WORKLOADS[] =
+    {
+        "collatz",
+        "loop",
+    };
+
+    // Lane i starts with r1 = i * BATCH_INPUT_STRIDE
+    const vmword BATCH_INPUT_STRIDE = 3000;
+
+    // Run a workload once per lane, one lane after the other on the table engine or all of
+    // them with vm_run_batch, repeat times and keep the fastest run. The result is the sum of
+    // the lanes' r0.
+    bool measure_batch(const MacroBench &bench, size_t lanes, bool batched, size_t repeat, Result *result)
+    {
+        auto base = vm_create();
+        if (base == nullptr)
+            return false;
+        size_t code_bytes = 0;
+        auto snapshot = prepare_macro(base, &bench, false, &code_bytes) ? vm_snapshot(base) : nullptr;
+        vm_destroy(base);
+        if (snapshot == nullptr)
+            return false;
+
+        bool have_result = false;
+        bool failed = false;
+        for (size_t i = 0; i < repeat && !failed; i++)
+        {
+            std::vector<VMContext*> contexts;
+            for (size_t lane = 0; lane < lanes; lane++)
+            {
+                auto ctx = vm_fork(snapshot);
+                if (ctx == nullptr)
+                    break;
+                ctx->registers[R1] = lane * BATCH_INPUT_STRIDE;
+                contexts.push_back(ctx);
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            auto start_cycles = read_cycles();
+            if (contexts.size() < lanes)
+                failed = true;
+            else if (batched)
+                vm_run_batch(snapshot, contexts.data(), contexts.size());
+            else
+            {
+                for (auto ctx : contexts)
+                    vm_run_table(ctx);
+            }
+            auto cycles = read_cycles() - start_cycles;
+            auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            vmword instructions = 0;
+            vmword sum = 0;
+            for (auto ctx : contexts)
+            {
+                failed |= ctx->trap != TRAP_NONE;
+                instructions += ctx->registers[IC];
+                sum += ctx->registers[R0];
+                vm_destroy(ctx);
+            }
+            if (!failed && (!have_result || seconds < result->seconds))
+            {
+                result->engine = batched ? "batch" : "table";
+                result->instructions = instructions;
+                result->seconds = seconds;
+                result->cycles = cycles;
+                result->result = sum;
+                result->code_bytes = code_bytes;
+                have_result = true;
+            }
+        }
+        vm_snapshot_destroy(snapshot);
+        return have_result && !failed;
+    }
+
+    ////////
+    // Output
+    ////////
+
+    enum Format
+    {
+        FORMAT_TEXT,
+        FORMAT_CSV,
+        FORMAT_JSON,
+    };
+
+    double per_instruction(double value, vmword instructions)
+    {
+        return instructions > 0 ? value / instructions : 0;
+    }
+
+    void print_header(Format format)
+    {
+        if (format == FORMAT_TEXT)
+        {
+            printf("%-6s %-9s %-20s %12s %14s %10s %10s %10s\n",
+                "suite", "engine", "benchmark", "instructions", "instr/s", "ns/instr", "cyc/instr", "code bytes");
+        }
+        else if (format == FORMAT_CSV)
+            printf("suite,engine,benchmark,instructions,seconds,instr_per_sec,ns_per_instr,cycles_per_instr,result,code_bytes\n");
+        else
+            printf("{\n  \"version\": \"%s\",\n  \"tsc\": %s,\n  \"results\": [", TVM_VERSION, TVM_BENCH_TSC ? "true" : "false");
+    }
+
+    void print_result(Format format, const Result &result, bool first)
+    {
+        auto instructions = result.instructions;
+        auto per_second = result.seconds > 0 ? instructions / result.seconds : 0;
+        auto ns = per_instruction(result.seconds * 1e9, instructions);
+        auto cycles = per_instruction(static_cast<double>(result.cycles), instructions);
+        auto count = static_cast<unsigned long long>(instructions);
+        if (format == FORMAT_TEXT)
+        {
+            printf("%-6s %-9s %-20s %12llu %14.0f %10.3f %10.3f %10zu\n", result.suite.c_str(),
+                result.engine.c_str(), result.name.c_str(), count, per_second, ns, cycles, result.code_bytes);
+        }
+        else if (format == FORMAT_CSV)
+        {
+            printf("%s,%s,\"%s\",%llu,%.9f,%.0f,%.4f,%.4f,%llu,%zu\n", result.suite.c_str(), result.engine.c_str(),
+                result.name.c_str(), count, result.seconds, per_second, ns, cycles,
+                static_cast<unsigned long long>(result.result), result.code_bytes);
+        }
+        else
+        {
+            printf("%s\n    {\"suite\": \"%s\", \"engine\": \"%s\", \"benchmark\": \"%s\", \"instructions\": %llu, "
+                "\"seconds\": %.9f, \"instr_per_sec\": %.0f, \"ns_per_instr\": %.4f, \"cycles_per_instr\": %.4f, "
+                "\"result\": %llu, \"code_bytes\": %zu}", first ? "" : ",", result.suite.c_str(), result.engine.c_str(),
+                result.name.c_str(), count, result.seconds, per_second, ns, cycles,
+                static_cast<unsigned long long>(result.result), result.code_bytes);
+        }
+        fflush(stdout);
+    }
+
+    void print_footer(Format format)
+    {
+        if (format == FORMAT_JSON)
+            printf("\n  ]\n}\n");
+    }
+
+    void print_usage(const char *program)
+    {
+        std::cout << "Usage: " << program << " [--suite micro|macro|batch|all] [--engine table|threaded|jit|compact|verified|batch|all]"
+            " [--format text|csv|json] [--filter text] [--iterations count] [--repeat count]"
+            " [--workloads dir] [--no-fusion] [--lanes count]" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool run_micro = true;
+    bool run_macro = true;
+    bool run_batch = true;
+    const char *engine_filter = "all";
+    const char *filter = "";
+    const char *workload_dir = TVM_BENCH_WORKLOAD_DIR;
+    Format format = FORMAT_TEXT;
+    size_t iterations = 10000;
+    size_t repeat = 3;
+    size_t lanes = 64;
+    bool fuse = true;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--suite") == 0 && i + 1 < argc)
+        {
+            auto suite = argv[++i];
+            run_micro = strcmp(suite, "micro") == 0 || strcmp(suite, "all") == 0;
+            run_macro = strcmp(suite, "macro") == 0 || strcmp(suite, "all") == 0;
+            run_batch = strcmp(suite, "batch") == 0 || strcmp(suite, "all") == 0;
+        }
+        else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+            engine_filter = argv[++i];
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            auto name = argv[++i];
+            if (strcmp(name, "csv") == 0)
+                format = FORMAT_CSV;
+            else if (strcmp(name, "json") == 0)
+                format = FORMAT_JSON;
+            else
+                format = FORMAT_TEXT;
+        }
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeat = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--workloads") == 0 && i + 1 < argc)
+            workload_dir = argv[++i];
+        else if (strcmp(argv[i], "--no-fusion") == 0)
+            fuse = false;
+        else if (strcmp(argv[i], "--lanes") == 0 && i + 1 < argc)
+            lanes = strtoul(argv[++i], nullptr, 10);
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (repeat == 0 || iterations == 0 || lanes == 0)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<const Engine*> engines;
+    for (auto &engine : ENGINES)
+    {
+        if (strcmp(engine_filter, "all") == 0 || strcmp(engine_filter, engine.name) == 0)
+            engines.push_back(&engine);
+    }
+    // The batch suite compares the table engine with batches
+    bool batch_engines = strcmp(engine_filter, "all") == 0 || strcmp(engine_filter, "table") == 0 || strcmp(engine_filter, "batch") == 0;
+    if (engines.empty() && !batch_engines)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    print_header(format);
+    bool first = true;
+    int failures = 0;
+
+    if (run_micro)
+    {
+        std::vector<MicroBench> benches;
+        for (auto &op : OPCODE_BENCHES)
+            add_micro_benches(op, iterations, benches);
+        for (auto &bench : benches)
+        {
+            auto name = micro_name(bench);
+            if (name.find(filter) == std::string::npos)
+                continue;
+            for (auto engine : engines)
+            {
+                Result result = { "micro", "", name, 0, 0, 0, 0, 0 };
+                if (!measure(*engine, &prepare_micro, &bench, repeat, &result))
+                {
+                    std::cerr << "Could not run " << name << " on " << engine->name << std::endl;
+                    failures++;
+                    continue;
+                }
+                print_result(format, result, first);
+                first = false;
+            }
+        }
+    }
+
+    if (run_macro)
+    {
+        for (auto workload : WORKLOADS)
+        {
+            if (std::string(workload).find(filter) == std::string::npos)
+                continue;
+            auto base = std::string(workload_dir) + "/" + workload;
+            MacroBench bench = { base + ".bin", base + ".compact.bin", fuse };
+            for (auto engine : engines)
+            {
+                Result result = { "macro", "", workload, 0, 0, 0, 0, 0 };
+                if (!measure(*engine, &prepare_macro, &bench, repeat, &result))
+                {
+                    std::cerr << "Could not run " << (engine->compact ? bench.compact_path : bench.path)
+                        << " on " << engine->name << std::endl;
+                    failures++;
+                    continue;
+                }
+                print_result(format, result, first);
+                first = false;
+            }
+        }
+    }
+
+    if (run_batch && batch_engines)
+    {
+        for (auto workload : BATCH_WORKLOADS)
+        {
+            if (std::string(workload).find(filter) == std::string::npos)
+                continue;
+            auto base = std::string(workload_dir) + "/" + workload;
+            MacroBench bench = { base + ".bin", base + ".compact.bin", fuse };
+            auto name = std::string(workload) + " x" + std::to_string(lanes);
+            for (auto batched : { false, true })
+            {
+                auto engine = batched ? "batch" : "table";
+                if (strcmp(engine_filter, "all") != 0 && strcmp(engine_filter, engine) != 0)
+                    continue;
+                Result result = { "batch", "", name, 0, 0, 0, 0, 0 };
+                if (!measure_batch(bench, lanes, batched, repeat, &result))
+                {
+                    std::cerr << "Could not run " << bench.path << " on " << engine << std::endl;
+                    failures++;
+                    continue;
+                }
+                print_result(format, result, first);
+                first = false;
+            }
+        }
+    }
+
+    print_footer(format);
+    return failures == 0 ? 0 : 1;
+}
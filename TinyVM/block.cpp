@@ -0,0 +1,364 @@
+#include "block.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+#if TVM_BLOCK_X86
+// SSE2 is part of x86-64
+#include <immintrin.h>
+#endif
+#if TVM_BLOCK_AVX2
+#include <cpuid.h>
+#endif
+
+namespace
+{
+    ////////
+    // Element-wise operations, one word and one vector at a time
+    ////////
+
+#if TVM_BLOCK_X86
+    // Low 64 bits of the products of the 64-bit lanes, there is no instruction for it before AVX-512
+    inline __m128i mul_lanes(__m128i a, __m128i b)
+    {
+        auto cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b), _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+        return _mm_add_epi64(_mm_mul_epu32(a, b), _mm_slli_epi64(cross, 32));
+    }
+
+#if TVM_BLOCK_AVX2
+    TVM_AVX2 inline __m256i mul_lanes(__m256i a, __m256i b)
+    {
+        auto cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b), _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+        return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+    }
+
+#define BLOCK_OP_AVX2(avx2_expr) TVM_AVX2 static __m256i avx2(__m256i a, __m256i b) { return avx2_expr; }
+#else
+#define BLOCK_OP_AVX2(avx2_expr)
+#endif
+
+#define BLOCK_OP(name, expr, sse2_expr, avx2_expr) \
+    struct name \
+    { \
+        static vmword scalar(vmword a, vmword b) { return expr; } \
+        static __m128i sse2(__m128i a, __m128i b) { return sse2_expr; } \
+        BLOCK_OP_AVX2(avx2_expr) \
+    }
+#else
+#define BLOCK_OP(name, expr, sse2_expr, avx2_expr) \
+    struct name \
+    { \
+        static vmword scalar(vmword a, vmword b) { return expr; } \
+    }
+#endif
+
+    BLOCK_OP(Add, a + b, _mm_add_epi64(a, b), _mm256_add_epi64(a, b));
+    BLOCK_OP(Sub, a - b, _mm_sub_epi64(a, b), _mm256_sub_epi64(a, b));
+    BLOCK_OP(Mul, a * b, mul_lanes(a, b), mul_lanes(a, b));
+    BLOCK_OP(Xor, a ^ b, _mm_xor_si128(a, b), _mm256_xor_si256(a, b));
+
+#undef BLOCK_OP
+#undef BLOCK_OP_AVX2
+
+    // If dst starts inside src, a forward pass would read words it already wrote.
+    // Do those word by word from the end and return true, otherwise return false.
+    template<typename Op>
+    bool elementwise_backward(vmword *dst, const vmword *src, size_t count)
+    {
+        if (dst <= src || dst >= src + count)
+            return false;
+        for (size_t i = count; i-- > 0; )
+            dst[i] = Op::scalar(dst[i], src[i]);
+        return true;
+    }
+
+    ////////
+    // Generic kernels
+    ////////
+
+    template<typename Op>
+    void generic_elementwise(vmword *dst, const vmword *src, size_t count)
+    {
+        if (elementwise_backward<Op>(dst, src, count))
+            return;
+        for (size_t i = 0; i < count; i++)
+            dst[i] = Op::scalar(dst[i], src[i]);
+    }
+
+    void generic_fill(vmword *dst, vmword value, size_t count)
+    {
+        std::fill(dst, dst + count, value);
+    }
+
+    vmword generic_sum(const vmword *src, size_t count)
+    {
+        vmword sum = 0;
+        for (size_t i = 0; i < count; i++)
+            sum += src[i];
+        return sum;
+    }
+
+    vmword generic_min(const vmword *src, size_t count)
+    {
+        vmword min = UINT64_MAX;
+        for (size_t i = 0; i < count; i++)
+            min = src[i] < min ? src[i] : min;
+        return min;
+    }
+
+    vmword generic_max(const vmword *src, size_t count)
+    {
+        vmword max = 0;
+        for (size_t i = 0; i < count; i++)
+            max = src[i] > max ? src[i] : max;
+        return max;
+    }
+
+    vmword generic_count(const vmword *src, vmword value, size_t count)
+    {
+        vmword matches = 0;
+        for (size_t i = 0; i < count; i++)
+            matches += src[i] == value;
+        return matches;
+    }
+
+    const VMBlockKernels GENERIC_KERNELS =
+    {
+        "generic",
+        &generic_elementwise<Add>, &generic_elementwise<Sub>, &generic_elementwise<Mul>, &generic_elementwise<Xor>,
+        &generic_fill,
+        &generic_sum, &generic_min, &generic_max, &generic_count,
+    };
+
+#if TVM_BLOCK_X86
+    ////////
+    // SSE2 kernels, 2 words per vector
+    ////////
+
+    inline __m128i load2(const vmword *src)
+    {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    }
+
+    inline void store2(vmword *dst, __m128i value)
+    {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), value);
+    }
+
+    template<typename Op>
+    void sse2_elementwise(vmword *dst, const vmword *src, size_t count)
+    {
+        if (elementwise_backward<Op>(dst, src, count))
+            return;
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+            store2(dst + i, Op::sse2(load2(dst + i), load2(src + i)));
+        for (; i < count; i++)
+            dst[i] = Op::scalar(dst[i], src[i]);
+    }
+
+    void sse2_fill(vmword *dst, vmword value, size_t count)
+    {
+        auto values = _mm_set1_epi64x(value);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+            store2(dst + i, values);
+        for (; i < count; i++)
+            dst[i] = value;
+    }
+
+    vmword sse2_sum(const vmword *src, size_t count)
+    {
+        auto sums = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+            sums = _mm_add_epi64(sums, load2(src + i));
+        vmword sum = _mm_cvtsi128_si64(sums) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+        for (; i < count; i++)
+            sum += src[i];
+        return sum;
+    }
+
+    vmword sse2_count(const vmword *src, vmword value, size_t count)
+    {
+        auto values = _mm_set1_epi64x(value);
+        auto matches = _mm_setzero_si128();
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2)
+        {
+            // A word is equal if both of its halves are, a match is -1
+            auto equal = _mm_cmpeq_epi32(load2(src + i), values);
+            equal = _mm_and_si128(equal, _mm_shuffle_epi32(equal, _MM_SHUFFLE(2, 3, 0, 1)));
+            matches = _mm_sub_epi64(matches, equal);
+        }
+        vmword total = _mm_cvtsi128_si64(matches) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(matches, matches));
+        for (; i < count; i++)
+            total += src[i] == value;
+        return total;
+    }
+
+    // SSE2 can't compare 64-bit words, minimum and maximum are left to the compiler
+    const VMBlockKernels SSE2_KERNELS =
+    {
+        "sse2",
+        &sse2_elementwise<Add>, &sse2_elementwise<Sub>, &sse2_elementwise<Mul>, &sse2_elementwise<Xor>,
+        &sse2_fill,
+        &sse2_sum, &generic_min, &generic_max, &sse2_count,
+    };
+#endif
+
+#if TVM_BLOCK_AVX2
+    ////////
+    // AVX2 kernels, 4 words per vector
+    ////////
+
+    TVM_AVX2 inline __m256i load4(const vmword *src)
+    {
+        return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    }
+
+    TVM_AVX2 inline void store4(vmword *dst, __m256i value)
+    {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst), value);
+    }
+
+    TVM_AVX2 inline vmword add_lanes(__m256i value)
+    {
+        auto pairs = _mm_add_epi64(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+        return _mm_cvtsi128_si64(pairs) + _mm_cvtsi128_si64(_mm_unpackhi_epi64(pairs, pairs));
+    }
+
+    template<typename Op>
+    TVM_AVX2 void avx2_elementwise(vmword *dst, const vmword *src, size_t count)
+    {
+        if (elementwise_backward<Op>(dst, src, count))
+            return;
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            store4(dst + i, Op::avx2(load4(dst + i), load4(src + i)));
+        for (; i < count; i++)
+            dst[i] = Op::scalar(dst[i], src[i]);
+    }
+
+    TVM_AVX2 void avx2_fill(vmword *dst, vmword value, size_t count)
+    {
+        auto values = _mm256_set1_epi64x(value);
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            store4(dst + i, values);
+        for (; i < count; i++)
+            dst[i] = value;
+    }
+
+    TVM_AVX2 vmword avx2_sum(const vmword *src, size_t count)
+    {
+        auto sums = _mm256_setzero_si256();
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+            sums = _mm256_add_epi64(sums, load4(src + i));
+        auto sum = add_lanes(sums);
+        for (; i < count; i++)
+            sum += src[i];
+        return sum;
+    }
+
+    // Minimum or maximum. AVX2 only compares signed words, flipping the
+    // sign bits of both sides makes that an unsigned comparison.
+    template<bool Max>
+    TVM_AVX2 vmword avx2_extreme(const vmword *src, size_t count)
+    {
+        vmword result = Max ? 0 : UINT64_MAX;
+        size_t i = 0;
+        if (count >= 4)
+        {
+            auto bias = _mm256_set1_epi64x(INT64_MIN);
+            auto best = _mm256_xor_si256(load4(src), bias);
+            for (i = 4; i + 4 <= count; i += 4)
+            {
+                auto values = _mm256_xor_si256(load4(src + i), bias);
+                auto better = Max ? _mm256_cmpgt_epi64(values, best) : _mm256_cmpgt_epi64(best, values);
+                best = _mm256_blendv_epi8(best, values, better);
+            }
+            vmword lanes[4];
+            store4(lanes, _mm256_xor_si256(best, bias));
+            result = Max ? generic_max(lanes, 4) : generic_min(lanes, 4);
+        }
+        for (; i < count; i++)
+            result = Max ? std::max(result, src[i]) : std::min(result, src[i]);
+        return result;
+    }
+
+    TVM_AVX2 vmword avx2_count(const vmword *src, vmword value, size_t count)
+    {
+        auto values = _mm256_set1_epi64x(value);
+        auto matches = _mm256_setzero_si256();
+        size_t i = 0;
+        // A match is -1
+        for (; i + 4 <= count; i += 4)
+            matches = _mm256_sub_epi64(matches, _mm256_cmpeq_epi64(load4(src + i), values));
+        auto total = add_lanes(matches);
+        for (; i < count; i++)
+            total += src[i] == value;
+        return total;
+    }
+
+    const VMBlockKernels AVX2_KERNELS =
+    {
+        "avx2",
+        &avx2_elementwise<Add>, &avx2_elementwise<Sub>, &avx2_elementwise<Mul>, &avx2_elementwise<Xor>,
+        &avx2_fill,
+        &avx2_sum, &avx2_extreme<false>, &avx2_extreme<true>, &avx2_count,
+    };
+#endif
+
+    const VMBlockKernels* best_kernels()
+    {
+        for (int isa = BLOCK_ISA_COUNT - 1; isa > BLOCK_GENERIC; isa--)
+        {
+            auto kernels = vm_block_kernels(static_cast<VMBlockIsa>(isa));
+            if (kernels != nullptr)
+                return kernels;
+        }
+        return &GENERIC_KERNELS;
+    }
+}
+
+bool vm_cpu_has_avx2()
+{
+#if TVM_BLOCK_AVX2
+    // CPUID bits: leaf 1 ECX has OSXSAVE (27) and AVX (28), leaf 7 EBX has AVX2 (5)
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || (ecx & (1u << 27)) == 0 || (ecx & (1u << 28)) == 0)
+        return false;
+    // The OS must save the XMM and YMM registers on context switches (XCR0 bits 1 and 2)
+    uint32_t xcr0, xcr0_high;
+    __asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_high) : "c"(0));
+    if ((xcr0 & 6) != 6 || __get_cpuid_max(0, nullptr) < 7)
+        return false;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1u << 5)) != 0;
+#else
+    return false;
+#endif
+}
+
+const VMBlockKernels* vm_block_kernels(VMBlockIsa isa)
+{
+    switch (isa)
+    {
+    case BLOCK_GENERIC:
+        return &GENERIC_KERNELS;
+#if TVM_BLOCK_X86
+    case BLOCK_SSE2:
+        return &SSE2_KERNELS;
+#endif
+#if TVM_BLOCK_AVX2
+    case BLOCK_AVX2:
+        return vm_cpu_has_avx2() ? &AVX2_KERNELS : nullptr;
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+const VMBlockKernels *const vm_block = best_kernels();
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+
+#include "vmtypes.hpp"
+
+// x86-64 builds have SSE2 kernels. AVX2 kernels also need a compiler that allows
+// AVX2 intrinsics in functions compiled for AVX2 only, GCC 4.9 or clang 3.8 and later.
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TVM_BLOCK_X86 1
+#if defined(__clang__) \
+    ? __clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8) \
+    : __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define TVM_BLOCK_AVX2 1
+// Compiles a function for AVX2, only call it if vm_cpu_has_avx2()
+#define TVM_AVX2 __attribute__((target("avx2")))
+#else
+#define TVM_BLOCK_AVX2 0
+#endif
+#else
+#define TVM_BLOCK_X86 0
+#define TVM_BLOCK_AVX2 0
+#endif
+
+// Kernels of the block instructions (VADD and friends) on runs of count words.
+// Each set is built for one instruction set extension, vm_block points to the best
+// one the CPU supports.
+enum VMBlockIsa
+{
+    BLOCK_GENERIC, // Plain C++
+    BLOCK_SSE2,
+    BLOCK_AVX2,
+
+    BLOCK_ISA_COUNT,
+};
+
+struct VMBlockKernels
+{
+    const char *name;
+
+    // dst[i] = dst[i] op src[i]. The ranges may overlap, src is read as it was before.
+    void (*add_words)(vmword *dst, const vmword *src, size_t count);
+    void (*sub_words)(vmword *dst, const vmword *src, size_t count);
+    void (*mul_words)(vmword *dst, const vmword *src, size_t count);
+    void (*xor_words)(vmword *dst, const vmword *src, size_t count);
+
+    void (*fill_words)(vmword *dst, vmword value, size_t count);
+
+    // Reductions. Sums wrap around, minimum and maximum are unsigned and
+    // UINT64_MAX and 0 respectively for count == 0.
+    vmword (*sum_words)(const vmword *src, size_t count);
+    vmword (*min_words)(const vmword *src, size_t count);
+    vmword (*max_words)(const vmword *src, size_t count);
+    // Number of words equal to value
+    vmword (*count_words)(const vmword *src, vmword value, size_t count);
+};
+
+// Whether this build has AVX2 kernels and both the CPU and the OS support AVX2
+bool vm_cpu_has_avx2();
+
+// Kernels for isa, nullptr if this build or the CPU doesn't support it
+const VMBlockKernels* vm_block_kernels(VMBlockIsa isa);
+
+// The kernels the block instructions use
+extern const VMBlockKernels *const vm_block;
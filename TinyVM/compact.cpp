@@ -0,0 +1,160 @@
+#include "compact.hpp"
+
+#include <algorithm>
+
+#include "vm.hpp"
+#include "util.hpp"
+
+namespace
+{
+    // Bytes after the code, so decode can read the mode bytes of every instruction
+    const size_t PADDING = 2;
+
+    // Rest of an operand that doesn't fit into one byte
+    TVM_NOINLINE vmword read_long_varint(vmword operand, const uint8_t *&code)
+    {
+        operand &= 0x7f;
+        unsigned shift = 7;
+        uint8_t byte;
+        do
+        {
+            byte = *code++;
+            operand |= static_cast<vmword>(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte >= 0x80);
+        return operand;
+    }
+
+    // Decode the compact instruction at code into instr. Same as vmi_decode_compact,
+    // minus the checks vm_compact_load made already, and with as few branches as possible.
+    inline void decode(const uint8_t *code, Instruction *instr)
+    {
+        auto head = code[0];
+        unsigned count = head >> 6;
+        unsigned modes = (code[1] | (code[2] & 0xf) << 8) & ((1u << (count * 4)) - 1);
+        code += 1 + (count > 0) + (count > 2);
+        instr->opcode = static_cast<Opcode>(head & 0x3f);
+        instr->flags = OF_NORMAL;
+        for (unsigned i = 0; i < 3; i++)
+        {
+            instr->addressing[i] = static_cast<AddressingMode>((modes >> (i * 4)) & 0xf);
+            instr->operands[i] = 0;
+        }
+        for (unsigned i = 0; i < count; i++)
+        {
+            vmword operand = *code++;
+            if (operand >= 0x80)
+                operand = read_long_varint(operand, code);
+            instr->operands[i] = operand;
+        }
+    }
+
+    // Fill the empty predecode slot at ip from its compact code, if it has any
+    void predecode_compact(VMContext *ctx, vmword ip)
+    {
+        // Host functions may replace memory and with it the compact code, so reload it every time
+        auto code = ctx->compact;
+        auto slot = static_cast<size_t>(ip >> 2);
+        auto index = slot - (code != nullptr ? code->first_slot : 0);
+        if (code == nullptr || (ip & 3) != 0 || index >= code->offsets.size() || code->offsets[index] == VM_COMPACT_NONE)
+            return;
+        Instruction instr;
+        decode(code->bytes->data() + code->offsets[index], &instr);
+        vm_predecode_instr(ctx, ctx->predecoded + slot, instr);
+        vm_mark_decoded(ctx, slot);
+    }
+
+    void run_compact(VMContext *ctx, void*)
+    {
+        ctx->running = true;
+        while (ctx->running)
+        {
+            auto slot = ctx->registers[IP] >> 2;
+            if (slot < ctx->predecode_slots && ctx->predecoded[slot].impl == nullptr)
+                predecode_compact(ctx, ctx->registers[IP]);
+            vm_execute(ctx, vm_fetch_decode(ctx));
+        }
+    }
+}
+
+bool vm_compact_load(VMContext *ctx, vmword address, const uint8_t *code, size_t size, size_t count)
+{
+    if (address % 4 != 0 || address > ctx->memory_size || count > (ctx->memory_size - address) / 4)
+        return false;
+    auto old_bytes = ctx->compact != nullptr ? ctx->compact->bytes->size() - PADDING : 0;
+    if (size >= VM_COMPACT_NONE - old_bytes)
+        return false;
+
+    // Validate everything before touching ctx
+    std::vector<uint32_t> offsets(count);
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        Instruction instr;
+        auto length = vmi_decode_compact(code + pos, size - pos, &instr);
+        if (length == 0)
+            return false;
+        offsets[i] = static_cast<uint32_t>(old_bytes + pos);
+        pos += length;
+    }
+    if (pos != size)
+        return false;
+    if (count == 0)
+        return true;
+
+    // Expand into memory, which drops whatever was decoded or compacted there before
+    for (size_t i = 0; i < count; i++)
+    {
+        Instruction instr;
+        vmi_decode_compact(code + offsets[i] - old_bytes, size - (offsets[i] - old_bytes), &instr);
+        auto data = vmi_encode(&instr);
+        std::copy(data.words, data.words + 4, ctx->memory + address + i * 4);
+    }
+    vm_invalidate_range(ctx, address, count * 4);
+
+    // Append the code and widen the offset table to cover its slots
+    auto first = static_cast<size_t>(address / 4);
+    auto compact = ctx->compact;
+    if (compact == nullptr)
+    {
+        compact = ctx->compact = new VMCompactCode;
+        compact->first_slot = first;
+        compact->bytes = std::make_shared<std::vector<uint8_t>>(PADDING);
+    }
+    auto begin = compact->offsets.empty() ? first : std::min(compact->first_slot, first);
+    auto end = std::max(compact->first_slot + compact->offsets.size(), first + count);
+    std::vector<uint32_t> table(end - begin, VM_COMPACT_NONE);
+    std::copy(compact->offsets.begin(), compact->offsets.end(), table.begin() + (compact->first_slot - begin));
+    std::copy(offsets.begin(), offsets.end(), table.begin() + (first - begin));
+    auto bytes = std::make_shared<std::vector<uint8_t>>(*compact->bytes);
+    bytes->insert(bytes->end() - PADDING, code, code + size);
+    compact->first_slot = begin;
+    compact->offsets.swap(table);
+    compact->bytes = std::move(bytes);
+
+    for (auto slot = first; slot < first + count; slot++)
+    {
+        ctx->predecoded[slot].compact = true;
+        vm_mark_decoded(ctx, slot);
+    }
+    return true;
+}
+
+void vm_compact_invalidate(VMContext *ctx, size_t slot)
+{
+    ctx->predecoded[slot].compact = false;
+    auto compact = ctx->compact;
+    if (compact != nullptr && slot - compact->first_slot < compact->offsets.size())
+        compact->offsets[slot - compact->first_slot] = VM_COMPACT_NONE;
+}
+
+void vm_compact_release(VMContext *ctx)
+{
+    delete ctx->compact;
+    ctx->compact = nullptr;
+}
+
+VMTrap vm_run_compact(VMContext *ctx)
+{
+    return vm_run_guarded(ctx, &run_compact, nullptr);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "vmtypes.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+enum VMTrap : int;
+
+// Offset of a slot that has no compact code
+const uint32_t VM_COMPACT_NONE = UINT32_MAX;
+
+// Compact code of a context: instructions in the variable-length encoding of
+// vmi_encode_compact, which vm_run_compact decodes each slot from once. The
+// encoding saves space in images, not at run time: memory holds the expanded
+// words all the same, so every other engine and anything reading code as data
+// sees the same program, and decoded slots live in the predecode cache.
+struct VMCompactCode
+{
+    // Slot of offsets[0]
+    size_t first_slot;
+    // Per slot: offset of its instruction in bytes, VM_COMPACT_NONE if it has none
+    // or was written to since
+    std::vector<uint32_t> offsets;
+    // Shared with snapshots and forks, never changed once created
+    std::shared_ptr<const std::vector<uint8_t>> bytes;
+};
+
+// Load count compact instructions of size bytes at code into the slots starting at address,
+// which must be 4-word-aligned. Their words are written to memory as well.
+// Returns false if the code is malformed or doesn't fit, in which case ctx is left untouched
+bool vm_compact_load(VMContext *ctx, vmword address, const uint8_t *code, size_t size, size_t count);
+
+// Drop the compact code of slot, called by vm_invalidate for slots marked compact
+void vm_compact_invalidate(VMContext *ctx, size_t slot);
+
+// Free the compact code of ctx without touching the slots marked compact,
+// for vm_invalidate_all and vm_destroy
+void vm_compact_release(VMContext *ctx);
+
+// Run ctx until it stops. Every slot is decoded from its compact code the first time it
+// runs and from then on dispatched from the predecode cache like vm_run_table does.
+// Instructions without compact code, e.g. because they were overwritten, are decoded
+// from memory instead.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted.
+VMTrap vm_run_compact(VMContext *ctx);
@@ -0,0 +1,279 @@
+#include "fusion.hpp"
+
+#include <algorithm>
+#include <ostream>
+
+#include "vm.hpp"
+#include "instruction_semantics.hpp"
+#include "platform.hpp"
+
+namespace
+{
+    ////////
+    // Superinstructions
+    ////////
+
+    // Mode template arguments of combined handlers. Register operands are checked when
+    // the pair is fused, so the handlers don't check them again.
+    const int FUSED_REGISTER = AM_REGISTER | AM_VERIFIED;
+    const int FUSED_LITERAL = AM_LITERAL;
+
+    // Superinstructions are called with the instruction of the first slot of the pair,
+    // the second instruction lives in the slot right after it
+    inline const PredecodedInstruction* first_slot(const Instruction *instr)
+    {
+        return reinterpret_cast<const PredecodedInstruction*>(instr);
+    }
+
+    // Count the first instruction and move on to the second, like the run loop does between them
+    inline void enter_second(VMContext *ctx, const PredecodedInstruction *second)
+    {
+        ctx->registers[IC]++;
+        if (ctx->trace != nullptr)
+            vm_trace_record(ctx->trace, ctx->registers[IC], ctx->registers[IP], &second->instr);
+        ctx->registers[IP] += 4;
+    }
+
+    // Execute a fused pair through the handlers of both instructions
+    void fused_impl(VMContext *ctx, const Instruction *instr)
+    {
+        auto first = first_slot(instr);
+        auto second = first + 1;
+
+        first->base_impl(ctx, &first->instr);
+
+        // Leave the second instruction to the run loop if the first one
+        // stopped the VM or overwrote the second one
+        if (!ctx->running || second->impl == nullptr)
+            return;
+
+        enter_second(ctx, second);
+        second->impl(ctx, &second->instr);
+        ctx->fusion_hits[first->fusion - 1]++;
+    }
+
+    // Same with both handlers known at compile time, so they are inlined into one
+    template<instr_func First, instr_func Second>
+    void fused_pair(VMContext *ctx, const Instruction *instr)
+    {
+        auto first = first_slot(instr);
+        auto second = first + 1;
+
+        First(ctx, instr);
+        if (!ctx->running || second->impl == nullptr)
+            return;
+
+        enter_second(ctx, second);
+        Second(ctx, &second->instr);
+        ctx->fusion_hits[first->fusion - 1]++;
+    }
+
+    // cmp r b c, jnz target r: CMP gives zero exactly if b == c, so branch on that
+    // instead of reading the result back from r
+    template<int MB, int MC>
+    void fused_cmp_jnz(VMContext *ctx, const Instruction *instr)
+    {
+        auto first = first_slot(instr);
+        auto second = first + 1;
+
+        auto b = operand_fetch<O_B, MB>(ctx, instr);
+        auto c = operand_fetch<O_C, MC>(ctx, instr);
+        ctx->registers[instr->operands[O_A]] = c < b ? vmword(-1) : c > b ? 1 : 0;
+        enter_second(ctx, second);
+        if (b != c)
+            jump_to(ctx, second->instr.operands[O_A]);
+        ctx->fusion_hits[first->fusion - 1]++;
+    }
+
+    // dec r, jnz target r: count down and branch on the new value
+    void fused_dec_jnz(VMContext *ctx, const Instruction *instr)
+    {
+        auto first = first_slot(instr);
+        auto second = first + 1;
+
+        auto counter = --ctx->registers[instr->operands[O_A]];
+        enter_second(ctx, second);
+        if (counter != 0)
+            jump_to(ctx, second->instr.operands[O_A]);
+        ctx->fusion_hits[first->fusion - 1]++;
+    }
+
+    // Mode template argument for operand index of instr if combined handlers take it, 0 otherwise
+    int fused_mode(const Instruction &instr, int index)
+    {
+        if (instr.addressing[index] == AM_LITERAL)
+            return FUSED_LITERAL;
+        if (instr.addressing[index] == AM_REGISTER && instr.operands[index] < VM_REGISTER_COUNT)
+            return FUSED_REGISTER;
+        return 0;
+    }
+
+    instr_func combine_cmp_jnz(const Instruction &first, const Instruction &second)
+    {
+        const int R = FUSED_REGISTER, L = FUSED_LITERAL;
+        if (fused_mode(first, O_A) != R || fused_mode(second, O_A) != L || fused_mode(second, O_B) != R)
+            return nullptr;
+        auto b = fused_mode(first, O_B);
+        auto c = fused_mode(first, O_C);
+        if (second.operands[O_B] == first.operands[O_A])
+        {
+            return b == R && c == R ? &fused_cmp_jnz<R, R>
+                : b == R && c == L ? &fused_cmp_jnz<R, L>
+                : b == L && c == R ? &fused_cmp_jnz<L, R>
+                : nullptr;
+        }
+        return b == R && c == R ? &fused_pair<&IMPL_NAME(cmp)<R, R, R>, &IMPL_NAME(jnz)<L, R>>
+            : b == R && c == L ? &fused_pair<&IMPL_NAME(cmp)<R, R, L>, &IMPL_NAME(jnz)<L, R>>
+            : b == L && c == R ? &fused_pair<&IMPL_NAME(cmp)<R, L, R>, &IMPL_NAME(jnz)<L, R>>
+            : nullptr;
+    }
+
+    instr_func combine_dec_jnz(const Instruction &first, const Instruction &second)
+    {
+        const int R = FUSED_REGISTER, L = FUSED_LITERAL;
+        if (fused_mode(first, O_A) != R || fused_mode(second, O_A) != L || fused_mode(second, O_B) != R)
+            return nullptr;
+        if (second.operands[O_B] == first.operands[O_A])
+            return &fused_dec_jnz;
+        return &fused_pair<&IMPL_NAME(dec)<R>, &IMPL_NAME(jnz)<L, R>>;
+    }
+
+    instr_func combine_mov_mod(const Instruction &first, const Instruction &second)
+    {
+        const int R = FUSED_REGISTER, L = FUSED_LITERAL;
+        if (fused_mode(first, O_A) != R || fused_mode(second, O_A) != R || fused_mode(second, O_B) != R)
+            return nullptr;
+        auto b = fused_mode(first, O_B);
+        auto c = fused_mode(second, O_C);
+        return b == R && c == R ? &fused_pair<&IMPL_NAME(mov)<R, R>, &IMPL_NAME(mod)<R, R, R>>
+            : b == R && c == L ? &fused_pair<&IMPL_NAME(mov)<R, R>, &IMPL_NAME(mod)<R, R, L>>
+            : b == L && c == R ? &fused_pair<&IMPL_NAME(mov)<R, L>, &IMPL_NAME(mod)<R, R, R>>
+            : b == L && c == L ? &fused_pair<&IMPL_NAME(mov)<R, L>, &IMPL_NAME(mod)<R, R, L>>
+            : nullptr;
+    }
+
+    instr_func combine_push_call(const Instruction &first, const Instruction &second)
+    {
+        const int R = FUSED_REGISTER, L = FUSED_LITERAL;
+        if (fused_mode(second, O_A) != L)
+            return nullptr;
+        auto a = fused_mode(first, O_A);
+        return a == R ? &fused_pair<&IMPL_NAME(push)<R>, &IMPL_NAME(call)<L>>
+            : a == L ? &fused_pair<&IMPL_NAME(push)<L>, &IMPL_NAME(call)<L>>
+            : nullptr;
+    }
+}
+
+const FusionPattern FUSION_PATTERNS[] =
+{
+    { "cmp+jnz",   OP_CMP,  OP_JNZ,  &combine_cmp_jnz },
+    { "dec+jnz",   OP_DEC,  OP_JNZ,  &combine_dec_jnz },
+    { "mov+mod",   OP_MOV,  OP_MOD,  &combine_mov_mod },
+    { "push+call", OP_PUSH, OP_CALL, &combine_push_call },
+};
+
+const size_t FUSION_PATTERN_COUNT = sizeof(FUSION_PATTERNS) / sizeof(FUSION_PATTERNS[0]);
+
+static_assert(sizeof(FUSION_PATTERNS) / sizeof(FUSION_PATTERNS[0]) <= VM_MAX_FUSION_PATTERNS,
+    "Too many fusion patterns, increase VM_MAX_FUSION_PATTERNS.");
+
+namespace
+{
+    // The first instruction of a pair must fall through to the second one
+    bool may_fuse_first(const Instruction &instr)
+    {
+        switch (instr.opcode)
+        {
+        case OP_HALT:
+        case OP_CALL:
+        case OP_RET:
+        case OP_JMP:
+        case OP_JEQ:
+        case OP_JNE:
+        case OP_JNZ:
+            return false;
+        default:
+            break;
+        }
+        for (size_t i = 0; i < 3; i++)
+        {
+            auto reg = instr.operands[i];
+            if ((instr.addressing[i] & AM_REGISTER) && (reg == IP || reg == IC))
+                return false;
+        }
+        return true;
+    }
+
+    // Return the index of the pattern matching the pair, or -1
+    int find_pattern(const Instruction &first, const Instruction &second)
+    {
+        if (!may_fuse_first(first))
+            return -1;
+        for (size_t i = 0; i < FUSION_PATTERN_COUNT; i++)
+        {
+            if (FUSION_PATTERNS[i].first == first.opcode && FUSION_PATTERNS[i].second == second.opcode)
+                return static_cast<int>(i);
+        }
+        return -1;
+    }
+}
+
+void vm_fuse(VMContext *ctx, vmword address, size_t count)
+{
+    auto begin = (address + 3) >> 2;
+    auto end = std::min<vmword>((address + count) >> 2, ctx->predecode_slots);
+    // Memory that was never touched is all zeroes, i.e. NOPs, which never fuse.
+    // Skipping it also keeps decoding from committing it.
+    auto chunk_slots = plat_memory_chunk_words() / 4;
+    auto untouched = [ctx](vmword slot)
+    {
+        return !plat_memory_chunk_committed(ctx->memory, ctx->memory_size, slot * 4);
+    };
+    for (auto slot = begin; slot + 1 < end; slot++)
+    {
+        if ((slot == begin || slot % chunk_slots == 0) && untouched(slot))
+        {
+            slot = (slot / chunk_slots + 1) * chunk_slots - 1;
+            continue;
+        }
+        if ((slot + 1) % chunk_slots == 0 && untouched(slot + 1))
+            continue;
+
+        auto entry = ctx->predecoded + slot;
+        auto next = entry + 1;
+        if (entry->impl == nullptr)
+            vm_predecode(ctx, entry, slot << 2);
+        if (next->impl == nullptr)
+            vm_predecode(ctx, next, (slot + 1) << 2);
+        vm_mark_decoded(ctx, slot);
+        vm_mark_decoded(ctx, slot + 1);
+
+        // Don't chain superinstructions
+        if (entry->fusion != 0 || next->fusion != 0 || (slot > 0 && entry[-1].fusion != 0))
+            continue;
+
+        auto pattern = find_pattern(entry->instr, next->instr);
+        if (pattern < 0)
+            continue;
+
+        auto combine = FUSION_PATTERNS[pattern].combine;
+        auto combined = combine != nullptr ? combine(entry->instr, next->instr) : nullptr;
+        entry->base_impl = entry->impl;
+        entry->impl = combined != nullptr ? combined : &fused_impl;
+        entry->fusion = static_cast<uint8_t>(pattern + 1);
+        entry->threaded = VM_THREADED_IMPL;
+        ctx->fusion_sites[pattern]++;
+        slot++;
+    }
+}
+
+void vm_fusion_report(const VMContext *ctx, std::ostream &out)
+{
+    out << "Superinstruction fusion:" << std::endl;
+    for (size_t i = 0; i < FUSION_PATTERN_COUNT; i++)
+    {
+        out << "  " << FUSION_PATTERNS[i].name
+            << ": " << ctx->fusion_sites[i] << " sites, "
+            << ctx->fusion_hits[i] << " executions" << std::endl;
+    }
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <iosfwd>
+
+#include "vmtypes.hpp"
+#include "instruction.hpp"
+#include "instruction_implementation.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+
+// Upper bound for the number of fusion patterns
+const size_t VM_MAX_FUSION_PATTERNS = 16;
+
+// A pair of adjacent instructions that is executed as one superinstruction,
+// i.e. with a single dispatch from the run loop
+struct FusionPattern
+{
+    const char *name;
+    Opcode first;
+    Opcode second;
+    // Returns a handler that runs the pair as one for the operands of first and second,
+    // nullptr to run each of them through its own handler. May be nullptr itself.
+    instr_func (*combine)(const Instruction &first, const Instruction &second);
+};
+
+// Patterns applied by vm_fuse. To add a pattern, extend the table in fusion.cpp.
+extern const FusionPattern FUSION_PATTERNS[];
+extern const size_t FUSION_PATTERN_COUNT;
+
+// Predecode the code in count words of memory starting at address and replace
+// pairs of instructions matching one of FUSION_PATTERNS with superinstructions.
+// Superinstructions add the number of original instructions to IC.
+void vm_fuse(VMContext *ctx, vmword address, size_t count);
+
+// Print how often each pattern was applied and executed
+void vm_fusion_report(const VMContext *ctx, std::ostream &out);
@@ -49,3 +49,67 @@ InstructionData vmi_read(const vmword *memory, size_t offset)
 	memcpy(data.words, adjusted_addr, sizeof(data.words));
 	return data;
 }
+
+size_t vmi_encode_compact(const Instruction *instr, uint8_t *dst)
+{
+	if (static_cast<uint32_t>(instr->opcode) >= 64 || instr->flags != OF_NORMAL)
+		return 0;
+	size_t count = 3;
+	while (count > 0 && instr->addressing[count - 1] == 0 && instr->operands[count - 1] == 0)
+		count--;
+
+	auto start = dst;
+	*dst++ = static_cast<uint8_t>(count << 6 | instr->opcode);
+	for (size_t i = 0; i < count; i++)
+	{
+		if (static_cast<uint32_t>(instr->addressing[i]) > 0xf)
+			return 0;
+	}
+	if (count > 0)
+		*dst++ = static_cast<uint8_t>(instr->addressing[0] | instr->addressing[1] << 4);
+	if (count > 2)
+		*dst++ = static_cast<uint8_t>(instr->addressing[2]);
+	for (size_t i = 0; i < count; i++)
+	{
+		auto operand = instr->operands[i];
+		while (operand >= 0x80)
+		{
+			*dst++ = static_cast<uint8_t>(operand | 0x80);
+			operand >>= 7;
+		}
+		*dst++ = static_cast<uint8_t>(operand);
+	}
+	return dst - start;
+}
+
+size_t vmi_decode_compact(const uint8_t *src, size_t size, Instruction *dst)
+{
+	if (size == 0)
+		return 0;
+	auto head = src[0];
+	size_t count = head >> 6;
+	size_t pos = 1 + (count > 0) + (count > 2);
+	if (pos > size)
+		return 0;
+	unsigned modes = count > 0 ? src[1] : 0;
+	if (count > 2)
+		modes |= (src[2] & 0xf) << 8;
+	*dst = Instruction{ static_cast<Opcode>(head & 0x3f), OF_NORMAL, {}, {} };
+	for (size_t i = 0; i < count; i++)
+	{
+		dst->addressing[i] = static_cast<AddressingMode>((modes >> (i * 4)) & 0xf);
+		vmword operand = 0;
+		for (unsigned shift = 0; ; shift += 7)
+		{
+			// At most 10 bytes, the last of which only has one bit left
+			if (pos >= size || shift > 63 || (shift == 63 && src[pos] > 1))
+				return 0;
+			auto byte = src[pos++];
+			operand |= static_cast<vmword>(byte & 0x7f) << shift;
+			if (byte < 0x80)
+				break;
+		}
+		dst->operands[i] = operand;
+	}
+	return pos;
+}
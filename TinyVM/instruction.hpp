@@ -34,6 +34,17 @@ enum Opcode
     OP_JNE,    // JNE a b c      Jump to a if b and c are not equal
     OP_JNZ,    // JNZ a b        Jump to a if b is not zero
     OP_RDRAND, // RDRAND a b c   a = random 64-bit integer in [b, c]. b must be <= c. If b == c == 0, the number is in [0, UINT64_MAX].
+    OP_SYSCALL, // SYSCALL a      Call the host function bound to number a, arguments and results are passed in registers
+    OP_VADD,   // VADD a b c     a[i] = a[i] + b[i] for the c words at addresses a and b
+    OP_VSUB,   // VSUB a b c     a[i] = a[i] - b[i] for the c words at addresses a and b
+    OP_VMUL,   // VMUL a b c     a[i] = a[i] * b[i] for the c words at addresses a and b
+    OP_VXOR,   // VXOR a b c     a[i] = a[i] ^ b[i] for the c words at addresses a and b
+    OP_VFILL,  // VFILL a b c    a[i] = b for the c words at address a
+    OP_VCOPY,  // VCOPY a b c    a[i] = b[i] for the c words at addresses a and b, the blocks may overlap
+    OP_VSUM,   // VSUM a b c     a = sum of the c words at address b
+    OP_VMIN,   // VMIN a b c     a = unsigned minimum of the c words at address b, UINT64_MAX if c is 0
+    OP_VMAX,   // VMAX a b c     a = unsigned maximum of the c words at address b, 0 if c is 0
+    OP_VCOUNT, // VCOUNT a b c   a = number of the c words at address b that are equal to a
 
 	INSTRUCTION_COUNT,
 };
@@ -72,3 +83,19 @@ Instruction vmi_decode(const InstructionData *data);
 
 // Read instruction data from memory
 InstructionData vmi_read(const vmword *memory, size_t offset = 0);
+
+// Compact encoding, the variable-length form of an instruction in compact code:
+//   byte 0: operand count << 6 | opcode
+//   byte 1: mode of a | mode of b << 4, if there is at least one operand
+//   byte 2: mode of c, if there are three operands
+// followed by the operands as unsigned LEB128 varints, so registers and literals below
+// 128 take one byte. Operands past the count and the flags are zero.
+const size_t VMI_COMPACT_MAX_BYTES = 3 + 3 * 10;
+
+// Encode instr into dst, which must have room for VMI_COMPACT_MAX_BYTES bytes.
+// Returns the number of bytes written, 0 if instr has no compact form
+size_t vmi_encode_compact(const Instruction *instr, uint8_t *dst);
+
+// Decode the compact instruction at the start of the size bytes at src
+// Returns the number of bytes read, 0 if they don't start with a valid compact instruction
+size_t vmi_decode_compact(const uint8_t *src, size_t size, Instruction *dst);
@@ -1,310 +1,193 @@
 #include "instruction_implementation.hpp"
 
-#include "instruction.hpp"
-#include "vm.hpp"
+#include "instruction_semantics.hpp"
 
-#include <random>
-#include <chrono>
-
-#define IMPL_NAME(name) op_##name##_impl
-#define INSTRUCTION_IMPL(name) void IMPL_NAME(name)(VMContext *ctx, const Instruction *instr)
+#include <cstring>
 
 ////////
-// Anonymous namespace for helper functions
+// Anonymous namespace for the table of mode-specialized implementations
 ////////
 namespace
 {
-    ////////
-    // Stack helper functions
-    ////////
-
-    inline vmword* stack_top(VMContext *ctx)
-    {
-        auto sp = ctx->registers[SP];
-        if (sp == -1)
-            sp++;
-        auto stack_base = ctx->memory + ctx->registers[SBP];
-        auto top = stack_base - sp;
-        return top;
-    }
-
-    inline vmword* stack_inc(VMContext *ctx)
-    {
-        if (ctx->registers[SP] >= ctx->registers[SBP])
-            vm_error(ctx, "Stack overflow");
-        ctx->registers[SP]++;
-        return stack_top(ctx);
-    }
+    // Modes that get their own variant. Everything else (indirect operands,
+    // unused operands) is folded into class 0 and handled by the generic variant.
+    const size_t MODE_CLASS_COUNT = 4;
 
-    inline vmword* stack_dec(VMContext *ctx)
+    constexpr size_t mode_class(int mode)
     {
-        if (ctx->registers[SP] <= 0)
-            vm_error(ctx, "Stack underflow");
-        ctx->registers[SP]--;
-        return stack_top(ctx);
+        return mode == AM_LITERAL ? 1
+            : mode == AM_MEMORY ? 2
+            : mode == AM_REGISTER ? 3
+            : 0;
     }
 
-    inline void stack_push(VMContext *ctx, vmword word)
-    {
-        *stack_inc(ctx) = word;
-    }
+    typedef instr_func VariantTable[MODE_CLASS_COUNT][MODE_CLASS_COUNT][MODE_CLASS_COUNT];
 
-    inline vmword stack_pop(VMContext *ctx)
+    // Set the variant for one combination of operand modes.
+    // Flags are the AM_VERIFIED bits of the checks the variant leaves out.
+    template<typename Variants, int Flags, int MA, int MB, int MC>
+    void set_variant(VariantTable &table)
     {
-        auto word = *stack_top(ctx);
-        stack_dec(ctx);
-        return word;
+        table[mode_class(MA)][mode_class(MB)][mode_class(MC)] = &Variants::template impl<MA | Flags, MB | Flags, MC | Flags>;
     }
 
-    ////////
-    // Operand helper functions
-    ////////
-
-    enum OperandIndex
+    // Instantiate variants for all specialized modes of the operands after those given
+    template<typename Variants, int Flags, int MA, int MB>
+    void fill_variants_c(VariantTable &table)
     {
-        O_A = 0,
-        O_B = 1,
-        O_C = 2,
+        set_variant<Variants, Flags, MA, MB, AM_LITERAL>(table);
+        set_variant<Variants, Flags, MA, MB, AM_MEMORY>(table);
+        set_variant<Variants, Flags, MA, MB, AM_REGISTER>(table);
+    }
+
+    template<typename Variants, int Flags, int MA>
+    void fill_variants_bc(VariantTable &table)
+    {
+        fill_variants_c<Variants, Flags, MA, AM_LITERAL>(table);
+        fill_variants_c<Variants, Flags, MA, AM_MEMORY>(table);
+        fill_variants_c<Variants, Flags, MA, AM_REGISTER>(table);
+    }
+
+    template<typename Variants, int Flags>
+    void fill_variants_abc(VariantTable &table)
+    {
+        fill_variants_bc<Variants, Flags, AM_LITERAL>(table);
+        fill_variants_bc<Variants, Flags, AM_MEMORY>(table);
+        fill_variants_bc<Variants, Flags, AM_REGISTER>(table);
+    }
+
+    template<typename Variants, int Flags, int MA>
+    void fill_variants_b(VariantTable &table)
+    {
+        set_variant<Variants, Flags, MA, AM_LITERAL, AM_DYNAMIC>(table);
+        set_variant<Variants, Flags, MA, AM_MEMORY, AM_DYNAMIC>(table);
+        set_variant<Variants, Flags, MA, AM_REGISTER, AM_DYNAMIC>(table);
+    }
+
+    template<typename Variants, int Flags>
+    void fill_variants_ab(VariantTable &table)
+    {
+        fill_variants_b<Variants, Flags, AM_LITERAL>(table);
+        fill_variants_b<Variants, Flags, AM_MEMORY>(table);
+        fill_variants_b<Variants, Flags, AM_REGISTER>(table);
+    }
+
+    template<typename Variants, int Flags>
+    void fill_variants_a(VariantTable &table)
+    {
+        set_variant<Variants, Flags, AM_LITERAL, AM_DYNAMIC, AM_DYNAMIC>(table);
+        set_variant<Variants, Flags, AM_MEMORY, AM_DYNAMIC, AM_DYNAMIC>(table);
+        set_variant<Variants, Flags, AM_REGISTER, AM_DYNAMIC, AM_DYNAMIC>(table);
+    }
+
+#define VARIANTS(name) name##_variants
+#define DECLARE_VARIANTS(name) \
+    struct VARIANTS(name) \
+    { \
+        template<int MA, int MB, int MC> \
+        static void impl(VMContext *ctx, const Instruction *instr) { IMPL_NAME(name)<MA, MB, MC>(ctx, instr); } \
+    }
+
+    DECLARE_VARIANTS(push);
+    DECLARE_VARIANTS(pop);
+    DECLARE_VARIANTS(add);
+    DECLARE_VARIANTS(sub);
+    DECLARE_VARIANTS(mul);
+    DECLARE_VARIANTS(div);
+    DECLARE_VARIANTS(shl);
+    DECLARE_VARIANTS(shr);
+    DECLARE_VARIANTS(mod);
+    DECLARE_VARIANTS(inc);
+    DECLARE_VARIANTS(dec);
+    DECLARE_VARIANTS(not);
+    DECLARE_VARIANTS(cmp);
+    DECLARE_VARIANTS(mov);
+    DECLARE_VARIANTS(call);
+    DECLARE_VARIANTS(ret);
+    DECLARE_VARIANTS(jmp);
+    DECLARE_VARIANTS(jeq);
+    DECLARE_VARIANTS(jne);
+    DECLARE_VARIANTS(jnz);
+    DECLARE_VARIANTS(rdrand);
+    DECLARE_VARIANTS(syscall);
+    DECLARE_VARIANTS(vadd);
+    DECLARE_VARIANTS(vsub);
+    DECLARE_VARIANTS(vmul);
+    DECLARE_VARIANTS(vxor);
+    DECLARE_VARIANTS(vfill);
+    DECLARE_VARIANTS(vcopy);
+    DECLARE_VARIANTS(vsum);
+    DECLARE_VARIANTS(vmin);
+    DECLARE_VARIANTS(vmax);
+    DECLARE_VARIANTS(vcount);
+
+    struct SpecializedTable
+    {
+        // Per VMVerifyLevel
+        VariantTable variants[VERIFIED_STACK + 1][INSTRUCTION_COUNT] = {};
+
+        // Variants of all opcodes with specialized modes
+        template<int Flags>
+        static void fill(VariantTable *table)
+        {
+            fill_variants_a<VARIANTS(push), Flags>(table[OP_PUSH]);
+            fill_variants_a<VARIANTS(pop), Flags>(table[OP_POP]);
+            fill_variants_abc<VARIANTS(add), Flags>(table[OP_ADD]);
+            fill_variants_abc<VARIANTS(sub), Flags>(table[OP_SUB]);
+            fill_variants_abc<VARIANTS(mul), Flags>(table[OP_MUL]);
+            fill_variants_abc<VARIANTS(div), Flags>(table[OP_DIV]);
+            fill_variants_abc<VARIANTS(shl), Flags>(table[OP_SHL]);
+            fill_variants_abc<VARIANTS(shr), Flags>(table[OP_SHR]);
+            fill_variants_abc<VARIANTS(mod), Flags>(table[OP_MOD]);
+            fill_variants_a<VARIANTS(inc), Flags>(table[OP_INC]);
+            fill_variants_a<VARIANTS(dec), Flags>(table[OP_DEC]);
+            fill_variants_a<VARIANTS(not), Flags>(table[OP_NOT]);
+            fill_variants_abc<VARIANTS(cmp), Flags>(table[OP_CMP]);
+            fill_variants_ab<VARIANTS(mov), Flags>(table[OP_MOV]);
+            fill_variants_a<VARIANTS(call), Flags>(table[OP_CALL]);
+            fill_variants_a<VARIANTS(jmp), Flags>(table[OP_JMP]);
+            fill_variants_abc<VARIANTS(jeq), Flags>(table[OP_JEQ]);
+            fill_variants_abc<VARIANTS(jne), Flags>(table[OP_JNE]);
+            fill_variants_ab<VARIANTS(jnz), Flags>(table[OP_JNZ]);
+            fill_variants_abc<VARIANTS(rdrand), Flags>(table[OP_RDRAND]);
+            fill_variants_a<VARIANTS(syscall), Flags>(table[OP_SYSCALL]);
+            fill_variants_abc<VARIANTS(vadd), Flags>(table[OP_VADD]);
+            fill_variants_abc<VARIANTS(vsub), Flags>(table[OP_VSUB]);
+            fill_variants_abc<VARIANTS(vmul), Flags>(table[OP_VMUL]);
+            fill_variants_abc<VARIANTS(vxor), Flags>(table[OP_VXOR]);
+            fill_variants_abc<VARIANTS(vfill), Flags>(table[OP_VFILL]);
+            fill_variants_abc<VARIANTS(vcopy), Flags>(table[OP_VCOPY]);
+            fill_variants_abc<VARIANTS(vsum), Flags>(table[OP_VSUM]);
+            fill_variants_abc<VARIANTS(vmin), Flags>(table[OP_VMIN]);
+            fill_variants_abc<VARIANTS(vmax), Flags>(table[OP_VMAX]);
+            fill_variants_abc<VARIANTS(vcount), Flags>(table[OP_VCOUNT]);
+        }
+
+        SpecializedTable()
+        {
+            fill<0>(variants[VERIFIED_NONE]);
+            fill<AM_VERIFIED>(variants[VERIFIED_OPERANDS]);
+
+            // Only stack operations differ once the stack is verified too. RET has no operands,
+            // so its only variant takes the place of the generic one.
+            memcpy(variants[VERIFIED_STACK], variants[VERIFIED_OPERANDS], sizeof(variants[VERIFIED_OPERANDS]));
+            const int stack_flags = AM_VERIFIED | AM_VERIFIED_STACK;
+            fill_variants_a<VARIANTS(push), stack_flags>(variants[VERIFIED_STACK][OP_PUSH]);
+            fill_variants_a<VARIANTS(pop), stack_flags>(variants[VERIFIED_STACK][OP_POP]);
+            fill_variants_a<VARIANTS(call), stack_flags>(variants[VERIFIED_STACK][OP_CALL]);
+            set_variant<VARIANTS(ret), stack_flags, AM_DYNAMIC, AM_DYNAMIC, AM_DYNAMIC>(variants[VERIFIED_STACK][OP_RET]);
+        }
     };
 
-    // Assign value to location operand at Index position points to. Does not support literal operands.
-    template<OperandIndex Index>
-    void operand_assign_at(VMContext *ctx, const Instruction *instr, vmword value)
-    {
-        static_assert(Index < 3, "Operand index must be less than 3.");
-
-        auto operand = instr->operands[Index];
-        auto mode = instr->addressing[Index];
-
-        if (mode & AM_LITERAL)
-            vm_error(ctx, "Trying to assign to a literal operand.");
-
-        vmword *target;
-        if (mode & AM_REGISTER)
-            target = (ctx->registers + operand);
-        else if (mode & AM_MEMORY)
-            target = (ctx->memory + operand);
-
-        if (mode & AM_INDIRECT)
-            target = (ctx->memory + *target);
-
-        *target = value;
-    }
-
-    // Fetch operand value at Index position, following indirections
-    template<OperandIndex Index>
-    vmword operand_fetch(const VMContext *ctx, const Instruction *instr)
-    {
-        static_assert(Index < 3, "Operand index must be less than 3.");
-
-        auto operand = instr->operands[Index];
-        auto mode = instr->addressing[Index];
-
-        vmword value;
-        if (mode & AM_LITERAL)
-            value = operand;
-        else if (mode & AM_MEMORY)
-            value = ctx->memory[operand];
-        else if (mode & AM_REGISTER)
-            value = ctx->registers[operand];
-
-        if (mode & AM_INDIRECT)
-            value = ctx->memory[value];
-
-        return value;
-    }
+    const SpecializedTable specialized_table;
 }
 
-////////
-// Anonymous namespace for instruction implementations
-////////
-namespace
+instr_func select_specialized_impl(const Instruction *instr, VMVerifyLevel verified)
 {
-    INSTRUCTION_IMPL(nop)
-    {
-
-    }
-
-    INSTRUCTION_IMPL(halt)
-    {
-        ctx->running = false;
-    }
-
-    INSTRUCTION_IMPL(push)
-    {
-        auto a = operand_fetch<O_A>(ctx, instr);
-        stack_push(ctx, a);
-    }
-
-    INSTRUCTION_IMPL(pop)
-    {
-        auto val = stack_pop(ctx);
-        operand_assign_at<O_A>(ctx, instr, val);
-    }
-
-    INSTRUCTION_IMPL(add)
-    {
-        // TODO: operate on signed value here?
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-        auto val = b + c;
-        operand_assign_at<O_A>(ctx, instr, val);
-    }
-
-	INSTRUCTION_IMPL(sub)
-	{
-		// TODO: operate on signed value here?
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-        auto val = b - c;
-        operand_assign_at<O_A>(ctx, instr, val);
-	}
-
-	INSTRUCTION_IMPL(mul)
-	{
-		// TODO: operate on signed value here?
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-        auto val = b * c;
-        operand_assign_at<O_A>(ctx, instr, val);
-	}
-
-	INSTRUCTION_IMPL(div)
-	{
-		// TODO: operate on signed value here?
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-		auto val = b / c;
-		auto rem = b % c;
-        operand_assign_at<O_A>(ctx, instr, val);
-		ctx->registers[RMD] = rem;
-	}
-
-	INSTRUCTION_IMPL(shl)
-	{
-		auto b = operand_fetch<O_B>(ctx, instr);
-		auto c = operand_fetch<O_C>(ctx, instr);
-		auto val = b << c;
-		operand_assign_at<O_A>(ctx, instr, val);
-	}
-
-	INSTRUCTION_IMPL(shr)
-	{
-		auto b = operand_fetch<O_B>(ctx, instr);
-		auto c = operand_fetch<O_C>(ctx, instr);
-		auto val = b >> c;
-		operand_assign_at<O_A>(ctx, instr, val);
-	}
-
-    INSTRUCTION_IMPL(mod)
-    {
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-        auto rem = b % c;
-        operand_assign_at<O_A>(ctx, instr, rem);
-    }
-
-    INSTRUCTION_IMPL(inc)
-    {
-        // TODO: operate on signed value here?
-        auto a = operand_fetch<O_A>(ctx, instr);
-        auto val = a + 1;
-        operand_assign_at<O_A>(ctx, instr, val);
-    }
-
-    INSTRUCTION_IMPL(dec)
-    {
-        // TODO: operate on signed value here?
-        auto a = operand_fetch<O_A>(ctx, instr);
-        auto val = a - 1;
-        operand_assign_at<O_A>(ctx, instr, val);
-    }
-
-	INSTRUCTION_IMPL(not)
-	{
-		// TODO: operate on signed value here?
-        auto a = operand_fetch<O_A>(ctx, instr);
-		auto na = ~a;
-        operand_assign_at<O_A>(ctx, instr, na);
-	}
-
-	INSTRUCTION_IMPL(cmp)
-	{
-		auto b = operand_fetch<O_B>(ctx, instr);
-		auto c = operand_fetch<O_C>(ctx, instr);
-		vmword result;
-		if (c < b)
-			result = (vmword)-1;
-		else if (c > b)
-			result = 1;
-		else
-			result = 0;
-		operand_assign_at<O_A>(ctx, instr, result);
-	}
-
-    INSTRUCTION_IMPL(mov)
-    {
-        auto b = operand_fetch<O_B>(ctx, instr);
-        operand_assign_at<O_A>(ctx, instr, b);
-    }
-
-	INSTRUCTION_IMPL(call)
-	{
-        auto a = operand_fetch<O_A>(ctx, instr);
-		stack_push(ctx, ctx->registers[IP]);
-		ctx->registers[IP] = a;
-	}
-
-	INSTRUCTION_IMPL(ret)
-	{
-		auto ip = stack_pop(ctx);
-		ctx->registers[IP] = ip;
-	}
-
-    INSTRUCTION_IMPL(jmp)
-    {
-        auto a = operand_fetch<O_A>(ctx, instr);
-        ctx->registers[IP] = a;
-    }
-
-    INSTRUCTION_IMPL(jeq)
-    {
-        auto a = operand_fetch<O_A>(ctx, instr);
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-        if (b == c)
-			ctx->registers[IP] = a;
-    }
-
-    INSTRUCTION_IMPL(jne)
-    {
-        auto a = operand_fetch<O_A>(ctx, instr);
-        auto b = operand_fetch<O_B>(ctx, instr);
-        auto c = operand_fetch<O_C>(ctx, instr);
-        if (b != c)
-			ctx->registers[IP] = a;
-    }
-
-	INSTRUCTION_IMPL(jnz)
-	{
-        auto a = operand_fetch<O_A>(ctx, instr);
-        auto b = operand_fetch<O_B>(ctx, instr);
-		if (b != 0)
-			ctx->registers[IP] = a;
-	}
-
-    INSTRUCTION_IMPL(rdrand)
-    {
-        static std::default_random_engine generator(std::chrono::system_clock::now().time_since_epoch().count());
-
-        auto min = operand_fetch<O_B>(ctx, instr);
-        auto max = operand_fetch<O_C>(ctx, instr);
-        if (min == max && min == 0)
-            max = UINT64_MAX;
-        std::uniform_int_distribution<vmword> distribution(min, max);
-        vmword value = distribution(generator);
-        operand_assign_at<O_A>(ctx, instr, value);
-    }
+    if (static_cast<uint32_t>(instr->opcode) >= INSTRUCTION_COUNT)
+        return nullptr;
+    auto &variants = specialized_table.variants[verified][instr->opcode];
+    return variants[mode_class(instr->addressing[0])][mode_class(instr->addressing[1])][mode_class(instr->addressing[2])];
 }
 
 void prepare_instruction_table(instr_func *buffer)
@@ -332,4 +215,15 @@ void prepare_instruction_table(instr_func *buffer)
 	buffer[OP_JNE] = &IMPL_NAME(jne);
 	buffer[OP_JNZ] = &IMPL_NAME(jnz);
     buffer[OP_RDRAND] = &IMPL_NAME(rdrand);
+    buffer[OP_SYSCALL] = &IMPL_NAME(syscall);
+    buffer[OP_VADD] = &IMPL_NAME(vadd);
+    buffer[OP_VSUB] = &IMPL_NAME(vsub);
+    buffer[OP_VMUL] = &IMPL_NAME(vmul);
+    buffer[OP_VXOR] = &IMPL_NAME(vxor);
+    buffer[OP_VFILL] = &IMPL_NAME(vfill);
+    buffer[OP_VCOPY] = &IMPL_NAME(vcopy);
+    buffer[OP_VSUM] = &IMPL_NAME(vsum);
+    buffer[OP_VMIN] = &IMPL_NAME(vmin);
+    buffer[OP_VMAX] = &IMPL_NAME(vmax);
+    buffer[OP_VCOUNT] = &IMPL_NAME(vcount);
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 // Forward declarations
 struct VMContext;
 struct Instruction;
@@ -9,3 +11,18 @@ typedef void (*instr_func)(VMContext*, const Instruction*);
 
 // Fill buffer with implementations for VM instructions. Buffer must be at least of size Opcode::INSTRUCTION_COUNT.
 void prepare_instruction_table(instr_func *buffer);
+
+// What vm_verify proved about an instruction, each level includes the ones before it
+enum VMVerifyLevel : uint8_t
+{
+    VERIFIED_NONE,
+    VERIFIED_OPERANDS, // Valid registers, memory operands inside memory
+    VERIFIED_STACK,    // Stack operations can neither overflow nor underflow
+};
+
+// Return an implementation specialized for the addressing modes of instr, with all
+// mode checks resolved at compile time. Verified instructions get variants that also
+// leave out the runtime checks verification made unnecessary.
+// Returns nullptr if there is no specialized variant (e.g. for indirect operands),
+// in which case the table entry must be used.
+instr_func select_specialized_impl(const Instruction *instr, VMVerifyLevel verified = VERIFIED_NONE);
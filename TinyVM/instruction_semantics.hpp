@@ -0,0 +1,481 @@
+#pragma once
+
+// Instruction semantics shared by all execution engines.
+// Everything in here is inline, so engines that dispatch on their own
+// can fold the implementations directly into their run loop.
+
+#include "instruction.hpp"
+#include "vm.hpp"
+#include "block.hpp"
+
+#include <cstring>
+
+// Addressing mode template argument meaning "read the mode from the instruction at runtime"
+const int AM_DYNAMIC = 0;
+
+// Bits of a mode template argument that hold the addressing mode, the ones above
+// tell variants for verified code which runtime checks to leave out (see vm_verify)
+const int AM_MODE_BITS = 0xff;
+// Register operands are valid and memory operands inside memory
+const int AM_VERIFIED = 0x100;
+// Added to the mode of a: the stack can neither overflow nor underflow here
+const int AM_VERIFIED_STACK = 0x200;
+
+// Implementations are templates over the addressing modes of their operands.
+// The default instantiation handles every mode at runtime, the others have the
+// mode checks resolved at compile time (see select_specialized_impl).
+#define IMPL_NAME(name) op_##name##_impl
+#define INSTRUCTION_IMPL(name) \
+    template<int MA = AM_DYNAMIC, int MB = AM_DYNAMIC, int MC = AM_DYNAMIC> \
+    inline void IMPL_NAME(name)(VMContext *ctx, const Instruction *instr)
+// Same for instructions without operands
+#define INSTRUCTION_IMPL_NO_OPERANDS(name) \
+    template<int MA = AM_DYNAMIC, int MB = AM_DYNAMIC, int MC = AM_DYNAMIC> \
+    inline void IMPL_NAME(name)(VMContext *ctx, const Instruction*)
+
+////////
+// Stack helper functions
+////////
+
+inline vmword* stack_top(VMContext *ctx)
+{
+    auto sp = ctx->registers[SP];
+    if (sp == static_cast<vmword>(-1))
+        sp++;
+    auto top = ctx->memory + vm_bound(ctx, ctx->registers[SBP] - sp);
+    return top;
+}
+
+template<bool Checked = true>
+inline vmword* stack_inc(VMContext *ctx)
+{
+    if (Checked && ctx->registers[SP] >= ctx->registers[SBP])
+        vm_trap(ctx, TRAP_STACK_OVERFLOW);
+    ctx->registers[SP]++;
+    return stack_top(ctx);
+}
+
+template<bool Checked = true>
+inline vmword* stack_dec(VMContext *ctx)
+{
+    if (Checked && ctx->registers[SP] <= 0)
+        vm_trap(ctx, TRAP_STACK_UNDERFLOW);
+    ctx->registers[SP]--;
+    return stack_top(ctx);
+}
+
+template<bool Checked = true>
+inline void stack_push(VMContext *ctx, vmword word)
+{
+    auto top = stack_inc<Checked>(ctx);
+    *top = word;
+    vm_invalidate(ctx, top - ctx->memory);
+}
+
+template<bool Checked = true>
+inline vmword stack_pop(VMContext *ctx)
+{
+    auto word = *stack_top(ctx);
+    stack_dec<Checked>(ctx);
+    return word;
+}
+
+////////
+// Control flow helper functions
+////////
+
+// Continue at target. Backward jumps end the run if its budget is used up.
+inline void jump_to(VMContext *ctx, vmword target)
+{
+    if (target < ctx->registers[IP])
+        vm_check_budget(ctx);
+    ctx->registers[IP] = target;
+}
+
+////////
+// Block helper functions
+////////
+
+// The count words starting at address. Traps unless all of them are inside memory.
+inline vmword* block_at(VMContext *ctx, vmword address, vmword count)
+{
+    if (address > ctx->memory_size || count > ctx->memory_size - address)
+        vm_trap(ctx, TRAP_OUT_OF_RANGE);
+    return ctx->memory + address;
+}
+
+// Same as block_at for words that are about to be written
+inline vmword* block_write_at(VMContext *ctx, vmword address, vmword count)
+{
+    auto block = block_at(ctx, address, count);
+    vm_invalidate_range(ctx, address, count);
+    return block;
+}
+
+////////
+// Operand helper functions
+////////
+
+enum OperandIndex
+{
+    O_A = 0,
+    O_B = 1,
+    O_C = 2,
+};
+
+// Whether stack operations of an instruction whose a has Mode check the stack pointer
+template<int Mode>
+constexpr bool stack_checked()
+{
+    return (Mode & AM_VERIFIED_STACK) == 0;
+}
+
+// The register operand names. Traps if there is no such register, unless verified.
+template<int Mode>
+inline vmword* register_at(VMContext *ctx, vmword operand)
+{
+    if (!(Mode & AM_VERIFIED) && operand >= VM_REGISTER_COUNT)
+        vm_trap(ctx, TRAP_INVALID_OPERAND);
+    return ctx->registers + operand;
+}
+
+// The memory word a memory operand names, out-of-range ones hit the guard area unless verified
+template<int Mode>
+inline vmword* memory_at(VMContext *ctx, vmword operand)
+{
+    return ctx->memory + ((Mode & AM_VERIFIED) ? operand : vm_bound(ctx, operand));
+}
+
+// Assign value to location operand at Index position points to. Does not support literal operands.
+// Mode is the operand's addressing mode if known at compile time, AM_DYNAMIC otherwise.
+template<OperandIndex Index, int Mode = AM_DYNAMIC>
+void operand_assign_at(VMContext *ctx, const Instruction *instr, vmword value)
+{
+    static_assert(Index < 3, "Operand index must be less than 3.");
+
+    auto operand = instr->operands[Index];
+    auto mode = (Mode & AM_MODE_BITS) == AM_DYNAMIC ? instr->addressing[Index] : Mode & AM_MODE_BITS;
+
+    if (mode & AM_LITERAL)
+        vm_trap(ctx, TRAP_INVALID_OPERAND);
+
+    vmword *target;
+    if (mode & AM_REGISTER)
+        target = register_at<Mode>(ctx, operand);
+    else if (mode & AM_MEMORY)
+        target = memory_at<Mode>(ctx, operand);
+    else
+        vm_trap(ctx, TRAP_INVALID_OPERAND);
+
+    if (mode & AM_INDIRECT)
+        target = (ctx->memory + vm_bound(ctx, *target));
+
+    *target = value;
+    if (mode & (AM_MEMORY | AM_INDIRECT))
+        vm_invalidate(ctx, target - ctx->memory);
+}
+
+// Fetch operand value at Index position, following indirections
+// Mode is the operand's addressing mode if known at compile time, AM_DYNAMIC otherwise.
+template<OperandIndex Index, int Mode = AM_DYNAMIC>
+vmword operand_fetch(VMContext *ctx, const Instruction *instr)
+{
+    static_assert(Index < 3, "Operand index must be less than 3.");
+
+    auto operand = instr->operands[Index];
+    auto mode = (Mode & AM_MODE_BITS) == AM_DYNAMIC ? instr->addressing[Index] : Mode & AM_MODE_BITS;
+
+    vmword value;
+    if (mode & AM_LITERAL)
+        value = operand;
+    else if (mode & AM_MEMORY)
+        value = *memory_at<Mode>(ctx, operand);
+    else if (mode & AM_REGISTER)
+        value = *register_at<Mode>(ctx, operand);
+    else
+        vm_trap(ctx, TRAP_INVALID_OPERAND);
+
+    if (mode & AM_INDIRECT)
+        value = ctx->memory[vm_bound(ctx, value)];
+
+    return value;
+}
+
+////////
+// Instruction implementations
+////////
+
+// Doesn't touch ctx either
+template<int MA = AM_DYNAMIC, int MB = AM_DYNAMIC, int MC = AM_DYNAMIC>
+inline void IMPL_NAME(nop)(VMContext*, const Instruction*)
+{
+
+}
+
+INSTRUCTION_IMPL_NO_OPERANDS(halt)
+{
+    ctx->running = false;
+}
+
+INSTRUCTION_IMPL(push)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    stack_push<stack_checked<MA>()>(ctx, a);
+}
+
+INSTRUCTION_IMPL(pop)
+{
+    auto val = stack_pop<stack_checked<MA>()>(ctx);
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(add)
+{
+    // TODO: operate on signed value here?
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto val = b + c;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(sub)
+{
+    // TODO: operate on signed value here?
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto val = b - c;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(mul)
+{
+    // TODO: operate on signed value here?
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto val = b * c;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(div)
+{
+    // TODO: operate on signed value here?
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    if (c == 0)
+        vm_trap(ctx, TRAP_DIVIDE_BY_ZERO);
+    auto val = b / c;
+    auto rem = b % c;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+    ctx->registers[RMD] = rem;
+}
+
+INSTRUCTION_IMPL(shl)
+{
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto val = b << c;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(shr)
+{
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto val = b >> c;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(mod)
+{
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    if (c == 0)
+        vm_trap(ctx, TRAP_DIVIDE_BY_ZERO);
+    auto rem = b % c;
+    operand_assign_at<O_A, MA>(ctx, instr, rem);
+}
+
+INSTRUCTION_IMPL(inc)
+{
+    // TODO: operate on signed value here?
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto val = a + 1;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(dec)
+{
+    // TODO: operate on signed value here?
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto val = a - 1;
+    operand_assign_at<O_A, MA>(ctx, instr, val);
+}
+
+INSTRUCTION_IMPL(not)
+{
+    // TODO: operate on signed value here?
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto na = ~a;
+    operand_assign_at<O_A, MA>(ctx, instr, na);
+}
+
+INSTRUCTION_IMPL(cmp)
+{
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    vmword result;
+    if (c < b)
+        result = (vmword)-1;
+    else if (c > b)
+        result = 1;
+    else
+        result = 0;
+    operand_assign_at<O_A, MA>(ctx, instr, result);
+}
+
+INSTRUCTION_IMPL(mov)
+{
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    operand_assign_at<O_A, MA>(ctx, instr, b);
+}
+
+INSTRUCTION_IMPL(call)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    stack_push<stack_checked<MA>()>(ctx, ctx->registers[IP]);
+    ctx->registers[IP] = a;
+    vm_check_budget(ctx);
+}
+
+INSTRUCTION_IMPL_NO_OPERANDS(ret)
+{
+    auto ip = stack_pop<stack_checked<MA>()>(ctx);
+    ctx->registers[IP] = ip;
+}
+
+INSTRUCTION_IMPL(jmp)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    jump_to(ctx, a);
+}
+
+INSTRUCTION_IMPL(jeq)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    if (b == c)
+        jump_to(ctx, a);
+}
+
+INSTRUCTION_IMPL(jne)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    if (b != c)
+        jump_to(ctx, a);
+}
+
+INSTRUCTION_IMPL(jnz)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    if (b != 0)
+        jump_to(ctx, a);
+}
+
+INSTRUCTION_IMPL(rdrand)
+{
+    auto min = operand_fetch<O_B, MB>(ctx, instr);
+    auto max = operand_fetch<O_C, MC>(ctx, instr);
+    auto value = min == 0 && max == 0 ? vm_rng_next(ctx->rng) : vm_rng_range(ctx->rng, min, max);
+    operand_assign_at<O_A, MA>(ctx, instr, value);
+}
+
+INSTRUCTION_IMPL(syscall)
+{
+    vm_syscall(ctx, operand_fetch<O_A, MA>(ctx, instr));
+}
+
+// Block instructions, a is the address of the target block, b the address of the
+// source block (or a value) and c the number of words
+
+template<int MA, int MB, int MC>
+inline void block_elementwise(VMContext *ctx, const Instruction *instr, void (*kernel)(vmword*, const vmword*, size_t))
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto src = block_at(ctx, b, c);
+    kernel(block_write_at(ctx, a, c), src, c);
+}
+
+INSTRUCTION_IMPL(vadd)
+{
+    block_elementwise<MA, MB, MC>(ctx, instr, vm_block->add_words);
+}
+
+INSTRUCTION_IMPL(vsub)
+{
+    block_elementwise<MA, MB, MC>(ctx, instr, vm_block->sub_words);
+}
+
+INSTRUCTION_IMPL(vmul)
+{
+    block_elementwise<MA, MB, MC>(ctx, instr, vm_block->mul_words);
+}
+
+INSTRUCTION_IMPL(vxor)
+{
+    block_elementwise<MA, MB, MC>(ctx, instr, vm_block->xor_words);
+}
+
+INSTRUCTION_IMPL(vfill)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    vm_block->fill_words(block_write_at(ctx, a, c), b, c);
+}
+
+INSTRUCTION_IMPL(vcopy)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    auto src = block_at(ctx, b, c);
+    memmove(block_write_at(ctx, a, c), src, c * sizeof(vmword));
+}
+
+// Reductions store the result of kernel over the block at b into a
+template<int MA, int MB, int MC>
+inline void block_reduce(VMContext *ctx, const Instruction *instr, vmword (*kernel)(const vmword*, size_t))
+{
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    operand_assign_at<O_A, MA>(ctx, instr, kernel(block_at(ctx, b, c), c));
+}
+
+INSTRUCTION_IMPL(vsum)
+{
+    block_reduce<MA, MB, MC>(ctx, instr, vm_block->sum_words);
+}
+
+INSTRUCTION_IMPL(vmin)
+{
+    block_reduce<MA, MB, MC>(ctx, instr, vm_block->min_words);
+}
+
+INSTRUCTION_IMPL(vmax)
+{
+    block_reduce<MA, MB, MC>(ctx, instr, vm_block->max_words);
+}
+
+INSTRUCTION_IMPL(vcount)
+{
+    auto a = operand_fetch<O_A, MA>(ctx, instr);
+    auto b = operand_fetch<O_B, MB>(ctx, instr);
+    auto c = operand_fetch<O_C, MC>(ctx, instr);
+    operand_assign_at<O_A, MA>(ctx, instr, vm_block->count_words(block_at(ctx, b, c), a, c));
+}
@@ -1,34 +1,248 @@
 #include "instruction_support.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <cstdio>
+#include <utility>
+#include <vector>
 
 #include "vm.hpp"
+#include "platform.hpp"
+
+namespace
+{
+    ////////
+    // Sectioned images
+    ////////
+
+    // Zero runs shorter than this are cheaper to store than to start a new segment for
+    const size_t SEGMENT_GAP_WORDS = 2;
+
+    // Words of a compact section of length bytes, without its header
+    size_t compact_section_words(vmword length)
+    {
+        return length / sizeof(vmword) + (length % sizeof(vmword) != 0);
+    }
+
+    // Check that the length bytes at code are exactly count compact instructions
+    bool compact_code_valid(const uint8_t *code, vmword length, vmword count)
+    {
+        vmword pos = 0;
+        for (vmword i = 0; i < count; i++)
+        {
+            Instruction instr;
+            auto size = vmi_decode_compact(code + pos, length - pos, &instr);
+            if (size == 0)
+                return false;
+            pos += size;
+        }
+        return pos == length;
+    }
+
+    bool load_sectioned_image(const vmword *words, size_t nwords, VMContext *ctx)
+    {
+        if (nwords < VMI_IMAGE_HEADER_WORDS || words[0] != VMI_IMAGE_MAGIC)
+            return false;
+        auto flags = words[1];
+        auto count = words[4];
+
+        // Validate everything before touching ctx
+        size_t pos = VMI_IMAGE_HEADER_WORDS;
+        for (vmword i = 0; i < count; i++)
+        {
+            if (nwords - pos < 2)
+                return false;
+            auto base = words[pos];
+            auto length = words[pos + 1];
+            pos += 2;
+            if (base > ctx->memory_size || length > ctx->memory_size - base || length > nwords - pos)
+                return false;
+            pos += length;
+        }
+        auto compact_pos = pos;
+        vmword compact_count = 0;
+        // vm_compact_load keeps all sections in one buffer addressed by 32-bit offsets
+        size_t compact_bytes = 0;
+        if (flags & IF_COMPACT)
+        {
+            if (pos >= nwords)
+                return false;
+            compact_count = words[pos++];
+            compact_pos = pos;
+            for (vmword i = 0; i < compact_count; i++)
+            {
+                if (nwords - pos < 3)
+                    return false;
+                auto base = words[pos];
+                auto instructions = words[pos + 1];
+                auto length = words[pos + 2];
+                pos += 3;
+                if (compact_section_words(length) > nwords - pos)
+                    return false;
+                if (base % 4 != 0 || base > ctx->memory_size || instructions > (ctx->memory_size - base) / 4
+                    || !compact_code_valid(reinterpret_cast<const uint8_t*>(words + pos), length, instructions))
+                    return false;
+                if (length >= VM_COMPACT_NONE - compact_bytes)
+                    return false;
+                compact_bytes += length;
+                pos += compact_section_words(length);
+            }
+        }
+
+        auto memory = plat_map_memory(ctx->memory_size);
+        if (memory == nullptr)
+            return false;
+        pos = VMI_IMAGE_HEADER_WORDS;
+        for (vmword i = 0; i < count; i++)
+        {
+            auto base = words[pos];
+            auto length = words[pos + 1];
+            memcpy(memory + base, words + pos + 2, length * sizeof(vmword));
+            pos += 2 + length;
+        }
+        vm_replace_memory(ctx, memory, &plat_unmap_memory);
+        pos = compact_pos;
+        for (vmword i = 0; i < compact_count; i++)
+        {
+            auto length = words[pos + 2];
+            auto code = reinterpret_cast<const uint8_t*>(words + pos + 3);
+            // Can't fail after the checks above, but never report half-installed code as loaded
+            if (!vm_compact_load(ctx, words[pos], code, length, words[pos + 1]))
+                return false;
+            pos += 3 + compact_section_words(length);
+        }
+        if (flags & IF_ENTRY)
+            vm_init_programbase(ctx, words[2]);
+        if (flags & IF_STACK)
+            vm_init_stack(ctx, words[3]);
+        return true;
+    }
+
+    bool write_words(FILE *fp, const vmword *words, size_t count)
+    {
+        return fwrite(words, sizeof(vmword), count, fp) == count;
+    }
+}
 
 void vmi_load_memory_image(const void *data, VMContext *ctx)
 {
-    memcpy(ctx->memory, data, sizeof(ctx->memory));
+    memcpy(ctx->memory, data, std::min(VM_MEMORY_SIZE, ctx->memory_size) * sizeof(vmword));
+    vm_invalidate_all(ctx);
+}
+
+bool vmi_load_image(const void *data, size_t size, VMContext *ctx)
+{
+    if (size == VM_MEMORY_SIZE * sizeof(vmword))
+    {
+        // Only treat this as a sectioned image if it starts with the magic and parses as one
+        if (!load_sectioned_image(static_cast<const vmword*>(data), size / sizeof(vmword), ctx))
+            vmi_load_memory_image(data, ctx);
+        return true;
+    }
+    if (size % sizeof(vmword) != 0)
+        return false;
+    return load_sectioned_image(static_cast<const vmword*>(data), size / sizeof(vmword), ctx);
 }
 
 bool vmi_load_memory_image_file(const char *filename, VMContext *ctx)
 {
-    auto fp = fopen(filename, "r");
+    auto fp = fopen(filename, "rb");
     if (fp == nullptr)
         return false;
-    auto read = fread(ctx->memory, sizeof(vmword), VM_MEMORY_SIZE, fp);
-    fclose(fp);
-    if (read == VM_MEMORY_SIZE)
-        return true;
+    vmword magic = 0;
+    fread(&magic, sizeof(magic), 1, fp);
+    if (magic == VMI_IMAGE_MAGIC)
+    {
+        // Sectioned images are small, just read them
+        fseek(fp, 0, SEEK_END);
+        auto size = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        std::vector<vmword> words(size / sizeof(vmword));
+        auto read = fread(words.data(), sizeof(vmword), words.size(), fp);
+        fclose(fp);
+        if (size % sizeof(vmword) == 0 && read == words.size()
+            && load_sectioned_image(words.data(), words.size(), ctx))
+            return true;
+    }
     else
+        fclose(fp);
+
+    size_t file_size;
+    auto memory = plat_map_file(filename, ctx->memory_size, &file_size);
+    if (memory == nullptr)
         return false;
+    if (file_size != VM_MEMORY_SIZE * sizeof(vmword))
+    {
+        plat_unmap_memory(memory, ctx->memory_size);
+        return false;
+    }
+    vm_replace_memory(ctx, memory, &plat_unmap_memory);
+    return true;
+}
+
+void vmi_adopt_memory_image(vmword *data, VMContext *ctx)
+{
+    vm_replace_memory(ctx, data, nullptr);
 }
 
 bool vmi_save_memory_image_file(const char *filename, const VMContext *ctx)
 {
-    auto fp = fopen(filename, "w");
+    // Find runs of non-zero words, merging runs separated by short gaps
+    std::vector<std::pair<size_t, size_t>> segments;
+    auto memory = ctx->memory;
+    auto size = ctx->memory_size;
+    auto chunk = plat_memory_chunk_words();
+    size_t addr = 0;
+    while (addr < size)
+    {
+        // Skip memory that was never touched without reading (and thus committing) it
+        if (addr % chunk == 0 && !plat_memory_chunk_committed(memory, size, addr))
+        {
+            addr += chunk;
+            continue;
+        }
+        if (memory[addr] == 0)
+        {
+            addr++;
+            continue;
+        }
+        auto base = addr;
+        auto end = addr + 1;
+        for (addr = end; addr < size && addr - end <= SEGMENT_GAP_WORDS; addr++)
+        {
+            if (memory[addr] != 0)
+                end = addr + 1;
+        }
+        segments.emplace_back(base, end - base);
+        addr = end;
+    }
+
+    auto fp = fopen(filename, "wb");
+    if (fp == nullptr)
+        return false;
+    vmword header[VMI_IMAGE_HEADER_WORDS] = { VMI_IMAGE_MAGIC, IF_ENTRY | IF_STACK,
+        ctx->registers[IP], ctx->registers[SBP], segments.size() };
+    bool ok = write_words(fp, header, VMI_IMAGE_HEADER_WORDS);
+    for (auto &segment : segments)
+    {
+        vmword segment_header[2] = { segment.first, segment.second };
+        ok = ok && write_words(fp, segment_header, 2);
+        ok = ok && write_words(fp, memory + segment.first, segment.second);
+    }
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+bool vmi_save_flat_memory_image_file(const char *filename, const VMContext *ctx)
+{
+    auto fp = fopen(filename, "wb");
     if (fp == nullptr)
         return false;
-    auto written = fwrite(ctx->memory, sizeof(vmword), VM_MEMORY_SIZE, fp);
+    auto count = std::min(VM_MEMORY_SIZE, ctx->memory_size);
+    auto written = fwrite(ctx->memory, sizeof(vmword), count, fp);
+    // Smaller memories are padded to the full image size
+    std::vector<vmword> padding(VM_MEMORY_SIZE - count);
+    written += fwrite(padding.data(), sizeof(vmword), padding.size(), fp);
     fclose(fp);
     if (written == VM_MEMORY_SIZE)
         return true;
@@ -39,7 +253,7 @@ bool vmi_save_memory_image_file(const char *filename, const VMContext *ctx)
 // Make a nullary instruction
 Instruction vmi_make_instr_0(Opcode opcode, OpcodeFlags flags)
 {
-	return Instruction{ opcode, flags };
+	return Instruction{ opcode, flags, {}, {} };
 }
 
 InstructionData vmi_encode_instr_0(Opcode opcode, OpcodeFlags flags)
@@ -52,7 +266,7 @@ InstructionData vmi_encode_instr_0(Opcode opcode, OpcodeFlags flags)
 Instruction vmi_make_instr_1(Opcode opcode, OpcodeFlags flags,
 	AddressingMode am0, vmword op0)
 {
-	Instruction instr{ opcode, flags };
+	Instruction instr{ opcode, flags, {}, {} };
 	instr.addressing[0] = am0;
 	instr.operands[0] = op0;
 	return instr;
@@ -70,7 +284,7 @@ Instruction vmi_make_instr_2(Opcode opcode, OpcodeFlags flags,
 	AddressingMode am0, vmword op0,
 	AddressingMode am1, vmword op1)
 {
-	Instruction instr{ opcode, flags };
+	Instruction instr{ opcode, flags, {}, {} };
 	instr.addressing[0] = am0;
 	instr.addressing[1] = am1;
 	instr.operands[0] = op0;
@@ -92,7 +306,7 @@ Instruction vmi_make_instr_3(Opcode opcode, OpcodeFlags flags,
 	AddressingMode am1, vmword op1,
 	AddressingMode am2, vmword op2)
 {
-	Instruction instr{ opcode, flags };
+	Instruction instr{ opcode, flags, {}, {} };
 	instr.addressing[0] = am0;
 	instr.addressing[1] = am1;
 	instr.addressing[2] = am2;
@@ -5,16 +5,51 @@
 // Forward-declare VMContext
 struct VMContext;
 
-// Load a memory image (VM_MEMORY_SIZE vmwords) from a memory location or a file
-// Exactly VM_MEMORY_SIZE * sizeof(vmword) bytes will be read
-// vmi_load_memory_image_file returns true if successful in loading the file, false otherwise
+// Sectioned image format. Everything is a vmword in native byte order (like flat images):
+//   magic, flags, entry point, stack size, segment count,
+//   then per segment: base address, length in words, followed by length words of data.
+// Memory not covered by any segment is zero. Entry point and stack size are only
+// applied if the corresponding flag is set.
+// With IF_COMPACT, the segments are followed by a section count and per section:
+// base address (4-word-aligned), instruction count, length in bytes, followed by the
+// compact instructions (see vmi_encode_compact), padded with zeroes to whole words.
+// Sections are loaded with vm_compact_load after the segments.
+const vmword VMI_IMAGE_MAGIC = 0x0100474D494D5654ULL; // "TVMIMG\0\1"
+const vmword VMI_IMAGE_HEADER_WORDS = 5;
+enum ImageFlags : vmword
+{
+    IF_ENTRY = 1 << 0, // Set IP to the entry point
+    IF_STACK = 1 << 1, // Initialize the stack with the stack size
+    IF_COMPACT = 1 << 2, // Compact code sections follow the segments
+};
+
+// Load a flat memory image (VM_MEMORY_SIZE vmwords) from a memory location
+// Only the part that fits is loaded into smaller memories, the rest of larger ones is left alone
 void vmi_load_memory_image(const void *data, VMContext *ctx);
+
+// Load an image of size bytes at data, which is either a sectioned or a flat image
+// Returns false if data is neither, in which case ctx is left untouched
+bool vmi_load_image(const void *data, size_t size, VMContext *ctx);
+
+// Load a sectioned or flat image from a file
+// Flat images are not read up front but mapped copy-on-write, so pages are loaded as they are used
+// Returns true if successful in loading the file, false otherwise
 bool vmi_load_memory_image_file(const char *filename, VMContext *ctx);
 
-// Save content of ctx's memory to file
+// Use a memory image of ctx->memory_size vmwords in place as ctx's memory, without copying it.
+// The buffer must stay valid until ctx is destroyed or its memory is replaced, and must
+// have room for PLAT_MEMORY_GUARD_WORDS more words that out-of-range accesses may hit.
+void vmi_adopt_memory_image(vmword *data, VMContext *ctx);
+
+// Save content of ctx's memory to file as a sectioned image, with IP as entry point
+// and SBP as stack size. Only the non-zero parts of memory are written.
 // Return true in case of success, false otherwise
 bool vmi_save_memory_image_file(const char *filename, const VMContext *ctx);
 
+// Save content of ctx's memory to file as a flat image of VM_MEMORY_SIZE vmwords
+// Return true in case of success, false otherwise
+bool vmi_save_flat_memory_image_file(const char *filename, const VMContext *ctx);
+
 // Make a nullary instruction
 Instruction vmi_make_instr_0(Opcode opcode, OpcodeFlags flags = OF_NORMAL);
 InstructionData vmi_encode_instr_0(Opcode opcode, OpcodeFlags flags = OF_NORMAL);
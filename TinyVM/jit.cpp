@@ -0,0 +1,791 @@
+#include "jit.hpp"
+
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+#include "vm.hpp"
+#include "platform.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define TVM_JIT_X64 1
+#else
+#define TVM_JIT_X64 0
+#endif
+
+// Signature of a compiled block. A block runs until one of its exits and leaves
+// IP and IC exactly where the interpreter would have left them.
+typedef void (*jit_block)(vmword *registers, vmword *memory);
+
+struct JitState
+{
+    uint8_t *code;
+    size_t code_used;
+
+    // Compiled block starting at each instruction slot, if any. Both tables are
+    // mapped lazily, so only the parts of memory that run code take up space.
+    jit_block *blocks;
+    // Number of times the interpreter reached each slot, saturating after JIT_HOT_THRESHOLD
+    uint8_t *heat;
+    size_t slots;
+    // Slots marked jit_covered in ctx->predecoded
+    std::vector<size_t> covered;
+};
+
+namespace
+{
+    const size_t JIT_CODE_SIZE = 16 * 1024 * 1024;
+    // Upper bound for the size of one compiled block
+    const size_t JIT_MAX_BLOCK_BYTES = 64 * 1024;
+    const size_t JIT_MAX_BLOCK_INSTRUCTIONS = 64;
+    // Number of times a slot has to be reached before it is compiled
+    const uint8_t JIT_HOT_THRESHOLD = 16;
+    // Memory operands are encoded as 32-bit displacements
+    const vmword JIT_MAX_MEMORY_OPERAND = 0x7fffffff / sizeof(vmword);
+
+#if TVM_JIT_X64
+    enum HostRegister
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15,
+        NO_REGISTER = -1,
+    };
+
+    enum Condition
+    {
+        CC_B  = 0x2,
+        CC_E  = 0x4,
+        CC_NE = 0x5,
+        CC_A  = 0x7,
+    };
+
+    // Register conventions inside a block:
+    //   rdi - guest register file, rsi - guest memory
+    //   rax, rcx, rdx - scratch
+    //   everything in PIN_REGISTERS - general-purpose guest registers used by the block
+    const HostRegister REGISTER_BASE = RDI;
+    const HostRegister MEMORY_BASE = RSI;
+    const HostRegister PIN_REGISTERS[] = { R8, R9, R10, R11, RBX, RBP, R12, R13, R14, R15 };
+    const size_t PIN_REGISTER_COUNT = sizeof(PIN_REGISTERS) / sizeof(PIN_REGISTERS[0]);
+
+    bool is_callee_saved(HostRegister reg)
+    {
+        return reg == RBX || reg == RBP || reg >= R12;
+    }
+
+    ////////
+    // Machine code emitter, covering exactly the x86-64 instructions the compiler needs
+    ////////
+
+    class Emitter
+    {
+    public:
+        Emitter(uint8_t *buffer, size_t capacity)
+            : buffer(buffer), capacity(capacity)
+        { }
+
+        size_t position() const { return pos; }
+        bool overflowed() const { return pos > capacity; }
+
+        // mov dst, src
+        void mov(HostRegister dst, HostRegister src)
+        {
+            rex(src, dst);
+            byte(0x89);
+            modrm_reg(src, dst);
+        }
+
+        // mov dst, [base + disp]
+        void load(HostRegister dst, HostRegister base, int32_t disp)
+        {
+            rex(dst, base);
+            byte(0x8B);
+            modrm_mem(dst, base, disp);
+        }
+
+        // mov [base + disp], src
+        void store(HostRegister base, int32_t disp, HostRegister src)
+        {
+            rex(src, base);
+            byte(0x89);
+            modrm_mem(src, base, disp);
+        }
+
+        // mov qword [base + disp], imm32 (sign-extended)
+        void store_imm(HostRegister base, int32_t disp, int32_t imm)
+        {
+            rex(RAX, base);
+            byte(0xC7);
+            modrm_mem(RAX, base, disp);
+            dword(static_cast<uint32_t>(imm));
+        }
+
+        // add qword [base + disp], imm32
+        void add_mem_imm(HostRegister base, int32_t disp, int32_t imm)
+        {
+            rex(RAX, base);
+            byte(0x81);
+            modrm_mem(RAX, base, disp);
+            dword(static_cast<uint32_t>(imm));
+        }
+
+        // mov dst, imm
+        void mov_imm(HostRegister dst, uint64_t imm)
+        {
+            if (imm <= UINT32_MAX)
+            {
+                // mov r32, imm32 zero-extends into the full register
+                if (dst >= R8)
+                    byte(0x41);
+                byte(0xB8 + (dst & 7));
+                dword(static_cast<uint32_t>(imm));
+            }
+            else
+            {
+                rex(RAX, dst);
+                byte(0xB8 + (dst & 7));
+                qword(imm);
+            }
+        }
+
+        void add(HostRegister dst, HostRegister src) { alu(0x01, dst, src); }
+        void sub(HostRegister dst, HostRegister src) { alu(0x29, dst, src); }
+        void cmp(HostRegister dst, HostRegister src) { alu(0x39, dst, src); }
+        void test(HostRegister dst, HostRegister src) { alu(0x85, dst, src); }
+
+        // cmp dst, [base + disp]
+        void cmp_mem(HostRegister dst, HostRegister base, int32_t disp)
+        {
+            rex(dst, base);
+            byte(0x3B);
+            modrm_mem(dst, base, disp);
+        }
+
+        // xor dst32, dst32
+        void zero(HostRegister dst)
+        {
+            if (dst >= R8)
+                byte(0x45);
+            byte(0x31);
+            modrm_reg(dst, dst);
+        }
+
+        // imul dst, src
+        void imul(HostRegister dst, HostRegister src)
+        {
+            rex(dst, src);
+            byte(0x0F);
+            byte(0xAF);
+            modrm_reg(dst, src);
+        }
+
+        void div(HostRegister src) { group(0xF7, 6, src); }
+        void not_(HostRegister dst) { group(0xF7, 2, dst); }
+        void inc(HostRegister dst) { group(0xFF, 0, dst); }
+        void dec(HostRegister dst) { group(0xFF, 1, dst); }
+        void shl_cl(HostRegister dst) { group(0xD3, 4, dst); }
+        void shr_cl(HostRegister dst) { group(0xD3, 5, dst); }
+
+        // setcc dst8, only for al, cl, dl and bl
+        void setcc(Condition cc, HostRegister dst)
+        {
+            byte(0x0F);
+            byte(0x90 + cc);
+            modrm_reg(RAX, dst);
+        }
+
+        // movzx dst, src8
+        void movzx8(HostRegister dst, HostRegister src)
+        {
+            rex(dst, src);
+            byte(0x0F);
+            byte(0xB6);
+            modrm_reg(dst, src);
+        }
+
+        void push(HostRegister reg)
+        {
+            if (reg >= R8)
+                byte(0x41);
+            byte(0x50 + (reg & 7));
+        }
+
+        void pop(HostRegister reg)
+        {
+            if (reg >= R8)
+                byte(0x41);
+            byte(0x58 + (reg & 7));
+        }
+
+        void ret() { byte(0xC3); }
+
+        // jcc rel32, returns the location of the displacement for patch()
+        size_t jcc(Condition cc)
+        {
+            byte(0x0F);
+            byte(0x80 + cc);
+            dword(0);
+            return pos - 4;
+        }
+
+        // jmp rel32, returns the location of the displacement for patch()
+        size_t jmp()
+        {
+            byte(0xE9);
+            dword(0);
+            return pos - 4;
+        }
+
+        // Point the jump with its displacement at location to target
+        void patch(size_t location, size_t target)
+        {
+            if (location + 4 > capacity)
+                return;
+            auto rel = static_cast<int32_t>(static_cast<int64_t>(target) - static_cast<int64_t>(location + 4));
+            memcpy(buffer + location, &rel, sizeof(rel));
+        }
+
+    private:
+        void byte(uint8_t b)
+        {
+            if (pos < capacity)
+                buffer[pos] = b;
+            pos++;
+        }
+
+        void dword(uint32_t d)
+        {
+            for (int i = 0; i < 4; i++)
+                byte(static_cast<uint8_t>(d >> (8 * i)));
+        }
+
+        void qword(uint64_t q)
+        {
+            for (int i = 0; i < 8; i++)
+                byte(static_cast<uint8_t>(q >> (8 * i)));
+        }
+
+        // REX.W prefix for an instruction with the given ModRM reg and rm fields
+        void rex(HostRegister reg, HostRegister rm)
+        {
+            byte(0x48 | ((reg >> 3) << 2) | (rm >> 3));
+        }
+
+        void modrm_reg(HostRegister reg, HostRegister rm)
+        {
+            byte(0xC0 | ((reg & 7) << 3) | (rm & 7));
+        }
+
+        // [base + disp32]; base must not be rsp or r12, which would need a SIB byte
+        void modrm_mem(HostRegister reg, HostRegister base, int32_t disp)
+        {
+            byte(0x80 | ((reg & 7) << 3) | (base & 7));
+            dword(static_cast<uint32_t>(disp));
+        }
+
+        void alu(uint8_t opcode, HostRegister dst, HostRegister src)
+        {
+            rex(src, dst);
+            byte(opcode);
+            modrm_reg(src, dst);
+        }
+
+        void group(uint8_t opcode, int extension, HostRegister rm)
+        {
+            rex(static_cast<HostRegister>(extension), rm);
+            byte(opcode);
+            modrm_reg(static_cast<HostRegister>(extension), rm);
+        }
+
+        uint8_t *buffer;
+        size_t capacity;
+        size_t pos = 0;
+    };
+
+    ////////
+    // Block compiler
+    ////////
+
+    int32_t register_offset(vmword reg)
+    {
+        return static_cast<int32_t>(reg * sizeof(vmword));
+    }
+
+    // VMContext::ic_limit, addressed relative to the registers
+    const int32_t IC_LIMIT_OFFSET = register_offset(VM_REGISTER_COUNT);
+    static_assert(offsetof(VMContext, ic_limit) == offsetof(VMContext, registers) + sizeof(vmword) * VM_REGISTER_COUNT,
+        "Compiled blocks expect ic_limit right after the registers.");
+
+    // IP and IC are kept exact by the block exits, so instructions must not touch them directly
+    bool is_compilable_register(vmword reg)
+    {
+        return reg < VM_REGISTER_COUNT && reg != IP && reg != IC;
+    }
+
+    bool is_source_compilable(AddressingMode mode, vmword operand, size_t memory_size)
+    {
+        switch (mode)
+        {
+        case AM_LITERAL:
+            return true;
+        case AM_MEMORY:
+            return operand < memory_size && operand <= JIT_MAX_MEMORY_OPERAND;
+        case AM_REGISTER:
+            return is_compilable_register(operand);
+        default:
+            return false;
+        }
+    }
+
+    // Compiled code never writes guest memory, so it can't invalidate itself
+    bool is_target_compilable(AddressingMode mode, vmword operand)
+    {
+        return mode == AM_REGISTER && is_compilable_register(operand);
+    }
+
+    bool is_compilable(const Instruction &instr, size_t memory_size)
+    {
+        auto &am = instr.addressing;
+        auto &op = instr.operands;
+        switch (instr.opcode)
+        {
+        case OP_NOP:
+            return true;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_MOD:
+        case OP_CMP:
+            return is_target_compilable(am[0], op[0])
+                && is_source_compilable(am[1], op[1], memory_size)
+                && is_source_compilable(am[2], op[2], memory_size);
+        case OP_INC:
+        case OP_DEC:
+        case OP_NOT:
+            return is_target_compilable(am[0], op[0]);
+        case OP_MOV:
+            return is_target_compilable(am[0], op[0])
+                && is_source_compilable(am[1], op[1], memory_size);
+        case OP_JMP:
+            return is_source_compilable(am[0], op[0], memory_size);
+        case OP_JNZ:
+            return is_source_compilable(am[0], op[0], memory_size)
+                && is_source_compilable(am[1], op[1], memory_size);
+        case OP_JEQ:
+        case OP_JNE:
+            return is_source_compilable(am[0], op[0], memory_size)
+                && is_source_compilable(am[1], op[1], memory_size)
+                && is_source_compilable(am[2], op[2], memory_size);
+        default:
+            return false;
+        }
+    }
+
+    bool is_branch(Opcode opcode)
+    {
+        return opcode == OP_JMP || opcode == OP_JEQ || opcode == OP_JNE || opcode == OP_JNZ;
+    }
+
+    bool writes_target(Opcode opcode)
+    {
+        return !is_branch(opcode) && opcode != OP_NOP;
+    }
+
+    class BlockCompiler
+    {
+    public:
+        BlockCompiler(vmword start, const std::vector<Instruction> &instrs, uint8_t *buffer, size_t capacity)
+            : start(start), instrs(instrs), emit(buffer, capacity)
+        {
+            for (auto &pin : pins)
+                pin = NO_REGISTER;
+            for (auto &flag : written)
+                flag = false;
+            assign_pins();
+        }
+
+        // Emit the block, returns its size in bytes or 0 if it didn't fit
+        size_t compile()
+        {
+            for (auto reg : saved)
+                emit.push(reg);
+            for (size_t reg = R0; reg <= R15; reg++)
+            {
+                if (pins[reg] != NO_REGISTER)
+                    emit.load(pins[reg], REGISTER_BASE, register_offset(reg));
+            }
+
+            loop_head = emit.position();
+            for (size_t k = 0; k < instrs.size(); k++)
+                compile_instruction(k);
+
+            if (instrs.back().opcode != OP_JMP)
+                emit_exit(instrs.size(), start + 4 * instrs.size());
+
+            return emit.overflowed() ? 0 : emit.position();
+        }
+
+    private:
+        // Pin the general-purpose registers used by the block, in order of first use
+        void assign_pins()
+        {
+            size_t next_pin = 0;
+            for (auto &instr : instrs)
+            {
+                for (size_t i = 0; i < 3; i++)
+                {
+                    auto reg = instr.operands[i];
+                    if (instr.addressing[i] != AM_REGISTER || reg > R15)
+                        continue;
+                    if (i == 0 && writes_target(instr.opcode))
+                        written[reg] = true;
+                    if (pins[reg] != NO_REGISTER || next_pin == PIN_REGISTER_COUNT)
+                        continue;
+                    pins[reg] = PIN_REGISTERS[next_pin++];
+                    if (is_callee_saved(pins[reg]))
+                        saved.push_back(pins[reg]);
+                }
+            }
+        }
+
+        void load_operand(HostRegister dst, AddressingMode mode, vmword operand)
+        {
+            if (mode == AM_LITERAL)
+                emit.mov_imm(dst, operand);
+            else if (mode == AM_MEMORY)
+                emit.load(dst, MEMORY_BASE, register_offset(operand));
+            else if (operand <= R15 && pins[operand] != NO_REGISTER)
+                emit.mov(dst, pins[operand]);
+            else
+                emit.load(dst, REGISTER_BASE, register_offset(operand));
+        }
+
+        void store_register(vmword reg, HostRegister src)
+        {
+            if (reg <= R15 && pins[reg] != NO_REGISTER)
+                emit.mov(pins[reg], src);
+            else
+                emit.store(REGISTER_BASE, register_offset(reg), src);
+        }
+
+        // Write back pinned registers, account for executed instructions, set IP and return.
+        // If ip_register is not NO_REGISTER, the new IP is taken from it instead of ip.
+        void emit_exit(size_t executed, vmword ip, HostRegister ip_register = NO_REGISTER)
+        {
+            for (size_t reg = R0; reg <= R15; reg++)
+            {
+                if (pins[reg] != NO_REGISTER && written[reg])
+                    emit.store(REGISTER_BASE, register_offset(reg), pins[reg]);
+            }
+            if (executed > 0)
+                emit.add_mem_imm(REGISTER_BASE, register_offset(IC), static_cast<int32_t>(executed));
+            if (ip_register != NO_REGISTER)
+                emit.store(REGISTER_BASE, register_offset(IP), ip_register);
+            else if (ip <= INT32_MAX)
+                emit.store_imm(REGISTER_BASE, register_offset(IP), static_cast<int32_t>(ip));
+            else
+            {
+                emit.mov_imm(RAX, ip);
+                emit.store(REGISTER_BASE, register_offset(IP), RAX);
+            }
+            for (auto it = saved.rbegin(); it != saved.rend(); ++it)
+                emit.pop(*it);
+            emit.ret();
+        }
+
+        // Leave the block (or loop back to its start) with the target in operand a of instr
+        void emit_jump(size_t executed, const Instruction &instr)
+        {
+            if (instr.addressing[0] == AM_LITERAL && instr.operands[0] == start)
+            {
+                // Loop until the budget of vm_run is used up, then leave at the start of the block
+                emit.add_mem_imm(REGISTER_BASE, register_offset(IC), static_cast<int32_t>(executed));
+                emit.load(RAX, REGISTER_BASE, register_offset(IC));
+                emit.cmp_mem(RAX, REGISTER_BASE, IC_LIMIT_OFFSET);
+                emit.patch(emit.jcc(CC_B), loop_head);
+                emit_exit(0, start);
+            }
+            else if (instr.addressing[0] == AM_LITERAL)
+                emit_exit(executed, instr.operands[0]);
+            else
+                emit_exit(executed, 0, RDX);
+        }
+
+        void compile_instruction(size_t k)
+        {
+            auto &instr = instrs[k];
+            auto &am = instr.addressing;
+            auto &op = instr.operands;
+            auto address = start + 4 * k;
+
+            switch (instr.opcode)
+            {
+            case OP_NOP:
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_SHL:
+            case OP_SHR:
+                load_operand(RAX, am[1], op[1]);
+                load_operand(RCX, am[2], op[2]);
+                if (instr.opcode == OP_ADD)
+                    emit.add(RAX, RCX);
+                else if (instr.opcode == OP_SUB)
+                    emit.sub(RAX, RCX);
+                else if (instr.opcode == OP_MUL)
+                    emit.imul(RAX, RCX);
+                else if (instr.opcode == OP_SHL)
+                    emit.shl_cl(RAX);
+                else
+                    emit.shr_cl(RAX);
+                store_register(op[0], RAX);
+                break;
+            case OP_DIV:
+            case OP_MOD:
+            {
+                load_operand(RAX, am[1], op[1]);
+                load_operand(RCX, am[2], op[2]);
+                // Leave division by zero to the interpreter
+                emit.test(RCX, RCX);
+                auto nonzero = emit.jcc(CC_NE);
+                emit_exit(k, address);
+                emit.patch(nonzero, emit.position());
+                emit.zero(RDX);
+                emit.div(RCX);
+                if (instr.opcode == OP_DIV)
+                {
+                    store_register(op[0], RAX);
+                    emit.store(REGISTER_BASE, register_offset(RMD), RDX);
+                }
+                else
+                    store_register(op[0], RDX);
+                break;
+            }
+            case OP_INC:
+            case OP_DEC:
+            case OP_NOT:
+                load_operand(RAX, am[0], op[0]);
+                if (instr.opcode == OP_INC)
+                    emit.inc(RAX);
+                else if (instr.opcode == OP_DEC)
+                    emit.dec(RAX);
+                else
+                    emit.not_(RAX);
+                store_register(op[0], RAX);
+                break;
+            case OP_CMP:
+                // a = (c > b) - (c < b)
+                load_operand(RAX, am[1], op[1]);
+                load_operand(RCX, am[2], op[2]);
+                emit.cmp(RCX, RAX);
+                emit.setcc(CC_A, RAX);
+                emit.setcc(CC_B, RDX);
+                emit.movzx8(RAX, RAX);
+                emit.movzx8(RDX, RDX);
+                emit.sub(RAX, RDX);
+                store_register(op[0], RAX);
+                break;
+            case OP_MOV:
+                load_operand(RAX, am[1], op[1]);
+                store_register(op[0], RAX);
+                break;
+            case OP_JMP:
+                if (am[0] != AM_LITERAL)
+                    load_operand(RDX, am[0], op[0]);
+                emit_jump(k + 1, instr);
+                break;
+            case OP_JEQ:
+            case OP_JNE:
+            case OP_JNZ:
+            {
+                if (am[0] != AM_LITERAL)
+                    load_operand(RDX, am[0], op[0]);
+                load_operand(RAX, am[1], op[1]);
+                size_t not_taken;
+                if (instr.opcode == OP_JNZ)
+                {
+                    emit.test(RAX, RAX);
+                    not_taken = emit.jcc(CC_E);
+                }
+                else
+                {
+                    load_operand(RCX, am[2], op[2]);
+                    emit.cmp(RAX, RCX);
+                    not_taken = emit.jcc(instr.opcode == OP_JEQ ? CC_NE : CC_E);
+                }
+                emit_jump(k + 1, instr);
+                emit.patch(not_taken, emit.position());
+                break;
+            }
+            default:
+                break;
+            }
+        }
+
+        vmword start;
+        const std::vector<Instruction> &instrs;
+        Emitter emit;
+        size_t loop_head = 0;
+
+        HostRegister pins[R15 + 1];
+        bool written[R15 + 1];
+        std::vector<HostRegister> saved;
+    };
+
+    // Compile the basic block starting at slot, returns nullptr if nothing could be compiled
+    jit_block compile_block(VMContext *ctx, JitState *jit, size_t slot)
+    {
+        std::vector<Instruction> instrs;
+        auto start = static_cast<vmword>(slot * 4);
+        for (auto s = slot; s < ctx->predecode_slots && instrs.size() < JIT_MAX_BLOCK_INSTRUCTIONS; s++)
+        {
+            auto instr = vmi_decode(reinterpret_cast<const InstructionData*>(ctx->memory + s * 4));
+            if (!is_compilable(instr, ctx->memory_size))
+                break;
+            instrs.push_back(instr);
+            if (is_branch(instr.opcode))
+                break;
+        }
+        if (instrs.empty())
+            return nullptr;
+
+        if (JIT_CODE_SIZE - jit->code_used < JIT_MAX_BLOCK_BYTES)
+            vm_jit_flush(ctx);
+
+        if (!plat_protect_code(jit->code, JIT_CODE_SIZE, false))
+            return nullptr;
+        auto entry = jit->code + jit->code_used;
+        BlockCompiler compiler(start, instrs, entry, JIT_MAX_BLOCK_BYTES);
+        auto size = compiler.compile();
+        plat_protect_code(jit->code, JIT_CODE_SIZE, true);
+        if (size == 0)
+            return nullptr;
+
+        jit->code_used += size;
+        for (size_t i = 0; i < instrs.size(); i++)
+        {
+            ctx->predecoded[slot + i].jit_covered = true;
+            vm_mark_decoded(ctx, slot + i);
+            jit->covered.push_back(slot + i);
+        }
+        auto block = reinterpret_cast<jit_block>(entry);
+        jit->blocks[slot] = block;
+        return block;
+    }
+#else
+    jit_block compile_block(VMContext *ctx, JitState *jit, size_t slot)
+    {
+        return nullptr;
+    }
+#endif
+}
+
+bool vm_jit_enable(VMContext *ctx)
+{
+    if (!TVM_JIT_X64)
+        return false;
+    if (ctx->jit != nullptr)
+        return true;
+
+    auto code = static_cast<uint8_t*>(plat_map_code(JIT_CODE_SIZE));
+    if (code == nullptr)
+        return false;
+
+    auto slots = ctx->predecode_slots;
+    auto blocks = static_cast<jit_block*>(plat_map_bytes(slots * sizeof(jit_block)));
+    auto heat = static_cast<uint8_t*>(plat_map_bytes(slots));
+    if (blocks == nullptr || heat == nullptr)
+    {
+        if (blocks != nullptr)
+            plat_unmap_bytes(blocks, slots * sizeof(jit_block));
+        if (heat != nullptr)
+            plat_unmap_bytes(heat, slots);
+        plat_unmap_code(code, JIT_CODE_SIZE);
+        return false;
+    }
+
+    auto jit = new JitState;
+    jit->code = code;
+    jit->code_used = 0;
+    jit->blocks = blocks;
+    jit->heat = heat;
+    jit->slots = slots;
+    ctx->jit = jit;
+    return true;
+}
+
+void vm_jit_disable(VMContext *ctx)
+{
+    if (ctx->jit == nullptr)
+        return;
+    vm_jit_flush(ctx);
+    plat_unmap_code(ctx->jit->code, JIT_CODE_SIZE);
+    plat_unmap_bytes(ctx->jit->blocks, ctx->jit->slots * sizeof(jit_block));
+    plat_unmap_bytes(ctx->jit->heat, ctx->jit->slots);
+    delete ctx->jit;
+    ctx->jit = nullptr;
+}
+
+void vm_jit_flush(VMContext *ctx)
+{
+    auto jit = ctx->jit;
+    if (jit == nullptr)
+        return;
+    jit->code_used = 0;
+    plat_zero_bytes(jit->blocks, jit->slots * sizeof(jit_block));
+    plat_zero_bytes(jit->heat, jit->slots);
+    // The whole table may have been replaced in the meantime (vm_invalidate_all), but then
+    // clearing the flags again is harmless
+    for (auto slot : jit->covered)
+        ctx->predecoded[slot].jit_covered = false;
+    jit->covered.clear();
+}
+
+namespace
+{
+    void run_jit(VMContext *ctx, void*)
+    {
+        auto jit = ctx->jit;
+        ctx->running = true;
+        while (ctx->running)
+        {
+            auto ip = ctx->registers[IP];
+            auto slot = ip >> 2;
+            if (jit != nullptr && (ip & 3) == 0 && slot < ctx->predecode_slots)
+            {
+                auto block = jit->blocks[slot];
+                if (block == nullptr && jit->heat[slot] <= JIT_HOT_THRESHOLD && ++jit->heat[slot] == JIT_HOT_THRESHOLD)
+                    block = compile_block(ctx, jit, slot);
+                if (block != nullptr)
+                {
+                    auto ic = ctx->registers[IC];
+                    if (ctx->trace != nullptr)
+                        vm_trace_record_block(ctx, ip);
+                    block(ctx->registers, ctx->memory);
+                    // A block that bails out on its first instruction (division by zero)
+                    // made no progress, the interpreter has to handle that instruction
+                    if (ctx->registers[IC] != ic)
+                    {
+                        // Blocks jumping to each other never reach the checks of the interpreter
+                        vm_check_budget(ctx);
+                        continue;
+                    }
+                }
+            }
+
+            auto instr = vm_fetch_decode(ctx);
+            vm_execute(ctx, instr);
+        }
+    }
+}
+
+VMTrap vm_run_jit(VMContext *ctx)
+{
+    return vm_run_guarded(ctx, &run_jit, nullptr);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+// Forward-declare VMContext
+struct VMContext;
+enum VMTrap : int;
+
+// Opaque per-context state of the JIT compiler
+struct JitState;
+
+// Enable the JIT compiler for ctx
+// Returns false if native code generation is not supported on this platform
+bool vm_jit_enable(VMContext *ctx);
+
+// Release all JIT state of ctx. Does nothing if the JIT is not enabled.
+void vm_jit_disable(VMContext *ctx);
+
+// Drop all compiled blocks of ctx, e.g. because memory covered by one of them was written
+void vm_jit_flush(VMContext *ctx);
+
+// Run ctx until it stops. Slots that are executed often are compiled to native
+// basic blocks, everything else (and everything the JIT can't handle) is interpreted.
+// The JIT must have been enabled with vm_jit_enable.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted.
+VMTrap vm_run_jit(VMContext *ctx);
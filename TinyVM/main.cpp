@@ -1,63 +1,333 @@
-#include "vm.hpp"
-#include "instruction_support.hpp"
-#include "config.hpp"
+#include "tinyvm.h"
 
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
 
-void run_vm_context(VMContext *ctx)
+// Load the example at 1032 with a stack of 1024 words, returns the number of words loaded
+size_t load_example(tvm_context *ctx)
 {
-    ctx->running = true;
-    while (ctx->running)
+    // Euclid's algorithm
+    // Inputs in R0 and R1
+    // Result in R0
+    const char source[] =
+        ".base 1032\n"
+        ".stack 1024\n"
+        "\tjmp :main\n"
+        "gcd:\n"
+        "\tmov r2 r1\n"
+        "\tmod r1 r0 r1\n"
+        "\tmov r0 r2\n"
+        "\tjnz :gcd r1\n"
+        "\tret\n"
+        "main:\n"
+        // Set inputs to random numbers
+        "\trdrand r0 #10000 #100000\n"
+        "\trdrand r1 #10000 #100000\n"
+        "\tcall :gcd\n"
+        "\thalt\n";
+    const size_t count = 10;
+    char message[256];
+    if (!tvm_assemble(ctx, source, sizeof(source) - 1, message, sizeof(message)))
     {
-        auto instr = vm_fetch_decode(ctx);
-        vm_execute(ctx, &instr);
+        std::cout << "Could not assemble the example: " << message << std::endl;
+        return 0;
     }
+    return count * 4;
 }
 
-void load_example(VMContext *ctx)
+// Load the example into a new context and snapshot it, so instances can be forked from it
+// Returns nullptr if that fails
+tvm_snapshot* snapshot_example(bool fuse)
 {
-    // Euclid's algorithm
-    // Inputs in R0 and R1
-    // Result in R0
-    InstructionData program[] =
-    {
-        // jmp main
-        vmi_encode_instr_1(OP_JMP, OF_NORMAL, AM_LITERAL, 1056),
-
-        // 1036:
-        // R2 = R1
-        vmi_encode_instr_2(OP_MOV, OF_NORMAL, AM_REGISTER, R2, AM_REGISTER, R1),
-        // R1 = R0 mod R1
-        vmi_encode_instr_3(OP_MOD, OF_NORMAL, AM_REGISTER, R1, AM_REGISTER, R0, AM_REGISTER, R1),
-        // R0 = R2
-        vmi_encode_instr_2(OP_MOV, OF_NORMAL, AM_REGISTER, R0, AM_REGISTER, R2),
-        // continue while R1 != 0
-        vmi_encode_instr_2(OP_JNZ, OF_NORMAL, AM_LITERAL, 1036, AM_REGISTER, R1),
-        // return
-        vmi_encode_instr_0(OP_RET),
-
-        // 1056 main:
-        // Set inputs to random numbers
-        vmi_encode_instr_3(OP_RDRAND, OF_NORMAL, AM_REGISTER, R0, AM_LITERAL, 10000, AM_LITERAL, 100000),
-        vmi_encode_instr_3(OP_RDRAND, OF_NORMAL, AM_REGISTER, R1, AM_LITERAL, 10000, AM_LITERAL, 100000),
-        vmi_encode_instr_1(OP_CALL, OF_NORMAL, AM_LITERAL, 1036),
-        vmi_encode_instr_0(OP_HALT),
-    };
-    vm_load_program(ctx, program, 10);
+    auto base = tvm_create(0);
+    if (base == nullptr)
+    {
+        std::cout << "Could not create the example context" << std::endl;
+        return nullptr;
+    }
+    auto program_size = load_example(base);
+    if (fuse)
+        tvm_fuse(base, tvm_get_register(base, TVM_IP), program_size);
+    auto snapshot = tvm_snapshot_create(base);
+    tvm_destroy(base);
+    if (snapshot == nullptr)
+        std::cout << "Could not snapshot the example context" << std::endl;
+    return snapshot;
 }
 
-int main(int argc, char **argv)
+// Fork count instances of the example from snapshot. Instance i gets the random numbers of seed + i.
+std::vector<tvm_context*> fork_example(const tvm_snapshot *snapshot, size_t count, uint64_t seed)
 {
-    std::cout << "TinyVM v" << TVM_VERSION << std::endl;
+    std::vector<tvm_context*> contexts;
+    for (size_t i = 0; i < count; i++)
+    {
+        auto ctx = tvm_fork(snapshot);
+        if (ctx == nullptr)
+        {
+            std::cout << "Could not fork context " << i << std::endl;
+            break;
+        }
+        tvm_seed(ctx, seed + i);
+        contexts.push_back(ctx);
+    }
+    return contexts;
+}
 
-    auto ctx = vm_create();
-    vm_init_stack(ctx, 1024);
-    vm_init_programbase(ctx, 1032);
+// Destroy the instances and return the number of instructions they executed
+uint64_t destroy_example(const std::vector<tvm_context*> &contexts)
+{
+    uint64_t instructions = 0;
+    for (auto ctx : contexts)
+    {
+        instructions += tvm_get_register(ctx, TVM_IC);
+        tvm_destroy(ctx);
+    }
+    return instructions;
+}
+
+// Run count instances of the example on a pool
+int run_pool(size_t count, bool fuse, uint64_t seed)
+{
+    auto snapshot = snapshot_example(fuse);
+    if (snapshot == nullptr)
+        return 1;
+    auto contexts = fork_example(snapshot, count, seed);
+    tvm_snapshot_destroy(snapshot);
 
-    load_example(ctx);
+    auto pool = tvm_pool_create(0, 0);
+    for (auto ctx : contexts)
+        tvm_pool_submit(pool, ctx, nullptr, nullptr);
+    tvm_pool_wait(pool);
+    auto instructions = destroy_example(contexts);
+    std::cout << "Ran " << contexts.size() << " contexts (" << instructions << " instructions) on "
+        << tvm_pool_worker_count(pool) << " workers" << std::endl;
+    tvm_pool_destroy(pool);
+    return 0;
+}
 
-    run_vm_context(ctx);
-    vm_destroy(ctx);
+// Run count instances of the example side by side in one batch
+int run_batch(size_t count, bool fuse, uint64_t seed)
+{
+    auto snapshot = snapshot_example(fuse);
+    if (snapshot == nullptr)
+        return 1;
+    auto contexts = fork_example(snapshot, count, seed);
+    tvm_run_batch(snapshot, contexts.data(), contexts.size());
+    tvm_snapshot_destroy(snapshot);
+    auto instructions = destroy_example(contexts);
+    std::cout << "Ran " << contexts.size() << " contexts (" << instructions << " instructions) in one batch" << std::endl;
     return 0;
 }
 
+// Describe address like tvm_describe_address
+std::string describe_address(const tvm_context *ctx, uint64_t address)
+{
+    std::string text(tvm_describe_address(ctx, address, nullptr, 0), '\0');
+    tvm_describe_address(ctx, address, &text[0], text.size() + 1);
+    return text;
+}
+
+// Write the profile report to filename and the folded call stacks to filename.folded
+bool write_profile(const tvm_context *ctx, const std::string &filename)
+{
+    return tvm_profile_write_report(ctx, filename.c_str())
+        && tvm_profile_write_folded(ctx, (filename + ".folded").c_str());
+}
+
+// Load image, assembling it in-process if it is tasm source. Prints why assembling failed.
+bool load_image(tvm_context *ctx, const std::string &image)
+{
+    const std::string source_suffix = ".tasm";
+    if (image.size() < source_suffix.size() || image.compare(image.size() - source_suffix.size(), std::string::npos, source_suffix) != 0)
+        return tvm_load_image_file(ctx, image.c_str()) != 0;
+
+    std::ifstream file(image, std::ios::binary);
+    if (!file)
+        return false;
+    std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    char message[256];
+    if (tvm_assemble(ctx, source.data(), source.size(), message, sizeof(message)))
+        return true;
+    std::cout << image << ": " << message << std::endl;
+    return false;
+}
+
+void print_usage(const char *program)
+{
+    std::cout << "Usage: " << program << " [--engine table|threaded|jit|compact] [--aot library] [--no-fusion] [--fusion-report] [--verify] [--pool count] [--batch count] [--memory words] [--profile file] [--seed number] [--symbols file] [--trace file] [--trace-size records] [image | source.tasm]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::cout << "TinyVM v" << tvm_version() << std::endl;
+
+    auto engine = TVM_ENGINE_TABLE;
+    bool fuse = true;
+    bool verify = false;
+    bool fusion_report = false;
+    size_t pool_contexts = 0;
+    size_t batch_contexts = 0;
+    const char *image = nullptr;
+    const char *profile = nullptr;
+    const char *aot = nullptr;
+    const char *symbols_file = nullptr;
+    const char *trace = nullptr;
+    size_t trace_size = 4096;
+    uint64_t memory_size = 0;
+    bool seeded = false;
+    uint64_t seed = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc)
+        {
+            auto name = argv[++i];
+            if (strcmp(name, "table") == 0)
+                engine = TVM_ENGINE_TABLE;
+            else if (strcmp(name, "threaded") == 0)
+                engine = TVM_ENGINE_THREADED;
+            else if (strcmp(name, "jit") == 0)
+                engine = TVM_ENGINE_JIT;
+            else if (strcmp(name, "compact") == 0)
+                engine = TVM_ENGINE_COMPACT;
+            else
+            {
+                print_usage(argv[0]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--aot") == 0 && i + 1 < argc)
+            aot = argv[++i];
+        else if (strcmp(argv[i], "--no-fusion") == 0)
+            fuse = false;
+        else if (strcmp(argv[i], "--verify") == 0)
+            verify = true;
+        else if (strcmp(argv[i], "--fusion-report") == 0)
+            fusion_report = true;
+        else if (strcmp(argv[i], "--pool") == 0 && i + 1 < argc)
+            pool_contexts = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batch_contexts = strtoul(argv[++i], nullptr, 10);
+        else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc)
+            memory_size = strtoull(argv[++i], nullptr, 0);
+        else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+            profile = argv[++i];
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+        {
+            seed = strtoull(argv[++i], nullptr, 0);
+            seeded = true;
+        }
+        else if (strcmp(argv[i], "--symbols") == 0 && i + 1 < argc)
+            symbols_file = argv[++i];
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace = argv[++i];
+        else if (strcmp(argv[i], "--trace-size") == 0 && i + 1 < argc)
+            trace_size = strtoul(argv[++i], nullptr, 10);
+        else if (argv[i][0] != '-' && image == nullptr)
+            image = argv[i];
+        else
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (pool_contexts > 0)
+        return run_pool(pool_contexts, fuse, seeded ? seed : std::random_device()());
+    if (batch_contexts > 0)
+        return run_batch(batch_contexts, fuse, seeded ? seed : std::random_device()());
+
+    auto ctx = tvm_create(memory_size);
+    if (ctx == nullptr)
+    {
+        std::cout << "Could not reserve " << memory_size << " words of memory" << std::endl;
+        return 1;
+    }
+    if (seeded)
+        tvm_seed(ctx, seed);
+    if (symbols_file != nullptr && !tvm_load_symbols(ctx, symbols_file))
+        std::cout << "Could not load symbols " << symbols_file << std::endl;
+    if (trace != nullptr && !tvm_trace_enable(ctx, trace_size, trace))
+    {
+        std::cout << "Could not create trace " << trace << ", running without it" << std::endl;
+        trace = nullptr;
+    }
+    if (trace != nullptr)
+        tvm_trace_dump_on_signal();
+    if (profile != nullptr)
+    {
+        // The profiler has its own run loop, whatever engine was selected
+        if (!tvm_profile_enable(ctx))
+        {
+            std::cout << "Could not allocate the profile, running without it" << std::endl;
+            profile = nullptr;
+        }
+    }
+    else if (!tvm_set_engine(ctx, engine))
+        std::cout << "JIT not supported on this platform, interpreting instead" << std::endl;
+    if (image != nullptr)
+    {
+        if (!load_image(ctx, image))
+        {
+            std::cout << "Could not load image " << image << std::endl;
+            tvm_destroy(ctx);
+            return 1;
+        }
+        if (fuse)
+            tvm_fuse(ctx, 0, tvm_memory_size(ctx));
+    }
+    else
+    {
+        auto program_size = load_example(ctx);
+        if (fuse)
+            tvm_fuse(ctx, tvm_get_register(ctx, TVM_IP), program_size);
+    }
+    // Built from the image, so it can only be loaded after it
+    if (aot != nullptr)
+    {
+        if (!tvm_load_aot(ctx, aot))
+            std::cout << "Could not load " << aot << ", interpreting instead" << std::endl;
+        else if (profile == nullptr)
+            tvm_set_engine(ctx, TVM_ENGINE_AOT);
+    }
+    if (verify)
+    {
+        char message[256];
+        auto verified = tvm_verify(ctx, message, sizeof(message));
+        std::cout << message << std::endl;
+        if (!verified)
+        {
+            tvm_destroy(ctx);
+            return 1;
+        }
+    }
+
+    auto status = tvm_run(ctx, 0);
+    if (status == TVM_STATUS_TRAPPED)
+    {
+        std::cout << "Error caught: " << tvm_trap_message(tvm_get_trap(ctx)) << " at "
+            << describe_address(ctx, tvm_get_trap_address(ctx)) << std::endl;
+    }
+    else if (image != nullptr)
+    {
+        std::cout << "Halted after " << tvm_get_register(ctx, TVM_IC) << " instructions, r0 = "
+            << tvm_get_register(ctx, TVM_R0) << std::endl;
+    }
+    if (fusion_report)
+    {
+        std::string report(tvm_fusion_report(ctx, nullptr, 0), '\0');
+        tvm_fusion_report(ctx, &report[0], report.size() + 1);
+        std::cout << report;
+    }
+    if (trace != nullptr && !tvm_trace_dump(ctx))
+        std::cout << "Could not write trace " << trace << std::endl;
+    if (profile != nullptr && !write_profile(ctx, profile))
+        std::cout << "Could not write profile " << profile << std::endl;
+    tvm_destroy(ctx);
+    return status == TVM_STATUS_TRAPPED ? -1 : 0;
+}
@@ -1,10 +1,132 @@
 #pragma once
 
+#include <cstdint>
+
 #include "vmtypes.hpp"
 
-// Map a memory region of nwords vmwords and return a pointer to it
-// Will return nullptr if the allocation fails
+// Map a zero-initialized memory region of nwords vmwords and return a pointer to it
+// The region is only reserved, physical memory is committed as it is touched. At
+// plat_memory_guard_offset(nwords) words into it lies a guard area of at least
+// PLAT_MEMORY_GUARD_WORDS words: accesses there are reported as out-of-range errors
+// where the platform supports it, elsewhere they land in scratch words.
+// Will return nullptr if the allocation fails or the guard area can't be set up
 vmword *plat_map_memory(size_t nwords);
 
-// Unmap a memory region mapped with plat_map_memory
+// Unmap a memory region mapped with plat_map_memory, plat_map_memory_image or plat_map_file
 void plat_unmap_memory(vmword *mem, size_t nwords);
+
+// How a plat_run_guarded call ended
+enum PlatFault
+{
+    PLAT_FAULT_NONE,          // The body returned
+    PLAT_FAULT_ABORTED,       // plat_abort_guarded was called
+    PLAT_FAULT_OUT_OF_RANGE,  // The body touched the guard area of memory from plat_map_memory
+    PLAT_FAULT_OUT_OF_MEMORY, // Memory from plat_map_memory could not be committed, where the platform reports it
+};
+
+// Run body(arg). Memory faults in the guard area and failures to commit memory on
+// this thread unwind to here instead of terminating the process, as does plat_abort_guarded.
+// Unwinding skips destructors, so body must not have objects with non-trivial ones on the stack.
+// Calls may be nested, faults go to the innermost one.
+PlatFault plat_run_guarded(void (*body)(void *arg), void *arg);
+
+// Unwind to the innermost plat_run_guarded call of this thread, which returns fault.
+// Returns only if there is none.
+void plat_abort_guarded(PlatFault fault);
+
+// Minimum number of guard words following memory from plat_map_memory
+const size_t PLAT_MEMORY_GUARD_WORDS = 4;
+
+// Offset in vmwords of the guard area of memory of nwords vmwords from plat_map_memory
+// Words between the end of memory and the guard area are scratch space.
+size_t plat_memory_guard_offset(size_t nwords);
+
+// Granularity in vmwords at which memory from plat_map_memory is committed
+size_t plat_memory_chunk_words();
+
+// Returns false if the chunk at word offset into memory of nwords vmwords at mem was
+// never touched and thus is all zeroes
+bool plat_memory_chunk_committed(const vmword *mem, size_t nwords, size_t offset);
+
+// Map a zero-initialized memory region of size bytes and return a pointer to it
+// Will return nullptr if the allocation fails
+void *plat_map_bytes(size_t size);
+
+// Zero size bytes at mem, which was mapped with plat_map_bytes. Releases the
+// physical memory backing it where possible.
+void plat_zero_bytes(void *mem, size_t size);
+
+// Unmap a memory region mapped with plat_map_bytes
+void plat_unmap_bytes(void *mem, size_t size);
+
+// Map a region of size bytes for generated machine code. The region starts out writable.
+// Will return nullptr if the allocation fails or the platform does not support it
+void *plat_map_code(size_t size);
+
+// Switch a code region between writable and executable
+// Returns true if successful, false otherwise
+bool plat_protect_code(void *mem, size_t size, bool executable);
+
+// Unmap a code region mapped with plat_map_code
+void plat_unmap_code(void *mem, size_t size);
+
+// Immutable memory image that can be mapped copy-on-write any number of times
+struct PlatImage;
+
+// Create an image from size bytes at data
+// Will return nullptr if the image can't be created
+PlatImage *plat_create_image(const void *data, size_t size);
+
+// Destroy an image. Existing mappings of it stay valid.
+void plat_destroy_image(PlatImage *image);
+
+// Map a private, writable view of image. Pages are shared with the image until they are written.
+// Unmap it with plat_unmap_bytes. Will return nullptr if the mapping fails
+void *plat_map_image(const PlatImage *image);
+
+// Map a private, writable view of image as memory of nwords vmwords, laid out like
+// memory from plat_map_memory. The image must be exactly nwords vmwords large.
+// Unmap it with plat_unmap_memory. Will return nullptr if the mapping fails
+vmword *plat_map_memory_image(const PlatImage *image, size_t nwords);
+
+// Map nwords vmwords backed by a private, copy-on-write view of the file at filename.
+// Words beyond the end of the file read as zero. The size of the file in bytes is stored in file_size.
+// Unmap it with plat_unmap_memory. Will return nullptr if the file can't be opened or mapped
+vmword *plat_map_file(const char *filename, size_t nwords, size_t *file_size);
+
+// Handle of a file opened with plat_open_write
+typedef intptr_t PlatFile;
+const PlatFile PLAT_NO_FILE = -1;
+
+// Create or truncate filename for writing
+// Will return PLAT_NO_FILE if the file can't be opened
+PlatFile plat_open_write(const char *filename);
+
+// Write size bytes at byte offset into file. Safe to call from signal handlers on POSIX.
+bool plat_write_at(PlatFile file, const void *data, size_t size, size_t offset);
+
+// Close a file opened with plat_open_write
+void plat_close(PlatFile file);
+
+// Shared library loaded with plat_load_library
+struct PlatLibrary;
+
+// Load the shared library at filename
+// Will return nullptr if it can't be loaded or the platform does not support it
+PlatLibrary *plat_load_library(const char *filename);
+
+// Address of the symbol name exported by library, nullptr if there is none
+void *plat_library_symbol(PlatLibrary *library, const char *name);
+
+// Unload a library loaded with plat_load_library
+void plat_unload_library(PlatLibrary *library);
+
+// Call handler whenever the process is asked to dump diagnostics (SIGUSR1 on POSIX).
+// handler runs on a thread of its own, not in signal context. The signal handler is
+// installed on the first call, one installed before it is still called.
+// Returns false if the platform has no way to request dumps
+bool plat_on_dump_request(void (*handler)());
+
+// Call handler right before the process dies of a fatal memory fault.
+// handler runs in signal context.
+void plat_on_fatal_fault(void (*handler)());
@@ -1,14 +1,196 @@
 #include "platform.hpp"
 
+#include <csetjmp>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+struct PlatImage
+{
+    void *data;
+    size_t size;
+};
+
+namespace
+{
+    // A plat_run_guarded call on the current thread
+    struct GuardedRun
+    {
+        std::jmp_buf jump;
+        GuardedRun *outer;
+        // Set before jumping, volatile because it changes between setjmp and longjmp
+        volatile PlatFault fault;
+    };
+
+    thread_local GuardedRun *current_guarded_run = nullptr;
+}
+
+PlatFault plat_run_guarded(void (*body)(void *arg), void *arg)
+{
+    // Without guard pages the only faults are the ones raised with plat_abort_guarded
+    GuardedRun run;
+    run.outer = current_guarded_run;
+    if (setjmp(run.jump) != 0)
+    {
+        current_guarded_run = run.outer;
+        return run.fault;
+    }
+    current_guarded_run = &run;
+    body(arg);
+    current_guarded_run = run.outer;
+    return PLAT_FAULT_NONE;
+}
+
+void plat_abort_guarded(PlatFault fault)
+{
+    auto run = current_guarded_run;
+    if (run != nullptr)
+    {
+        run->fault = fault;
+        std::longjmp(run->jump, 1);
+    }
+}
 
 vmword *plat_map_memory(size_t nwords)
 {
-    void *mem_pointer = calloc(nwords, sizeof(vmword));
+    // No guard pages here, out-of-range accesses hit the scratch words at the end
+    void *mem_pointer = calloc(nwords + PLAT_MEMORY_GUARD_WORDS, sizeof(vmword));
     return static_cast<vmword*>(mem_pointer);
 }
 
-void plat_unmap_memory(vmword *mem)
+void plat_unmap_memory(vmword *mem, size_t)
+{
+    free(mem);
+}
+
+size_t plat_memory_guard_offset(size_t nwords)
+{
+    return nwords;
+}
+
+size_t plat_memory_chunk_words()
+{
+    return 8192;
+}
+
+bool plat_memory_chunk_committed(const vmword*, size_t, size_t)
+{
+    return true;
+}
+
+void *plat_map_bytes(size_t size)
+{
+    return calloc(size, 1);
+}
+
+void plat_zero_bytes(void *mem, size_t size)
+{
+    memset(mem, 0, size);
+}
+
+void plat_unmap_bytes(void *mem, size_t)
 {
     free(mem);
 }
+
+void *plat_map_code(size_t)
+{
+    return nullptr;
+}
+
+bool plat_protect_code(void*, size_t, bool)
+{
+    return false;
+}
+
+void plat_unmap_code(void*, size_t)
+{
+}
+
+PlatImage *plat_create_image(const void *data, size_t size)
+{
+    void *copy = malloc(size);
+    if (copy == nullptr)
+        return nullptr;
+    memcpy(copy, data, size);
+    return new PlatImage{ copy, size };
+}
+
+void plat_destroy_image(PlatImage *image)
+{
+    free(image->data);
+    delete image;
+}
+
+void *plat_map_image(const PlatImage *image)
+{
+    void *mem = malloc(image->size);
+    if (mem != nullptr)
+        memcpy(mem, image->data, image->size);
+    return mem;
+}
+
+vmword *plat_map_memory_image(const PlatImage *image, size_t nwords)
+{
+    if (image->size != nwords * sizeof(vmword))
+        return nullptr;
+    auto mem = plat_map_memory(nwords);
+    if (mem != nullptr)
+        memcpy(mem, image->data, image->size);
+    return mem;
+}
+
+vmword *plat_map_file(const char *filename, size_t nwords, size_t *file_size)
+{
+    auto fp = fopen(filename, "rb");
+    if (fp == nullptr)
+        return nullptr;
+    fseek(fp, 0, SEEK_END);
+    *file_size = static_cast<size_t>(ftell(fp));
+    fseek(fp, 0, SEEK_SET);
+    auto mem = plat_map_memory(nwords);
+    if (mem != nullptr)
+        fread(mem, sizeof(vmword), nwords, fp);
+    fclose(fp);
+    return mem;
+}
+
+PlatFile plat_open_write(const char *filename)
+{
+    auto fp = fopen(filename, "wb");
+    return fp == nullptr ? PLAT_NO_FILE : reinterpret_cast<PlatFile>(fp);
+}
+
+bool plat_write_at(PlatFile file, const void *data, size_t size, size_t offset)
+{
+    auto fp = reinterpret_cast<FILE*>(file);
+    return fseek(fp, static_cast<long>(offset), SEEK_SET) == 0 && fwrite(data, 1, size, fp) == size && fflush(fp) == 0;
+}
+
+void plat_close(PlatFile file)
+{
+    fclose(reinterpret_cast<FILE*>(file));
+}
+
+PlatLibrary *plat_load_library(const char*)
+{
+    return nullptr;
+}
+
+void *plat_library_symbol(PlatLibrary*, const char*)
+{
+    return nullptr;
+}
+
+void plat_unload_library(PlatLibrary*)
+{
+}
+
+bool plat_on_dump_request(void (*)())
+{
+    return false;
+}
+
+void plat_on_fatal_fault(void (*)())
+{
+}
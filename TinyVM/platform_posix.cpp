@@ -1,16 +1,591 @@
 #include "platform.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+
+struct PlatImage
+{
+    int fd;
+    size_t size;
+};
+
+namespace
+{
+    // Create an anonymous file that lives only as long as it has open descriptors
+    int create_anonymous_file()
+    {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+        return memfd_create("tinyvm-image", MFD_CLOEXEC);
+#else
+        char name[] = "/tmp/tinyvm-image-XXXXXX";
+        int fd = mkstemp(name);
+        if (fd != -1)
+            unlink(name);
+        return fd;
+#endif
+    }
+
+    bool is_zero(const unsigned char *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            if (data[i] != 0)
+                return false;
+        }
+        return true;
+    }
+
+    size_t page_size()
+    {
+        static const size_t size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        return size;
+    }
+
+    size_t round_to_pages(size_t size)
+    {
+        return (size + page_size() - 1) / page_size() * page_size();
+    }
+
+    ////////
+    // Guarded memory
+    ////////
+
+    // Memory regions are mapped readable and writable without reserving swap, so the
+    // kernel commits pages as they are touched, and are followed by an inaccessible
+    // guard area: accesses there are out of range. That keeps each region at two
+    // mappings however it is accessed, vm.max_map_count is never the limit.
+    const size_t CHUNK_BYTES = 64 * 1024;
+    const size_t GUARD_BYTES = 64 * 1024;
+    const size_t MAX_REGIONS = 16384;
+
+    // A region is [begin, end), memory lies in [begin, usable_end) and the guard area
+    // follows at [usable_end, end). [begin, mapped_end) is a view of a file or image.
+    struct Region
+    {
+        std::atomic<uintptr_t> begin;
+        uintptr_t usable_end;
+        uintptr_t end;
+        uintptr_t mapped_end;
+    };
+
+    // Slots are claimed by setting begin, the signal handler scans them without locking.
+    // The scan only runs for faults in guard areas and ones that are not ours.
+    Region regions[MAX_REGIONS];
+    std::atomic<size_t> region_high_water(0);
+    const uintptr_t REGION_CLAIMED = 1;
+
+    struct sigaction previous_segv_action;
+
+    Region *find_region(uintptr_t address)
+    {
+        auto count = region_high_water.load(std::memory_order_acquire);
+        for (size_t i = 0; i < count; i++)
+        {
+            auto begin = regions[i].begin.load(std::memory_order_acquire);
+            if (begin > REGION_CLAIMED && address >= begin && address < regions[i].end)
+                return regions + i;
+        }
+        return nullptr;
+    }
+
+    // Linux tells which pages of a process are present or swapped out in /proc/self/pagemap.
+    // Anonymous pages that are neither were never touched, so they are still zero.
+    int pagemap_file()
+    {
+#ifdef __linux__
+        static const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+        return fd;
+#else
+        return -1;
+#endif
+    }
+
+    // Returns true if any of [begin, end) of region may hold something else than zeroes.
+    // Where the platform can't tell, that's all of it.
+    bool is_touched(const Region *region, uintptr_t begin, uintptr_t end)
+    {
+        end = end > region->usable_end ? region->usable_end : end;
+        if (begin < region->mapped_end)
+            return true;
+        auto fd = pagemap_file();
+        if (fd == -1)
+            return true;
+
+        const uint64_t PAGE_PRESENT = uint64_t(1) << 63;
+        const uint64_t PAGE_SWAPPED = uint64_t(1) << 62;
+        uint64_t entries[CHUNK_BYTES / 4096];
+        for (auto page = begin / page_size(); page * page_size() < end; )
+        {
+            auto count = std::min(sizeof(entries) / sizeof(entries[0]), (end - 1) / page_size() + 1 - page);
+            auto bytes = static_cast<ssize_t>(count * sizeof(uint64_t));
+            if (pread(fd, entries, bytes, static_cast<off_t>(page * sizeof(uint64_t))) != bytes)
+                return true;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (entries[i] & (PAGE_PRESENT | PAGE_SWAPPED))
+                    return true;
+            }
+            page += count;
+        }
+        return false;
+    }
+
+    // A plat_run_guarded call on the current thread
+    struct GuardedRun
+    {
+        sigjmp_buf jump;
+        GuardedRun *outer;
+        // Set before jumping, volatile because it changes between setjmp and longjmp
+        volatile PlatFault fault;
+    };
+
+    thread_local GuardedRun *current_guarded_run = nullptr;
+
+    std::atomic<void (*)()> dump_request_handler(nullptr);
+    std::atomic<void (*)()> fatal_fault_handler(nullptr);
+
+    // The SIGUSR1 handler passes dump requests to the dump thread through this pipe
+    int dump_request_pipe[2] = { -1, -1 };
+    struct sigaction previous_dump_action;
+
+    void handle_dump_request(int signal, siginfo_t *info, void *context)
+    {
+        auto saved_errno = errno;
+        // The pipe is non-blocking, if it is full a dump is pending anyway
+        char request = 0;
+        auto written = write(dump_request_pipe[1], &request, 1);
+        (void)written;
+        errno = saved_errno;
+
+        if (previous_dump_action.sa_flags & SA_SIGINFO)
+            previous_dump_action.sa_sigaction(signal, info, context);
+        else if (previous_dump_action.sa_handler != SIG_DFL && previous_dump_action.sa_handler != SIG_IGN)
+            previous_dump_action.sa_handler(signal);
+    }
+
+    // Runs dump requests outside of signal context, where handlers may take locks
+    void dump_thread_main()
+    {
+        char requests[64];
+        for (;;)
+        {
+            auto count = read(dump_request_pipe[0], requests, sizeof(requests));
+            if (count < 0 && errno == EINTR)
+                continue;
+            if (count <= 0)
+                return;
+            auto dump = dump_request_handler.load();
+            if (dump != nullptr)
+                dump();
+        }
+    }
+
+    void fatal_fault(const char *message, size_t length)
+    {
+        auto dump = fatal_fault_handler.load();
+        if (dump != nullptr)
+            dump();
+        if (write(STDOUT_FILENO, message, length) < 0)
+            _exit(-1);
+        _exit(-1);
+    }
+
+    void handle_segv(int signal, siginfo_t *info, void *context)
+    {
+        auto address = reinterpret_cast<uintptr_t>(info->si_addr);
+        auto region = find_region(address);
+        if (region != nullptr && address >= region->usable_end)
+        {
+            plat_abort_guarded(PLAT_FAULT_OUT_OF_RANGE);
+            static const char message[] = "Error caught: Memory access out of range\n";
+            fatal_fault(message, sizeof(message) - 1);
+        }
+
+        // Not ours, hand it on
+        if (previous_segv_action.sa_flags & SA_SIGINFO)
+            previous_segv_action.sa_sigaction(signal, info, context);
+        else if (previous_segv_action.sa_handler != SIG_DFL && previous_segv_action.sa_handler != SIG_IGN)
+            previous_segv_action.sa_handler(signal);
+        else
+        {
+            // Returning re-executes the faulting instruction, which now gets the default action
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = SIG_DFL;
+            sigaction(SIGSEGV, &action, nullptr);
+        }
+    }
+
+    void install_segv_handler()
+    {
+        static std::once_flag once;
+        std::call_once(once, []()
+        {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = &handle_segv;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGSEGV, &action, &previous_segv_action);
+        });
+    }
+
+    size_t region_bytes(size_t nwords)
+    {
+        return round_to_pages(nwords * sizeof(vmword)) + GUARD_BYTES;
+    }
+
+    // Map a region for nwords vmwords of memory and register its guard area. Fails if
+    // the region can't be registered, as the SIGSEGV handler then could not turn
+    // accesses to the guard area into out-of-range errors.
+    vmword *reserve_memory(size_t nwords)
+    {
+        install_segv_handler();
+        auto bytes = region_bytes(nwords);
+        auto usable_bytes = bytes - GUARD_BYTES;
+        void *base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED)
+            return nullptr;
+        auto begin = reinterpret_cast<uintptr_t>(base);
+        if (mprotect(reinterpret_cast<void*>(begin + usable_bytes), GUARD_BYTES, PROT_NONE) != 0)
+        {
+            munmap(base, bytes);
+            return nullptr;
+        }
+
+        for (size_t i = 0; i < MAX_REGIONS; i++)
+        {
+            uintptr_t expected = 0;
+            if (!regions[i].begin.compare_exchange_strong(expected, REGION_CLAIMED))
+                continue;
+            regions[i].usable_end = begin + usable_bytes;
+            regions[i].end = begin + bytes;
+            regions[i].mapped_end = begin;
+            regions[i].begin.store(begin, std::memory_order_release);
+            auto high_water = region_high_water.load();
+            while (high_water < i + 1 && !region_high_water.compare_exchange_weak(high_water, i + 1))
+                ;
+            return static_cast<vmword*>(base);
+        }
+
+        munmap(base, bytes);
+        return nullptr;
+    }
+
+    // Put size bytes of fd over the start of memory from reserve_memory
+    bool map_over_memory(vmword *mem, int fd, size_t size)
+    {
+        void *view = mmap(mem, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, fd, 0);
+        if (view == MAP_FAILED)
+            return false;
+        // Pages of the view that weren't read yet aren't present, but aren't zero either
+        find_region(reinterpret_cast<uintptr_t>(mem))->mapped_end = reinterpret_cast<uintptr_t>(mem) + size;
+        return true;
+    }
+
+    void release_region(uintptr_t begin)
+    {
+        auto region = find_region(begin);
+        if (region != nullptr)
+            region->begin.store(0, std::memory_order_release);
+    }
+}
+
+PlatFault plat_run_guarded(void (*body)(void *arg), void *arg)
+{
+    GuardedRun run;
+    run.outer = current_guarded_run;
+    // Save the signal mask, so jumping out of the SIGSEGV handler unblocks SIGSEGV again
+    if (sigsetjmp(run.jump, 1) != 0)
+    {
+        current_guarded_run = run.outer;
+        return run.fault;
+    }
+    current_guarded_run = &run;
+    body(arg);
+    current_guarded_run = run.outer;
+    return PLAT_FAULT_NONE;
+}
+
+void plat_abort_guarded(PlatFault fault)
+{
+    auto run = current_guarded_run;
+    if (run != nullptr)
+    {
+        run->fault = fault;
+        siglongjmp(run->jump, 1);
+    }
+}
 
 vmword *plat_map_memory(size_t nwords)
 {
-    void *mem_ptr = mmap(nullptr, nwords * sizeof(vmword), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return reserve_memory(nwords);
+}
+
+void plat_unmap_memory(vmword *mem, size_t nwords)
+{
+    // Unregister first, so a new mapping at the same address can't be mistaken for this one
+    release_region(reinterpret_cast<uintptr_t>(mem));
+    munmap(mem, region_bytes(nwords));
+}
+
+size_t plat_memory_guard_offset(size_t nwords)
+{
+    return round_to_pages(nwords * sizeof(vmword)) / sizeof(vmword);
+}
+
+size_t plat_memory_chunk_words()
+{
+    return CHUNK_BYTES / sizeof(vmword);
+}
+
+bool plat_memory_chunk_committed(const vmword *mem, size_t, size_t offset)
+{
+    auto region = find_region(reinterpret_cast<uintptr_t>(mem));
+    if (region == nullptr)
+        return true;
+    auto begin = reinterpret_cast<uintptr_t>(mem + offset);
+    return is_touched(region, begin, begin + CHUNK_BYTES);
+}
+
+void *plat_map_bytes(size_t size)
+{
+    // Large tables may be sparse, only the pages actually used should count
+    void *mem_ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     if (mem_ptr == MAP_FAILED)
         return nullptr;
-    return static_cast<vmword*>(mem_ptr);
+    return mem_ptr;
 }
 
-void plat_unmap_memory(vmword *mem, size_t nwords)
+void plat_zero_bytes(void *mem, size_t size)
+{
+    // Replacing whole pages with fresh ones is cheaper than writing them and releases them, too
+    auto begin = reinterpret_cast<uintptr_t>(mem);
+    auto first_page = round_to_pages(begin);
+    auto end = begin + size;
+    auto last_page = end / page_size() * page_size();
+    if (last_page > first_page + CHUNK_BYTES)
+    {
+        void *pages = mmap(reinterpret_cast<void*>(first_page), last_page - first_page, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+        if (pages != MAP_FAILED)
+        {
+            memset(mem, 0, first_page - begin);
+            memset(reinterpret_cast<void*>(last_page), 0, end - last_page);
+            return;
+        }
+    }
+    memset(mem, 0, size);
+}
+
+void plat_unmap_bytes(void *mem, size_t size)
+{
+    munmap(mem, size);
+}
+
+void *plat_map_code(size_t size)
+{
+    return plat_map_bytes(size);
+}
+
+bool plat_protect_code(void *mem, size_t size, bool executable)
+{
+    int prot = executable ? (PROT_READ | PROT_EXEC) : (PROT_READ | PROT_WRITE);
+    return mprotect(mem, size, prot) == 0;
+}
+
+void plat_unmap_code(void *mem, size_t size)
+{
+    plat_unmap_bytes(mem, size);
+}
+
+PlatImage *plat_create_image(const void *data, size_t size)
+{
+    int fd = create_anonymous_file();
+    if (fd == -1)
+        return nullptr;
+    if (ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    void *view = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (view == MAP_FAILED)
+    {
+        close(fd);
+        return nullptr;
+    }
+    // Leave pages that are all zeroes as holes in the file
+    auto src = static_cast<const unsigned char*>(data);
+    auto dst = static_cast<unsigned char*>(view);
+    auto page = page_size();
+    auto region = find_region(reinterpret_cast<uintptr_t>(data));
+    for (size_t chunk = 0; chunk < size; chunk += CHUNK_BYTES)
+    {
+        // Memory that was never touched is zero, reading it would only map it
+        auto chunk_begin = reinterpret_cast<uintptr_t>(src + chunk);
+        if (region != nullptr && !is_touched(region, chunk_begin, chunk_begin + CHUNK_BYTES))
+            continue;
+        auto chunk_end = std::min(size, chunk + CHUNK_BYTES);
+        for (auto offset = chunk; offset < chunk_end; offset += page)
+        {
+            auto length = std::min(page, chunk_end - offset);
+            if (!is_zero(src + offset, length))
+                memcpy(dst + offset, src + offset, length);
+        }
+    }
+    munmap(view, size);
+
+    return new PlatImage{ fd, size };
+}
+
+void plat_destroy_image(PlatImage *image)
+{
+    close(image->fd);
+    delete image;
+}
+
+void *plat_map_image(const PlatImage *image)
+{
+    void *mem_ptr = mmap(nullptr, image->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, image->fd, 0);
+    if (mem_ptr == MAP_FAILED)
+        return nullptr;
+    return mem_ptr;
+}
+
+vmword *plat_map_memory_image(const PlatImage *image, size_t nwords)
+{
+    if (image->size != nwords * sizeof(vmword))
+        return nullptr;
+    auto mem = reserve_memory(nwords);
+    if (mem == nullptr)
+        return nullptr;
+    if (!map_over_memory(mem, image->fd, image->size))
+    {
+        plat_unmap_memory(mem, nwords);
+        return nullptr;
+    }
+    return mem;
+}
+
+vmword *plat_map_file(const char *filename, size_t nwords, size_t *file_size)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+    *file_size = static_cast<size_t>(st.st_size);
+
+    // Map the whole region, then put the file over the start of memory. Pages that
+    // lie completely beyond the end of the file would raise SIGBUS when touched, so those
+    // stay anonymous memory.
+    auto mem = reserve_memory(nwords);
+    if (mem == nullptr)
+    {
+        close(fd);
+        return nullptr;
+    }
+    auto size = nwords * sizeof(vmword);
+    auto mapped_bytes = round_to_pages(*file_size < size ? *file_size : size);
+    bool ok = mapped_bytes == 0 || map_over_memory(mem, fd, mapped_bytes);
+    close(fd);
+    if (!ok)
+    {
+        plat_unmap_memory(mem, nwords);
+        return nullptr;
+    }
+    return mem;
+}
+
+PlatFile plat_open_write(const char *filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    return fd == -1 ? PLAT_NO_FILE : fd;
+}
+
+bool plat_write_at(PlatFile file, const void *data, size_t size, size_t offset)
+{
+    auto bytes = static_cast<const char*>(data);
+    while (size > 0)
+    {
+        auto written = pwrite(static_cast<int>(file), bytes, size, static_cast<off_t>(offset));
+        if (written <= 0)
+            return false;
+        bytes += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+void plat_close(PlatFile file)
+{
+    close(static_cast<int>(file));
+}
+
+PlatLibrary *plat_load_library(const char *filename)
+{
+    // dlopen searches the library path for bare names, but filename is a path
+    std::string path = strchr(filename, '/') == nullptr ? std::string("./") + filename : filename;
+    // Resolve everything now, so a broken library fails here rather than in the middle of a run
+    return static_cast<PlatLibrary*>(dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL));
+}
+
+void *plat_library_symbol(PlatLibrary *library, const char *name)
+{
+    return dlsym(library, name);
+}
+
+void plat_unload_library(PlatLibrary *library)
+{
+    dlclose(library);
+}
+
+bool plat_on_dump_request(void (*handler)())
+{
+    dump_request_handler.store(handler);
+
+    static bool installed = false;
+    static std::once_flag once;
+    std::call_once(once, []()
+    {
+        if (pipe(dump_request_pipe) != 0)
+            return;
+        fcntl(dump_request_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(dump_request_pipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl(dump_request_pipe[1], F_SETFL, O_NONBLOCK);
+        std::thread(&dump_thread_main).detach();
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = &handle_dump_request;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        installed = sigaction(SIGUSR1, &action, &previous_dump_action) == 0;
+    });
+    return installed;
+}
+
+void plat_on_fatal_fault(void (*handler)())
 {
-    int res = munmap(mem, nwords * sizeof(vmword));
+    fatal_fault_handler.store(handler);
 }
@@ -0,0 +1,292 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "vm.hpp"
+#include "platform.hpp"
+#include "symbols.hpp"
+
+static_assert(INSTRUCTION_COUNT == 34, "Update OPCODE_NAMES of the profiler.");
+
+namespace
+{
+    // Must be kept in the same order as the Opcode enum
+    const char *const OPCODE_NAMES[INSTRUCTION_COUNT] =
+    {
+        "nop", "halt", "push", "pop",
+        "add", "sub", "mul", "div",
+        "shl", "shr", "mod", "inc",
+        "dec", "not", "cmp", "mov",
+        "call", "ret", "jmp", "jeq",
+        "jne", "jnz", "rdrand", "syscall",
+        "vadd", "vsub", "vmul", "vxor",
+        "vfill", "vcopy", "vsum", "vmin",
+        "vmax", "vcount",
+    };
+
+    // A node of the tree of call stacks seen so far. The root is the code the run started in.
+    struct Frame
+    {
+        // Entry address of the function
+        vmword function;
+        size_t parent;
+        // Instructions executed in this function while it was called through this stack
+        uint64_t instructions;
+        // Number of calls that created this stack
+        uint64_t calls;
+    };
+
+    const size_t NO_FRAME = static_cast<size_t>(-1);
+
+    struct FrameKeyHash
+    {
+        size_t operator()(const std::pair<size_t, vmword> &key) const
+        {
+            return std::hash<size_t>()(key.first) ^ std::hash<vmword>()(key.second * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+}
+
+struct VMProfile
+{
+    // Executions per instruction slot, mapped lazily like the predecode table
+    uint64_t *slot_counts;
+    size_t slots;
+    // Slots with a non-zero count, in order of their first execution
+    std::vector<size_t> hit_slots;
+    // Executions of instructions that are not slot-aligned or outside of memory
+    std::unordered_map<vmword, uint64_t> other_counts;
+
+    uint64_t opcode_counts[INSTRUCTION_COUNT];
+    uint64_t invalid_opcodes;
+    uint64_t instructions;
+
+    std::vector<Frame> frames;
+    std::unordered_map<std::pair<size_t, vmword>, size_t, FrameKeyHash> children;
+    size_t current;
+};
+
+namespace
+{
+    void count_address(VMProfile *profile, vmword ip)
+    {
+        auto slot = ip >> 2;
+        if ((ip & 3) == 0 && slot < profile->slots)
+        {
+            if (profile->slot_counts[slot]++ == 0)
+                profile->hit_slots.push_back(slot);
+        }
+        else
+            profile->other_counts[ip]++;
+    }
+
+    void enter_function(VMProfile *profile, vmword function)
+    {
+        auto key = std::make_pair(profile->current, function);
+        auto child = profile->children.find(key);
+        if (child == profile->children.end())
+        {
+            profile->frames.push_back({ function, profile->current, 0, 0 });
+            child = profile->children.emplace(key, profile->frames.size() - 1).first;
+        }
+        profile->current = child->second;
+        profile->frames[profile->current].calls++;
+    }
+
+    void leave_function(VMProfile *profile)
+    {
+        // Returning from the function the run started in just drops back to the root
+        auto parent = profile->frames[profile->current].parent;
+        if (parent != NO_FRAME)
+            profile->current = parent;
+    }
+
+    // Record one executed instruction that was fetched at ip
+    void record(VMContext *ctx, VMProfile *profile, vmword ip, const Instruction &instr)
+    {
+        count_address(profile, ip);
+        profile->instructions++;
+        if (static_cast<uint32_t>(instr.opcode) < INSTRUCTION_COUNT)
+            profile->opcode_counts[instr.opcode]++;
+        else
+            profile->invalid_opcodes++;
+        profile->frames[profile->current].instructions++;
+
+        // A CALL that used up the budget of the run stopped ctx, but still went to
+        // the function, so the edge is recorded regardless of ctx->running
+        if (instr.opcode == OP_CALL)
+            enter_function(profile, ctx->registers[IP]);
+        else if (instr.opcode == OP_RET)
+            leave_function(profile);
+    }
+
+    double percent(uint64_t count, uint64_t total)
+    {
+        return total > 0 ? 100.0 * count / total : 0;
+    }
+}
+
+bool vm_profile_enable(VMContext *ctx)
+{
+    if (ctx->profile != nullptr)
+        return true;
+
+    auto slots = ctx->predecode_slots;
+    auto slot_counts = static_cast<uint64_t*>(plat_map_bytes(slots * sizeof(uint64_t)));
+    if (slot_counts == nullptr)
+        return false;
+
+    auto profile = new VMProfile;
+    profile->slot_counts = slot_counts;
+    profile->slots = slots;
+    std::fill(profile->opcode_counts, profile->opcode_counts + INSTRUCTION_COUNT, 0);
+    profile->invalid_opcodes = 0;
+    profile->instructions = 0;
+    profile->current = NO_FRAME;
+    ctx->profile = profile;
+    return true;
+}
+
+void vm_profile_disable(VMContext *ctx)
+{
+    if (ctx->profile == nullptr)
+        return;
+    plat_unmap_bytes(ctx->profile->slot_counts, ctx->profile->slots * sizeof(uint64_t));
+    delete ctx->profile;
+    ctx->profile = nullptr;
+}
+
+namespace
+{
+    void run_profiled(VMContext *ctx, void*)
+    {
+        auto profile = ctx->profile;
+        if (profile->current == NO_FRAME)
+        {
+            profile->frames.push_back({ ctx->registers[IP], NO_FRAME, 0, 0 });
+            profile->current = 0;
+        }
+
+        ctx->running = true;
+        while (ctx->running)
+        {
+            auto ip = ctx->registers[IP];
+            auto instr = vm_fetch_decode(ctx);
+            auto impl = instr->fusion != 0 ? instr->base_impl : instr->impl;
+            impl(ctx, &instr->instr);
+            ctx->registers[IC]++;
+            record(ctx, profile, ip, instr->instr);
+        }
+    }
+}
+
+VMTrap vm_run_profiled(VMContext *ctx)
+{
+    return vm_run_guarded(ctx, &run_profiled, nullptr);
+}
+
+void vm_profile_report(const VMContext *ctx, std::ostream &out, size_t top)
+{
+    auto profile = ctx->profile;
+    if (profile == nullptr)
+        return;
+    auto total = profile->instructions;
+    auto flags = out.flags();
+    out << std::fixed << std::setprecision(2);
+
+    out << "Profile: " << total << " instructions" << std::endl;
+
+    out << "Opcodes:" << std::endl;
+    std::vector<size_t> opcodes;
+    for (size_t i = 0; i < INSTRUCTION_COUNT; i++)
+    {
+        if (profile->opcode_counts[i] != 0)
+            opcodes.push_back(i);
+    }
+    std::stable_sort(opcodes.begin(), opcodes.end(), [profile](size_t a, size_t b)
+    {
+        return profile->opcode_counts[a] > profile->opcode_counts[b];
+    });
+    for (auto opcode : opcodes)
+    {
+        auto count = profile->opcode_counts[opcode];
+        out << "  " << std::left << std::setw(8) << OPCODE_NAMES[opcode] << std::right
+            << std::setw(14) << count << std::setw(8) << percent(count, total) << "%" << std::endl;
+    }
+    if (profile->invalid_opcodes != 0)
+        out << "  " << std::left << std::setw(8) << "invalid" << std::right << std::setw(14) << profile->invalid_opcodes << std::endl;
+
+    out << "Hot spots:" << std::endl;
+    std::vector<std::pair<vmword, uint64_t>> addresses;
+    for (auto slot : profile->hit_slots)
+        addresses.emplace_back(slot << 2, profile->slot_counts[slot]);
+    for (auto &other : profile->other_counts)
+        addresses.push_back(other);
+    auto shown = std::min(top, addresses.size());
+    std::partial_sort(addresses.begin(), addresses.begin() + shown, addresses.end(),
+        [](const std::pair<vmword, uint64_t> &a, const std::pair<vmword, uint64_t> &b)
+    {
+        return a.second > b.second || (a.second == b.second && a.first < b.first);
+    });
+    for (size_t i = 0; i < shown; i++)
+    {
+        auto address = addresses[i].first;
+        auto count = addresses[i].second;
+        std::string opcode = "?";
+        if ((address & 3) == 0 && (address >> 2) < ctx->predecode_slots)
+        {
+            auto &entry = ctx->predecoded[address >> 2];
+            if (entry.impl != nullptr && static_cast<uint32_t>(entry.instr.opcode) < INSTRUCTION_COUNT)
+                opcode = OPCODE_NAMES[entry.instr.opcode];
+        }
+        out << "  " << std::right << std::setw(14) << count << std::setw(8) << percent(count, total) << "%  "
+            << std::left << std::setw(8) << opcode << vm_symbols_describe(ctx->symbols, address) << std::endl;
+    }
+
+    // Merge the call tree into caller -> callee edges
+    out << "Call graph (calls):" << std::endl;
+    std::map<std::pair<vmword, vmword>, uint64_t> edge_calls;
+    for (auto &frame : profile->frames)
+    {
+        if (frame.parent != NO_FRAME)
+            edge_calls[std::make_pair(profile->frames[frame.parent].function, frame.function)] += frame.calls;
+    }
+    std::vector<std::pair<std::pair<vmword, vmword>, uint64_t>> edges(edge_calls.begin(), edge_calls.end());
+    std::stable_sort(edges.begin(), edges.end(),
+        [](const std::pair<std::pair<vmword, vmword>, uint64_t> &a, const std::pair<std::pair<vmword, vmword>, uint64_t> &b)
+    {
+        return a.second > b.second;
+    });
+    for (auto &edge : edges)
+    {
+        out << "  " << std::right << std::setw(14) << edge.second << "  "
+            << vm_symbols_function_name(ctx->symbols, edge.first.first) << " -> "
+            << vm_symbols_function_name(ctx->symbols, edge.first.second) << std::endl;
+    }
+    out.flags(flags);
+}
+
+void vm_profile_write_folded(const VMContext *ctx, std::ostream &out)
+{
+    auto profile = ctx->profile;
+    if (profile == nullptr)
+        return;
+    std::vector<std::string> stacks(profile->frames.size());
+    for (size_t i = 0; i < profile->frames.size(); i++)
+    {
+        // Parents are always created before their children
+        auto &frame = profile->frames[i];
+        auto name = vm_symbols_function_name(ctx->symbols, frame.function);
+        stacks[i] = frame.parent == NO_FRAME ? name : stacks[frame.parent] + ";" + name;
+        if (frame.instructions != 0)
+            out << stacks[i] << " " << frame.instructions << "\n";
+    }
+    out.flush();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <iosfwd>
+
+#include "vmtypes.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+enum VMTrap : int;
+
+// Opaque per-context profiling data
+struct VMProfile;
+
+// Enable profiling for ctx. Profiles are only recorded by vm_run_profiled,
+// the other run loops are not affected.
+// Returns false if the profile tables could not be allocated
+bool vm_profile_enable(VMContext *ctx);
+
+// Release the profile of ctx. Does nothing if profiling is not enabled.
+void vm_profile_disable(VMContext *ctx);
+
+// Run ctx until it stops, counting executions per instruction address and opcode,
+// and following CALL/RET to attribute instructions to call stacks.
+// Superinstructions are executed as their parts so each part is counted at its own address.
+// Profiling must have been enabled with vm_profile_enable.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted.
+VMTrap vm_run_profiled(VMContext *ctx);
+
+// Print per-opcode counts, the top hottest instruction addresses and the call graph edges.
+// Addresses are named after labels and source lines if ctx->symbols is set.
+void vm_profile_report(const VMContext *ctx, std::ostream &out, size_t top = 20);
+
+// Write instruction counts per call stack in the folded format read by flamegraph.pl,
+// one "frame;frame;frame count" line per distinct stack
+void vm_profile_write_folded(const VMContext *ctx, std::ostream &out);
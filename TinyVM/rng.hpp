@@ -0,0 +1,80 @@
+#pragma once
+
+#include "vmtypes.hpp"
+
+// Random number generator of a context, xoshiro256** by Blackman and Vigna.
+// Small, fast and good enough for anything but cryptography.
+struct VMRng
+{
+    uint64_t state[4];
+};
+
+// SplitMix64, expands a seed into a well-mixed state
+inline uint64_t vm_rng_splitmix(uint64_t &x)
+{
+    auto z = (x += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Reset rng to the sequence of seed. Equal seeds give equal sequences.
+inline void vm_rng_seed(VMRng &rng, uint64_t seed)
+{
+    for (auto &word : rng.state)
+        word = vm_rng_splitmix(seed);
+}
+
+inline uint64_t vm_rng_next(VMRng &rng)
+{
+    auto &s = rng.state;
+    auto rotl = [](uint64_t x, int k) { return (x << k) | (x >> (64 - k)); };
+    auto result = rotl(s[1] * 5, 7) * 9;
+    auto t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+// Uniform number in [0, bound), bound must not be 0.
+// Lemire's multiply-and-reject: unbiased, and divides only in the rare case that
+// a draw lands in the biased part.
+inline uint64_t vm_rng_below(VMRng &rng, uint64_t bound)
+{
+#if defined(__SIZEOF_INT128__)
+    auto product = static_cast<unsigned __int128>(vm_rng_next(rng)) * bound;
+    auto low = static_cast<uint64_t>(product);
+    if (low < bound)
+    {
+        // 2^64 mod bound
+        auto threshold = (0 - bound) % bound;
+        while (low < threshold)
+        {
+            product = static_cast<unsigned __int128>(vm_rng_next(rng)) * bound;
+            low = static_cast<uint64_t>(product);
+        }
+    }
+    return static_cast<uint64_t>(product >> 64);
+#else
+    // Reject the 2^64 mod bound lowest numbers, what remains is a multiple of bound
+    auto threshold = (0 - bound) % bound;
+    uint64_t value;
+    do
+        value = vm_rng_next(rng);
+    while (value < threshold);
+    return value % bound;
+#endif
+}
+
+// Uniform number in [min, max]. If max < min, the range wraps around past UINT64_MAX.
+inline uint64_t vm_rng_range(VMRng &rng, uint64_t min, uint64_t max)
+{
+    auto span = max - min;
+    if (span == UINT64_MAX)
+        return vm_rng_next(rng);
+    return min + vm_rng_below(rng, span + 1);
+}
@@ -0,0 +1,124 @@
+#include "symbols.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace
+{
+    const char *const SYMBOLS_HEADER = "TVMSYM 1";
+
+    std::string hex(vmword value)
+    {
+        std::ostringstream text;
+        text << "0x" << std::hex << value;
+        return text.str();
+    }
+
+    template<typename T>
+    bool by_address(const T &a, const T &b)
+    {
+        return a.address < b.address;
+    }
+
+    // Return the last entry of table with an address <= address, or nullptr
+    template<typename T>
+    const T* find_at_or_before(const std::vector<T> &table, vmword address)
+    {
+        auto next = std::upper_bound(table.begin(), table.end(), address,
+            [](vmword value, const T &entry) { return value < entry.address; });
+        return next == table.begin() ? nullptr : &*(next - 1);
+    }
+}
+
+VMSymbols* vm_symbols_load(const char *filename)
+{
+    std::ifstream file(filename);
+    std::string line;
+    if (!std::getline(file, line) || line != SYMBOLS_HEADER)
+        return nullptr;
+
+    auto symbols = new VMSymbols;
+    while (std::getline(file, line))
+    {
+        if (line.size() < 2 || line[1] != ' ')
+            continue;
+        auto rest = line.substr(2);
+        std::istringstream fields(rest);
+        switch (line[0])
+        {
+        case 'F':
+            symbols->source = rest;
+            break;
+        case 'L':
+        {
+            VMSymbol symbol;
+            if (fields >> symbol.address >> symbol.name)
+                symbols->labels.push_back(symbol);
+            break;
+        }
+        case 'S':
+        {
+            VMSourceLine source_line;
+            if (fields >> source_line.address >> source_line.line)
+                symbols->lines.push_back(source_line);
+            break;
+        }
+        default:
+            // Unknown entries are left for newer versions
+            break;
+        }
+    }
+
+    // tasm writes them sorted, but don't rely on it
+    std::stable_sort(symbols->labels.begin(), symbols->labels.end(), &by_address<VMSymbol>);
+    std::stable_sort(symbols->lines.begin(), symbols->lines.end(), &by_address<VMSourceLine>);
+    return symbols;
+}
+
+void vm_symbols_destroy(VMSymbols *symbols)
+{
+    delete symbols;
+}
+
+const VMSymbol* vm_symbols_find(const VMSymbols *symbols, vmword address)
+{
+    return find_at_or_before(symbols->labels, address);
+}
+
+uint32_t vm_symbols_line(const VMSymbols *symbols, vmword address)
+{
+    auto entry = find_at_or_before(symbols->lines, address);
+    // Only instruction starts have lines, anything in between belongs to the instruction before it
+    return entry != nullptr && address - entry->address < 4 ? entry->line : 0;
+}
+
+std::string vm_symbols_describe(const VMSymbols *symbols, vmword address)
+{
+    auto text = hex(address);
+    if (symbols == nullptr)
+        return text;
+
+    auto symbol = vm_symbols_find(symbols, address);
+    if (symbol != nullptr)
+    {
+        text += " " + symbol->name;
+        if (address != symbol->address)
+            text += "+" + hex(address - symbol->address);
+    }
+    auto line = vm_symbols_line(symbols, address);
+    if (line != 0)
+        text += " (" + symbols->source + ":" + std::to_string(line) + ")";
+    return text;
+}
+
+std::string vm_symbols_function_name(const VMSymbols *symbols, vmword address)
+{
+    if (symbols != nullptr)
+    {
+        auto symbol = vm_symbols_find(symbols, address);
+        if (symbol != nullptr && symbol->address == address)
+            return symbol->name;
+    }
+    return hex(address);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "vmtypes.hpp"
+
+// A label of the assembled program
+struct VMSymbol
+{
+    vmword address;
+    std::string name;
+};
+
+// Source line of the instruction at address
+struct VMSourceLine
+{
+    vmword address;
+    uint32_t line;
+};
+
+// Symbols of a program as written by tasm.py --symbols. Both tables are sorted by
+// address, so lookups are binary searches.
+struct VMSymbols
+{
+    std::string source;
+    std::vector<VMSymbol> labels;
+    std::vector<VMSourceLine> lines;
+};
+
+// Load a symbol file
+// Returns nullptr if the file can't be read or is not a symbol file
+VMSymbols* vm_symbols_load(const char *filename);
+
+// Destroy symbols loaded with vm_symbols_load
+void vm_symbols_destroy(VMSymbols *symbols);
+
+// Return the closest label at or before address, or nullptr if there is none
+const VMSymbol* vm_symbols_find(const VMSymbols *symbols, vmword address);
+
+// Return the source line of the instruction at address, or 0 if it is unknown
+uint32_t vm_symbols_line(const VMSymbols *symbols, vmword address);
+
+// Describe address as "0x100c fib+0x4 (fib.tasm:13)", leaving out what is unknown.
+// symbols may be nullptr, then only the address is printed.
+std::string vm_symbols_describe(const VMSymbols *symbols, vmword address);
+
+// Name the function starting at address, i.e. its label if one starts exactly there,
+// its address in hex otherwise. symbols may be nullptr.
+std::string vm_symbols_function_name(const VMSymbols *symbols, vmword address);
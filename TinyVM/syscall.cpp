@@ -0,0 +1,45 @@
+#include "syscall.hpp"
+
+#include "vm.hpp"
+
+bool vm_syscall_register(VMContext *ctx, vmword number, vm_syscall_func func, void *user)
+{
+    if (number >= VM_MAX_SYSCALLS)
+        return false;
+    if (ctx->syscalls == nullptr)
+    {
+        if (func == nullptr)
+            return true;
+        ctx->syscalls = new VMSyscallTable();
+    }
+    ctx->syscalls->entries[number].func = func;
+    ctx->syscalls->entries[number].user = user;
+    return true;
+}
+
+void vm_syscall_clear(VMContext *ctx)
+{
+    delete ctx->syscalls;
+    ctx->syscalls = nullptr;
+}
+
+void vm_syscall(VMContext *ctx, vmword number)
+{
+    auto table = ctx->syscalls;
+    if (table == nullptr || number >= VM_MAX_SYSCALLS || table->entries[number].func == nullptr)
+        vm_trap(ctx, TRAP_INVALID_SYSCALL);
+
+    auto &entry = table->entries[number];
+    auto trap = entry.func(ctx, entry.user);
+    if (trap != TRAP_NONE)
+        vm_trap(ctx, trap);
+}
+
+vmword* vm_memory_span(VMContext *ctx, vmword address, vmword count, bool write)
+{
+    if (address > ctx->memory_size || count > ctx->memory_size - address)
+        return nullptr;
+    if (write)
+        vm_invalidate_range(ctx, address, count);
+    return ctx->memory + address;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+#include "vmtypes.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+enum VMTrap : int;
+
+// Syscall numbers range from 0 to VM_MAX_SYSCALLS - 1
+const size_t VM_MAX_SYSCALLS = 256;
+
+// Native function called by SYSCALL. Arguments and results are passed in the registers,
+// buffers are accessed in place through vm_memory_span. Runs on the thread running ctx.
+// Returns TRAP_NONE to continue after the SYSCALL or the trap to stop ctx with.
+// Setting ctx->running to false stops ctx as if it executed HALT.
+typedef VMTrap (*vm_syscall_func)(VMContext *ctx, void *user);
+
+struct VMSyscall
+{
+    vm_syscall_func func;
+    void *user;
+};
+
+// Host functions of a context, indexed by syscall number
+struct VMSyscallTable
+{
+    VMSyscall entries[VM_MAX_SYSCALLS];
+};
+
+// Bind func to number, replacing the previous binding. Pass nullptr to unbind the number.
+// Returns false if number is out of range
+bool vm_syscall_register(VMContext *ctx, vmword number, vm_syscall_func func, void *user);
+
+// Drop all bindings of ctx
+void vm_syscall_clear(VMContext *ctx);
+
+// Call the function bound to number. Traps with TRAP_INVALID_SYSCALL if there is none,
+// or with whatever trap the function returned.
+void vm_syscall(VMContext *ctx, vmword number);
+
+// Pointer to count words of memory starting at address, without copying.
+// If write is set, the predecoded instructions of the range are dropped up front, so the
+// caller may store anything there until it returns to the guest.
+// Returns nullptr if the range is not inside memory
+vmword* vm_memory_span(VMContext *ctx, vmword address, vmword count, bool write);
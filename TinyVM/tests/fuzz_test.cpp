@@ -0,0 +1,554 @@
+// Differential fuzzer for the execution engines
+//
+// Generates random programs (arithmetic in every addressing mode, moves, stack
+// traffic, forward branches and calls, a counted loop), runs each with vm_run_table
+// and with every other engine, and checks they end with the same registers (IP, IC
+// and SP included), data memory, the stack and trap. Engines also run in budgeted
+// slices, which stop and resume them at arbitrary instructions.
+//
+// Usage: tinyvm_fuzz_test [programs] [programs compiled ahead of time]
+// Ahead-of-time compilation needs a compiler at test time, see TVM_TEST_AOT_CXX.
+
+#include "vm.hpp"
+#include "vm_threaded.hpp"
+#include "instruction_support.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#ifndef TVM_TEST_WORK_DIR
+#define TVM_TEST_WORK_DIR "."
+#endif
+
+namespace
+{
+    // Where programs are loaded, the stack and the data words they work on
+    const vmword PROGRAM_BASE = 1032;
+    const vmword STACK_SIZE = 1024;
+    const vmword DATA_BASE = 4000;
+    const size_t DATA_WORDS = 16;
+
+    // Number of times the loop of a program runs, kept in R15
+    const vmword LOOP_COUNT = 50;
+
+    // Programs run far fewer instructions than this, an engine still running after it is stuck
+    const vmword MAX_INSTRUCTIONS = 1000000;
+
+    ////////
+    // Program generation
+    ////////
+
+    class Generator
+    {
+    public:
+        explicit Generator(uint64_t seed) : rng(seed) {}
+
+        std::vector<InstructionData> program(size_t length)
+        {
+            std::vector<InstructionData> code;
+            std::vector<size_t> forward_jumps;
+            // Slots of POPs, which branches must not land on without their PUSH
+            std::vector<size_t> pops;
+            bool looped = false;
+
+            code.push_back(vmi_encode_instr_2(OP_MOV, OF_NORMAL, AM_REGISTER, R15, AM_LITERAL, LOOP_COUNT));
+            while (code.size() < length)
+            {
+                auto kind = rng() % 20;
+                if (kind < 10)
+                {
+                    const Opcode opcodes[] = { OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_SHL, OP_SHR, OP_MOD, OP_CMP };
+                    auto opcode = opcodes[rng() % 8];
+                    auto mode_b = source_mode();
+                    auto mode_c = source_mode();
+                    auto b = source(mode_b);
+                    auto c = source(mode_c);
+                    // Divide by literals, zero every now and then
+                    if (opcode == OP_DIV || opcode == OP_MOD)
+                    {
+                        mode_c = AM_LITERAL;
+                        c = rng() % 8 == 0 ? 0 : 1 + rng() % 50;
+                    }
+                    code.push_back(vmi_encode_instr_3(opcode, OF_NORMAL, AM_REGISTER, target(), mode_b, b, mode_c, c));
+                }
+                else if (kind < 12)
+                {
+                    const Opcode opcodes[] = { OP_INC, OP_DEC, OP_NOT };
+                    code.push_back(vmi_encode_instr_1(opcodes[rng() % 3], OF_NORMAL, AM_REGISTER, target()));
+                }
+                else if (kind < 14)
+                {
+                    auto mode = source_mode();
+                    code.push_back(vmi_encode_instr_2(OP_MOV, OF_NORMAL, AM_REGISTER, target(), mode, source(mode)));
+                }
+                else if (kind < 15)
+                {
+                    auto mode = source_mode();
+                    code.push_back(vmi_encode_instr_3(OP_ADD, OF_NORMAL, AM_MEMORY, DATA_BASE + rng() % DATA_WORDS,
+                        mode, source(mode), AM_REGISTER, rng() % 16));
+                }
+                else if (kind < 16)
+                {
+                    code.push_back(vmi_encode_instr_1(OP_PUSH, OF_NORMAL, AM_REGISTER, rng() % 16));
+                    pops.push_back(code.size());
+                    code.push_back(vmi_encode_instr_1(OP_POP, OF_NORMAL, AM_REGISTER, rng() % 15));
+                }
+                else if (!looped)
+                {
+                    looped = true;
+                    loop(code, pops);
+                }
+                else
+                {
+                    // Some come in the pairs vm_fuse combines: a compare or count down
+                    // followed by a branch on its result, or a push followed by a call
+                    auto pair = rng() % 4;
+                    auto reg = target();
+                    if (pair == 0)
+                    {
+                        auto mode_b = source_mode();
+                        auto mode_c = source_mode();
+                        code.push_back(vmi_encode_instr_3(OP_CMP, OF_NORMAL, AM_REGISTER, reg, mode_b, source(mode_b), mode_c, source(mode_c)));
+                    }
+                    else if (pair == 1)
+                        code.push_back(vmi_encode_instr_1(OP_DEC, OF_NORMAL, AM_REGISTER, reg));
+                    else if (pair == 2)
+                        code.push_back(vmi_encode_instr_1(OP_PUSH, OF_NORMAL, AM_REGISTER, rng() % 16));
+
+                    // Patched to a target inside the program below
+                    forward_jumps.push_back(code.size());
+                    if (pair < 2)
+                        code.push_back(vmi_encode_instr_2(OP_JNZ, OF_NORMAL, AM_LITERAL, 0, AM_REGISTER, reg));
+                    else if (pair == 2)
+                        code.push_back(vmi_encode_instr_1(OP_CALL, OF_NORMAL, AM_LITERAL, 0));
+                    else
+                        code.push_back(branch(0));
+                }
+            }
+
+            for (auto slot : forward_jumps)
+            {
+                auto target = slot + 1 + rng() % (code.size() - slot);
+                if (std::find(pops.begin(), pops.end(), target) != pops.end())
+                    target++;
+                code[slot].words[1] = address_of(target);
+            }
+            code.push_back(vmi_encode_instr_0(OP_HALT));
+            return code;
+        }
+
+        uint64_t next() { return rng(); }
+
+    private:
+        std::mt19937_64 rng;
+
+        static vmword address_of(size_t slot)
+        {
+            return PROGRAM_BASE + 4 * slot;
+        }
+
+        AddressingMode source_mode()
+        {
+            auto kind = rng() % 10;
+            return kind < 3 ? AM_LITERAL : kind < 5 ? AM_MEMORY
+                : kind < 6 ? static_cast<AddressingMode>(AM_MEMORY | AM_INDIRECT) : AM_REGISTER;
+        }
+
+        vmword source(AddressingMode mode)
+        {
+            if (mode == AM_LITERAL)
+                return rng() % 4 == 0 ? rng() : rng() % 100;
+            if (mode & AM_MEMORY)
+                return DATA_BASE + rng() % DATA_WORDS;
+            const vmword special[] = { RMD, SP, SBP, IC };
+            auto index = rng() % 20;
+            return index < 16 ? index : special[index - 16];
+        }
+
+        // Any general purpose register but the loop counter, or RMD
+        vmword target()
+        {
+            auto index = rng() % 16;
+            return index < 15 ? index : static_cast<vmword>(RMD);
+        }
+
+        InstructionData branch(vmword target)
+        {
+            auto mode_b = source_mode();
+            auto mode_c = source_mode();
+            switch (rng() % 3)
+            {
+            case 0:
+                return vmi_encode_instr_2(OP_JNZ, OF_NORMAL, AM_LITERAL, target, mode_b, source(mode_b));
+            case 1:
+                return vmi_encode_instr_3(OP_JNE, OF_NORMAL, AM_LITERAL, target, mode_b, source(mode_b), mode_c, source(mode_c));
+            default:
+                return vmi_encode_instr_3(OP_JEQ, OF_NORMAL, AM_LITERAL, target, mode_b, source(mode_b), mode_c, source(mode_c));
+            }
+        }
+
+        // Count down R15 and jump back to a random earlier instruction while it is not zero
+        void loop(std::vector<InstructionData> &code, const std::vector<size_t> &pops)
+        {
+            auto target = 1 + rng() % code.size();
+            if (std::find(pops.begin(), pops.end(), target) != pops.end())
+                target--;
+            code.push_back(vmi_encode_instr_1(OP_DEC, OF_NORMAL, AM_REGISTER, R15));
+            switch (rng() % 3)
+            {
+            case 0:
+                code.push_back(vmi_encode_instr_2(OP_JNZ, OF_NORMAL, AM_LITERAL, address_of(target), AM_REGISTER, R15));
+                break;
+            case 1:
+                code.push_back(vmi_encode_instr_3(OP_JNE, OF_NORMAL, AM_LITERAL, address_of(target), AM_REGISTER, R15, AM_LITERAL, 0));
+                break;
+            default:
+                // Forward over an unconditional backward jump
+                code.push_back(vmi_encode_instr_3(OP_JEQ, OF_NORMAL, AM_LITERAL, address_of(code.size() + 2), AM_REGISTER, R15, AM_LITERAL, 0));
+                code.push_back(vmi_encode_instr_1(OP_JMP, OF_NORMAL, AM_LITERAL, address_of(target)));
+                break;
+            }
+        }
+    };
+
+    ////////
+    // Running programs
+    ////////
+
+    struct FuzzCase
+    {
+        std::vector<InstructionData> code;
+        // Seed of the initial registers and data
+        uint64_t seed;
+        // Compiled with tvm-aot, empty if it was not
+        std::string library;
+    };
+
+    struct Outcome
+    {
+        vmword registers[VM_REGISTER_COUNT];
+        vmword data[DATA_WORDS];
+        // Memory up to the program, which holds the stack
+        vmword stack[PROGRAM_BASE];
+        VMTrap trap;
+        vmword trap_address;
+    };
+
+    // Fill registers and data with values from seed
+    void init_state(VMContext *ctx, uint64_t seed)
+    {
+        std::mt19937_64 rng(seed);
+        for (int i = 0; i < 15; i++)
+            ctx->registers[i] = rng() % 1000;
+        for (size_t i = 0; i < DATA_WORDS; i++)
+            ctx->memory[DATA_BASE + i] = rng() % 1000;
+    }
+
+    // A context with the program of fuzz_case loaded, but no state
+    VMContext *load_program(const FuzzCase &fuzz_case)
+    {
+        auto ctx = vm_create();
+        vm_init_stack(ctx, STACK_SIZE);
+        vm_init_programbase(ctx, PROGRAM_BASE);
+        auto code = fuzz_case.code;
+        vm_load_program(ctx, code.data(), code.size());
+        return ctx;
+    }
+
+    Outcome outcome(const VMContext *ctx)
+    {
+        Outcome result;
+        memcpy(result.registers, ctx->registers, sizeof(result.registers));
+        memcpy(result.data, ctx->memory + DATA_BASE, sizeof(result.data));
+        memcpy(result.stack, ctx->memory, sizeof(result.stack));
+        result.trap = ctx->trap;
+        result.trap_address = ctx->trap != TRAP_NONE ? ctx->trap_address : 0;
+        return result;
+    }
+
+    // Print how actual differs from expected, returns whether it does
+    bool differs(const Outcome &expected, const Outcome &actual, const char *engine, size_t index)
+    {
+        if (memcmp(expected.registers, actual.registers, sizeof(expected.registers)) == 0
+            && memcmp(expected.data, actual.data, sizeof(expected.data)) == 0
+            && memcmp(expected.stack, actual.stack, sizeof(expected.stack)) == 0
+            && expected.trap == actual.trap && expected.trap_address == actual.trap_address)
+            return false;
+        std::cerr << "Program " << index << " differs under " << engine << ":" << std::endl;
+        for (int i = 0; i < VM_REGISTER_COUNT; i++)
+        {
+            if (expected.registers[i] != actual.registers[i])
+                std::cerr << "  register " << i << ": " << expected.registers[i] << " vs " << actual.registers[i] << std::endl;
+        }
+        for (size_t i = 0; i < DATA_WORDS; i++)
+        {
+            if (expected.data[i] != actual.data[i])
+                std::cerr << "  word " << DATA_BASE + i << ": " << expected.data[i] << " vs " << actual.data[i] << std::endl;
+        }
+        for (size_t i = 0; i < PROGRAM_BASE; i++)
+        {
+            if (expected.stack[i] != actual.stack[i])
+                std::cerr << "  word " << i << ": " << expected.stack[i] << " vs " << actual.stack[i] << std::endl;
+        }
+        if (expected.trap != actual.trap || expected.trap_address != actual.trap_address)
+        {
+            std::cerr << "  trap: " << vm_trap_message(expected.trap) << " at " << expected.trap_address
+                << " vs " << vm_trap_message(actual.trap) << " at " << actual.trap_address << std::endl;
+        }
+        return true;
+    }
+
+    ////////
+    // Engines
+    ////////
+
+    // Load the program as compact code, in sections split at instructions without a compact form
+    bool load_compact(VMContext *ctx, const FuzzCase &fuzz_case)
+    {
+        std::vector<uint8_t> code;
+        size_t count = 0;
+        auto section = PROGRAM_BASE;
+        auto flush = [&](vmword next)
+        {
+            auto loaded = count == 0 || vm_compact_load(ctx, section, code.data(), code.size(), count);
+            code.clear();
+            count = 0;
+            section = next;
+            return loaded;
+        };
+
+        for (size_t i = 0; i < fuzz_case.code.size(); i++)
+        {
+            auto address = PROGRAM_BASE + 4 * i;
+            auto instr = vmi_decode(&fuzz_case.code[i]);
+            uint8_t bytes[VMI_COMPACT_MAX_BYTES];
+            auto length = vmi_encode_compact(&instr, bytes);
+            if (length == 0)
+            {
+                if (!flush(address + 4))
+                    return false;
+                continue;
+            }
+            code.insert(code.end(), bytes, bytes + length);
+            count++;
+        }
+        return flush(0);
+    }
+
+    bool prepare_none(VMContext*, const FuzzCase&)
+    {
+        return true;
+    }
+
+    bool prepare_jit(VMContext *ctx, const FuzzCase&)
+    {
+        return vm_jit_enable(ctx);
+    }
+
+    bool prepare_fused(VMContext *ctx, const FuzzCase &fuzz_case)
+    {
+        vm_fuse(ctx, PROGRAM_BASE, 4 * fuzz_case.code.size());
+        return true;
+    }
+
+    bool prepare_fused_jit(VMContext *ctx, const FuzzCase &fuzz_case)
+    {
+        return prepare_fused(ctx, fuzz_case) && prepare_jit(ctx, fuzz_case);
+    }
+
+    // Programs that fail verification just run unverified
+    bool prepare_verified(VMContext *ctx, const FuzzCase&)
+    {
+        vm_verify(ctx);
+        return true;
+    }
+
+    bool prepare_fused_verified(VMContext *ctx, const FuzzCase &fuzz_case)
+    {
+        return prepare_fused(ctx, fuzz_case) && prepare_verified(ctx, fuzz_case);
+    }
+
+    bool prepare_aot(VMContext *ctx, const FuzzCase &fuzz_case)
+    {
+        return vm_aot_load(ctx, fuzz_case.library.c_str());
+    }
+
+    bool prepare_fused_aot(VMContext *ctx, const FuzzCase &fuzz_case)
+    {
+        return prepare_fused(ctx, fuzz_case) && prepare_aot(ctx, fuzz_case);
+    }
+
+    struct Engine
+    {
+        const char *name;
+        bool (*prepare)(VMContext *ctx, const FuzzCase &fuzz_case);
+        vm_engine run;
+        // Budget of the slices it runs in, 0 to run in one go
+        vmword slice;
+        // Only runs programs compiled ahead of time
+        bool aot;
+    };
+
+    const Engine ENGINES[] =
+    {
+        { "threaded", &prepare_none, &vm_run_threaded, 0, false },
+        { "jit", &prepare_jit, &vm_run_jit, 0, false },
+        { "fused", &prepare_fused, &vm_run_table, 0, false },
+        { "fused jit", &prepare_fused_jit, &vm_run_jit, 0, false },
+        { "compact", &load_compact, &vm_run_compact, 0, false },
+        { "verified", &prepare_verified, &vm_run_table, 0, false },
+        { "verified threaded", &prepare_verified, &vm_run_threaded, 0, false },
+        { "fused verified", &prepare_fused_verified, &vm_run_table, 0, false },
+        { "fused verified threaded", &prepare_fused_verified, &vm_run_threaded, 0, false },
+        { "table in slices of 1", &prepare_none, &vm_run_table, 1, false },
+        { "threaded in slices of 3", &prepare_none, &vm_run_threaded, 3, false },
+        { "jit in slices of 1", &prepare_jit, &vm_run_jit, 1, false },
+        { "fused jit in slices of 5", &prepare_fused_jit, &vm_run_jit, 5, false },
+        { "compact in slices of 2", &load_compact, &vm_run_compact, 2, false },
+        { "verified in slices of 3", &prepare_verified, &vm_run_table, 3, false },
+        { "aot", &prepare_aot, &vm_run_aot, 0, true },
+        { "fused aot", &prepare_fused_aot, &vm_run_aot, 0, true },
+        { "aot in slices of 7", &prepare_aot, &vm_run_aot, 7, true },
+    };
+
+    // Run ctx with engine until it stops, returns false if it did not within MAX_INSTRUCTIONS
+    bool run(VMContext *ctx, const Engine &engine)
+    {
+        auto slice = engine.slice != 0 ? engine.slice : MAX_INSTRUCTIONS;
+        while (vm_run(ctx, slice, engine.run) == TRAP_NONE && ctx->running)
+        {
+            if (ctx->registers[IC] >= MAX_INSTRUCTIONS)
+                return false;
+        }
+        return true;
+    }
+
+    Outcome run_table(const FuzzCase &fuzz_case)
+    {
+        auto ctx = load_program(fuzz_case);
+        init_state(ctx, fuzz_case.seed);
+        vm_run_table(ctx);
+        auto result = outcome(ctx);
+        vm_destroy(ctx);
+        return result;
+    }
+
+    // Returns the number of engines that disagree with the table engine
+    int check_engines(const FuzzCase &fuzz_case, const Outcome &expected, size_t index)
+    {
+        int failures = 0;
+        for (auto &engine : ENGINES)
+        {
+            if (engine.aot && fuzz_case.library.empty())
+                continue;
+            auto ctx = load_program(fuzz_case);
+            init_state(ctx, fuzz_case.seed);
+            if (!engine.prepare(ctx, fuzz_case))
+            {
+                std::cerr << "Program " << index << ": could not prepare " << engine.name << std::endl;
+                failures++;
+            }
+            else if (!run(ctx, engine))
+            {
+                std::cerr << "Program " << index << " did not stop under " << engine.name << std::endl;
+                failures++;
+            }
+            else
+                failures += differs(expected, outcome(ctx), engine.name, index);
+            vm_destroy(ctx);
+        }
+        return failures;
+    }
+
+    // Run lanes copies of the program with their own state in one batch
+    int check_batch(const FuzzCase &fuzz_case, size_t lanes, size_t index)
+    {
+        auto base = load_program(fuzz_case);
+        auto snapshot = vm_snapshot(base);
+        vm_destroy(base);
+
+        std::vector<VMContext*> contexts;
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            contexts.push_back(vm_fork(snapshot));
+            init_state(contexts.back(), fuzz_case.seed + lane);
+        }
+        vm_run_batch(snapshot, contexts.data(), lanes);
+
+        int failures = 0;
+        for (size_t lane = 0; lane < lanes; lane++)
+        {
+            auto lane_case = fuzz_case;
+            lane_case.seed += lane;
+            failures += differs(run_table(lane_case), outcome(contexts[lane]), "batch", index);
+            vm_destroy(contexts[lane]);
+        }
+        vm_snapshot_destroy(snapshot);
+        return failures;
+    }
+
+    // Compile the program ahead of time like tvm-aot does.
+    // Returns the library, empty if it could not be built.
+    std::string compile(const FuzzCase &fuzz_case, size_t index)
+    {
+#ifdef TVM_TEST_AOT_CXX
+        auto ctx = load_program(fuzz_case);
+        auto library = std::string(TVM_TEST_WORK_DIR) + "/fuzz_" + std::to_string(index) + ".so";
+        auto source = library + ".cpp";
+        std::ofstream file(source);
+        vm_aot_emit(ctx, file);
+        file.close();
+        vm_destroy(ctx);
+
+        auto command = std::string(TVM_TEST_AOT_CXX) + " -std=c++11 -O1 -shared -fPIC -o \"" + library + "\" \"" + source + "\"";
+        if (!file || std::system(command.c_str()) != 0)
+        {
+            std::cerr << "Program " << index << ": could not build " << library << std::endl;
+            return std::string();
+        }
+        return library;
+#else
+        return std::string();
+#endif
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t programs = argc > 1 ? strtoul(argv[1], nullptr, 10) : 500;
+    size_t aot_programs = argc > 2 ? strtoul(argv[2], nullptr, 10) : 8;
+
+    int failures = 0;
+    size_t traps = 0;
+    for (size_t i = 0; i < programs; i++)
+    {
+        Generator generator(i);
+        FuzzCase fuzz_case;
+        fuzz_case.code = generator.program(5 + generator.next() % 40);
+        fuzz_case.seed = generator.next();
+        if (i < aot_programs)
+        {
+            fuzz_case.library = compile(fuzz_case, i);
+            failures += fuzz_case.library.empty();
+        }
+
+        auto expected = run_table(fuzz_case);
+        traps += expected.trap != TRAP_NONE;
+        failures += check_engines(fuzz_case, expected, i);
+        failures += check_batch(fuzz_case, 1 + i % 8, i);
+    }
+
+    if (failures != 0)
+    {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    std::cout << "All engines agree on " << programs << " programs (" << traps << " trapped)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,117 @@
+// Checks that profiles don't depend on how a run is sliced
+//
+// Runs the workloads in bench/workloads profiled once in a single run and once
+// split into runs of a few instructions each, like VMPool and vm_run_for do, and
+// compares the folded call stacks. A CALL or RET at the end of a slice must leave
+// the call tree exactly where an uninterrupted run would.
+
+#include "vm.hpp"
+#include "assembler.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+
+#ifndef TVM_TEST_WORKLOAD_DIR
+#define TVM_TEST_WORKLOAD_DIR "."
+#endif
+
+namespace
+{
+    // fib is the one that calls, collatz checks that plain jumps are unaffected
+    const char *const WORKLOADS[] = { "fib", "collatz" };
+
+    // Budgets of the sliced runs, small ones end slices on every kind of instruction
+    const vmword BUDGETS[] = { 1, 2, 5, 7, 1000 };
+
+    bool read_file(const std::string &filename, std::string &text)
+    {
+        std::ifstream file(filename, std::ios::binary);
+        if (!file)
+            return false;
+        text.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    // Profile source run in slices of budget instructions, or in one run if budget is 0.
+    // Returns false and prints why if it could not be run.
+    bool profile(const std::string &name, const std::string &source, vmword budget, std::string &folded)
+    {
+        auto ctx = vm_create();
+        auto assembled = vm_assemble(ctx, source.data(), source.size());
+        if (assembled.error != ASSEMBLE_OK)
+        {
+            std::cerr << name << ": " << vm_assemble_message(assembled.error) << " in line " << assembled.line << std::endl;
+            vm_destroy(ctx);
+            return false;
+        }
+        vm_profile_enable(ctx);
+
+        auto trap = TRAP_NONE;
+        if (budget == 0)
+            trap = vm_run_profiled(ctx);
+        else
+        {
+            do
+                trap = vm_run(ctx, budget, &vm_run_profiled);
+            while (trap == TRAP_NONE && ctx->running);
+        }
+
+        std::ostringstream out;
+        vm_profile_write_folded(ctx, out);
+        folded = out.str();
+        vm_destroy(ctx);
+
+        if (trap != TRAP_NONE)
+        {
+            std::cerr << name << ": trapped with " << vm_trap_message(trap) << std::endl;
+            return false;
+        }
+        return true;
+    }
+}
+
+int main()
+{
+    int failures = 0;
+    for (auto name : WORKLOADS)
+    {
+        std::string source;
+        if (!read_file(std::string(TVM_TEST_WORKLOAD_DIR) + "/" + name + ".tasm", source))
+        {
+            std::cerr << name << ": could not read the workload" << std::endl;
+            failures++;
+            continue;
+        }
+
+        std::string expected;
+        if (!profile(name, source, 0, expected))
+        {
+            failures++;
+            continue;
+        }
+        for (auto budget : BUDGETS)
+        {
+            std::string folded;
+            if (!profile(name, source, budget, folded))
+                failures++;
+            else if (folded != expected)
+            {
+                std::cerr << name << ": profile of runs of " << budget << " instructions differs" << std::endl
+                    << "single run:" << std::endl << expected
+                    << "sliced:" << std::endl << folded;
+                failures++;
+            }
+        }
+    }
+
+    if (failures != 0)
+    {
+        std::cerr << failures << " failures" << std::endl;
+        return 1;
+    }
+    std::cout << "Profiles match for all budgets" << std::endl;
+    return 0;
+}
@@ -0,0 +1,535 @@
+#include "tinyvm.h"
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "vm.hpp"
+#include "vm_threaded.hpp"
+#include "vm_pool.hpp"
+#include "assembler.hpp"
+#include "instruction_support.hpp"
+#include "symbols.hpp"
+#include "config.hpp"
+
+static_assert(TVM_REGISTER_COUNT == static_cast<int>(VM_REGISTER_COUNT) && TVM_RMD == static_cast<int>(RMD),
+    "tvm_register must match Registers");
+static_assert(TVM_TRAP_INVALID_SYSCALL == static_cast<int>(TRAP_INVALID_SYSCALL),
+    "tvm_trap must match VMTrap");
+static_assert(TVM_MAX_SYSCALLS == VM_MAX_SYSCALLS, "TVM_MAX_SYSCALLS must match VM_MAX_SYSCALLS");
+
+// A host function bound with tvm_register_syscall, the user data of its VM-level binding
+struct tvm_syscall_binding
+{
+    tvm_context *ctx;
+    tvm_syscall_func func;
+    void *user;
+};
+
+struct tvm_context
+{
+    VMContext *vm;
+    tvm_engine engine;
+    tvm_status status;
+    std::shared_ptr<VMSymbols> symbols;
+    // Library loaded with tvm_load_aot, loaded again by forks
+    std::string aot;
+    // One entry per syscall number once the first one is bound, never reallocated after that
+    std::vector<tvm_syscall_binding> syscalls;
+};
+
+struct tvm_snapshot
+{
+    VMSnapshot *vm;
+    tvm_engine engine;
+    tvm_status status;
+    std::shared_ptr<VMSymbols> symbols;
+    std::string aot;
+    std::vector<tvm_syscall_binding> syscalls;
+};
+
+struct tvm_pool
+{
+    explicit tvm_pool(size_t worker_count, vmword slice)
+        : pool(worker_count, slice)
+    {
+    }
+
+    VMPool pool;
+};
+
+namespace
+{
+    const vmword DEFAULT_STACK_SIZE = 2048;
+
+    tvm_context* wrap(VMContext *vm, tvm_engine engine, tvm_status status)
+    {
+        auto ctx = new tvm_context;
+        ctx->vm = vm;
+        ctx->engine = engine;
+        ctx->status = status;
+        return ctx;
+    }
+
+    void update_status(tvm_context *ctx)
+    {
+        if (ctx->vm->trap != TRAP_NONE)
+            ctx->status = TVM_STATUS_TRAPPED;
+        else
+            ctx->status = ctx->vm->running ? TVM_STATUS_READY : TVM_STATUS_HALTED;
+    }
+
+    vm_engine select_engine(const tvm_context *ctx)
+    {
+        if (ctx->vm->profile != nullptr)
+            return &vm_run_profiled;
+        switch (ctx->engine)
+        {
+        case TVM_ENGINE_THREADED:
+            return &vm_run_threaded;
+        case TVM_ENGINE_JIT:
+            return &vm_run_jit;
+        case TVM_ENGINE_COMPACT:
+            return &vm_run_compact;
+        case TVM_ENGINE_AOT:
+            return &vm_run_aot;
+        default:
+            return &vm_run_table;
+        }
+    }
+
+    VMTrap call_syscall(VMContext *vm, void *user)
+    {
+        auto binding = static_cast<const tvm_syscall_binding*>(user);
+        return static_cast<VMTrap>(binding->func(binding->ctx, vm->registers, binding->user));
+    }
+
+    // Copy text to buffer the way snprintf does
+    size_t copy_text(const std::string &text, char *buffer, size_t size)
+    {
+        if (size > 0)
+        {
+            auto length = text.size() < size - 1 ? text.size() : size - 1;
+            memcpy(buffer, text.data(), length);
+            buffer[length] = '\0';
+        }
+        return text.size();
+    }
+
+    // Reset the registers to the defaults for images, load one with load and restore them if that failed
+    template<typename Load>
+    int load_with_defaults(tvm_context *ctx, Load load)
+    {
+        auto vm = ctx->vm;
+        vmword saved[VM_REGISTER_COUNT];
+        memcpy(saved, vm->registers, sizeof(saved));
+        memset(vm->registers, 0, sizeof(vm->registers));
+        vm_init_stack(vm, DEFAULT_STACK_SIZE);
+        vm_init_programbase(vm, 0);
+        if (!load(vm))
+        {
+            memcpy(vm->registers, saved, sizeof(saved));
+            return 0;
+        }
+        tvm_resume(ctx);
+        return 1;
+    }
+}
+
+uint32_t tvm_api_version(void)
+{
+    return TVM_API_VERSION;
+}
+
+const char* tvm_version(void)
+{
+    return TVM_VERSION;
+}
+
+tvm_context* tvm_create(uint64_t memory_words)
+{
+    auto vm = vm_create(memory_words != 0 ? memory_words : VM_MEMORY_SIZE);
+    if (vm == nullptr)
+        return nullptr;
+    return wrap(vm, TVM_ENGINE_TABLE, TVM_STATUS_READY);
+}
+
+void tvm_destroy(tvm_context *ctx)
+{
+    if (ctx == nullptr)
+        return;
+    vm_destroy(ctx->vm);
+    delete ctx;
+}
+
+int tvm_set_engine(tvm_context *ctx, tvm_engine engine)
+{
+    switch (engine)
+    {
+    case TVM_ENGINE_TABLE:
+    case TVM_ENGINE_THREADED:
+    case TVM_ENGINE_COMPACT:
+        break;
+    case TVM_ENGINE_JIT:
+        if (ctx->vm->jit == nullptr && !vm_jit_enable(ctx->vm))
+            return 0;
+        break;
+    case TVM_ENGINE_AOT:
+        if (ctx->vm->aot == nullptr)
+            return 0;
+        break;
+    default:
+        return 0;
+    }
+    ctx->engine = engine;
+    return 1;
+}
+
+int tvm_load_image(tvm_context *ctx, const void *data, size_t size)
+{
+    return load_with_defaults(ctx, [data, size](VMContext *vm) { return vmi_load_image(data, size, vm); });
+}
+
+int tvm_load_image_file(tvm_context *ctx, const char *filename)
+{
+    return load_with_defaults(ctx, [filename](VMContext *vm) { return vmi_load_memory_image_file(filename, vm); });
+}
+
+int tvm_assemble(tvm_context *ctx, const char *source, size_t length, char *message, size_t size)
+{
+    VMAssembleResult result;
+    auto assembled = load_with_defaults(ctx, [&](VMContext *vm)
+    {
+        result = vm_assemble(vm, source, length);
+        return result.error == ASSEMBLE_OK;
+    });
+    std::ostringstream text;
+    if (assembled)
+        text << "Assembled " << result.instructions << " instructions";
+    else
+        text << vm_assemble_message(result.error) << " in line " << result.line;
+    copy_text(text.str(), message, size);
+    return assembled;
+}
+
+int tvm_load_aot(tvm_context *ctx, const char *filename)
+{
+    if (!vm_aot_load(ctx->vm, filename))
+        return 0;
+    ctx->aot = filename;
+    return 1;
+}
+
+int tvm_load_symbols(tvm_context *ctx, const char *filename)
+{
+    auto symbols = vm_symbols_load(filename);
+    if (symbols == nullptr)
+        return 0;
+    ctx->symbols.reset(symbols, &vm_symbols_destroy);
+    ctx->vm->symbols = symbols;
+    return 1;
+}
+
+void tvm_fuse(tvm_context *ctx, uint64_t address, uint64_t words)
+{
+    vm_fuse(ctx->vm, address, words);
+}
+
+int tvm_verify(tvm_context *ctx, char *message, size_t size)
+{
+    auto result = vm_verify(ctx->vm);
+    std::ostringstream text;
+    if (result.error != VERIFY_OK)
+        text << vm_verify_message(result.error) << " at " << vm_symbols_describe(ctx->symbols.get(), result.address);
+    else
+    {
+        text << "Verified " << result.instructions << " instructions, ";
+        if (result.stack_bounded)
+            text << "stack depth at most " << result.stack_depth << " words";
+        else
+            text << "stack checked at runtime";
+    }
+    copy_text(text.str(), message, size);
+    return result.error == VERIFY_OK;
+}
+
+uint64_t tvm_memory_size(const tvm_context *ctx)
+{
+    return ctx->vm->memory_size;
+}
+
+uint64_t* tvm_memory_span(tvm_context *ctx, uint64_t address, uint64_t count, int write)
+{
+    return vm_memory_span(ctx->vm, address, count, write != 0);
+}
+
+int tvm_read_memory(const tvm_context *ctx, uint64_t address, uint64_t *words, size_t count)
+{
+    auto size = ctx->vm->memory_size;
+    if (address > size || count > size - address)
+        return 0;
+    memcpy(words, ctx->vm->memory + address, count * sizeof(vmword));
+    return 1;
+}
+
+int tvm_write_memory(tvm_context *ctx, uint64_t address, const uint64_t *words, size_t count)
+{
+    auto size = ctx->vm->memory_size;
+    if (address > size || count > size - address)
+        return 0;
+    memcpy(ctx->vm->memory + address, words, count * sizeof(vmword));
+    vm_invalidate_range(ctx->vm, address, count);
+    return 1;
+}
+
+void tvm_seed(tvm_context *ctx, uint64_t seed)
+{
+    vm_seed(ctx->vm, seed);
+}
+
+uint64_t tvm_get_register(const tvm_context *ctx, tvm_register reg)
+{
+    return static_cast<unsigned>(reg) < VM_REGISTER_COUNT ? ctx->vm->registers[reg] : 0;
+}
+
+int tvm_set_register(tvm_context *ctx, tvm_register reg, uint64_t value)
+{
+    if (static_cast<unsigned>(reg) >= VM_REGISTER_COUNT)
+        return 0;
+    ctx->vm->registers[reg] = value;
+    // The stack proof started from the old ones
+    if (reg == TVM_IP || reg == TVM_SP || reg == TVM_SBP)
+        vm_verify_drop_stack(ctx->vm);
+    return 1;
+}
+
+tvm_status tvm_run(tvm_context *ctx, uint64_t max_instructions)
+{
+    if (ctx->status != TVM_STATUS_READY)
+        return ctx->status;
+
+    auto engine = select_engine(ctx);
+    if (max_instructions != 0)
+        vm_run(ctx->vm, max_instructions, engine);
+    else
+        engine(ctx->vm);
+    update_status(ctx);
+    return ctx->status;
+}
+
+tvm_status tvm_run_for(tvm_context *ctx, uint64_t microseconds)
+{
+    if (ctx->status != TVM_STATUS_READY)
+        return ctx->status;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(microseconds);
+    vm_run_for(ctx->vm, deadline, select_engine(ctx));
+    update_status(ctx);
+    return ctx->status;
+}
+
+void tvm_resume(tvm_context *ctx)
+{
+    ctx->vm->running = true;
+    ctx->vm->trap = TRAP_NONE;
+    ctx->vm->trap_address = 0;
+    ctx->status = TVM_STATUS_READY;
+}
+
+tvm_status tvm_get_status(const tvm_context *ctx)
+{
+    return ctx->status;
+}
+
+int tvm_register_syscall(tvm_context *ctx, uint64_t number, tvm_syscall_func func, void *user)
+{
+    if (number >= VM_MAX_SYSCALLS)
+        return 0;
+    if (ctx->syscalls.empty())
+    {
+        if (func == nullptr)
+            return 1;
+        ctx->syscalls.resize(VM_MAX_SYSCALLS);
+    }
+    auto &binding = ctx->syscalls[number];
+    binding.ctx = ctx;
+    binding.func = func;
+    binding.user = user;
+    return vm_syscall_register(ctx->vm, number, func != nullptr ? &call_syscall : nullptr, &binding);
+}
+
+void tvm_halt(tvm_context *ctx)
+{
+    ctx->vm->running = false;
+    ctx->status = TVM_STATUS_HALTED;
+}
+
+tvm_trap tvm_get_trap(const tvm_context *ctx)
+{
+    return static_cast<tvm_trap>(ctx->vm->trap);
+}
+
+uint64_t tvm_get_trap_address(const tvm_context *ctx)
+{
+    return ctx->vm->trap != TRAP_NONE ? ctx->vm->trap_address : 0;
+}
+
+const char* tvm_trap_message(tvm_trap trap)
+{
+    return vm_trap_message(static_cast<VMTrap>(trap));
+}
+
+size_t tvm_describe_address(const tvm_context *ctx, uint64_t address, char *buffer, size_t size)
+{
+    return copy_text(vm_symbols_describe(ctx->symbols.get(), address), buffer, size);
+}
+
+size_t tvm_fusion_report(const tvm_context *ctx, char *buffer, size_t size)
+{
+    std::ostringstream report;
+    vm_fusion_report(ctx->vm, report);
+    return copy_text(report.str(), buffer, size);
+}
+
+int tvm_trace_enable(tvm_context *ctx, size_t records, const char *filename)
+{
+    return vm_trace_enable(ctx->vm, records, filename);
+}
+
+int tvm_trace_dump(const tvm_context *ctx)
+{
+    return vm_trace_dump(ctx->vm);
+}
+
+int tvm_trace_dump_on_signal(void)
+{
+    return vm_trace_dump_on_request();
+}
+
+int tvm_profile_enable(tvm_context *ctx)
+{
+    return vm_profile_enable(ctx->vm);
+}
+
+int tvm_profile_write_report(const tvm_context *ctx, const char *filename)
+{
+    if (ctx->vm->profile == nullptr)
+        return 0;
+    std::ofstream out(filename);
+    vm_profile_report(ctx->vm, out);
+    return out.good();
+}
+
+int tvm_profile_write_folded(const tvm_context *ctx, const char *filename)
+{
+    if (ctx->vm->profile == nullptr)
+        return 0;
+    std::ofstream out(filename);
+    vm_profile_write_folded(ctx->vm, out);
+    return out.good();
+}
+
+tvm_snapshot* tvm_snapshot_create(const tvm_context *ctx)
+{
+    auto vm = vm_snapshot(ctx->vm);
+    if (vm == nullptr)
+        return nullptr;
+    auto snapshot = new tvm_snapshot;
+    snapshot->vm = vm;
+    snapshot->engine = ctx->engine;
+    snapshot->status = ctx->status;
+    snapshot->symbols = ctx->symbols;
+    snapshot->aot = ctx->aot;
+    snapshot->syscalls = ctx->syscalls;
+    return snapshot;
+}
+
+void tvm_snapshot_destroy(tvm_snapshot *snapshot)
+{
+    if (snapshot == nullptr)
+        return;
+    vm_snapshot_destroy(snapshot->vm);
+    delete snapshot;
+}
+
+tvm_context* tvm_fork(const tvm_snapshot *snapshot)
+{
+    auto vm = vm_fork(snapshot->vm);
+    if (vm == nullptr)
+        return nullptr;
+    auto engine = snapshot->engine;
+    if (engine == TVM_ENGINE_JIT && !vm_jit_enable(vm))
+        engine = TVM_ENGINE_TABLE;
+    // Loading the library again only takes another reference to it
+    bool aot = !snapshot->aot.empty() && vm_aot_load(vm, snapshot->aot.c_str());
+    if (engine == TVM_ENGINE_AOT && !aot)
+        engine = TVM_ENGINE_TABLE;
+    auto ctx = wrap(vm, engine, snapshot->status);
+    if (aot)
+        ctx->aot = snapshot->aot;
+    ctx->symbols = snapshot->symbols;
+    vm->symbols = ctx->symbols.get();
+    // The bindings copied by vm_fork still pass the snapshotted context
+    for (size_t number = 0; number < snapshot->syscalls.size(); number++)
+    {
+        auto &binding = snapshot->syscalls[number];
+        if (binding.func != nullptr)
+            tvm_register_syscall(ctx, number, binding.func, binding.user);
+    }
+    return ctx;
+}
+
+void tvm_run_batch(const tvm_snapshot *snapshot, tvm_context *const *contexts, size_t count)
+{
+    std::vector<tvm_context*> ready;
+    std::vector<VMContext*> lanes;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (contexts[i]->status != TVM_STATUS_READY)
+            continue;
+        ready.push_back(contexts[i]);
+        lanes.push_back(contexts[i]->vm);
+    }
+    vm_run_batch(snapshot->vm, lanes.data(), lanes.size());
+    for (auto ctx : ready)
+        update_status(ctx);
+}
+
+tvm_pool* tvm_pool_create(size_t worker_count, uint64_t slice)
+{
+    return new tvm_pool(worker_count, slice != 0 ? slice : VM_POOL_DEFAULT_SLICE);
+}
+
+void tvm_pool_destroy(tvm_pool *pool)
+{
+    delete pool;
+}
+
+size_t tvm_pool_worker_count(const tvm_pool *pool)
+{
+    return pool->pool.worker_count();
+}
+
+void tvm_pool_submit(tvm_pool *pool, tvm_context *ctx, tvm_completion_func done, void *user)
+{
+    if (ctx->status != TVM_STATUS_READY)
+    {
+        if (done != nullptr)
+            done(ctx, user);
+        return;
+    }
+    pool->pool.submit(ctx->vm, [ctx, done, user](VMContext*)
+    {
+        update_status(ctx);
+        if (done != nullptr)
+            done(ctx, user);
+    }, select_engine(ctx));
+}
+
+void tvm_pool_wait(tvm_pool *pool)
+{
+    pool->pool.wait_idle();
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+// The TinyVM embedding API.
+// Plain C, so it can be used from C and through FFIs, and stable: functions are only
+// ever added, which bumps TVM_API_VERSION_MINOR. Anything else bumps the major version,
+// which is also the soname version of the shared library.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TVM_API_VERSION_MAJOR 1
+#define TVM_API_VERSION_MINOR 9
+#define TVM_API_VERSION ((TVM_API_VERSION_MAJOR << 16) | TVM_API_VERSION_MINOR)
+
+#if defined(_WIN32)
+#define TVM_API
+#else
+#define TVM_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A virtual machine with its memory, registers and loaded program
+typedef struct tvm_context tvm_context;
+// Copy-on-write snapshot that contexts can be forked from, see tvm_snapshot_create
+typedef struct tvm_snapshot tvm_snapshot;
+// Worker threads running many contexts, see tvm_pool_create
+typedef struct tvm_pool tvm_pool;
+
+typedef enum tvm_register
+{
+    TVM_R0, TVM_R1, TVM_R2, TVM_R3, TVM_R4, TVM_R5, TVM_R6, TVM_R7,
+    TVM_R8, TVM_R9, TVM_R10, TVM_R11, TVM_R12, TVM_R13, TVM_R14, TVM_R15,
+    TVM_IP,  // Instruction pointer
+    TVM_IC,  // Instruction counter
+    TVM_SP,  // Stack pointer
+    TVM_SBP, // Stack base pointer
+    TVM_RMD, // Remainder of the last division
+    TVM_REGISTER_COUNT
+} tvm_register;
+
+typedef enum tvm_engine
+{
+    TVM_ENGINE_TABLE,    // Interpreter dispatching through the predecode cache
+    TVM_ENGINE_THREADED, // Interpreter with threaded dispatch where the compiler supports it
+    TVM_ENGINE_JIT,      // Native code for hot loops, interpreter for everything else
+    TVM_ENGINE_COMPACT,  // Interpreter decoding the compact code of images once per instruction. Added in API version 1.4
+    TVM_ENGINE_AOT       // Native code loaded with tvm_load_aot, interpreter for everything else. Added in API version 1.8
+} tvm_engine;
+
+typedef enum tvm_status
+{
+    TVM_STATUS_READY,     // Loaded and not run yet, or stopped by the instruction budget
+    TVM_STATUS_HALTED,    // Executed HALT
+    TVM_STATUS_TRAPPED    // Stopped by an error, see tvm_get_trap
+} tvm_status;
+
+typedef enum tvm_trap
+{
+    TVM_TRAP_NONE,
+    TVM_TRAP_STACK_OVERFLOW,
+    TVM_TRAP_STACK_UNDERFLOW,
+    TVM_TRAP_INVALID_OPCODE,
+    TVM_TRAP_INVALID_OPERAND,
+    TVM_TRAP_OUT_OF_RANGE,
+    TVM_TRAP_DIVIDE_BY_ZERO,
+    TVM_TRAP_OUT_OF_MEMORY,
+    TVM_TRAP_INVALID_SYSCALL // SYSCALL with an unbound number, added in API version 1.2
+} tvm_trap;
+
+// Syscall numbers range from 0 to TVM_MAX_SYSCALLS - 1
+#define TVM_MAX_SYSCALLS 256
+
+// Called on a pool worker thread once a context submitted with tvm_pool_submit stopped
+typedef void (*tvm_completion_func)(tvm_context *ctx, void *user);
+
+// Host function called by the SYSCALL instruction, on the thread running ctx.
+// registers points to the TVM_REGISTER_COUNT registers of ctx, which carry the arguments
+// and results. Returns TVM_TRAP_NONE to continue after the SYSCALL or the trap to stop ctx with.
+typedef tvm_trap (*tvm_syscall_func)(tvm_context *ctx, uint64_t *registers, void *user);
+
+// TVM_API_VERSION of the library, which may be newer than the header.
+// Compatible as long as the major versions match and the minor version is at least the header's
+TVM_API uint32_t tvm_api_version(void);
+
+// Release version of the library, e.g. "0.1.0"
+TVM_API const char* tvm_version(void);
+
+// Functions returning int return nonzero on success and 0 on failure.
+
+// Create a context with memory_words words of memory, 0 for the default size.
+// Memory is only reserved, pages are committed as they are touched. On POSIX that
+// is left to the kernel: under strict overcommit accounting (vm.overcommit_memory=2
+// on Linux) all of memory counts against the commit limit right away.
+// Returns NULL if the memory could not be reserved, which includes running out of
+// guarded regions for the memory of live contexts (16384 on POSIX)
+TVM_API tvm_context* tvm_create(uint64_t memory_words);
+
+// Destroy ctx and everything attached to it. ctx may be NULL.
+TVM_API void tvm_destroy(tvm_context *ctx);
+
+// Select the engine tvm_run uses, the default is TVM_ENGINE_TABLE.
+// Fails if the engine is not supported on this platform, leaving the current one selected
+TVM_API int tvm_set_engine(tvm_context *ctx, tvm_engine engine);
+
+// Load a sectioned or flat image, from a buffer of size bytes or from a file.
+// Registers are reset first: IP is 0 and the stack has 2048 words unless the image says otherwise.
+// On failure ctx is left untouched
+TVM_API int tvm_load_image(tvm_context *ctx, const void *data, size_t size);
+TVM_API int tvm_load_image_file(tvm_context *ctx, const char *filename);
+
+// Assemble the length bytes of tasm source at source (see AssemblyReference.md) straight
+// into the memory of ctx, without tasm.py and an image in between. Registers are reset
+// like for images and IP is set to the entry point, memory the program doesn't cover is
+// kept. Writes how many instructions were assembled, or the error and its source line,
+// to message like snprintf does. Fails if the source is invalid, leaving the registers
+// untouched. Added in API version 1.7
+TVM_API int tvm_assemble(tvm_context *ctx, const char *source, size_t length, char *message, size_t size);
+
+// Load a shared library built by tvm-aot from the code in the memory of ctx, see
+// AssemblyReference.md. Blocks whose code differs from memory are left out, and so are
+// those written to later. Loading an image unloads the library, forks of ctx load it
+// again. Select TVM_ENGINE_AOT to run the blocks. Fails if the library can't be loaded
+// or was built by a different version of tvm-aot. Added in API version 1.8
+TVM_API int tvm_load_aot(tvm_context *ctx, const char *filename);
+
+// Load a symbol file written by tasm --symbols, used to name addresses in reports
+TVM_API int tvm_load_symbols(tvm_context *ctx, const char *filename);
+
+// Fuse common instruction pairs in words words of memory starting at address into
+// superinstructions. Call again after changing the code.
+TVM_API void tvm_fuse(tvm_context *ctx, uint64_t address, uint64_t words);
+
+// Verify the code reachable from IP, so tvm_run can leave out the runtime checks it
+// makes unnecessary. Code that is written to afterwards is checked again as it runs.
+// Setting IP, SP or SBP keeps the operand checks away but brings the stack checks back.
+// Writes what was verified, or why and where verification failed, to message like
+// snprintf does. Fails if the code is invalid, leaving ctx untouched.
+// Added in API version 1.5
+TVM_API int tvm_verify(tvm_context *ctx, char *message, size_t size);
+
+// Size of the memory of ctx in words
+TVM_API uint64_t tvm_memory_size(const tvm_context *ctx);
+
+// Copy count words of guest memory from or to address.
+// Fails without copying anything if the range is not inside memory
+TVM_API int tvm_read_memory(const tvm_context *ctx, uint64_t address, uint64_t *words, size_t count);
+TVM_API int tvm_write_memory(tvm_context *ctx, uint64_t address, const uint64_t *words, size_t count);
+
+// Pointer to count words of guest memory starting at address, for host functions that
+// work on guest buffers in place. Pass write as nonzero before storing to the words.
+// The pointer stays valid until ctx is destroyed or another image is loaded.
+// Returns NULL if the range is not inside memory. Added in API version 1.2
+TVM_API uint64_t* tvm_memory_span(tvm_context *ctx, uint64_t address, uint64_t count, int write);
+
+// Restart the numbers RDRAND returns with the sequence of seed, for reproducible runs.
+// New contexts are seeded differently each, forks continue the sequence of their snapshot.
+// Added in API version 1.3
+TVM_API void tvm_seed(tvm_context *ctx, uint64_t seed);
+
+// Registers, unknown registers read as 0 and can't be set
+TVM_API uint64_t tvm_get_register(const tvm_context *ctx, tvm_register reg);
+TVM_API int tvm_set_register(tvm_context *ctx, tvm_register reg, uint64_t value);
+
+// Run ctx until it halts or traps, or until it executed about max_instructions more
+// instructions if that is not 0. The budget is checked at backward jumps and calls.
+// A context stopped by the budget continues exactly where it left off when run again.
+// Running a halted or trapped context does nothing until another image is loaded or
+// tvm_resume is called.
+// Returns the status ctx stopped with
+TVM_API tvm_status tvm_run(tvm_context *ctx, uint64_t max_instructions);
+
+// Run ctx like tvm_run, but stop at the first budget check after microseconds passed.
+// Added in API version 1.1
+TVM_API tvm_status tvm_run_for(tvm_context *ctx, uint64_t microseconds);
+
+// Make a halted or trapped context runnable again, e.g. after moving IP past HALT
+TVM_API void tvm_resume(tvm_context *ctx);
+
+TVM_API tvm_status tvm_get_status(const tvm_context *ctx);
+
+// Bind func to syscall number, replacing the previous binding, or unbind it if func is NULL.
+// Bindings are inherited by snapshots and forks, which pass the fork to func.
+// Added in API version 1.2
+TVM_API int tvm_register_syscall(tvm_context *ctx, uint64_t number, tvm_syscall_func func, void *user);
+
+// Stop ctx as if it executed HALT, e.g. from a host function implementing exit.
+// Added in API version 1.2
+TVM_API void tvm_halt(tvm_context *ctx);
+
+// Why and where ctx trapped, TVM_TRAP_NONE and 0 if it did not
+TVM_API tvm_trap tvm_get_trap(const tvm_context *ctx);
+TVM_API uint64_t tvm_get_trap_address(const tvm_context *ctx);
+
+// Describe trap, e.g. "Stack overflow"
+TVM_API const char* tvm_trap_message(tvm_trap trap);
+
+// Write a description of address with its label and source line if symbols are loaded,
+// e.g. "0x40c loop+0x4 (sort.tasm:12)", to buffer like snprintf does.
+// Returns the length of the full description
+TVM_API size_t tvm_describe_address(const tvm_context *ctx, uint64_t address, char *buffer, size_t size);
+
+// Write per-pattern fusion statistics of ctx to buffer like snprintf does.
+// Returns the length of the full report
+TVM_API size_t tvm_fusion_report(const tvm_context *ctx, char *buffer, size_t size);
+
+// Trace the last records instructions of ctx, dumped to filename by tvm_trace_dump,
+// when ctx traps and on SIGUSR1 if enabled with tvm_trace_dump_on_signal.
+// Interpreted instructions are recorded one by one, which takes them off the fast path
+// of the predecode cache. Compiled code (TVM_ENGINE_JIT and TVM_ENGINE_AOT) keeps
+// running natively and only records the first instruction of every block it enters.
+// See tvmtrace.py for decoding dumps.
+TVM_API int tvm_trace_enable(tvm_context *ctx, size_t records, const char *filename);
+TVM_API int tvm_trace_dump(const tvm_context *ctx);
+
+// Dump the traces of all contexts traced to a file whenever the process receives SIGUSR1.
+// Installs a SIGUSR1 handler that still calls the one installed before, the dumps run
+// on a thread of their own. Returns 0 if the platform has no SIGUSR1.
+// Added in API version 1.9
+TVM_API int tvm_trace_dump_on_signal(void);
+
+// Profile ctx. While profiling, tvm_run interprets with the profiler whatever engine is selected.
+TVM_API int tvm_profile_enable(tvm_context *ctx);
+
+// Write the profile report (hot spots, opcodes, call graph) or the call stacks in
+// the folded format read by flamegraph.pl to filename
+TVM_API int tvm_profile_write_report(const tvm_context *ctx, const char *filename);
+TVM_API int tvm_profile_write_folded(const tvm_context *ctx, const char *filename);
+
+// Take a snapshot of ctx, including its engine and symbols.
+// Forking contexts from it is much cheaper than loading the image again.
+// Returns NULL on failure
+TVM_API tvm_snapshot* tvm_snapshot_create(const tvm_context *ctx);
+TVM_API void tvm_snapshot_destroy(tvm_snapshot *snapshot);
+
+// Create a context from a snapshot, sharing memory pages with it until they are written.
+// Returns NULL on failure
+TVM_API tvm_context* tvm_fork(const tvm_snapshot *snapshot);
+
+// Run count contexts forked from snapshot, e.g. with different inputs, until all of them
+// halted or trapped. Instructions that several of them execute at the same address run
+// for all of them at once, which gives several times the throughput of running them one
+// after the other if the program mostly computes in registers. The results are the same.
+// Contexts whose code differs from the snapshot are interpreted one by one. Batches
+// interpret, whatever engine is selected, and skip contexts that are not ready.
+// Added in API version 1.6
+TVM_API void tvm_run_batch(const tvm_snapshot *snapshot, tvm_context *const *contexts, size_t count);
+
+// Start worker_count worker threads, or one per hardware thread if worker_count is 0.
+// Contexts are time-sliced by slice instructions, 0 for the default slice.
+TVM_API tvm_pool* tvm_pool_create(size_t worker_count, uint64_t slice);
+
+// Wait for all submitted contexts to stop, then shut the workers down
+TVM_API void tvm_pool_destroy(tvm_pool *pool);
+
+TVM_API size_t tvm_pool_worker_count(const tvm_pool *pool);
+
+// Run ctx on the pool until it halts or traps, then call done(ctx, user) if done is not NULL.
+// ctx must not be touched until then. It runs on the engine selected with tvm_set_engine,
+// in slices of the instruction budget given to tvm_pool_create.
+// Contexts that are not ready complete right away, on the calling thread.
+TVM_API void tvm_pool_submit(tvm_pool *pool, tvm_context *ctx, tvm_completion_func done, void *user);
+
+// Block until all submitted contexts have stopped
+TVM_API void tvm_pool_wait(tvm_pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
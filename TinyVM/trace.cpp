@@ -0,0 +1,147 @@
+#include "trace.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include "vm.hpp"
+
+namespace
+{
+    // Traces with a dump file, dumped on dump requests. dumped_mutex guards the list
+    // and the traces in it, so they can't be released while they are dumped.
+    std::mutex dumped_mutex;
+    std::vector<VMTrace*> dumped_traces;
+
+    size_t buffer_bytes(const VMTrace *trace)
+    {
+        return (trace->mask + 1) * sizeof(VMTraceRecord);
+    }
+
+    bool dump_trace(const VMTrace *trace)
+    {
+        if (trace->dump_file == PLAT_NO_FILE)
+            return false;
+
+        auto head = trace->head.load(std::memory_order_acquire);
+        auto capacity = trace->mask + 1;
+        auto count = head < capacity ? head : capacity;
+        vmword header[VM_TRACE_HEADER_WORDS] =
+        {
+            VM_TRACE_MAGIC,
+            sizeof(VMTraceRecord) / sizeof(vmword),
+            count,
+            head,
+        };
+        auto offset = sizeof(header);
+        if (!plat_write_at(trace->dump_file, header, sizeof(header), 0))
+            return false;
+
+        // Oldest first, the ring may wrap once
+        auto first = (head - count) & trace->mask;
+        auto first_part = count < capacity - first ? count : capacity - first;
+        auto record_bytes = sizeof(VMTraceRecord);
+        return plat_write_at(trace->dump_file, trace->records + first, first_part * record_bytes, offset)
+            && plat_write_at(trace->dump_file, trace->records, (count - first_part) * record_bytes,
+                offset + first_part * record_bytes);
+    }
+
+    void dump_all_traces()
+    {
+        std::lock_guard<std::mutex> lock(dumped_mutex);
+        for (auto trace : dumped_traces)
+            dump_trace(trace);
+    }
+
+    // Runs in the signal handler of a fatal fault. The process is about to die, so
+    // rather skip the dump than wait for a thread holding the lock.
+    void dump_all_traces_on_fault()
+    {
+        if (!dumped_mutex.try_lock())
+            return;
+        for (auto trace : dumped_traces)
+            dump_trace(trace);
+        dumped_mutex.unlock();
+    }
+
+    size_t round_to_power_of_2(size_t value)
+    {
+        size_t result = 1;
+        while (result < value)
+            result <<= 1;
+        return result;
+    }
+}
+
+bool vm_trace_enable(VMContext *ctx, size_t records, const char *dump_file)
+{
+    vm_trace_disable(ctx);
+
+    auto capacity = round_to_power_of_2(records > 0 ? records : 1);
+    auto trace = new VMTrace;
+    trace->head = 0;
+    trace->mask = capacity - 1;
+    trace->dump_file = PLAT_NO_FILE;
+    trace->records = static_cast<VMTraceRecord*>(plat_map_bytes(buffer_bytes(trace)));
+    if (trace->records == nullptr)
+    {
+        delete trace;
+        return false;
+    }
+
+    if (dump_file != nullptr)
+    {
+        trace->dump_file = plat_open_write(dump_file);
+        if (trace->dump_file == PLAT_NO_FILE)
+        {
+            plat_unmap_bytes(trace->records, buffer_bytes(trace));
+            delete trace;
+            return false;
+        }
+
+        static std::once_flag once;
+        std::call_once(once, []() { plat_on_fatal_fault(&dump_all_traces_on_fault); });
+        std::lock_guard<std::mutex> lock(dumped_mutex);
+        dumped_traces.push_back(trace);
+    }
+
+    ctx->trace = trace;
+    return true;
+}
+
+void vm_trace_disable(VMContext *ctx)
+{
+    auto trace = ctx->trace;
+    if (trace == nullptr)
+        return;
+    ctx->trace = nullptr;
+    if (trace->dump_file != PLAT_NO_FILE)
+    {
+        std::lock_guard<std::mutex> lock(dumped_mutex);
+        dumped_traces.erase(std::remove(dumped_traces.begin(), dumped_traces.end(), trace), dumped_traces.end());
+    }
+    if (trace->dump_file != PLAT_NO_FILE)
+        plat_close(trace->dump_file);
+    plat_unmap_bytes(trace->records, buffer_bytes(trace));
+    delete trace;
+}
+
+bool vm_trace_dump(const VMContext *ctx)
+{
+    if (ctx->trace == nullptr)
+        return false;
+    // Don't interleave writes with a dump requested at the same time
+    std::lock_guard<std::mutex> lock(dumped_mutex);
+    return dump_trace(ctx->trace);
+}
+
+bool vm_trace_dump_on_request()
+{
+    return plat_on_dump_request(&dump_all_traces);
+}
+
+void vm_trace_record_block(VMContext *ctx, vmword ip)
+{
+    auto instr = vmi_decode(reinterpret_cast<const InstructionData*>(ctx->memory + ip));
+    vm_trace_record(ctx->trace, ctx->registers[IC], ip, &instr);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+
+#include "vmtypes.hpp"
+#include "instruction.hpp"
+#include "platform.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+
+// Trace dump format. Everything is a vmword in native byte order:
+//   magic, words per record, record count, total number of records written,
+//   then the records, oldest first.
+const vmword VM_TRACE_MAGIC = 0x01004352544D5654ULL; // "TVMTRC\0\1"
+const size_t VM_TRACE_HEADER_WORDS = 4;
+
+// One executed instruction. control is the encoded control word (see vmi_encode),
+// operands are the raw operand words.
+struct VMTraceRecord
+{
+    vmword ic;
+    vmword ip;
+    vmword control;
+    vmword operands[3];
+};
+
+// Ring buffer of the most recently executed instructions of a context.
+// Only the thread running the context writes to it.
+struct VMTrace
+{
+    // Number of records written so far, the latest one is at (head - 1) & mask
+    std::atomic<uint64_t> head;
+    size_t mask;
+    VMTraceRecord *records;
+    // Where vm_trace_dump writes to, PLAT_NO_FILE if nowhere
+    PlatFile dump_file;
+};
+
+// Enable tracing of the last records instructions (rounded up to a power of 2) of ctx.
+// If dump_file is not nullptr, the trace is dumped there by vm_trace_dump, when the
+// context stops with a trap, and on dump requests once vm_trace_dump_on_request was called.
+// Natively compiled code (JIT and AOT blocks) is traced at block granularity, see
+// vm_trace_record_block.
+// Returns false if the buffer can't be allocated or dump_file can't be created
+bool vm_trace_enable(VMContext *ctx, size_t records, const char *dump_file);
+
+// Release the trace of ctx. Does nothing if tracing is not enabled.
+void vm_trace_disable(VMContext *ctx);
+
+// Write the trace of ctx to its dump file, replacing earlier dumps.
+// Returns false if there is no trace or dump file, or writing failed
+bool vm_trace_dump(const VMContext *ctx);
+
+// Dump all traces with a dump file whenever the process is asked to (SIGUSR1 on POSIX).
+// Installs a signal handler, so hosts have to ask for it. Dumps run on a thread of
+// their own, a SIGUSR1 handler installed before keeps getting the signal.
+// Returns false if the platform has no way to request dumps
+bool vm_trace_dump_on_request();
+
+// Record entering native code at ip, with the first instruction of the block, before
+// it runs as instruction number IC. The instructions the native code runs after that,
+// including blocks it chains to, are not recorded and show as a gap in IC.
+void vm_trace_record_block(VMContext *ctx, vmword ip);
+
+// Record an instruction fetched at ip, about to be executed as instruction number ic
+inline void vm_trace_record(VMTrace *trace, vmword ic, vmword ip, const Instruction *instr)
+{
+    auto head = trace->head.load(std::memory_order_relaxed);
+    auto &record = trace->records[head & trace->mask];
+    record.ic = ic;
+    record.ip = ip;
+    record.control = (static_cast<vmword>(instr->opcode) << 32)
+        | (static_cast<vmword>(instr->flags & 0xff) << 24)
+        | (static_cast<vmword>(instr->addressing[0] & 0xff) << 16)
+        | (static_cast<vmword>(instr->addressing[1] & 0xff) << 8)
+        | static_cast<vmword>(instr->addressing[2] & 0xff);
+    record.operands[0] = instr->operands[0];
+    record.operands[1] = instr->operands[1];
+    record.operands[2] = instr->operands[2];
+    // Publish the record to dumps running on other threads
+    trace->head.store(head + 1, std::memory_order_release);
+}
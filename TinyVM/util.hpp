@@ -12,3 +12,12 @@ public:
 	NonCopyable(const NonCopyable&) = delete;
 	NonCopyable& operator=(const NonCopyable&) = delete;
 };
+
+// Keeps the compiler from inlining a function, e.g. the rare path of a hot loop
+#if defined(__GNUC__) || defined(__clang__)
+#define TVM_NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define TVM_NOINLINE __declspec(noinline)
+#else
+#define TVM_NOINLINE
+#endif
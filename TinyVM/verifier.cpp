@@ -0,0 +1,436 @@
+#include "verifier.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "vm.hpp"
+
+static_assert(INSTRUCTION_COUNT == 34, "Update operand_uses of the verifier.");
+
+namespace
+{
+    // What an instruction does with an operand
+    enum OperandUse
+    {
+        USE_NONE,
+        USE_READ,
+        USE_WRITE,
+        USE_MODIFY, // Read, then written
+        USE_TARGET, // Read as the address to continue at
+    };
+
+    struct OperandUses
+    {
+        OperandUse use[3];
+    };
+
+    OperandUses operand_uses(Opcode opcode)
+    {
+        switch (opcode)
+        {
+        case OP_PUSH:
+        case OP_SYSCALL:
+            return { { USE_READ } };
+        case OP_POP:
+            return { { USE_WRITE } };
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_MOD:
+        case OP_CMP:
+        case OP_RDRAND:
+        case OP_VSUM:
+        case OP_VMIN:
+        case OP_VMAX:
+            return { { USE_WRITE, USE_READ, USE_READ } };
+        case OP_INC:
+        case OP_DEC:
+        case OP_NOT:
+            return { { USE_MODIFY } };
+        case OP_MOV:
+            return { { USE_WRITE, USE_READ } };
+        case OP_CALL:
+        case OP_JMP:
+            return { { USE_TARGET } };
+        case OP_JEQ:
+        case OP_JNE:
+            return { { USE_TARGET, USE_READ, USE_READ } };
+        case OP_JNZ:
+            return { { USE_TARGET, USE_READ } };
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_VXOR:
+        case OP_VFILL:
+        case OP_VCOPY:
+            return { { USE_READ, USE_READ, USE_READ } };
+        case OP_VCOUNT:
+            return { { USE_MODIFY, USE_READ, USE_READ } };
+        default:
+            return {};
+        }
+    }
+
+    const size_t NO_SLOT = SIZE_MAX;
+
+    // A reachable instruction and where control goes from it
+    struct Node
+    {
+        Instruction instr;
+        // Next instruction if control can fall through to it
+        size_t next;
+        // Jump or call target with a literal address
+        size_t target;
+    };
+
+    // A function for the stack proof: the entry or a call target, with the
+    // deepest the stack gets relative to its entry
+    struct Function
+    {
+        vmword local_depth;
+        // Callees and the depth at the call, which pushes the return address on top
+        std::vector<std::pair<size_t, vmword>> calls;
+        // 0 not measured yet, 1 being measured, 2 done
+        int state;
+        vmword depth;
+    };
+
+    class Verifier
+    {
+    public:
+        explicit Verifier(const VMContext *ctx)
+            : ctx(ctx)
+        {
+        }
+
+        VMVerifyResult run()
+        {
+            VMVerifyResult result = {};
+            auto ip = ctx->registers[IP];
+            if (!walk(ip, result))
+                return result;
+            result.instructions = order.size();
+            result.stack_bounded = stack_provable && prove_stack(ip >> 2, &result.stack_depth);
+            return result;
+        }
+
+        const std::vector<size_t>& slots() const
+        {
+            return order;
+        }
+
+    private:
+        const VMContext *ctx;
+        // Index into nodes per slot, only for reached slots
+        std::unordered_map<size_t, size_t> node_of;
+        std::vector<Node> nodes;
+        // Reached slots in the order they were found
+        std::vector<size_t> order;
+        // Cleared by anything that moves the stack pointer in ways the proof can't follow
+        bool stack_provable = true;
+        std::unordered_map<size_t, Function> functions;
+
+        bool fail(VMVerifyResult &result, VMVerifyError error, size_t slot)
+        {
+            result.error = error;
+            result.address = slot << 2;
+            return false;
+        }
+
+        VMVerifyError check_operand(const Instruction &instr, size_t i, OperandUse use)
+        {
+            auto mode = instr.addressing[i];
+            auto operand = instr.operands[i];
+            auto base = mode & ~AM_INDIRECT;
+            if (base != AM_LITERAL && base != AM_MEMORY && base != AM_REGISTER)
+                return VERIFY_INVALID_MODE;
+            if (base == AM_REGISTER && operand >= VM_REGISTER_COUNT)
+                return VERIFY_INVALID_REGISTER;
+            if (base == AM_MEMORY && operand >= ctx->memory_size)
+                return VERIFY_OUT_OF_RANGE;
+            if ((use == USE_WRITE || use == USE_MODIFY) && base == AM_LITERAL)
+                return VERIFY_LITERAL_TARGET;
+            if (use == USE_TARGET && mode == AM_LITERAL)
+            {
+                if (operand % 4 != 0)
+                    return VERIFY_MISALIGNED_TARGET;
+                if (operand / 4 >= ctx->predecode_slots)
+                    return VERIFY_OUT_OF_RANGE;
+            }
+            return VERIFY_OK;
+        }
+
+        // Check the instruction in slot and find where control goes from it
+        VMVerifyError check_instruction(size_t slot, Node &node)
+        {
+            auto &instr = node.instr;
+            instr = vmi_decode(reinterpret_cast<const InstructionData*>(ctx->memory + slot * 4));
+            if (static_cast<uint32_t>(instr.opcode) >= INSTRUCTION_COUNT)
+                return VERIFY_INVALID_OPCODE;
+
+            auto uses = operand_uses(instr.opcode);
+            node.next = slot + 1;
+            node.target = NO_SLOT;
+            for (size_t i = 0; i < 3; i++)
+            {
+                auto use = uses.use[i];
+                if (use == USE_NONE)
+                    continue;
+                auto error = check_operand(instr, i, use);
+                if (error != VERIFY_OK)
+                    return error;
+
+                if (use == USE_TARGET)
+                {
+                    if (instr.addressing[i] == AM_LITERAL)
+                        node.target = instr.operands[i] / 4;
+                    else
+                        stack_provable = false;
+                }
+                // Writes to IP are jumps the proof can't follow, writes to SP and SBP move the stack
+                auto reg = instr.operands[i];
+                if ((use == USE_WRITE || use == USE_MODIFY) && instr.addressing[i] == AM_REGISTER
+                    && (reg == IP || reg == SP || reg == SBP))
+                    stack_provable = false;
+            }
+
+            switch (instr.opcode)
+            {
+            case OP_HALT:
+            case OP_JMP:
+                node.next = NO_SLOT;
+                break;
+            case OP_RET:
+                // Returns to the instruction after its call, which is reached from there
+                node.next = NO_SLOT;
+                break;
+            case OP_SYSCALL:
+                // Host functions may do anything with the registers
+                stack_provable = false;
+                break;
+            default:
+                break;
+            }
+            if (node.next != NO_SLOT && node.next >= ctx->predecode_slots)
+                return VERIFY_OUT_OF_RANGE;
+            return VERIFY_OK;
+        }
+
+        // Find and check everything reachable from ip
+        bool walk(vmword ip, VMVerifyResult &result)
+        {
+            if (ip % 4 != 0)
+            {
+                result.error = VERIFY_MISALIGNED_TARGET;
+                result.address = ip;
+                return false;
+            }
+            if (ip / 4 >= ctx->predecode_slots)
+            {
+                result.error = VERIFY_OUT_OF_RANGE;
+                result.address = ip;
+                return false;
+            }
+
+            std::vector<size_t> pending = { static_cast<size_t>(ip / 4) };
+            node_of[pending[0]] = 0;
+            nodes.emplace_back();
+            while (!pending.empty())
+            {
+                auto slot = pending.back();
+                pending.pop_back();
+                order.push_back(slot);
+                Node node;
+                auto error = check_instruction(slot, node);
+                if (error != VERIFY_OK)
+                    return fail(result, error, slot);
+                nodes[node_of[slot]] = node;
+
+                for (auto next : { node.next, node.target })
+                {
+                    if (next == NO_SLOT || node_of.count(next) != 0)
+                        continue;
+                    node_of[next] = nodes.size();
+                    nodes.emplace_back();
+                    pending.push_back(next);
+                }
+            }
+            return true;
+        }
+
+        // Walk the function at entry with the stack depth relative to its entry.
+        // Returns false unless the depth is the same wherever paths meet and never
+        // drops below the entry.
+        bool measure_function(size_t entry, bool called, Function &function)
+        {
+            std::unordered_map<size_t, vmword> depths = { { entry, 0 } };
+            std::vector<size_t> pending = { entry };
+            function.local_depth = 0;
+            while (!pending.empty())
+            {
+                auto slot = pending.back();
+                pending.pop_back();
+                auto &node = nodes[node_of[slot]];
+                auto depth = depths[slot];
+                auto after = depth;
+                size_t successors[2] = { node.next, node.target };
+
+                switch (node.instr.opcode)
+                {
+                case OP_PUSH:
+                    after = depth + 1;
+                    break;
+                case OP_POP:
+                    if (depth == 0)
+                        return false;
+                    after = depth - 1;
+                    break;
+                case OP_RET:
+                    // Only a called function's own return address may be popped
+                    if (!called || depth != 0)
+                        return false;
+                    break;
+                case OP_CALL:
+                    function.calls.emplace_back(node.target, depth);
+                    successors[1] = NO_SLOT;
+                    break;
+                default:
+                    break;
+                }
+                function.local_depth = std::max(function.local_depth, after);
+
+                for (auto next : successors)
+                {
+                    if (next == NO_SLOT)
+                        continue;
+                    auto known = depths.find(next);
+                    if (known == depths.end())
+                    {
+                        depths[next] = after;
+                        pending.push_back(next);
+                    }
+                    else if (known->second != after)
+                        return false;
+                }
+            }
+            return true;
+        }
+
+        // Deepest the stack gets from the entry of the function at entry, including its callees.
+        // Returns false for recursion and functions measure_function rejects.
+        bool function_depth(size_t entry, bool called, vmword *depth)
+        {
+            // Stays valid while callees are added, unordered_map never moves its elements
+            auto &function = functions[entry];
+            if (function.state == 1)
+                return false;
+            if (function.state == 0)
+            {
+                function.state = 1;
+                if (!measure_function(entry, called, function))
+                    return false;
+                function.depth = function.local_depth;
+                for (auto &call : function.calls)
+                {
+                    vmword callee_depth;
+                    if (!function_depth(call.first, true, &callee_depth))
+                        return false;
+                    function.depth = std::max(function.depth, call.second + 1 + callee_depth);
+                }
+                function.state = 2;
+            }
+            *depth = function.depth;
+            return true;
+        }
+
+        bool prove_stack(size_t entry, vmword *depth)
+        {
+            if (!function_depth(entry, false, depth))
+                return false;
+            auto sp = ctx->registers[SP];
+            auto sbp = ctx->registers[SBP];
+            return sp <= sbp && *depth <= sbp - sp;
+        }
+    };
+}
+
+VMVerifyResult vm_verify(VMContext *ctx)
+{
+    Verifier verifier(ctx);
+    auto result = verifier.run();
+    if (result.error != VERIFY_OK)
+        return result;
+
+    vm_verify_drop_stack(ctx);
+    auto level = result.stack_bounded ? VERIFIED_STACK : VERIFIED_OPERANDS;
+    for (auto slot : verifier.slots())
+    {
+        auto entry = ctx->predecoded + slot;
+        // Keep superinstructions, with the verified variant as their first half
+        auto impl = entry->impl;
+        auto fusion = impl != nullptr ? entry->fusion : 0;
+        entry->verified = level;
+        vm_predecode(ctx, entry, slot << 2);
+        if (fusion != 0)
+        {
+            entry->base_impl = entry->impl;
+            entry->impl = impl;
+            entry->fusion = fusion;
+            entry->threaded = VM_THREADED_IMPL;
+        }
+        vm_mark_decoded(ctx, slot);
+    }
+    ctx->stack_verified = result.stack_bounded;
+    return result;
+}
+
+const char* vm_verify_message(VMVerifyError error)
+{
+    switch (error)
+    {
+    case VERIFY_OK:
+        return "Verified";
+    case VERIFY_INVALID_OPCODE:
+        return "Invalid opcode";
+    case VERIFY_INVALID_MODE:
+        return "Invalid addressing mode";
+    case VERIFY_INVALID_REGISTER:
+        return "Invalid register";
+    case VERIFY_LITERAL_TARGET:
+        return "Assignment to a literal operand";
+    case VERIFY_MISALIGNED_TARGET:
+        return "Misaligned jump target";
+    case VERIFY_OUT_OF_RANGE:
+        return "Address out of range";
+    }
+    return "Unknown error";
+}
+
+void vm_verify_drop_stack(VMContext *ctx)
+{
+    if (!ctx->stack_verified)
+        return;
+    ctx->stack_verified = false;
+    for (auto slot = ctx->decoded_begin; slot < ctx->decoded_end; slot++)
+    {
+        auto entry = ctx->predecoded + slot;
+        if (entry->verified == VERIFIED_STACK)
+        {
+            entry->verified = VERIFIED_OPERANDS;
+            entry->impl = nullptr;
+        }
+    }
+}
+
+void vm_verify_invalidate(VMContext *ctx, PredecodedInstruction *entry)
+{
+    // The stack proof covered what was here
+    auto level = entry->verified;
+    entry->verified = VERIFIED_NONE;
+    if (level == VERIFIED_STACK)
+        vm_verify_drop_stack(ctx);
+}
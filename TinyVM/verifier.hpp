@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+
+#include "vmtypes.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+struct PredecodedInstruction;
+
+// Why vm_verify rejected a program
+enum VMVerifyError
+{
+    VERIFY_OK,
+    VERIFY_INVALID_OPCODE,
+    VERIFY_INVALID_MODE,      // An operand the instruction uses has no or several addressing modes
+    VERIFY_INVALID_REGISTER,
+    VERIFY_LITERAL_TARGET,    // Assignment to a literal operand
+    VERIFY_MISALIGNED_TARGET, // Jump or call to an address that is not 4-word-aligned
+    VERIFY_OUT_OF_RANGE,      // Memory operand or jump target outside of memory, or running off its end
+};
+
+struct VMVerifyResult
+{
+    VMVerifyError error;
+    // Address of the offending instruction, 0 if there is no error
+    vmword address;
+    // Number of instructions reachable from IP
+    size_t instructions;
+    // Set if the stack provably stays within [0, SBP], in which case stack_depth is
+    // the deepest it gets in words, counted from the current SP
+    bool stack_bounded;
+    vmword stack_depth;
+};
+
+// Verify the code reachable from IP once, so it can run without most runtime checks.
+// Follows the control flow through every jump and call with a literal target and checks
+// each instruction for invalid opcodes, operands without a single mode, unknown registers,
+// writes to literals, misaligned jump targets and memory operands outside of memory.
+// If all of them pass, their slots are predecoded with variants that skip the register
+// and memory bounds checks. If, in addition, the stack depth is bounded at every
+// instruction (no recursion, unbalanced loops, dynamic jumps, host functions or writes to
+// SP and SBP) and fits between SP and SBP, stack operations skip their checks as well.
+//
+// Code reached only through a computed jump and code written after verification run
+// checked as before, so verification never changes what a program does. The stack proof
+// holds for IP, SP and SBP as they are now, change any of them and call
+// vm_verify_drop_stack. A program overwriting the return addresses on its stack may then
+// miss stack traps, but its accesses stay bounded by memory either way.
+// Returns the result, nothing is changed unless it has no error.
+VMVerifyResult vm_verify(VMContext *ctx);
+
+// Describe error, e.g. "Invalid register"
+const char* vm_verify_message(VMVerifyError error);
+
+// Give up the stack proof of the last vm_verify, stack operations check again
+void vm_verify_drop_stack(VMContext *ctx);
+
+// Drop the verification of entry, called by vm_invalidate for verified slots
+void vm_verify_invalidate(VMContext *ctx, PredecodedInstruction *entry);
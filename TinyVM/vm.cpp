@@ -3,68 +3,433 @@
 #include <cstring>
 #include <cstdlib>
 
+#include <atomic>
 #include <iostream>
+#include <memory>
+#include <vector>
 
 #include "platform.hpp"
+#include "symbols.hpp"
 
-VMContext* vm_create()
+namespace
 {
-	VMContext *ctx = new VMContext;
-    ctx->memory = plat_map_memory(VM_MEMORY_SIZE);
+    // Instructions between clock reads in vm_run_for
+    const vmword RUN_FOR_FIRST_SLICE = 10000;
+    const vmword RUN_FOR_MIN_SLICE = 1000;
+    const vmword RUN_FOR_MAX_SLICE = vmword(1) << 30;
+
+    // Seed of a new context, different for every context even if they are created at the same time
+    uint64_t default_seed()
+    {
+        static std::atomic<uint64_t> contexts_created(0);
+        auto now = static_cast<uint64_t>(std::chrono::steady_clock::now().time_since_epoch().count());
+        return now ^ (contexts_created.fetch_add(1, std::memory_order_relaxed) * 0x9E3779B97F4A7C15ULL);
+    }
+
+    size_t predecode_bytes(size_t slots)
+    {
+        return slots * sizeof(PredecodedInstruction);
+    }
+
+    void invalid_opcode(VMContext *ctx, const Instruction*)
+    {
+        vm_trap(ctx, TRAP_INVALID_OPCODE);
+    }
+
+    void run_table(VMContext *ctx, void*)
+    {
+        ctx->running = true;
+        while (ctx->running)
+        {
+            auto instr = vm_fetch_decode(ctx);
+            vm_execute(ctx, instr);
+        }
+    }
+
+    struct GuardedLoop
+    {
+        VMContext *ctx;
+        void (*loop)(VMContext *ctx, void *arg);
+        void *arg;
+    };
+
+    void run_guarded_loop(void *arg)
+    {
+        auto run = static_cast<GuardedLoop*>(arg);
+        run->loop(run->ctx, run->arg);
+    }
+}
+
+struct VMSnapshot
+{
+    PlatImage *memory;
+    PlatImage *predecoded;
+    size_t memory_size;
+    vmword registers[VM_REGISTER_COUNT];
+    size_t decoded_begin;
+    size_t decoded_end;
+    std::unique_ptr<VMSyscallTable> syscalls;
+    std::unique_ptr<VMCompactCode> compact;
+    bool stack_verified;
+    VMRng rng;
+};
+
+VMContext* vm_create(size_t memory_size)
+{
+    memory_size = memory_size < 4 ? 4 : (memory_size + 3) & ~size_t(3);
+    auto slots = memory_size / 4;
+    // Fresh mappings are zeroed already, so this is a reset without touching any pages
+    auto memory = plat_map_memory(memory_size);
+    auto predecoded = static_cast<PredecodedInstruction*>(plat_map_bytes(predecode_bytes(slots)));
+    if (memory == nullptr || predecoded == nullptr)
+    {
+        if (memory != nullptr)
+            plat_unmap_memory(memory, memory_size);
+        if (predecoded != nullptr)
+            plat_unmap_bytes(predecoded, predecode_bytes(slots));
+        return nullptr;
+    }
+
+    VMContext *ctx = new VMContext;
+    ctx->memory = memory;
+    ctx->memory_size = memory_size;
+    ctx->memory_guard = plat_memory_guard_offset(memory_size);
+    ctx->memory_release = &plat_unmap_memory;
+    ctx->predecoded = predecoded;
+    ctx->predecode_slots = slots;
     prepare_instruction_table(ctx->instr_table);
-    vm_reset(ctx);
-	return ctx;
+    vm_seed(ctx, default_seed());
+    ctx->running = false;
+    memset(ctx->registers, 0, sizeof(ctx->registers));
+    return ctx;
+}
+
+void vm_seed(VMContext *ctx, uint64_t seed)
+{
+    vm_rng_seed(ctx->rng, seed);
+}
+
+VMSnapshot* vm_snapshot(const VMContext *ctx)
+{
+    auto snapshot = new VMSnapshot;
+    memcpy(snapshot->registers, ctx->registers, sizeof(snapshot->registers));
+    snapshot->memory_size = ctx->memory_size;
+    snapshot->decoded_begin = ctx->decoded_begin;
+    snapshot->decoded_end = ctx->decoded_end;
+    snapshot->stack_verified = ctx->stack_verified;
+    snapshot->rng = ctx->rng;
+    snapshot->memory = plat_create_image(ctx->memory, ctx->memory_size * sizeof(vmword));
+    if (ctx->syscalls != nullptr)
+        snapshot->syscalls.reset(new VMSyscallTable(*ctx->syscalls));
+    if (ctx->compact != nullptr)
+        snapshot->compact.reset(new VMCompactCode(*ctx->compact));
+
+    // Compiled code is not shared, so forks must not think their slots are covered by it
+    auto bytes = predecode_bytes(ctx->predecode_slots);
+    if (ctx->jit != nullptr || ctx->aot != nullptr)
+    {
+        std::vector<PredecodedInstruction> predecoded(ctx->predecoded, ctx->predecoded + ctx->predecode_slots);
+        for (auto &entry : predecoded)
+        {
+            entry.jit_covered = false;
+            entry.aot_covered = false;
+        }
+        snapshot->predecoded = plat_create_image(predecoded.data(), bytes);
+    }
+    else
+        snapshot->predecoded = plat_create_image(ctx->predecoded, bytes);
+
+    if (snapshot->memory == nullptr || snapshot->predecoded == nullptr)
+    {
+        vm_snapshot_destroy(snapshot);
+        return nullptr;
+    }
+    return snapshot;
+}
+
+void vm_snapshot_destroy(VMSnapshot *snapshot)
+{
+    if (snapshot->memory != nullptr)
+        plat_destroy_image(snapshot->memory);
+    if (snapshot->predecoded != nullptr)
+        plat_destroy_image(snapshot->predecoded);
+    delete snapshot;
+}
+
+VMContext* vm_fork(const VMSnapshot *snapshot)
+{
+    auto memory_size = snapshot->memory_size;
+    auto slots = memory_size / 4;
+    auto memory = plat_map_memory_image(snapshot->memory, memory_size);
+    auto predecoded = static_cast<PredecodedInstruction*>(plat_map_image(snapshot->predecoded));
+    if (memory == nullptr || predecoded == nullptr)
+    {
+        if (memory != nullptr)
+            plat_unmap_memory(memory, memory_size);
+        if (predecoded != nullptr)
+            plat_unmap_bytes(predecoded, predecode_bytes(slots));
+        return nullptr;
+    }
+
+    VMContext *ctx = new VMContext;
+    ctx->memory = memory;
+    ctx->memory_size = memory_size;
+    ctx->memory_guard = plat_memory_guard_offset(memory_size);
+    ctx->memory_release = &plat_unmap_memory;
+    ctx->predecoded = predecoded;
+    ctx->predecode_slots = slots;
+    prepare_instruction_table(ctx->instr_table);
+    ctx->running = false;
+    memcpy(ctx->registers, snapshot->registers, sizeof(ctx->registers));
+    ctx->decoded_begin = snapshot->decoded_begin;
+    ctx->decoded_end = snapshot->decoded_end;
+    ctx->stack_verified = snapshot->stack_verified;
+    ctx->rng = snapshot->rng;
+    if (snapshot->syscalls != nullptr)
+        ctx->syscalls = new VMSyscallTable(*snapshot->syscalls);
+    if (snapshot->compact != nullptr)
+        ctx->compact = new VMCompactCode(*snapshot->compact);
+    return ctx;
 }
 
 void vm_destroy(VMContext *ctx)
 {
-    plat_unmap_memory(ctx->memory, VM_MEMORY_SIZE);
-	delete ctx;
+    vm_jit_disable(ctx);
+    vm_aot_unload(ctx);
+    vm_profile_disable(ctx);
+    vm_trace_disable(ctx);
+    vm_syscall_clear(ctx);
+    vm_compact_release(ctx);
+    if (ctx->memory_release != nullptr)
+        ctx->memory_release(ctx->memory, ctx->memory_size);
+    plat_unmap_bytes(ctx->predecoded, predecode_bytes(ctx->predecode_slots));
+    delete ctx;
 }
 
 void vm_reset(VMContext *ctx)
 {
-	ctx->running = false;
-    memset(ctx->memory, 0, VM_MEMORY_SIZE * sizeof(vmword));
-	memset(ctx->registers, 0, sizeof(ctx->registers));
+    ctx->running = false;
+    // Swapping in fresh memory keeps untouched pages uncommitted
+    auto memory = ctx->memory_release == &plat_unmap_memory ? plat_map_memory(ctx->memory_size) : nullptr;
+    if (memory != nullptr)
+        vm_replace_memory(ctx, memory, &plat_unmap_memory);
+    else
+        memset(ctx->memory, 0, ctx->memory_size * sizeof(vmword));
+    memset(ctx->registers, 0, sizeof(ctx->registers));
+    memset(ctx->fusion_sites, 0, sizeof(ctx->fusion_sites));
+    memset(ctx->fusion_hits, 0, sizeof(ctx->fusion_hits));
+    vm_invalidate_all(ctx);
+}
+
+void vm_replace_memory(VMContext *ctx, vmword *memory, memory_release_func release)
+{
+    if (ctx->memory_release != nullptr)
+        ctx->memory_release(ctx->memory, ctx->memory_size);
+    ctx->memory = memory;
+    ctx->memory_release = release;
+    ctx->memory_guard = release == &plat_unmap_memory ? plat_memory_guard_offset(ctx->memory_size) : ctx->memory_size;
+    vm_invalidate_all(ctx);
 }
 
 void vm_init_stack(VMContext *ctx, size_t stacksize)
 {
-	ctx->registers[SP] = 0;
-	ctx->registers[SBP] = stacksize;
+    ctx->registers[SP] = 0;
+    ctx->registers[SBP] = stacksize;
+    vm_verify_drop_stack(ctx);
 }
 
 void vm_init_programbase(VMContext *ctx, vmword location)
 {
-	ctx->registers[IP] = location;
+    ctx->registers[IP] = location;
 }
 
 void vm_load_program(VMContext *ctx, InstructionData *data, size_t count)
 {
-	auto ctx_program_addr = ctx->memory + ctx->registers[IP];
-	memcpy(ctx_program_addr, data, count * sizeof(InstructionData));
+    auto ctx_program_addr = ctx->memory + ctx->registers[IP];
+    memcpy(ctx_program_addr, data, count * sizeof(InstructionData));
+    vm_invalidate_range(ctx, ctx->registers[IP], count * 4);
 }
 
-void vm_error(VMContext *ctx, const char *message)
+void vm_trap(VMContext *ctx, VMTrap trap)
 {
-	ctx->running = false;
-	// TODO: Add some more information
-	std::cout << "Error caught: " << message << std::endl;
-	exit(-1);
+    ctx->running = false;
+    ctx->trap = trap;
+    // IP already points past the instruction that failed
+    ctx->trap_address = ctx->registers[IP] - 4;
+    plat_abort_guarded(PLAT_FAULT_ABORTED);
+
+    // Not run by an engine, nobody could handle it
+    std::cout << "Error caught: " << vm_trap_message(trap) << " at " << vm_symbols_describe(ctx->symbols, ctx->trap_address) << std::endl;
+    vm_trace_dump(ctx);
+    exit(-1);
+}
+
+const char* vm_trap_message(VMTrap trap)
+{
+    switch (trap)
+    {
+    case TRAP_NONE:
+        return "No error";
+    case TRAP_STACK_OVERFLOW:
+        return "Stack overflow";
+    case TRAP_STACK_UNDERFLOW:
+        return "Stack underflow";
+    case TRAP_INVALID_OPCODE:
+        return "Invalid opcode";
+    case TRAP_INVALID_OPERAND:
+        return "Invalid operand";
+    case TRAP_OUT_OF_RANGE:
+        return "Memory access out of range";
+    case TRAP_DIVIDE_BY_ZERO:
+        return "Division by zero";
+    case TRAP_OUT_OF_MEMORY:
+        return "Out of memory";
+    case TRAP_INVALID_SYSCALL:
+        return "Invalid syscall";
+    }
+    return "Unknown error";
+}
+
+VMTrap vm_run_guarded(VMContext *ctx, void (*loop)(VMContext *ctx, void *arg), void *arg)
+{
+    ctx->trap = TRAP_NONE;
+    GuardedLoop run = { ctx, loop, arg };
+    auto fault = plat_run_guarded(&run_guarded_loop, &run);
+    if (fault == PLAT_FAULT_OUT_OF_RANGE || fault == PLAT_FAULT_OUT_OF_MEMORY)
+    {
+        // Faults interrupt the instruction before IP. Compiled JIT blocks only update
+        // IP when they exit, so for those this is the start of the block.
+        ctx->running = false;
+        ctx->trap = fault == PLAT_FAULT_OUT_OF_RANGE ? TRAP_OUT_OF_RANGE : TRAP_OUT_OF_MEMORY;
+        ctx->trap_address = ctx->registers[IP] - 4;
+    }
+    if (ctx->trap != TRAP_NONE)
+        vm_trace_dump(ctx);
+    return ctx->trap;
+}
+
+VMTrap vm_run_table(VMContext *ctx)
+{
+    return vm_run_guarded(ctx, &run_table, nullptr);
+}
+
+VMTrap vm_run(VMContext *ctx, vmword max_instructions, vm_engine engine)
+{
+    auto ic = ctx->registers[IC];
+    ctx->ic_limit = ic + max_instructions < ic ? VM_NO_IC_LIMIT : ic + max_instructions;
+    ctx->suspended = false;
+    auto trap = engine(ctx);
+    ctx->ic_limit = VM_NO_IC_LIMIT;
+    if (ctx->suspended && trap == TRAP_NONE)
+        ctx->running = true;
+    ctx->suspended = false;
+    return trap;
+}
+
+VMTrap vm_run_for(VMContext *ctx, std::chrono::steady_clock::time_point deadline, vm_engine engine)
+{
+    auto slice = RUN_FOR_FIRST_SLICE;
+    for (;;)
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (start >= deadline)
+            return TRAP_NONE;
+        auto ic = ctx->registers[IC];
+        auto trap = vm_run(ctx, slice, engine);
+        if (trap != TRAP_NONE || !ctx->running)
+            return trap;
+
+        // Aim the next slice at half of the remaining time at the speed of this one
+        auto end = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration<double>(end - start).count();
+        auto remaining = std::chrono::duration<double>(deadline - end).count();
+        if (elapsed > 0 && remaining > 0)
+        {
+            auto next = (ctx->registers[IC] - ic) / elapsed * remaining / 2;
+            slice = next < RUN_FOR_MIN_SLICE ? RUN_FOR_MIN_SLICE
+                : next > RUN_FOR_MAX_SLICE ? RUN_FOR_MAX_SLICE : static_cast<vmword>(next);
+        }
+    }
+}
+
+void vm_invalidate_range(VMContext *ctx, vmword address, size_t count)
+{
+    if (count == 0)
+        return;
+    // Only look at slots that may hold something, and only write to those that do, so
+    // invalidating a large data buffer neither reads nor commits the predecode cache behind it
+    auto first = address >> 2;
+    auto last = (address + count - 1) >> 2;
+    if (first < ctx->decoded_begin)
+        first = ctx->decoded_begin;
+    for (auto slot = first; slot <= last && slot < ctx->decoded_end; slot++)
+    {
+        auto entry = ctx->predecoded + slot;
+        if (entry->impl != nullptr || entry->jit_covered || entry->aot_covered || entry->compact || entry->batched || (slot > 0 && entry[-1].fusion != 0))
+            vm_invalidate(ctx, slot << 2);
+    }
+}
+
+void vm_invalidate_all(VMContext *ctx)
+{
+    plat_zero_bytes(ctx->predecoded, predecode_bytes(ctx->predecode_slots));
+    ctx->decoded_begin = SIZE_MAX;
+    ctx->decoded_end = 0;
+    ctx->stack_verified = false;
+    // Lockstep slots are forgotten along with everything else
+    ctx->batch_diverged = true;
+    vm_jit_flush(ctx);
+    // The new code is not what the library was built from
+    vm_aot_unload(ctx);
+    vm_compact_release(ctx);
 }
 
-Instruction vm_fetch_decode(VMContext *ctx)
+void vm_predecode(const VMContext *ctx, PredecodedInstruction *dst, vmword address)
 {
-    auto data_address = reinterpret_cast<InstructionData*>(ctx->memory + ctx->registers[IP]);
-	auto instr = vmi_decode(data_address);
-	ctx->registers[IP] += 4;
-	return instr;
+    // An instruction that doesn't fit into memory is read from the guard area
+    if (address > ctx->memory_size - 4)
+        address = ctx->memory_guard;
+    auto data_address = reinterpret_cast<const InstructionData*>(ctx->memory + address);
+    vm_predecode_instr(ctx, dst, vmi_decode(data_address));
+}
+
+void vm_predecode_instr(const VMContext *ctx, PredecodedInstruction *dst, const Instruction &instr)
+{
+    dst->instr = instr;
+    auto impl = select_specialized_impl(&dst->instr, dst->verified);
+    if (impl == nullptr)
+        impl = static_cast<uint32_t>(dst->instr.opcode) < INSTRUCTION_COUNT ? ctx->instr_table[dst->instr.opcode] : &invalid_opcode;
+    dst->impl = impl;
+    dst->fusion = 0;
+    dst->threaded = vm_threaded_handler(&dst->instr, dst->verified);
+}
+
+const PredecodedInstruction* vm_fetch_decode_slow(VMContext *ctx, vmword ip)
+{
+    auto slot = ip >> 2;
+    PredecodedInstruction *entry;
+    if ((ip & 3) != 0 || slot >= ctx->predecode_slots)
+    {
+        entry = &ctx->unaligned;
+        vm_predecode(ctx, entry, ip);
+    }
+    else
+    {
+        entry = ctx->predecoded + slot;
+        if (entry->impl == nullptr)
+        {
+            vm_predecode(ctx, entry, ip);
+            vm_mark_decoded(ctx, slot);
+        }
+    }
+
+    if (ctx->trace != nullptr)
+        vm_trace_record(ctx->trace, ctx->registers[IC], ip, &entry->instr);
+    return entry;
 }
 
-void vm_execute(VMContext *ctx, const Instruction *instr)
+void vm_execute(VMContext *ctx, const PredecodedInstruction *instr)
 {
-    auto instr_impl = ctx->instr_table[instr->opcode];
-    instr_impl(ctx, instr);
-	ctx->registers[IC]++;
+    instr->impl(ctx, &instr->instr);
+    ctx->registers[IC]++;
 }
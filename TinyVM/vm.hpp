@@ -1,8 +1,21 @@
 #pragma once
 
+#include <chrono>
+
 #include "vmtypes.hpp"
 #include "instruction.hpp"
 #include "instruction_implementation.hpp"
+#include "jit.hpp"
+#include "aot.hpp"
+#include "fusion.hpp"
+#include "profiler.hpp"
+#include "trace.hpp"
+#include "syscall.hpp"
+#include "rng.hpp"
+#include "compact.hpp"
+#include "verifier.hpp"
+#include "batch.hpp"
+#include "vm_threaded.hpp"
 
 enum Registers
 {
@@ -34,19 +47,148 @@ enum Registers
     VM_REGISTER_COUNT,
 };
 
+// Why a context stopped other than by executing HALT
+enum VMTrap : int
+{
+    TRAP_NONE,            // Still running or halted normally
+    TRAP_STACK_OVERFLOW,
+    TRAP_STACK_UNDERFLOW,
+    TRAP_INVALID_OPCODE,
+    TRAP_INVALID_OPERAND, // Assignment to a literal operand, unknown register or operand without mode
+    TRAP_OUT_OF_RANGE,    // Memory access outside of memory
+    TRAP_DIVIDE_BY_ZERO,
+    TRAP_OUT_OF_MEMORY,   // Memory could not be committed
+    TRAP_INVALID_SYSCALL, // SYSCALL with a number no host function is bound to
+};
+
+// Default memory size of a context in vmwords
 const size_t VM_MEMORY_SIZE = 0x10000;
 
+// Value of VMContext::ic_limit outside of vm_run
+const vmword VM_NO_IC_LIMIT = ~vmword(0);
+
+// An instruction slot, decoded once and cached together with its implementation.
+// A slot with impl == nullptr has not been decoded yet or was invalidated by a write.
+struct PredecodedInstruction
+{
+    Instruction instr;
+    instr_func impl;
+    // Implementation of instr alone if impl is a superinstruction (see vm_fuse)
+    instr_func base_impl;
+    // 1 + index into FUSION_PATTERNS if this slot was fused with the next one, 0 otherwise
+    uint8_t fusion;
+    // Handler vm_run_threaded jumps to, see vm_threaded_handler
+    uint8_t threaded;
+    // Set if a compiled JIT block covers this slot
+    bool jit_covered;
+    // Set if a block loaded with vm_aot_load covers this slot
+    bool aot_covered;
+    // Set if the slot has compact code, see vm_compact_load
+    bool compact;
+    // What vm_verify proved about the slot, selects the implementation vm_predecode picks
+    VMVerifyLevel verified;
+    // Set if vm_run_batch runs the slot in lockstep with other contexts
+    bool batched;
+};
+
+// Labels and source lines of a program, see symbols.hpp
+struct VMSymbols;
+
+// Releases the memory of a context, see VMContext::memory_release
+typedef void (*memory_release_func)(vmword *memory, size_t nwords);
+
 struct VMContext
 {
 	bool running = true;
+    // Set when the context stopped because of an error, together with the address of the failing instruction
+    VMTrap trap = TRAP_NONE;
+    vmword trap_address = 0;
     instr_func instr_table[INSTRUCTION_COUNT];
 
     vmword registers[VM_REGISTER_COUNT];
+    // Run loops stop at the next backward jump or call once IC reaches this, see vm_run.
+    // Compiled JIT blocks expect it right after the registers.
+    vmword ic_limit = VM_NO_IC_LIMIT;
+    // Set when the run loop was stopped by ic_limit rather than HALT
+    bool suspended = false;
     vmword *memory;
+    // Size of memory in vmwords, always a multiple of 4
+    size_t memory_size;
+    // Offset of the guard area that out-of-range addresses are mapped to, see vm_bound
+    size_t memory_guard;
+    // Called when memory is replaced or the context is destroyed, nullptr if someone else owns it
+    memory_release_func memory_release;
+
+    // One entry per 4-word-aligned slot of memory
+    PredecodedInstruction *predecoded;
+    size_t predecode_slots;
+    // Decode target for instructions that do not start at an aligned slot
+    PredecodedInstruction unaligned = {};
+    // Slots outside of [decoded_begin, decoded_end) hold nothing, see vm_mark_decoded
+    size_t decoded_begin = SIZE_MAX;
+    size_t decoded_end = 0;
+
+    // State of the JIT compiler, nullptr unless enabled with vm_jit_enable
+    JitState *jit = nullptr;
+
+    // Ahead-of-time compiled blocks, nullptr unless loaded with vm_aot_load
+    AotState *aot = nullptr;
+
+    // Profiling data, nullptr unless enabled with vm_profile_enable
+    VMProfile *profile = nullptr;
+
+    // Ring buffer of recently executed instructions, nullptr unless enabled with vm_trace_enable
+    VMTrace *trace = nullptr;
+
+    // Host functions called by SYSCALL, nullptr until one is bound with vm_syscall_register
+    VMSyscallTable *syscalls = nullptr;
+
+    // Compact code of the loaded program, nullptr unless loaded with vm_compact_load
+    VMCompactCode *compact = nullptr;
+
+    // Set while slots are predecoded as VERIFIED_STACK, see vm_verify
+    bool stack_verified = false;
+
+    // Set once the context wrote to a slot vm_run_batch runs in lockstep, which then
+    // interprets it on its own
+    bool batch_diverged = false;
+
+    // Generator of RDRAND, seeded differently for every new context, see vm_seed
+    VMRng rng;
+
+    // Symbols of the loaded program for error reports and the profiler, may be nullptr.
+    // Not owned by the context.
+    const VMSymbols *symbols = nullptr;
+
+    // Per pattern: number of fused pairs created and number of times they were executed
+    uint64_t fusion_sites[VM_MAX_FUSION_PATTERNS] = {};
+    uint64_t fusion_hits[VM_MAX_FUSION_PATTERNS] = {};
 };
 
-// Create a new vm context and reset it
-VMContext* vm_create();
+// Copy-on-write snapshot of the memory, predecoded instructions, compact code, registers,
+// syscalls and random number generator of a context
+struct VMSnapshot;
+
+// Create a new vm context with memory_size vmwords of memory (rounded up to a multiple of 4) and reset it
+// Memory is only reserved, pages are committed as they are touched
+// Returns nullptr if the memory could not be reserved
+VMContext* vm_create(size_t memory_size = VM_MEMORY_SIZE);
+
+// Restart the random numbers of ctx with the sequence of seed, for reproducible runs
+void vm_seed(VMContext *ctx, uint64_t seed);
+
+// Take a snapshot of ctx that any number of contexts can be forked from
+// Returns nullptr if the snapshot could not be created
+VMSnapshot* vm_snapshot(const VMContext *ctx);
+
+// Destroy a snapshot. Contexts forked from it stay valid.
+void vm_snapshot_destroy(VMSnapshot *snapshot);
+
+// Create a new vm context from a snapshot. Its memory shares pages with the snapshot
+// and only uses memory of its own for the pages it writes to.
+// Forks continue the random numbers of the snapshot, use vm_seed to give them their own.
+// Returns nullptr if the memory could not be mapped
+VMContext* vm_fork(const VMSnapshot *snapshot);
 
 // Destroy the given vm context
 void vm_destroy(VMContext *ctx);
@@ -54,6 +196,13 @@ void vm_destroy(VMContext *ctx);
 // Reset the given vm context, basically zeroing everything
 void vm_reset(VMContext *ctx);
 
+// Replace the memory of ctx with ctx->memory_size words at memory, releasing the current
+// memory. release is called on memory when it is replaced in turn or ctx is destroyed,
+// pass nullptr if the caller keeps ownership. Memory from plat_map_memory and friends
+// is released with plat_unmap_memory, other memory must be followed by at least
+// PLAT_MEMORY_GUARD_WORDS words that out-of-range accesses may hit.
+void vm_replace_memory(VMContext *ctx, vmword *memory, memory_release_func release);
+
 // Initialize the stack by setting sp and sbp and zeroing the stack
 void vm_init_stack(VMContext *ctx, vmword stacksize);
 
@@ -63,11 +212,123 @@ void vm_init_programbase(VMContext *ctx, vmword location);
 // Load the given number of instructions into memory, starting at ip
 void vm_load_program(VMContext *ctx, InstructionData *data, size_t count);
 
-// Report an error and stop execution
-void vm_error(VMContext *ctx, const char *message);
+// Stop ctx with trap at the current instruction, i.e. the one before IP.
+// Unwinds to the vm_run_guarded call running ctx and does not return. Without one,
+// the error is reported and the process exits, so ctx must be run by one of the engines.
+[[noreturn]] void vm_trap(VMContext *ctx, VMTrap trap);
+
+// Describe trap, e.g. "Stack overflow"
+const char* vm_trap_message(VMTrap trap);
+
+// Run loop(ctx, arg) such that traps and memory faults stop ctx instead of the process.
+// This is the entry of every engine, success costs nothing but setting up the unwind target.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted or loop returned.
+VMTrap vm_run_guarded(VMContext *ctx, void (*loop)(VMContext *ctx, void *arg), void *arg);
+
+// Run ctx until it stops, dispatching through the predecode cache
+VMTrap vm_run_table(VMContext *ctx);
+
+// An execution engine, runs a context until it stops
+typedef VMTrap (*vm_engine)(VMContext *ctx);
+
+// Run ctx with engine, but stop once it executed about max_instructions instructions.
+// The budget is only checked at backward jumps and calls, so the run may overshoot by
+// the length of a straight-line stretch of code. If the budget stopped ctx, ctx->running
+// is left set and running ctx again continues exactly where it stopped.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted or ran out of budget.
+VMTrap vm_run(VMContext *ctx, vmword max_instructions, vm_engine engine = &vm_run_table);
+
+// Run ctx with engine like vm_run, but stop at the first budget check after deadline.
+// The clock is only read between budgeted slices, which are sized from the measured speed.
+VMTrap vm_run_for(VMContext *ctx, std::chrono::steady_clock::time_point deadline,
+    vm_engine engine = &vm_run_table);
+
+// Drop predecoded instructions overlapping count words of memory, starting at address
+void vm_invalidate_range(VMContext *ctx, vmword address, size_t count);
+
+// Drop all predecoded instructions, e.g. after the whole memory was replaced
+void vm_invalidate_all(VMContext *ctx);
+
+// Map address onto the guard area past the end of memory if it is out of range.
+// This compiles to a conditional move, so in-range accesses don't pay for a branch,
+// and out-of-range ones fault in the guard area (see plat_map_memory).
+inline vmword vm_bound(const VMContext *ctx, vmword address)
+{
+    return address < ctx->memory_size ? address : ctx->memory_guard;
+}
+
+// Drop the predecoded instruction overlapping the memory word at address.
+// Must be called whenever guest code writes to memory.
+inline void vm_invalidate(VMContext *ctx, vmword address)
+{
+    auto slot = address >> 2;
+    if (slot < ctx->predecode_slots)
+    {
+        auto entry = ctx->predecoded + slot;
+        entry->impl = nullptr;
+        // A superinstruction in the previous slot includes this one
+        if (slot > 0 && entry[-1].fusion != 0)
+            entry[-1].impl = nullptr;
+        if (entry->jit_covered)
+            vm_jit_flush(ctx);
+        if (entry->aot_covered)
+            vm_aot_invalidate(ctx, slot);
+        if (entry->compact)
+            vm_compact_invalidate(ctx, slot);
+        if (entry->verified != VERIFIED_NONE)
+            vm_verify_invalidate(ctx, entry);
+        if (entry->batched)
+            ctx->batch_diverged = true;
+    }
+}
+
+// Stop the run loop once the budget of vm_run is used up.
+// Called at backward jumps and calls, so no loop can run past the budget.
+inline void vm_check_budget(VMContext *ctx)
+{
+    if (ctx->registers[IC] >= ctx->ic_limit)
+    {
+        ctx->running = false;
+        ctx->suspended = true;
+    }
+}
+
+// Record that slot holds a decoded or compiled instruction, so vm_invalidate_range
+// can skip ranges that only ever held data
+inline void vm_mark_decoded(VMContext *ctx, size_t slot)
+{
+    if (slot < ctx->decoded_begin)
+        ctx->decoded_begin = slot;
+    if (slot >= ctx->decoded_end)
+        ctx->decoded_end = slot + 1;
+}
+
+// Decode the instruction at address into dst and resolve its implementation
+void vm_predecode(const VMContext *ctx, PredecodedInstruction *dst, vmword address);
+
+// Same for an instruction that was decoded from somewhere else, e.g. compact code
+void vm_predecode_instr(const VMContext *ctx, PredecodedInstruction *dst, const Instruction &instr);
+
+// Fetch the instruction at ip the slow way: decode it if it is not cached or not
+// aligned, and record it if ctx is traced. Kept out of line so vm_fetch_decode stays
+// small enough to be inlined into every dispatch of the threaded core.
+const PredecodedInstruction* vm_fetch_decode_slow(VMContext *ctx, vmword ip);
+
+// Fetch the next instruction, decoding it only if it is not cached yet
+inline const PredecodedInstruction* vm_fetch_decode(VMContext *ctx)
+{
+    auto ip = ctx->registers[IP];
+    ctx->registers[IP] += 4;
 
-// Fetch and decode the next instruction
-Instruction vm_fetch_decode(VMContext *ctx);
+    auto slot = ip >> 2;
+    if ((ip & 3) == 0 && slot < ctx->predecode_slots && ctx->trace == nullptr)
+    {
+        auto entry = ctx->predecoded + slot;
+        if (entry->impl != nullptr)
+            return entry;
+    }
+    return vm_fetch_decode_slow(ctx, ip);
+}
 
 // Execute the given instruction
-void vm_execute(VMContext *ctx, const Instruction *instr);
+void vm_execute(VMContext *ctx, const PredecodedInstruction *instr);
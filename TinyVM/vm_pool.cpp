@@ -0,0 +1,170 @@
+#include "vm_pool.hpp"
+
+#include <algorithm>
+
+#include "vm.hpp"
+
+namespace
+{
+    // Index of the pool worker running on this thread, used to keep
+    // contexts submitted from completion callbacks on the same worker
+    thread_local const VMPool *current_pool = nullptr;
+    thread_local size_t current_worker = 0;
+}
+
+VMPool::VMPool(size_t worker_count, vmword slice)
+    : slice(slice), next_worker(0), queued(0), outstanding(0)
+{
+    if (worker_count == 0)
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < worker_count; i++)
+        workers.emplace_back(new Worker);
+    for (size_t i = 0; i < worker_count; i++)
+        workers[i]->thread = std::thread(&VMPool::worker_main, this, i);
+}
+
+VMPool::~VMPool()
+{
+    wait_idle();
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        stopping = true;
+    }
+    work_available.notify_all();
+    for (auto &worker : workers)
+        worker->thread.join();
+}
+
+std::future<VMContext*> VMPool::submit(VMContext *ctx, vm_engine engine)
+{
+    auto task = new Task;
+    task->ctx = ctx;
+    task->engine = engine;
+    auto future = task->promise.get_future();
+    enqueue(task);
+    return future;
+}
+
+void VMPool::submit(VMContext *ctx, VMCompletionCallback callback, vm_engine engine)
+{
+    auto task = new Task;
+    task->ctx = ctx;
+    task->engine = engine;
+    task->callback = std::move(callback);
+    enqueue(task);
+}
+
+void VMPool::wait_idle()
+{
+    std::unique_lock<std::mutex> lock(state_mutex);
+    idle.wait(lock, [this] { return outstanding.load() == 0; });
+}
+
+void VMPool::enqueue(Task *task)
+{
+    outstanding++;
+
+    // Keep work local when a worker submits, spread it round-robin otherwise
+    size_t index;
+    if (current_pool == this)
+        index = current_worker;
+    else
+        index = next_worker++ % workers.size();
+    push(index, task);
+}
+
+// Add task to the back of the deque of a worker and wake up an idle one
+void VMPool::push(size_t worker_index, Task *task)
+{
+    {
+        // Counted under the same lock take() pops under, so queued never drops below zero
+        std::lock_guard<std::mutex> lock(workers[worker_index]->mutex);
+        workers[worker_index]->tasks.push_back(task);
+        queued++;
+    }
+    {
+        // A worker between checking queued and going to sleep holds state_mutex,
+        // so it can't miss the notification
+        std::lock_guard<std::mutex> lock(state_mutex);
+    }
+    work_available.notify_one();
+}
+
+VMPool::Task *VMPool::take(size_t worker_index)
+{
+    // Own deque first, oldest task first so local contexts are round-robined
+    {
+        auto &own = *workers[worker_index];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty())
+        {
+            auto task = own.tasks.front();
+            own.tasks.pop_front();
+            queued--;
+            return task;
+        }
+    }
+
+    // Steal from the back of the other workers' deques
+    for (size_t i = 1; i < workers.size(); i++)
+    {
+        auto &victim = *workers[(worker_index + i) % workers.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty())
+        {
+            auto task = victim.tasks.back();
+            victim.tasks.pop_back();
+            queued--;
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+void VMPool::worker_main(size_t worker_index)
+{
+    current_pool = this;
+    current_worker = worker_index;
+
+    while (true)
+    {
+        auto task = take(worker_index);
+        if (task == nullptr)
+        {
+            std::unique_lock<std::mutex> lock(state_mutex);
+            work_available.wait(lock, [this] { return stopping || queued.load() > 0; });
+            if (stopping && queued.load() == 0)
+                return;
+            continue;
+        }
+
+        if (run_slice(task))
+            complete(task);
+        else
+        {
+            // Budget used up, go to the back of the line
+            push(worker_index, task);
+        }
+    }
+}
+
+// Run the task for one time slice, returns true if its context stopped
+bool VMPool::run_slice(Task *task)
+{
+    auto ctx = task->ctx;
+    vm_run(ctx, slice, task->engine);
+    return !ctx->running;
+}
+
+void VMPool::complete(Task *task)
+{
+    if (task->callback)
+        task->callback(task->ctx);
+    else
+        task->promise.set_value(task->ctx);
+    delete task;
+
+    std::lock_guard<std::mutex> lock(state_mutex);
+    if (--outstanding == 0)
+        idle.notify_all();
+}
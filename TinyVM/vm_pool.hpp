@@ -0,0 +1,83 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vm.hpp"
+#include "util.hpp"
+
+// Default number of instructions a context may execute before it has to yield its worker
+const vmword VM_POOL_DEFAULT_SLICE = 100000;
+
+// Called on the worker thread that ran ctx, after ctx stopped
+typedef std::function<void(VMContext *ctx)> VMCompletionCallback;
+
+// Runs many independent contexts on a fixed set of worker threads.
+// Every worker owns a deque of runnable contexts and steals from the other
+// workers when its own deque runs dry. Contexts are time-sliced by the number
+// of instructions they execute (counted on IC), so a long-running guest can't
+// starve the others.
+class VMPool : private NonCopyable
+{
+public:
+    // Start worker_count workers, or one per hardware thread if worker_count is 0
+    explicit VMPool(size_t worker_count = 0, vmword slice = VM_POOL_DEFAULT_SLICE);
+
+    // Wait for all submitted contexts to stop, then shut the workers down
+    ~VMPool();
+
+    // Schedule ctx to run with engine until it stops. ctx must be fully initialized
+    // (memory, registers, IP, whatever engine needs) and must not be touched by the
+    // caller until it completed.
+    std::future<VMContext*> submit(VMContext *ctx, vm_engine engine = &vm_run_table);
+    void submit(VMContext *ctx, VMCompletionCallback callback, vm_engine engine = &vm_run_table);
+
+    // Block until all submitted contexts have stopped
+    void wait_idle();
+
+    size_t worker_count() const { return workers.size(); }
+
+private:
+    struct Task
+    {
+        VMContext *ctx;
+        vm_engine engine;
+        VMCompletionCallback callback;
+        std::promise<VMContext*> promise;
+    };
+
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Task*> tasks;
+        std::thread thread;
+    };
+
+    void enqueue(Task *task);
+    void push(size_t worker_index, Task *task);
+    Task *take(size_t worker_index);
+    void worker_main(size_t worker_index);
+    bool run_slice(Task *task);
+    void complete(Task *task);
+
+    vmword slice;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic<size_t> next_worker;
+
+    // Number of tasks sitting in deques and number of tasks not yet completed.
+    // queued only changes under the lock of the deque the task goes into or comes from.
+    std::atomic<size_t> queued;
+    std::atomic<size_t> outstanding;
+    bool stopping = false;
+
+    std::mutex state_mutex;
+    std::condition_variable work_available;
+    std::condition_variable idle;
+};
@@ -0,0 +1,221 @@
+#include "vm_threaded.hpp"
+
+#include "vm.hpp"
+#include "instruction_semantics.hpp"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TVM_COMPUTED_GOTO 1
+#else
+#define TVM_COMPUTED_GOTO 0
+#endif
+
+// Operand modes of inlined handlers: register, literal, memory, or D for operands
+// the instruction doesn't use, which match any mode
+#define THREADED_MODE_R AM_REGISTER
+#define THREADED_MODE_L AM_LITERAL
+#define THREADED_MODE_M AM_MEMORY
+#define THREADED_MODE_D AM_DYNAMIC
+
+// Instructions the threaded core runs inline with their modes resolved at compile time,
+// as opcode, implementation and the modes of a, b and c
+#define THREADED_INLINE(X) \
+    X(OP_NOP, nop, D, D, D) \
+    X(OP_HALT, halt, D, D, D) \
+    X(OP_ADD, add, R, R, R) X(OP_ADD, add, R, R, L) X(OP_ADD, add, R, L, R) \
+    X(OP_SUB, sub, R, R, R) X(OP_SUB, sub, R, R, L) X(OP_SUB, sub, R, L, R) \
+    X(OP_MUL, mul, R, R, R) X(OP_MUL, mul, R, R, L) X(OP_MUL, mul, R, L, R) \
+    X(OP_DIV, div, R, R, R) X(OP_DIV, div, R, R, L) X(OP_DIV, div, R, L, R) \
+    X(OP_SHL, shl, R, R, R) X(OP_SHL, shl, R, R, L) X(OP_SHL, shl, R, L, R) \
+    X(OP_SHR, shr, R, R, R) X(OP_SHR, shr, R, R, L) X(OP_SHR, shr, R, L, R) \
+    X(OP_MOD, mod, R, R, R) X(OP_MOD, mod, R, R, L) X(OP_MOD, mod, R, L, R) \
+    X(OP_CMP, cmp, R, R, R) X(OP_CMP, cmp, R, R, L) X(OP_CMP, cmp, R, L, R) \
+    X(OP_INC, inc, R, D, D) \
+    X(OP_DEC, dec, R, D, D) \
+    X(OP_NOT, not, R, D, D) \
+    X(OP_MOV, mov, R, R, D) X(OP_MOV, mov, R, L, D) X(OP_MOV, mov, R, M, D) X(OP_MOV, mov, M, R, D) \
+    X(OP_JMP, jmp, L, D, D) \
+    X(OP_JEQ, jeq, L, R, R) X(OP_JEQ, jeq, L, R, L) \
+    X(OP_JNE, jne, L, R, R) X(OP_JNE, jne, L, R, L) \
+    X(OP_JNZ, jnz, L, R, D)
+
+// Same for stack operations, which have another variant once the stack is verified
+#define THREADED_INLINE_STACK(X) \
+    X(OP_PUSH, push, R, D, D) X(OP_PUSH, push, L, D, D) \
+    X(OP_POP, pop, R, D, D) \
+    X(OP_CALL, call, L, D, D) \
+    X(OP_RET, ret, D, D, D)
+
+// Every opcode in order, as opcode and implementation. Slots with modes none of the lists
+// above has (memory, indirect) run these inline, reading their modes at runtime like the
+// table entries do. Only superinstructions and invalid opcodes call their implementation.
+#define THREADED_INLINE_DYNAMIC(X) \
+    X(OP_NOP, nop) X(OP_HALT, halt) X(OP_PUSH, push) X(OP_POP, pop) \
+    X(OP_ADD, add) X(OP_SUB, sub) X(OP_MUL, mul) X(OP_DIV, div) \
+    X(OP_SHL, shl) X(OP_SHR, shr) X(OP_MOD, mod) X(OP_INC, inc) \
+    X(OP_DEC, dec) X(OP_NOT, not) X(OP_CMP, cmp) X(OP_MOV, mov) \
+    X(OP_CALL, call) X(OP_RET, ret) X(OP_JMP, jmp) X(OP_JEQ, jeq) \
+    X(OP_JNE, jne) X(OP_JNZ, jnz) X(OP_RDRAND, rdrand) X(OP_SYSCALL, syscall) \
+    X(OP_VADD, vadd) X(OP_VSUB, vsub) X(OP_VMUL, vmul) X(OP_VXOR, vxor) \
+    X(OP_VFILL, vfill) X(OP_VCOPY, vcopy) X(OP_VSUM, vsum) X(OP_VMIN, vmin) \
+    X(OP_VMAX, vmax) X(OP_VCOUNT, vcount)
+
+namespace
+{
+    // Handlers of the threaded core. Inlined instructions get one per verify level they
+    // have a variant for: unchecked, verified operands (_V) and verified stack (_S).
+    // Opcodes run with dynamic modes get a single one, _X.
+    enum ThreadedHandler : uint8_t
+    {
+        TH_IMPL = VM_THREADED_IMPL,
+#define HANDLER_ID(opcode, name, a, b, c) TH_##name##_##a##b##c, TH_##name##_##a##b##c##_V,
+#define HANDLER_ID_STACK(opcode, name, a, b, c) TH_##name##_##a##b##c, TH_##name##_##a##b##c##_V, TH_##name##_##a##b##c##_S,
+        THREADED_INLINE(HANDLER_ID)
+        THREADED_INLINE_STACK(HANDLER_ID_STACK)
+#define HANDLER_ID_DYNAMIC(opcode, name) TH_##name##_X,
+        THREADED_INLINE_DYNAMIC(HANDLER_ID_DYNAMIC)
+#undef HANDLER_ID
+#undef HANDLER_ID_STACK
+#undef HANDLER_ID_DYNAMIC
+        TH_COUNT
+    };
+
+    struct InlineHandler
+    {
+        Opcode opcode;
+        int modes[3];
+        // Per VMVerifyLevel
+        uint8_t handlers[VERIFIED_STACK + 1];
+    };
+
+    const InlineHandler inline_handlers[] =
+    {
+#define HANDLER_ENTRY(opcode, name, a, b, c) \
+        { opcode, { THREADED_MODE_##a, THREADED_MODE_##b, THREADED_MODE_##c }, \
+          { TH_##name##_##a##b##c, TH_##name##_##a##b##c##_V, TH_##name##_##a##b##c##_V } },
+#define HANDLER_ENTRY_STACK(opcode, name, a, b, c) \
+        { opcode, { THREADED_MODE_##a, THREADED_MODE_##b, THREADED_MODE_##c }, \
+          { TH_##name##_##a##b##c, TH_##name##_##a##b##c##_V, TH_##name##_##a##b##c##_S } },
+        THREADED_INLINE(HANDLER_ENTRY)
+        THREADED_INLINE_STACK(HANDLER_ENTRY_STACK)
+#undef HANDLER_ENTRY
+#undef HANDLER_ENTRY_STACK
+    };
+
+    // Per opcode
+    const uint8_t dynamic_handlers[] =
+    {
+#define HANDLER_ENTRY_DYNAMIC(opcode, name) TH_##name##_X,
+        THREADED_INLINE_DYNAMIC(HANDLER_ENTRY_DYNAMIC)
+#undef HANDLER_ENTRY_DYNAMIC
+    };
+
+    static_assert(sizeof(dynamic_handlers) / sizeof(dynamic_handlers[0]) == INSTRUCTION_COUNT,
+        "Every opcode needs a dynamic handler");
+    static_assert(TH_COUNT <= UINT8_MAX + 1, "Handlers must fit into PredecodedInstruction::threaded");
+
+    bool mode_matches(int handler_mode, AddressingMode mode)
+    {
+        return handler_mode == AM_DYNAMIC || handler_mode == mode;
+    }
+
+    void run_threaded(VMContext *ctx, void*)
+    {
+        const PredecodedInstruction *instr;
+
+        const int V = AM_VERIFIED;
+        const int S = AM_VERIFIED | AM_VERIFIED_STACK;
+
+#if TVM_COMPUTED_GOTO
+        // Generated from the same lists as ThreadedHandler, so it is in the same order
+        static const void *dispatch_table[TH_COUNT] =
+        {
+            &&L_TH_IMPL,
+#define HANDLER_LABEL(opcode, name, a, b, c) &&L_TH_##name##_##a##b##c, &&L_TH_##name##_##a##b##c##_V,
+#define HANDLER_LABEL_STACK(opcode, name, a, b, c) &&L_TH_##name##_##a##b##c, &&L_TH_##name##_##a##b##c##_V, &&L_TH_##name##_##a##b##c##_S,
+            THREADED_INLINE(HANDLER_LABEL)
+            THREADED_INLINE_STACK(HANDLER_LABEL_STACK)
+#define HANDLER_LABEL_DYNAMIC(opcode, name) &&L_TH_##name##_X,
+            THREADED_INLINE_DYNAMIC(HANDLER_LABEL_DYNAMIC)
+#undef HANDLER_LABEL
+#undef HANDLER_LABEL_STACK
+#undef HANDLER_LABEL_DYNAMIC
+        };
+
+#define DISPATCH() \
+        do { \
+            if (!ctx->running) \
+                return; \
+            instr = vm_fetch_decode(ctx); \
+            goto *dispatch_table[instr->threaded]; \
+        } while (false)
+#define HANDLER(handler) L_##handler:
+#define NEXT() \
+        ctx->registers[IC]++; \
+        DISPATCH()
+
+        ctx->running = true;
+        DISPATCH();
+#else
+#define HANDLER(handler) case handler:
+#define NEXT() \
+        ctx->registers[IC]++; \
+        continue
+
+        ctx->running = true;
+        while (ctx->running)
+        {
+            instr = vm_fetch_decode(ctx);
+            switch (instr->threaded)
+            {
+#endif
+
+        // Superinstructions and invalid opcodes
+        HANDLER(TH_IMPL) instr->impl(ctx, &instr->instr); NEXT();
+
+#define MODES(a, b, c, flags) THREADED_MODE_##a | flags, THREADED_MODE_##b | flags, THREADED_MODE_##c | flags
+#define INLINE_HANDLER(opcode, name, a, b, c) \
+        HANDLER(TH_##name##_##a##b##c) IMPL_NAME(name)<MODES(a, b, c, 0)>(ctx, &instr->instr); NEXT(); \
+        HANDLER(TH_##name##_##a##b##c##_V) IMPL_NAME(name)<MODES(a, b, c, V)>(ctx, &instr->instr); NEXT();
+#define INLINE_HANDLER_STACK(opcode, name, a, b, c) \
+        INLINE_HANDLER(opcode, name, a, b, c) \
+        HANDLER(TH_##name##_##a##b##c##_S) IMPL_NAME(name)<MODES(a, b, c, S)>(ctx, &instr->instr); NEXT();
+        THREADED_INLINE(INLINE_HANDLER)
+        THREADED_INLINE_STACK(INLINE_HANDLER_STACK)
+#define INLINE_HANDLER_DYNAMIC(opcode, name) \
+        HANDLER(TH_##name##_X) IMPL_NAME(name)<>(ctx, &instr->instr); NEXT();
+        THREADED_INLINE_DYNAMIC(INLINE_HANDLER_DYNAMIC)
+#undef INLINE_HANDLER
+#undef INLINE_HANDLER_STACK
+#undef INLINE_HANDLER_DYNAMIC
+#undef MODES
+
+#if !TVM_COMPUTED_GOTO
+            }
+        }
+#endif
+
+#undef HANDLER
+#undef NEXT
+#undef DISPATCH
+    }
+}
+
+uint8_t vm_threaded_handler(const Instruction *instr, VMVerifyLevel verified)
+{
+    for (auto &handler : inline_handlers)
+    {
+        if (handler.opcode == instr->opcode
+            && mode_matches(handler.modes[0], instr->addressing[0])
+            && mode_matches(handler.modes[1], instr->addressing[1])
+            && mode_matches(handler.modes[2], instr->addressing[2]))
+            return handler.handlers[verified];
+    }
+    if (static_cast<uint32_t>(instr->opcode) < INSTRUCTION_COUNT)
+        return dynamic_handlers[instr->opcode];
+    return TH_IMPL;
+}
+
+VMTrap vm_run_threaded(VMContext *ctx)
+{
+    return vm_run_guarded(ctx, &run_threaded, nullptr);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+#include "instruction_implementation.hpp"
+
+// Forward-declare VMContext
+struct VMContext;
+struct Instruction;
+enum VMTrap : int;
+
+// Handler of the threaded core that calls the implementation of the slot
+const uint8_t VM_THREADED_IMPL = 0;
+
+// The handler the threaded core runs a slot holding instr with, chosen by vm_predecode.
+// Common instructions have the variant of their modes and verify level inlined into
+// the core, the rest the inlined variant that reads modes at runtime. Only invalid
+// opcodes (and superinstructions, see vm_fuse) get VM_THREADED_IMPL.
+uint8_t vm_threaded_handler(const Instruction *instr, VMVerifyLevel verified);
+
+// Run ctx until it stops, using the threaded interpreter core.
+// Every slot jumps straight to its handler, which runs the instruction inline
+// and dispatches to the next instruction on its own. Uses computed goto where the compiler
+// supports it and falls back to a switch otherwise.
+// Returns the trap that stopped ctx, TRAP_NONE if it halted.
+VMTrap vm_run_threaded(VMContext *ctx);
@@ -2,7 +2,7 @@
 
 #
 # The TinyVM Assembler
-# Usage: tasm -o image.bin sourcecode.tasm
+# Usage: tasm [--flat | --compact] [--quiet] [--symbols image.sym] -o image.bin sourcecode.tasm
 #
 
 import sys, argparse, re, array
@@ -16,7 +16,7 @@ TOK_NO_TEXT = 2
 
 TOK_RULES = [(n, re.compile(r), f) for n, r, f in [
     ("newline", r"\r\n|\n", (TOK_NO_TEXT,)),
-    ("whitespace", r"\s+", (TOK_DISCARD,)),
+    ("whitespace", r"[^\S\n]+", (TOK_DISCARD,)),
     ("comment", r";[^\n]*", (TOK_DISCARD,)),
     ("label", r"\w+:", ()),
     ("label_ref", r":\w+", ()),
@@ -106,28 +106,45 @@ def parse_line(line):
     elif tok == "identifier":
         return "instruction", text, parse_operands(rest) if len(rest) > 0 else []
 
-def parse(tokens):
-    "Parse a bunch of tokens into instructions, labels, and specifiers"
+def parse_numbered(tokens):
+    "Parse a bunch of tokens into (source line number, parsed line) tuples"
     line = []
+    number = 1
     for tok, text in tokens:
         if tok != "newline":
             line.append((tok, text))
             continue
         if len(line) > 0:
-            yield parse_line(line)
+            yield number, parse_line(line)
             line = []
+        number += 1
     else:
         if len(line) > 0:
             # Make sure to parse the last line even if there is no final newline
-            yield parse_line(line)
+            yield number, parse_line(line)
+
+def parse(tokens):
+    "Parse a bunch of tokens into instructions, labels, and specifiers"
+    for number, line in parse_numbered(tokens):
+        yield line
 
 # # #
 # Assembling
 # # #
 
-# VM memory size in 64 bit words
+# VM memory size in 64 bit words of flat images, which hold all of it. Sectioned
+# images may place words anywhere, the loader checks them against the memory size.
 VM_IMAGE_SIZE = 0x10000
 
+# Sectioned image header: magic, flags, entry point, stack size, segment count
+# Each segment follows as base address, length in words, and the words themselves
+# With IF_COMPACT, a count of compact code sections follows, each as base address,
+# instruction count, length in bytes and the bytes padded to whole words
+IMAGE_MAGIC = 0x0100474D494D5654 # "TVMIMG\0\1"
+IF_ENTRY = 1 # Entry point is valid
+IF_STACK = 2 # Stack size is valid
+IF_COMPACT = 4 # Compact code sections follow the segments
+
 # Dict mapping instruction mnemonics to tuples with (opcode, operand count)
 INSTRUCTION_INFO = {
     "nop": (0, 0),
@@ -153,6 +170,17 @@ INSTRUCTION_INFO = {
     "jne": (20, 3),
     "jnz": (21, 2),
     "rdrand": (22, 3),
+    "syscall": (23, 1),
+    "vadd": (24, 3),
+    "vsub": (25, 3),
+    "vmul": (26, 3),
+    "vxor": (27, 3),
+    "vfill": (28, 3),
+    "vcopy": (29, 3),
+    "vsum": (30, 3),
+    "vmin": (31, 3),
+    "vmax": (32, 3),
+    "vcount": (33, 3),
 }
 
 # Dict mapping register names to register numbers
@@ -183,6 +211,8 @@ REGISTER_INFO = {
 # Dict mapping specifier names to required arguments
 SPECIFIER_INFO = {
     "base": ["number"], # Sets the address in memory where the next instruction will be mapped at. Argument must be multiple of 4.
+    "entry": ["number|label_ref"], # Sets the address execution starts at. Defaults to the first instruction.
+    "stack": ["number"], # Sets the stack size (the initial rSBP) the image is started with.
 }
 
 # Opcode/Instruction flags
@@ -207,6 +237,32 @@ def encode_instruction(opcode, flags, operands):
     words.extend([o[1] for o in operands])
     return words
 
+def encode_varint(value):
+    "Encode a number as unsigned LEB128"
+    data = bytearray()
+    while value >= 0x80:
+        data.append(value & 0x7f | 0x80)
+        value >>= 7
+    data.append(value)
+    return data
+
+def encode_compact_instruction(opcode, flags, operands):
+    """Encode an instruction into its compact form (see vmi_encode_compact)
+    Returns None if it has none"""
+    count = 3
+    while count > 0 and operands[count - 1] == (0, 0):
+        count -= 1
+    if opcode >= 64 or flags != OF_NORMAL or any(am > 0xf or val >= 1 << 64 for am, val in operands):
+        return None
+    data = bytearray([count << 6 | opcode])
+    if count > 0:
+        data.append(operands[0][0] | operands[1][0] << 4)
+    if count > 2:
+        data.append(operands[2][0])
+    for am, val in operands[:count]:
+        data.extend(encode_varint(val))
+    return bytes(data)
+
 def convert_instruction(instr_tuple, label_dict):
     """"Takes an instruction tuple from the parser and convert it into something that can be assembled
     Returns a tuple of (opcode, flags, operands), where operands is a list of 3 (AM, value) tuples"""
@@ -257,24 +313,135 @@ def encode_image(value_list):
     "Encode an array of integers into a vm image"
     return array.array("Q", value_list)
 
-def assemble(line_tuples, outfile):
+def make_segments(words):
+    "Group a dict mapping addresses to words into a sorted list of (base, [words]) runs"
+    segments = []
+    for addr in sorted(words):
+        if len(segments) > 0 and segments[-1][0] + len(segments[-1][1]) == addr:
+            segments[-1][1].append(words[addr])
+        else:
+            segments.append((addr, [words[addr]]))
+    return segments
+
+def make_compact_sections(instructions):
+    """Group a dict mapping addresses to converted instructions into a sorted list of
+    (base, instruction count, bytes) runs of compact code
+    Returns the sections and a dict with the instructions that have no compact form"""
+    sections = []
+    rest = {}
+    for addr in sorted(instructions):
+        code = encode_compact_instruction(*instructions[addr]) if addr % 4 == 0 else None
+        if code is None:
+            rest[addr] = instructions[addr]
+        elif len(sections) > 0 and sections[-1][0] + 4 * sections[-1][1] == addr:
+            base, count, section_code = sections[-1]
+            sections[-1] = (base, count + 1, section_code + code)
+        else:
+            sections.append((addr, 1, code))
+    return sections, rest
+
+def encode_sectioned_image(words, entry, stack, sections=None):
+    """Encode a dict mapping addresses to words into a sectioned vm image
+    sections are compact code sections as returned by make_compact_sections"""
+    flags = 0
+    if entry is not None:
+        flags |= IF_ENTRY
+    if stack is not None:
+        flags |= IF_STACK
+    if sections is not None:
+        flags |= IF_COMPACT
+    segments = make_segments(words)
+    value_list = [IMAGE_MAGIC, flags, entry or 0, stack or 0, len(segments)]
+    for base, segment_words in segments:
+        value_list.extend([base, len(segment_words)])
+        value_list.extend(segment_words)
+    image = encode_image(value_list)
+    if sections is not None:
+        image.append(len(sections))
+        for base, count, code in sections:
+            image.extend([base, count, len(code)])
+            image.frombytes(code + bytes(-len(code) % 8))
+    return image
+
+def assemble(line_tuples, outfile, flat=False, compact=False):
     addr = 0
-    val_list = [0] * VM_IMAGE_SIZE # List of words in the vm image
+    instructions = {} # Dict mapping addresses to converted instructions
+    entry = None
+    stack = None
+    first_instruction = None
     label_dict = make_label_index(line_tuples)
     for line in line_tuples:
         if line[0] == "instruction":
-            converted_instr = convert_instruction(line, label_dict)
-            encoded_instr = encode_instruction(*converted_instr)
-            for i in range(4):
-                val_list[addr + i] = encoded_instr[i]
+            if first_instruction is None:
+                first_instruction = addr
+            instructions[addr] = convert_instruction(line, label_dict)
             addr += 4
         elif line[0] == "specifier":
             t, spec, args = line
             if spec == "base":
                 addr = int(args[0][1])
-    image = encode_image(val_list)
+            elif spec == "entry":
+                tok, text = args[0]
+                entry = label_dict[text[1:]] if tok == "label_ref" else int(text)
+            elif spec == "stack":
+                stack = int(args[0][1])
+    sections = None
+    if compact:
+        sections, instructions = make_compact_sections(instructions)
+    words = {} # Dict mapping addresses to words in the vm image
+    for instr_addr, converted_instr in instructions.items():
+        encoded_instr = encode_instruction(*converted_instr)
+        for i in range(4):
+            words[instr_addr + i] = encoded_instr[i]
+    if flat:
+        if max(words, default=0) >= VM_IMAGE_SIZE:
+            raise Exception("Program does not fit into a flat image of {} words".format(VM_IMAGE_SIZE))
+        val_list = [0] * VM_IMAGE_SIZE # List of words in the vm image
+        for word_addr, word in words.items():
+            val_list[word_addr] = word
+        image = encode_image(val_list)
+    else:
+        image = encode_sectioned_image(words, entry if entry is not None else first_instruction, stack, sections)
     image.tofile(outfile)
 
+# # #
+# Symbols
+# # #
+
+# Symbol files are text, one entry per line:
+#   TVMSYM 1                  header and format version
+#   F <path>                  source file
+#   L <address> <label>       label, sorted by address
+#   S <address> <line>        source line of the instruction at address, sorted by address
+SYMBOLS_HEADER = "TVMSYM 1"
+
+def make_symbols(numbered_lines):
+    "Collect sorted (address, label) and (address, source line) lists"
+    addr = 0
+    labels = []
+    lines = []
+    for number, line in numbered_lines:
+        if line[0] == "specifier":
+            t, spec, args = line
+            if spec == "base":
+                addr = int(args[0][1])
+        elif line[0] == "instruction":
+            lines.append((addr, number))
+            addr += 4
+        elif line[0] == "label":
+            t, label = line
+            labels.append((addr, label))
+    return sorted(labels), sorted(lines)
+
+def write_symbols(numbered_lines, source, outfile):
+    labels, lines = make_symbols(numbered_lines)
+    outfile.write(SYMBOLS_HEADER + "\n")
+    outfile.write("F {}\n".format(source))
+    for addr, label in labels:
+        outfile.write("L {} {}\n".format(addr, label))
+    for addr, number in lines:
+        outfile.write("S {} {}\n".format(addr, number))
+
 # # #
 # Glue
 # # #
@@ -283,24 +450,34 @@ def parse_arguments():
     parser = argparse.ArgumentParser(description="The TinyVM Assembler")
     parser.add_argument("file", metavar="FILE", help="source file to assemble")
     parser.add_argument("-o", metavar="OUTFILE", default="tvmimage.bin", help="name of the output memory image (default: tvmimage.bin)")
+    layout = parser.add_mutually_exclusive_group()
+    layout.add_argument("--flat", action="store_true", help="write a legacy flat image of the whole memory instead of a sectioned one")
+    layout.add_argument("--compact", action="store_true", help="store instructions in the compact variable-length encoding, which TinyVM runs directly with --engine compact")
+    parser.add_argument("--quiet", action="store_true", help="don't print the parsed and encoded instructions")
+    parser.add_argument("--symbols", metavar="SYMFILE", help="also write labels and source lines to a symbol file for the profiler and error reports")
     return parser.parse_args()
 
 def main():
     args = parse_arguments()
     with open(args.file, "r") as f:
         tokens = list(tokenize(f.read()))
-        lines = list(parse(tokens))
-        for x in lines:
-            print(x)
-        label_dict = make_label_index(lines)
-        for x in lines:
-            if x[0] == "instruction":
-                converted = convert_instruction(x, label_dict)
-                encoded = encode_instruction(*converted)
-                print("converted: ", converted)
-                print("encoded: ", encoded)
+        numbered_lines = list(parse_numbered(tokens))
+        lines = [line for number, line in numbered_lines]
+        if not args.quiet:
+            for x in lines:
+                print(x)
+            label_dict = make_label_index(lines)
+            for x in lines:
+                if x[0] == "instruction":
+                    converted = convert_instruction(x, label_dict)
+                    encoded = encode_instruction(*converted)
+                    print("converted: ", converted)
+                    print("encoded: ", encoded)
         with open(args.o, "wb") as outfile:
-            assemble(lines, outfile)
+            assemble(lines, outfile, args.flat, args.compact)
+        if args.symbols is not None:
+            with open(args.symbols, "w") as symfile:
+                write_symbols(numbered_lines, args.file, symfile)
 
 if __name__ == "__main__":
     main()
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+
+#
+# The TinyVM trace decoder
+# Usage: tvmtrace [--symbols image.sym] trace.bin
+#
+
+import sys, argparse, array, bisect
+
+from tasm import INSTRUCTION_INFO, REGISTER_INFO, AM_INDIRECT, AM_LITERAL, AM_MEMORY, AM_REGISTER, SYMBOLS_HEADER
+
+# Trace header: magic, words per record, record count, total number of records written
+TRACE_MAGIC = 0x01004352544D5654 # "TVMTRC\0\1"
+TRACE_HEADER_WORDS = 4
+TRACE_RECORD_WORDS = 6
+
+OPCODE_NAMES = {opcode: name for name, (opcode, count) in INSTRUCTION_INFO.items()}
+OPERAND_COUNTS = {opcode: count for name, (opcode, count) in INSTRUCTION_INFO.items()}
+REGISTER_NAMES = {number: name for name, number in REGISTER_INFO.items()}
+
+def read_trace(f):
+    "Read a trace dump, returns (total records written, [(ic, ip, control, [operands])])"
+    words = array.array("Q")
+    words.frombytes(f.read())
+    if len(words) < TRACE_HEADER_WORDS or words[0] != TRACE_MAGIC:
+        raise Exception("Not a TinyVM trace")
+    magic, record_words, count, total = words[:TRACE_HEADER_WORDS]
+    if record_words < TRACE_RECORD_WORDS:
+        raise Exception("Unsupported record size {}".format(record_words))
+    records = []
+    for i in range(count):
+        base = TRACE_HEADER_WORDS + i * record_words
+        if base + TRACE_RECORD_WORDS > len(words):
+            break
+        ic, ip, control, *operands = words[base:base + TRACE_RECORD_WORDS]
+        records.append((ic, ip, control, operands))
+    return total, records
+
+def read_symbols(f):
+    "Read a symbol file written by tasm --symbols, returns (source, sorted labels, dict of lines)"
+    if f.readline().rstrip("\n") != SYMBOLS_HEADER:
+        raise Exception("Not a TinyVM symbol file")
+    source = ""
+    labels = []
+    lines = {}
+    for line in f:
+        kind, _, rest = line.rstrip("\n").partition(" ")
+        if kind == "F":
+            source = rest
+        elif kind == "L":
+            addr, label = rest.split(" ", 1)
+            labels.append((int(addr), label))
+        elif kind == "S":
+            addr, number = rest.split(" ", 1)
+            lines[int(addr)] = int(number)
+    return source, sorted(labels), lines
+
+def describe_address(addr, symbols):
+    "Name addr after the closest label before it and its source line"
+    if symbols is None:
+        return ""
+    source, labels, lines = symbols
+    text = ""
+    i = bisect.bisect_right(labels, (addr, chr(0x10ffff))) - 1
+    if i >= 0:
+        base, label = labels[i]
+        text = label if base == addr else "{}+{:#x}".format(label, addr - base)
+    if addr in lines:
+        text += " ({}:{})".format(source, lines[addr])
+    return text.strip()
+
+def format_operand(am, value):
+    "Format an operand the way tasm reads it"
+    if am & AM_REGISTER:
+        text = REGISTER_NAMES.get(value, "r?{}".format(value))
+    elif am & AM_LITERAL:
+        text = "#{}".format(value)
+    elif am & AM_MEMORY:
+        text = str(value)
+    else:
+        text = "?{}".format(value)
+    return "[{}]".format(text) if am & AM_INDIRECT else text
+
+def format_instruction(control, operands):
+    opcode = control >> 32
+    modes = [(control >> 16) & 0xff, (control >> 8) & 0xff, control & 0xff]
+    name = OPCODE_NAMES.get(opcode, "invalid({})".format(opcode))
+    count = OPERAND_COUNTS.get(opcode, 3)
+    return " ".join([name] + [format_operand(modes[i], operands[i]) for i in range(count)])
+
+def parse_arguments():
+    parser = argparse.ArgumentParser(description="The TinyVM trace decoder")
+    parser.add_argument("file", metavar="FILE", help="trace dump to decode")
+    parser.add_argument("--symbols", metavar="SYMFILE", help="symbol file written by tasm --symbols")
+    return parser.parse_args()
+
+def main():
+    args = parse_arguments()
+    symbols = None
+    if args.symbols is not None:
+        with open(args.symbols, "r") as f:
+            symbols = read_symbols(f)
+    with open(args.file, "rb") as f:
+        total, records = read_trace(f)
+    print("Last {} of {} records:".format(len(records), total))
+    next_ic = None
+    for ic, ip, control, operands in records:
+        # Compiled blocks only record their first instruction
+        if next_ic is not None and ic > next_ic:
+            print("{:>12} instructions in compiled code".format("... " + str(ic - next_ic)))
+        next_ic = ic + 1
+        line = "{:>12} {:>10x}  {:<32}".format(ic, ip, format_instruction(control, operands))
+        print("{} {}".format(line, describe_address(ip, symbols)).rstrip())
+
+if __name__ == "__main__":
+    main()